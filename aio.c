@@ -0,0 +1,672 @@
+/*
+ * aio.c: native worker pool behind the asyncio interface of kmodule
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// A pool runs insmod, rmmod and modinfo jobs on its own threads, each
+/// with its own kmod_ctx. A job is queued with the GIL held and gets an
+/// id back; the thread that finishes it moves it to the done list and
+/// bumps an eventfd. The event loop watches that fd and collects the
+/// finished jobs in one call, so no python thread waits on a job.
+///
+/// The pool lock is only held for list updates, the threads never take
+/// the GIL, so it is taken with the GIL held.
+///
+///////////////////////////////////////////////////////////////////////
+
+enum {
+  AIO_INSMOD,
+  AIO_RMMOD,
+  AIO_MODINFO,
+};
+
+struct aio_job {
+  struct aio_job                *next;
+  unsigned long                 id;
+  int                           op;
+  char                          *name;      // path or module name
+  char                          *options;
+  int                           flags;      // KMOD_REMOVE_* of rmmod
+  bool                          found;      // the module was resolved
+  int                           err;
+  struct kmodule_insert_result  insert;
+  struct kmodule_modinfo_result modinfo;
+};
+
+typedef struct {
+  PyObject_HEAD
+
+  char              dirname[PATH_MAX];
+  int               decompress;
+  int               efd;
+
+  pthread_mutex_t   lock;
+  pthread_cond_t    cond;
+
+  struct aio_job    *pending;
+  struct aio_job    **pending_tail;
+  struct aio_job    *done;
+  struct aio_job    **done_tail;
+  unsigned long     next_id;
+  unsigned          active;
+
+  pthread_t         *threads;
+  unsigned          nthreads;
+  bool              stop;
+} AioObject;
+
+/***********************************************************************
+ *
+ * aio_job_free:
+ *
+ ***********************************************************************/
+static void
+aio_job_free (
+  struct aio_job  *job
+  )
+{
+  kmodule_modinfo_release (&job->modinfo);
+  free (job->name);
+  free (job->options);
+  free (job);
+} // aio_job_free
+
+/***********************************************************************
+ *
+ * aio_module_inuse:
+ *
+ *   Same checks as rmmod without force, as a negative errno.
+ *
+ ***********************************************************************/
+static int
+aio_module_inuse (
+  struct kmod_module  *mod
+  )
+{
+  struct kmod_list *holders;
+  int state;
+
+  state = kmod_module_get_initstate (mod);
+  if (state == KMOD_MODULE_BUILTIN || state < 0)
+    return -ENOENT;
+
+  holders = kmod_module_get_holders (mod);
+  if (holders != NULL) {
+    kmod_module_unref_list (holders);
+    return -EBUSY;
+  }
+
+  return kmod_module_get_refcnt (mod) > 0 ? -EBUSY : 0;
+} // aio_module_inuse
+
+/***********************************************************************
+ *
+ * aio_run:
+ *
+ *   Run Job on the calling thread, with its own Ctx.
+ *
+ ***********************************************************************/
+static void
+aio_run (
+  AioObject       *Self,
+  struct kmod_ctx *ctx,
+  struct aio_job  *job
+  )
+{
+  struct kmod_module  *mod;
+  struct stat         st;
+
+  if (ctx == NULL) {
+    job->err = -ENOMEM;
+    return;
+  }
+
+  KMODULE_STATS_START (start);
+
+  switch (job->op) {
+  case AIO_INSMOD:
+    job->err = kmod_module_new_from_path (ctx, job->name, &mod);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+    if (job->err < 0)
+      return;
+    job->found = true;
+    job->err = kmodule_insert_module (mod, job->options, Self->decompress, &job->insert);
+    kmod_module_unref (mod);
+    break;
+
+  case AIO_RMMOD:
+    if (stat (job->name, &st) == 0)
+      job->err = kmod_module_new_from_path (ctx, job->name, &mod);
+    else
+      job->err = kmod_module_new_from_name (ctx, job->name, &mod);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+    if (job->err < 0)
+      return;
+    job->found = true;
+    if (!(job->flags & KMOD_REMOVE_FORCE)) {
+      KMODULE_STATS_START (state);
+      job->err = aio_module_inuse (mod);
+      KMODULE_STATS_PHASE (KMODULE_PHASE_STATE, state);
+    }
+    if (job->err == 0) {
+      KMODULE_STATS_START (remove);
+      job->err = kmod_module_remove_module (mod, job->flags);
+      KMODULE_STATS_PHASE (KMODULE_PHASE_DELETE_MODULE, remove);
+    }
+    kmod_module_unref (mod);
+    break;
+
+  case AIO_MODINFO:
+    kmodule_modinfo_collect (ctx, NULL, job->name, &job->modinfo);
+    break;
+  }
+} // aio_run
+
+/***********************************************************************
+ *
+ * aio_thread:
+ *
+ ***********************************************************************/
+static void *
+aio_thread (
+  void  *arg
+  )
+{
+  AioObject       *Self = arg;
+  struct kmod_ctx *ctx;
+  struct aio_job  *job;
+  const char      *null_config = NULL;
+  uint64_t        one = 1;
+
+  KMODULE_STATS_START (start);
+
+  ctx = kmod_new (Self->dirname, &null_config);
+  if (ctx != NULL) {
+    kmodule_log_attach (ctx);
+    kmod_load_resources (ctx);
+  }
+
+  KMODULE_STATS_PHASE (KMODULE_PHASE_CONTEXT, start);
+
+  pthread_mutex_lock (&Self->lock);
+
+  for (;;) {
+    while (!Self->stop && Self->pending == NULL)
+      pthread_cond_wait (&Self->cond, &Self->lock);
+    if (Self->stop)
+      break;
+
+    job = Self->pending;
+    Self->pending = job->next;
+    if (Self->pending == NULL)
+      Self->pending_tail = &Self->pending;
+    pthread_mutex_unlock (&Self->lock);
+
+    aio_run (Self, ctx, job);
+
+    pthread_mutex_lock (&Self->lock);
+    job->next = NULL;
+    *Self->done_tail = job;
+    Self->done_tail = &job->next;
+    if (write (Self->efd, &one, sizeof (one)) < 0) {
+      // the counter only overflows when nobody reads it, nothing is lost
+    }
+  }
+
+  pthread_mutex_unlock (&Self->lock);
+
+  if (ctx != NULL)
+    kmod_unref (ctx);
+
+  return NULL;
+} // aio_thread
+
+/***********************************************************************
+ *
+ * aio_result:
+ *
+ *   Result of a finished Job, or the exception it raised.
+ *
+ ***********************************************************************/
+static PyObject *
+aio_result (
+  struct aio_job  *job
+  )
+{
+  PyObject *ret = NULL;
+
+  switch (job->op) {
+  case AIO_INSMOD:
+    if (!job->found)
+      PyErr_Format (PyExc_SystemError, "Could not load module %s: %s\n", job->name, strerror(-job->err));
+    else if (job->err < 0)
+      PyErr_Format (PyExc_SystemError, "could not insert module %s: %s\n", job->name, mod_strerror(-job->err));
+    else
+      ret = Py_BuildValue ("{s:s,s:s,s:K,s:K}",
+              "path",       job->name,
+              "decompress", job->insert.method,
+              "size",       (unsigned long long) job->insert.size,
+              "avoided",    (unsigned long long) job->insert.avoided);
+    break;
+
+  case AIO_RMMOD:
+    if (job->err < 0) {
+      ret = PyObject_CallFunction (PyExc_OSError, "iss",
+              -job->err, strerror (-job->err), job->name);
+    } else {
+      Py_INCREF (Py_None);
+      ret = Py_None;
+    }
+    break;
+
+  case AIO_MODINFO:
+    if (job->err < 0)
+      job->modinfo.err = job->err;
+    ret = kmodule_modinfo_build (&job->modinfo, job->name);
+    break;
+  }
+
+  if (ret == NULL) {
+    PyObject *type, *value, *tb;
+
+    PyErr_Fetch (&type, &value, &tb);
+    PyErr_NormalizeException (&type, &value, &tb);
+    Py_XDECREF (type);
+    Py_XDECREF (tb);
+    ret = value;
+  }
+
+  return ret;
+} // aio_result
+
+///////////////////////////////////////////////////////////////////////
+///
+/// pool type
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * Aio_close:
+ *
+ *   _aio.close ()
+ *
+ *   Stop the threads once their current job is done, jobs not started
+ *   are dropped.
+ *
+ ***********************************************************************/
+static PyObject *
+Aio_close (
+  AioObject   *Self,
+  PyObject    *Unused
+  )
+{
+  struct aio_job *job;
+  unsigned i;
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock (&Self->lock);
+  Self->stop = true;
+  pthread_cond_broadcast (&Self->cond);
+  pthread_mutex_unlock (&Self->lock);
+
+  for (i = 0; i < Self->nthreads; i++)
+    pthread_join (Self->threads[i], NULL);
+  Self->nthreads = 0;
+  Py_END_ALLOW_THREADS
+
+  while ((job = Self->pending) != NULL) {
+    Self->pending = job->next;
+    aio_job_free (job);
+  }
+  Self->pending_tail = &Self->pending;
+
+  while ((job = Self->done) != NULL) {
+    Self->done = job->next;
+    aio_job_free (job);
+  }
+  Self->done_tail = &Self->done;
+
+  if (Self->efd >= 0)
+    close (Self->efd);
+  Self->efd = -1;
+
+  Py_INCREF (Py_None);
+  return Py_None;
+} // Aio_close
+
+/***********************************************************************
+ *
+ * Aio_dealloc:
+ *
+ ***********************************************************************/
+static void
+Aio_dealloc (
+  AioObject   *Self
+  )
+{
+  Py_XDECREF (Aio_close (Self, NULL));
+  free (Self->threads);
+
+  pthread_cond_destroy (&Self->cond);
+  pthread_mutex_destroy (&Self->lock);
+
+  PyObject_Del (Self);
+} // Aio_dealloc
+
+/***********************************************************************
+ *
+ * Aio_submit:
+ *
+ *   _aio.submit (op, name, parameter=None, force=False, wait=False) -> id
+ *
+ *   Queue a job, op 0 insmod (path, parameter), 1 rmmod (name, force,
+ *   wait), 2 modinfo (name). The result is collected by completed().
+ *
+ ***********************************************************************/
+static PyObject *
+Aio_submit (
+  AioObject   *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  int             op;
+  char            *name;
+  char            *Parameters = NULL;
+  int             force = 0, wait = 0;
+  struct aio_job  *job;
+
+  static char   *kwlist[] = {"op", "name", "parameter", "force", "wait", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "is|zpp",
+      kwlist,
+      &op,
+      &name,
+      &Parameters,
+      &force,
+      &wait)) {
+    return NULL;
+  }
+
+  if (op < AIO_INSMOD || op > AIO_MODINFO) {
+    PyErr_Format (PyExc_ValueError, "unknown job %d.", op);
+    return NULL;
+  }
+
+  if (Self->nthreads == 0) {
+    PyErr_Format (PyExc_ValueError, "pool is closed.");
+    return NULL;
+  }
+
+  job = calloc (1, sizeof (*job));
+  if (job == NULL)
+    return PyErr_NoMemory ();
+
+  job->op    = op;
+  job->flags = (force ? KMOD_REMOVE_FORCE : 0) | (wait ? 0 : KMOD_REMOVE_NOWAIT);
+  job->name  = strdup (name);
+  if (Parameters != NULL)
+    job->options = strdup (Parameters);
+  if (job->name == NULL || (Parameters != NULL && job->options == NULL)) {
+    aio_job_free (job);
+    return PyErr_NoMemory ();
+  }
+
+  pthread_mutex_lock (&Self->lock);
+  job->id = ++Self->next_id;
+  *Self->pending_tail = job;
+  Self->pending_tail = &job->next;
+  Self->active++;
+  pthread_cond_signal (&Self->cond);
+  pthread_mutex_unlock (&Self->lock);
+
+  return PyLong_FromUnsignedLong (job->id);
+} // Aio_submit
+
+/***********************************************************************
+ *
+ * Aio_completed:
+ *
+ *   _aio.completed () -> [(id, result), ...]
+ *
+ *   Every job finished since the last call, result being the exception
+ *   raised by the job when it failed. Clears the eventfd.
+ *
+ ***********************************************************************/
+static PyObject *
+Aio_completed (
+  AioObject   *Self,
+  PyObject    *Unused
+  )
+{
+  struct aio_job  *done, *job;
+  PyObject        *ret;
+  uint64_t        count;
+
+  if (Self->efd >= 0 && read (Self->efd, &count, sizeof (count)) < 0) {
+    // EAGAIN, nothing was signalled
+  }
+
+  pthread_mutex_lock (&Self->lock);
+  done = Self->done;
+  Self->done = NULL;
+  Self->done_tail = &Self->done;
+  pthread_mutex_unlock (&Self->lock);
+
+  ret = PyList_New (0);
+
+  while ((job = done) != NULL) {
+    done = job->next;
+
+    if (ret != NULL) {
+      PyObject *item = aio_result (job);
+
+      item = item != NULL ? Py_BuildValue ("(kN)", job->id, item) : NULL;
+      if (item == NULL || PyList_Append (ret, item) < 0)
+        Py_CLEAR (ret);
+      Py_XDECREF (item);
+    }
+
+    aio_job_free (job);
+    Self->active--;
+  }
+
+  return ret;
+} // Aio_completed
+
+/***********************************************************************
+ *
+ * Aio_fileno:
+ *
+ *   The eventfd readable while finished jobs wait for completed().
+ *
+ ***********************************************************************/
+static PyObject *
+Aio_fileno (
+  AioObject   *Self,
+  PyObject    *Unused
+  )
+{
+  if (Self->efd < 0) {
+    PyErr_Format (PyExc_ValueError, "pool is closed.");
+    return NULL;
+  }
+
+  return PyLong_FromLong (Self->efd);
+} // Aio_fileno
+
+/***********************************************************************
+ *
+ * Aio_get_active:
+ *
+ ***********************************************************************/
+static PyObject *
+Aio_get_active (
+  AioObject   *Self,
+  void        *Closure
+  )
+{
+  return PyLong_FromUnsignedLong (Self->active);
+} // Aio_get_active
+
+static PyMethodDef Aio_methods [] = {
+
+  { "submit",       (PyCFunction) Aio_submit,     METH_VARARGS | METH_KEYWORDS, NULL},
+  { "completed",    (PyCFunction) Aio_completed,  METH_NOARGS, NULL},
+  { "fileno",       (PyCFunction) Aio_fileno,     METH_NOARGS, NULL},
+  { "close",        (PyCFunction) Aio_close,      METH_NOARGS, NULL},
+
+  { NULL, NULL, 0, NULL}
+
+}; // Aio_methods
+
+static PyGetSetDef Aio_getset [] = {
+
+  { "active",       (getter) Aio_get_active, NULL, "jobs submitted and not collected yet", NULL},
+
+  { NULL, NULL, NULL, NULL, NULL}
+
+}; // Aio_getset
+
+PyTypeObject AioType = {
+
+  PyVarObject_HEAD_INIT (NULL, 0)
+
+  .tp_name      = "_kmodule._aio",
+  .tp_doc       = "native worker pool of kmodule.aio",
+  .tp_basicsize = sizeof (AioObject),
+  .tp_itemsize  = 0,
+  .tp_flags     = Py_TPFLAGS_DEFAULT,
+  .tp_dealloc   = (destructor) Aio_dealloc,
+  .tp_methods   = Aio_methods,
+  .tp_getset    = Aio_getset,
+
+}; // AioType
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_aio:
+ *
+ *   _aio (basedir=None, kversion=None, workers=0, decompress="auto")
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_aio (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  char        *root = NULL, *kversion = NULL, *decompress = NULL;
+  int         workers = 0;
+  AioObject   *aio;
+  unsigned    i;
+
+  static char   *kwlist[] = {"basedir", "kversion", "workers", "decompress", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "|zziz",
+      kwlist,
+      &root,
+      &kversion,
+      &workers,
+      &decompress)) {
+    return NULL;
+  }
+
+  if (workers <= 0)
+    workers = sysconf (_SC_NPROCESSORS_ONLN);
+  if (workers <= 0)
+    workers = 1;
+
+  aio = PyObject_New (AioObject, &AioType);
+  if (aio == NULL)
+    return NULL;
+
+  memset ((char *) aio + sizeof (PyObject), 0, sizeof (AioObject) - sizeof (PyObject));
+  pthread_mutex_init (&aio->lock, NULL);
+  pthread_cond_init (&aio->cond, NULL);
+  aio->pending_tail = &aio->pending;
+  aio->done_tail    = &aio->done;
+  aio->efd          = -1;
+
+  if (decompress != NULL) {
+    aio->decompress = kmodule_decompress_mode (decompress);
+    if (aio->decompress < 0) {
+      Py_DECREF (aio);
+      PyErr_Format (PyExc_ValueError, "decompress must be auto, kernel or user.");
+      return NULL;
+    }
+  }
+
+  if (kmodule_dirname (root, kversion, aio->dirname, sizeof (aio->dirname)) < 0) {
+    Py_DECREF (aio);
+    return NULL;
+  }
+
+  aio->efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (aio->efd < 0) {
+    Py_DECREF (aio);
+    return PyErr_SetFromErrno (PyExc_OSError);
+  }
+
+  aio->threads = calloc (workers, sizeof (pthread_t));
+  if (aio->threads == NULL) {
+    Py_DECREF (aio);
+    return PyErr_NoMemory ();
+  }
+
+  for (i = 0; i < (unsigned) workers; i++) {
+    if (pthread_create (&aio->threads[i], NULL, aio_thread, aio) != 0)
+      break;
+    aio->nthreads++;
+  }
+
+  if (aio->nthreads == 0) {
+    Py_DECREF (aio);
+    PyErr_Format (PyExc_OSError, "could not start aio threads.\n");
+    return NULL;
+  }
+
+  return (PyObject *) aio;
+} // kmodule_aio
@@ -0,0 +1,537 @@
+/*
+ * alias.c: bulk modalias resolution with a bounded LRU of the answers
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <libkmod/libkmod.h>
+
+#include <shared/hash.h>
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// The cache of a Context maps an alias to the names of the modules it
+/// resolves to, packed "a\0b\0\0", the empty list included. Entries are
+/// on a list, most recently used first; past the capacity the last one
+/// goes. Every access is made with the Context lock held.
+///
+///////////////////////////////////////////////////////////////////////
+
+struct alias_entry {
+  struct alias_entry  *prev;
+  struct alias_entry  *next;
+  size_t              size;       // of names, both NULs included
+  char                *names;
+  char                key[];
+};
+
+struct kmodule_alias_cache {
+  struct hash         *index;
+  struct alias_entry  *head;
+  struct alias_entry  *tail;
+  unsigned            count;
+  unsigned            capacity;
+  uint64_t            hits;
+  uint64_t            misses;
+};
+
+/***********************************************************************
+ *
+ * alias_unlink:
+ *
+ ***********************************************************************/
+static void
+alias_unlink (
+  struct kmodule_alias_cache  *cache,
+  struct alias_entry          *entry
+  )
+{
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    cache->head = entry->next;
+
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    cache->tail = entry->prev;
+} // alias_unlink
+
+/***********************************************************************
+ *
+ * alias_push:
+ *
+ ***********************************************************************/
+static void
+alias_push (
+  struct kmodule_alias_cache  *cache,
+  struct alias_entry          *entry
+  )
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL)
+    cache->head->prev = entry;
+  else
+    cache->tail = entry;
+  cache->head = entry;
+} // alias_push
+
+/***********************************************************************
+ *
+ * alias_lookup:
+ *
+ *   Names of the modules Alias resolves to, packed, into *Names and
+ *   *Size. Returns 0 or a negative errno.
+ *
+ ***********************************************************************/
+static int
+alias_lookup (
+  struct kmod_ctx *ctx,
+  const char      *alias,
+  char            **names,
+  size_t          *size
+  )
+{
+  struct kmod_list *l, *list = NULL;
+  size_t  len = 1;
+  char    *p;
+  int     err;
+
+  KMODULE_STATS_START (start);
+  err = kmod_module_new_from_lookup (ctx, alias, &list);
+  KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+  if (err < 0)
+    return err;
+
+  kmod_list_foreach (l, list) {
+    struct kmod_module *mod = kmod_module_get_module (l);
+
+    len += strlen (kmod_module_get_name (mod)) + 1;
+    kmod_module_unref (mod);
+  }
+
+  p = *names = malloc (len);
+  if (p == NULL) {
+    kmod_module_unref_list (list);
+    return -ENOMEM;
+  }
+
+  kmod_list_foreach (l, list) {
+    struct kmod_module *mod = kmod_module_get_module (l);
+    const char *name = kmod_module_get_name (mod);
+    size_t n = strlen (name) + 1;
+
+    memcpy (p, name, n);
+    p += n;
+    kmod_module_unref (mod);
+  }
+  *p = '\0';
+  *size = len;
+
+  kmod_module_unref_list (list);
+
+  return 0;
+} // alias_lookup
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule internal function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_alias_cache_new:
+ *
+ *   Cache of up to Capacity aliases, NULL when out of memory.
+ *
+ ***********************************************************************/
+struct kmodule_alias_cache *
+kmodule_alias_cache_new (
+  unsigned  capacity
+  )
+{
+  struct kmodule_alias_cache *cache;
+
+  cache = calloc (1, sizeof (*cache));
+  if (cache == NULL)
+    return NULL;
+
+  cache->capacity = capacity;
+  cache->index    = hash_new (capacity < 64 ? 64 : capacity, NULL);
+  if (cache->index == NULL) {
+    free (cache);
+    return NULL;
+  }
+
+  return cache;
+} // kmodule_alias_cache_new
+
+/***********************************************************************
+ *
+ * kmodule_alias_cache_clear:
+ *
+ ***********************************************************************/
+void
+kmodule_alias_cache_clear (
+  struct kmodule_alias_cache  *cache
+  )
+{
+  struct alias_entry *entry, *next;
+
+  for (entry = cache->head; entry != NULL; entry = next) {
+    next = entry->next;
+    hash_del (cache->index, entry->key);
+    free (entry->names);
+    free (entry);
+  }
+
+  cache->head  = NULL;
+  cache->tail  = NULL;
+  cache->count = 0;
+} // kmodule_alias_cache_clear
+
+/***********************************************************************
+ *
+ * kmodule_alias_cache_free:
+ *
+ ***********************************************************************/
+void
+kmodule_alias_cache_free (
+  struct kmodule_alias_cache  *cache
+  )
+{
+  if (cache == NULL)
+    return;
+
+  kmodule_alias_cache_clear (cache);
+  hash_free (cache->index);
+  free (cache);
+} // kmodule_alias_cache_free
+
+/***********************************************************************
+ *
+ * kmodule_alias_resolve:
+ *
+ *   Names of the modules Alias resolves to, packed, copied into *Names
+ *   for the caller to free(), through Cache when there is one. Returns
+ *   0 or a negative errno. Called with the Context lock held and
+ *   without the GIL.
+ *
+ ***********************************************************************/
+int
+kmodule_alias_resolve (
+  struct kmod_ctx             *ctx,
+  struct kmodule_alias_cache  *cache,
+  const char                  *alias,
+  char                        **names
+  )
+{
+  struct alias_entry *entry;
+  size_t  size, len;
+  int     err;
+
+  if (cache != NULL && cache->capacity > 0) {
+    entry = hash_find (cache->index, alias);
+    if (entry != NULL) {
+      cache->hits++;
+      if (entry != cache->head) {
+        alias_unlink (cache, entry);
+        alias_push (cache, entry);
+      }
+      *names = malloc (entry->size);
+      if (*names == NULL)
+        return -ENOMEM;
+      memcpy (*names, entry->names, entry->size);
+      return 0;
+    }
+    cache->misses++;
+  }
+
+  err = alias_lookup (ctx, alias, names, &size);
+  if (err < 0 || cache == NULL || cache->capacity == 0)
+    return err;
+
+  //
+  // A failed insert only costs the next lookup of the alias.
+  //
+  len   = strlen (alias) + 1;
+  entry = malloc (sizeof (*entry) + len);
+  if (entry == NULL)
+    return 0;
+  entry->names = malloc (size);
+  if (entry->names == NULL) {
+    free (entry);
+    return 0;
+  }
+  memcpy (entry->names, *names, size);
+  memcpy (entry->key, alias, len);
+  entry->size = size;
+
+  if (hash_add (cache->index, entry->key, entry) < 0) {
+    free (entry->names);
+    free (entry);
+    return 0;
+  }
+
+  alias_push (cache, entry);
+  cache->count++;
+
+  while (cache->count > cache->capacity) {
+    struct alias_entry *old = cache->tail;
+
+    alias_unlink (cache, old);
+    hash_del (cache->index, old->key);
+    free (old->names);
+    free (old);
+    cache->count--;
+  }
+
+  return 0;
+} // kmodule_alias_resolve
+
+/***********************************************************************
+ *
+ * alias_tuple:
+ *
+ *   "a\0b\0\0" -> ('a', 'b')
+ *
+ ***********************************************************************/
+static PyObject *
+alias_tuple (
+  const char  *names
+  )
+{
+  PyObject    *tuple;
+  const char  *p;
+  Py_ssize_t  count = 0, i;
+
+  for (p = names; *p != '\0'; p += strlen (p) + 1)
+    count++;
+
+  tuple = PyTuple_New (count);
+  if (tuple == NULL)
+    return NULL;
+
+  for (p = names, i = 0; i < count; p += strlen (p) + 1, i++) {
+    PyObject *name = PyUnicode_FromString (p);
+
+    if (name == NULL) {
+      Py_DECREF (tuple);
+      return NULL;
+    }
+    PyTuple_SET_ITEM (tuple, i, name);
+  }
+
+  return tuple;
+} // alias_tuple
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule public function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_resolve_aliases:
+ *
+ *   Context._resolve_aliases (aliases)
+ *
+ *   List, in the order of the iterable Aliases, of the tuple of module
+ *   names each one resolves to. An alias given more than once is looked
+ *   up once and shares its tuple.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_resolve_aliases (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  KmodContextObject *Context = (KmodContextObject *) Self;
+  PyObject    *aliases, *list = NULL, *seen = NULL, *ret = NULL;
+  PyObject    **tuples = NULL;
+  Py_ssize_t  *slot = NULL;
+  const char  **unique = NULL;
+  char        **names = NULL;
+  Py_ssize_t  i, count, nunique = 0;
+  int         err = 0;
+
+  struct kmod_ctx *ctx;
+
+  static char   *kwlist[] = {"aliases", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "O",
+      kwlist,
+      &aliases)) {
+    return NULL;
+  }
+
+  ctx = kmodule_context_get (Self);
+  if (ctx == NULL)
+    return NULL;
+
+  list = PySequence_List (aliases);
+  if (list == NULL)
+    return NULL;
+
+  count  = PyList_GET_SIZE (list);
+  seen   = PyDict_New ();
+  slot   = PyMem_Calloc (count + 1, sizeof (Py_ssize_t));
+  unique = PyMem_Calloc (count + 1, sizeof (char *));
+  if (seen == NULL || slot == NULL || unique == NULL) {
+    PyErr_NoMemory ();
+    goto end;
+  }
+
+  //
+  // The strings stay alive in List, which owns them.
+  //
+  for (i = 0; i < count; i++) {
+    PyObject *alias = PyList_GET_ITEM (list, i);
+    PyObject *index;
+
+    if (!PyUnicode_Check (alias)) {
+      PyErr_Format (PyExc_TypeError, "alias must be str, not %s", Py_TYPE (alias)->tp_name);
+      goto end;
+    }
+
+    index = PyDict_GetItemWithError (seen, alias);
+    if (index != NULL) {
+      slot[i] = PyLong_AsSsize_t (index);
+      continue;
+    }
+    if (PyErr_Occurred ())
+      goto end;
+
+    unique[nunique] = PyUnicode_AsUTF8 (alias);
+    if (unique[nunique] == NULL)
+      goto end;
+
+    index = PyLong_FromSsize_t (nunique);
+    if (index == NULL || PyDict_SetItem (seen, alias, index) < 0) {
+      Py_XDECREF (index);
+      goto end;
+    }
+    Py_DECREF (index);
+    slot[i] = nunique++;
+  }
+
+  names  = PyMem_Calloc (nunique + 1, sizeof (char *));
+  tuples = PyMem_Calloc (nunique + 1, sizeof (PyObject *));
+  if (names == NULL || tuples == NULL) {
+    PyErr_NoMemory ();
+    goto end;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+
+  //
+  // _reload_config may have replaced the ctx before the lock was taken.
+  //
+  ctx = Context->ctx;
+
+  if (Context->aliases == NULL && Context->alias_capacity > 0)
+    Context->aliases = kmodule_alias_cache_new (Context->alias_capacity);
+
+  for (i = 0; i < nunique && err == 0; i++)
+    err = kmodule_alias_resolve (ctx, Context->aliases, unique[i], &names[i]);
+
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  if (err < 0) {
+    PyErr_Format (PyExc_OSError, "could not resolve alias %s: %s\n", unique[i - 1], strerror (-err));
+    goto end;
+  }
+
+  for (i = 0; i < nunique; i++) {
+    tuples[i] = alias_tuple (names[i]);
+    if (tuples[i] == NULL)
+      goto end;
+  }
+
+  ret = PyList_New (count);
+  for (i = 0; ret != NULL && i < count; i++) {
+    Py_INCREF (tuples[slot[i]]);
+    PyList_SET_ITEM (ret, i, tuples[slot[i]]);
+  }
+
+end:
+  for (i = 0; names != NULL && i < nunique; i++)
+    free (names[i]);
+  for (i = 0; tuples != NULL && i < nunique; i++)
+    Py_XDECREF (tuples[i]);
+  PyMem_Free (names);
+  PyMem_Free (tuples);
+  PyMem_Free (unique);
+  PyMem_Free (slot);
+  Py_XDECREF (seen);
+  Py_DECREF (list);
+
+  return ret;
+
+} // kmodule_resolve_aliases
+
+/***********************************************************************
+ *
+ * kmodule_alias_cache_info:
+ *
+ *   Context._alias_cache_info ()
+ *
+ *   dict of the alias cache size, capacity, hits and misses.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_alias_cache_info (
+  PyObject    *Self,
+  PyObject    *Unused
+  )
+{
+  KmodContextObject *Context = (KmodContextObject *) Self;
+  unsigned long long hits = 0, misses = 0;
+  unsigned count = 0;
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+  if (Context->aliases != NULL) {
+    count  = Context->aliases->count;
+    hits   = Context->aliases->hits;
+    misses = Context->aliases->misses;
+  }
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  return Py_BuildValue ("{s:I,s:I,s:K,s:K}",
+           "size",     count,
+           "capacity", Context->alias_capacity,
+           "hits",     hits,
+           "misses",   misses);
+
+} // kmodule_alias_cache_info
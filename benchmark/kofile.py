@@ -0,0 +1,251 @@
+# kofile.py: minimal kernel module files for the kmodule benchmarks
+#  Copyright (C) 2022  MaxWu <EfiPy.core@gmail.com>.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+
+import gzip
+import lzma
+import os
+import struct
+import subprocess
+
+def elf (sections):
+  '''
+  x86_64 relocatable ELF image holding sections, a list of
+  (name, bytes, sh_type). Only what libkmod reads is filled in.
+  '''
+
+  shstr = b'\0'
+  names = []
+  for name, _, _ in sections:
+    names.append (len (shstr))
+    shstr += name.encode () + b'\0'
+  names.append (len (shstr))
+  shstr += b'.shstrtab\0'
+
+  sections = list (sections) + [('.shstrtab', shstr, 3)]
+
+  body = b''
+  offsets = []
+  for _, data, _ in sections:
+    offsets.append (64 + len (body))
+    body += data
+    body += b'\0' * (-len (body) % 8)
+
+  shnum = len (sections) + 1
+  hdr = b'\x7fELF' + bytes ([2, 1, 1, 0]) + b'\0' * 8
+  hdr += struct.pack ('<HHIQQQIHHHHHH', 1, 62, 1, 0, 0, 64 + len (body),
+                      0, 64, 0, 0, 64, shnum, shnum - 1)
+
+  sh = b'\0' * 64
+  for i, (_, data, sh_type) in enumerate (sections):
+    sh += struct.pack ('<IIQQQQIIQQ', names[i], sh_type, 0, 0, offsets[i],
+                       len (data), 0, 0, 1, 0)
+
+  return hdr + body + sh
+
+def module (info):
+  '''
+  Module image with a .modinfo section made of the (key, value) pairs
+  of info.
+  '''
+
+  modinfo = b''.join (('%s=%s' % (k, v)).encode () + b'\0' for k, v in info)
+
+  return elf ([('.modinfo', modinfo, 1)])
+
+def compress (image, kind):
+  '''
+  image compressed as kind, '' (none), 'xz', 'gz' or 'zst', and the file
+  suffix that goes with it.
+  '''
+
+  if not kind:
+    return image, ''
+
+  if kind == 'xz':
+    return lzma.compress (image, check = lzma.CHECK_CRC32), '.xz'
+
+  if kind == 'gz':
+    return gzip.compress (image, mtime = 0), '.gz'
+
+  if kind == 'zst':
+    try:
+      import zstandard
+      return zstandard.ZstdCompressor ().compress (image), '.zst'
+    except ImportError:
+      return subprocess.run (['zstd', '-q', '-c'], input = image, stdout = subprocess.PIPE, check = True).stdout, '.zst'
+
+  raise ValueError ('unknown compression %s' % kind)
+
+#
+# libkmod index files: a trie, big endian, every node an offset with its
+# flags in the top bits.
+#
+_INDEX_MAGIC    = 0xB007F457
+_INDEX_VERSION  = 0x00020001
+_INDEX_PREFIX   = 0x80000000
+_INDEX_VALUES   = 0x40000000
+_INDEX_CHILDS   = 0x20000000
+
+class _Node:
+
+  def __init__ (self, prefix = ''):
+    self.prefix   = prefix
+    self.children = {}
+    self.values   = []
+
+def _index_insert (root, key, value, priority):
+
+  node = root
+  i = 0
+
+  while True:
+    prefix = node.prefix
+    j = 0
+    while j < len (prefix) and i + j < len (key) and prefix[j] == key[i + j]:
+      j += 1
+
+    #
+    # Split the node where key leaves its prefix.
+    #
+    if j < len (prefix):
+      child = _Node (prefix[j + 1:])
+      child.children, child.values = node.children, node.values
+      node.prefix, node.children, node.values = prefix[:j], {prefix[j]: child}, []
+
+    i += j
+    if i == len (key):
+      node.values.append ((priority, value))
+      return
+
+    child = node.children.get (key[i])
+    if child is None:
+      child = node.children[key[i]] = _Node (key[i + 1:])
+      child.values.append ((priority, value))
+      return
+
+    node = child
+    i += 1
+
+def _index_write (node, out):
+
+  offsets = {c: _index_write (child, out) for c, child in node.children.items ()}
+  offset  = len (out)
+  flags   = 0
+
+  if node.prefix:
+    out += node.prefix.encode () + b'\0'
+    flags |= _INDEX_PREFIX
+
+  if node.children:
+    first, last = min (map (ord, offsets)), max (map (ord, offsets))
+    out += bytes ([first, last])
+    for c in range (first, last + 1):
+      out += struct.pack ('>I', offsets.get (chr (c), 0))
+    flags |= _INDEX_CHILDS
+
+  if node.values:
+    out += struct.pack ('>I', len (node.values))
+    for priority, value in sorted (node.values, key = lambda v: v[0]):
+      out += struct.pack ('>I', priority) + value.encode () + b'\0'
+    flags |= _INDEX_VALUES
+
+  return offset | flags
+
+def index (path, items):
+  '''
+  Write the (key, value) pairs of items as the libkmod index path, the
+  values of a key in the order given.
+  '''
+
+  root = _Node ()
+  for priority, (key, value) in enumerate (items):
+    _index_insert (root, key, value, priority)
+
+  out = bytearray (struct.pack ('>III', _INDEX_MAGIC, _INDEX_VERSION, 0))
+  out[8:12] = struct.pack ('>I', _index_write (root, out))
+
+  with open (path, 'wb') as f:
+    f.write (out)
+
+def tree (basedir, kversion, count, groups = 16, compress_kinds = ('',), depmod = False):
+  '''
+  Write count modules spread over groups directories under
+  basedir/lib/modules/kversion/kernel and return the modules directory.
+
+  Module i is compressed as compress_kinds[i % len (compress_kinds)]. It
+  takes up to 16 parameters and, every third one aside, depends on the
+  two modules before it. With depmod, the modules.dep, modules.alias,
+  modules.symbols (eight exports per module) and the other indexes
+  depmod would write are written too.
+  '''
+
+  moddir = os.path.join (basedir, 'lib', 'modules', kversion)
+  deps, aliases = [], []
+
+  for i in range (count):
+    name = 'mod%d' % i
+    depends = ['mod%d' % j for j in range (max (0, i - 2), i)] if depmod and i % 3 else []
+    info = [('license', 'GPL'), ('description', 'module %d' % i),
+            ('author', 'kmodule benchmark'),
+            ('alias', 'pci:v%08Xd*sv*sd*bc*sc*i*' % i), ('alias', 'bench%d' % i)]
+    for p in range (1 + i % 16):
+      info += [('parm', 'param%d:parameter %d of %s' % (p, p, name)),
+               ('parmtype', 'param%d:%s' % (p, ('int', 'uint', 'charp', 'bool')[p % 4]))]
+    info += [('firmware', 'bench/%s.bin' % name), ('depends', ','.join (depends)),
+             ('retpoline', 'Y'), ('intree', 'Y'),
+             ('name', name), ('vermagic', '%s SMP mod_unload modversions' % kversion)]
+
+    image, suffix = compress (module (info), compress_kinds[i % len (compress_kinds)])
+    rel = os.path.join ('kernel', 'drivers', 'grp%d' % (i % groups), name + '.ko' + suffix)
+
+    os.makedirs (os.path.dirname (os.path.join (moddir, rel)), exist_ok = True)
+    with open (os.path.join (moddir, rel), 'wb') as f:
+      f.write (image)
+
+    deps.append ((name, rel, depends))
+    aliases += [(v, name) for k, v in info if k == 'alias']
+
+  if depmod:
+    path = {name: rel for name, rel, _ in deps}
+    lines = [(name, '%s: %s' % (rel, ' '.join (path[d] for d in reversed (depends)))) for name, rel, depends in deps]
+
+    index (os.path.join (moddir, 'modules.dep.bin'), lines)
+    index (os.path.join (moddir, 'modules.alias.bin'), aliases)
+    symbols = [('symbol:%s_sym%d' % (name, s), name) for name, _, _ in deps for s in range (8)]
+    index (os.path.join (moddir, 'modules.symbols.bin'), symbols)
+    for f in ('modules.builtin.bin', 'modules.builtin.alias.bin'):
+      index (os.path.join (moddir, f), [])
+
+    with open (os.path.join (moddir, 'modules.dep'), 'w') as f:
+      f.writelines ('%s\n' % line.rstrip () for _, line in lines)
+    with open (os.path.join (moddir, 'modules.alias'), 'w') as f:
+      f.writelines ('alias %s %s\n' % a for a in aliases)
+    with open (os.path.join (moddir, 'modules.symbols'), 'w') as f:
+      f.writelines ('alias %s %s\n' % s for s in symbols)
+    with open (os.path.join (moddir, 'modules.softdep'), 'w') as f:
+      f.write ('# Soft dependencies extracted from modules themselves.\n')
+
+  return moddir
+
+def proc_modules (path, count):
+  '''
+  Write a /proc/modules of count loaded modules, mod<i> held by the two
+  modules after it.
+  '''
+
+  with open (path, 'w') as f:
+    for i in range (count):
+      holders = ''.join ('mod%d,' % j for j in range (i + 1, min (i + 3, count)) if j % 3)
+      f.write ('mod%d %d %d %s Live 0x%016x\n' % (i, 16384 + 4096 * (i % 8), len (holders.split (',')) - 1,
+                                                   holders or '-', 0xffffffffc0000000 + i * 0x10000))
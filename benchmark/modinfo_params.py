@@ -0,0 +1,49 @@
+#!/bin/env python3
+
+# modinfo_params.py: modinfo benchmark over a module with many parameters
+#  Copyright (C) 2022  MaxWu <EfiPy.core@gmail.com>.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+
+import argparse
+import os
+import tempfile
+import time
+
+import kmodule as km
+import kofile
+
+parser = argparse.ArgumentParser (description = 'modinfo of a module with many parameters')
+parser.add_argument ('--params', type = int, default = 200, help = 'parameters in the module')
+parser.add_argument ('--loops', type = int, default = 2000, help = 'modinfo calls timed')
+args = parser.parse_args ()
+
+info = [('license', 'GPL'), ('description', 'many parameters')]
+for i in range (args.params):
+  info.append (('parm', 'param_%d:description of parameter %d' % (i, i)))
+  info.append (('parmtype', 'param_%d:int' % i))
+info.append (('name', 'many_params'))
+
+with tempfile.TemporaryDirectory () as tmp:
+  path = os.path.join (tmp, 'many_params.ko')
+  with open (path, 'wb') as f:
+    f.write (kofile.module (info))
+
+  ctx = km.Context (tmp)
+  assert len (ctx.modinfo (path)[0]['parm']) == args.params
+
+  t0 = time.perf_counter ()
+  for _ in range (args.loops):
+    ctx.modinfo (path)
+  t = time.perf_counter () - t0
+
+print ('%d params: %.1f us per modinfo' % (args.params, t / args.loops * 1e6))
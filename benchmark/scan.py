@@ -0,0 +1,66 @@
+#!/bin/env python3
+
+# scan.py: whole tree modinfo benchmark, kmodule.scan against os.walk
+#  Copyright (C) 2022  MaxWu <EfiPy.core@gmail.com>.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+
+import argparse
+import os
+import tempfile
+import time
+
+import kmodule as km
+import kofile
+
+KVER = '0.0.0-bench'
+
+parser = argparse.ArgumentParser (description = 'modinfo of every module of a generated tree')
+parser.add_argument ('--modules', type = int, default = 4000, help = 'modules in the tree')
+parser.add_argument ('--workers', type = int, nargs = '*', default = [1, 2, 4, 8], help = 'scan threads')
+args = parser.parse_args ()
+
+def walk (moddir):
+
+  ctx = km.Context (os.path.dirname (os.path.dirname (os.path.dirname (moddir))), KVER)
+  count = 0
+
+  for top, dirs, files in os.walk (moddir):
+    for f in files:
+      if f.endswith ('.ko'):
+        ctx.modinfo (os.path.join (top, f))
+        count += 1
+
+  return count
+
+def scan (basedir, workers):
+
+  count = 0
+
+  for path, info in km.scan (basedir, KVER, workers = workers):
+    count += 1
+
+  return count
+
+with tempfile.TemporaryDirectory () as tmp:
+  moddir = kofile.tree (tmp, KVER, args.modules)
+
+  t0 = time.perf_counter ()
+  count = walk (moddir)
+  t = time.perf_counter () - t0
+  print ('%-20s %6d files %10.0f files/s' % ('os.walk + modinfo', count, count / t))
+
+  for workers in args.workers:
+    t0 = time.perf_counter ()
+    count = scan (tmp, workers)
+    t = time.perf_counter () - t0
+    print ('%-20s %6d files %10.0f files/s' % ('scan workers=%d' % workers, count, count / t))
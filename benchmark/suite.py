@@ -0,0 +1,359 @@
+#!/bin/env python3
+
+# suite.py: kmodule benchmark suite over a generated modules tree, JSON results
+#  Copyright (C) 2022  MaxWu <EfiPy.core@gmail.com>.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+
+import argparse
+import concurrent.futures
+import json
+import os
+import platform
+import statistics
+import sys
+import tempfile
+import time
+
+import kmodule as km
+import kofile
+
+from _kmodule import _lsmod_read
+
+KVER = '0.0.0-bench'
+
+parser = argparse.ArgumentParser (description = 'kmodule benchmarks over a generated modules tree, as JSON')
+parser.add_argument ('--modules', type = int, default = 2000, help = 'modules in the tree')
+parser.add_argument ('--repeat', type = int, default = 5, help = 'runs of each benchmark, the median is kept')
+parser.add_argument ('--workers', type = int, default = 4, help = 'scan threads')
+parser.add_argument ('--compress', nargs = '*', help = 'compressions of the compressed modules, those of the kmod build by default')
+parser.add_argument ('--only', nargs = '*', help = 'benchmarks to run, all by default')
+parser.add_argument ('--output', help = 'JSON file, standard output by default')
+parser.add_argument ('--compare', help = 'JSON of an earlier run, a benchmark slower by more than --threshold fails')
+parser.add_argument ('--threshold', type = float, default = 0.20, help = 'allowed slowdown against --compare, 0.20 by default')
+args = parser.parse_args ()
+
+#
+# Each benchmark is setup (tree) -> run, run () returning the operations
+# it made. Only run is timed.
+#
+benchmarks = {}
+
+def benchmark (name):
+
+  def register (setup):
+    benchmarks[name] = setup
+    return setup
+
+  return register
+
+def paths (moddir):
+
+  return sorted (os.path.join (top, f) for top, _, files in os.walk (moddir) for f in files if '.ko' in f)
+
+@benchmark ('modinfo_path')
+def _ (t):
+
+  ctx   = km.Context (t.basedir, KVER)
+  files = [f for f in paths (t.moddir) if f.endswith ('.ko')]
+
+  def run ():
+    for f in files:
+      ctx.modinfo (f)
+    return len (files)
+
+  return run
+
+@benchmark ('modinfo_path_compressed')
+def _ (t):
+
+  ctx   = km.Context (t.basedir, KVER)
+  files = [f for f in paths (t.moddir) if not f.endswith ('.ko')]
+
+  def run ():
+    for f in files:
+      ctx.modinfo (f)
+    return len (files)
+
+  return run
+
+def modinfo_threads (threads):
+
+  #
+  # The same modinfo by path as modinfo_path, split over threads with a
+  # Context each: libkmod runs without the GIL, so the time falls with
+  # the cores up to --workers.
+  #
+  @benchmark ('modinfo_threads%d' % threads)
+  def _ (t):
+
+    ctxs  = [km.Context (t.basedir, KVER) for _ in range (threads)]
+    files = [f for f in paths (t.moddir) if f.endswith ('.ko')]
+    pool  = concurrent.futures.ThreadPoolExecutor (threads)
+
+    def part (i):
+      for f in files[i::threads]:
+        ctxs[i].modinfo (f)
+
+    def run ():
+      for f in [pool.submit (part, i) for i in range (threads)]:
+        f.result ()
+      return len (files)
+
+    return run
+
+for threads in sorted ({1, args.workers}):
+  modinfo_threads (threads)
+
+@benchmark ('modinfo_alias')
+def _ (t):
+
+  ctx   = km.Context (t.basedir, KVER)
+  names = ['bench%d' % i for i in range (t.count)]
+
+  def run ():
+    for n in names:
+      ctx.modinfo (n)
+    return len (names)
+
+  return run
+
+@benchmark ('modinfo_batch')
+def _ (t):
+
+  ctx   = km.Context (t.basedir, KVER)
+  names = ['mod%d' % i for i in range (t.count)]
+
+  def run ():
+    return len (ctx.modinfo_batch (names))
+
+  return run
+
+@benchmark ('resolve_aliases')
+def _ (t):
+
+  #
+  # Coldplug like: each modalias seen by four devices.
+  #
+  ctx     = km.Context (t.basedir, KVER)
+  aliases = ['pci:v%08Xd00001234sv00001028sd000004AAbc02sc00i00' % (i % t.count) for i in range (4 * t.count)]
+
+  def run ():
+    ctx.resolve_aliases (aliases)
+    return len (aliases)
+
+  return run
+
+@benchmark ('depgraph')
+def _ (t):
+
+  names = ['mod%d' % i for i in range (t.count - 10, t.count)]
+
+  def run ():
+    g = km.DepGraph (t.basedir, KVER)
+    g.order ()
+    for n in names:
+      g.closure (n)
+      g.closure (n, reverse = True)
+    return len (g)
+
+  return run
+
+@benchmark ('closure')
+def _ (t):
+
+  #
+  # Initramfs like: a tenth of the modules as roots, every module of the
+  # closure read for its firmware.
+  #
+  ctx   = km.Context (t.basedir, KVER)
+  roots = ['mod%d' % i for i in range (0, t.count, 10)]
+
+  def run ():
+    return len (ctx.closure (*roots, jobs = args.workers)['modules'])
+
+  return run
+
+@benchmark ('lsmod_parse')
+def _ (t):
+
+  def run ():
+    for _ in range (10):
+      _lsmod_read (None, t.proc)
+    return 10 * t.count
+
+  return run
+
+@benchmark ('scan')
+def _ (t):
+
+  def run ():
+    count = 0
+    for path, info in km.scan (t.basedir, KVER, workers = args.workers):
+      count += 1
+    return count
+
+  return run
+
+@benchmark ('symbol_providers')
+def _ (t):
+
+  #
+  # One index read, then every symbol of the tree and as many unknown
+  # ones in a single query.
+  #
+  symbols = ['mod%d_sym%d' % (i, s) for i in range (t.count) for s in range (8)]
+  symbols += ['unknown%d' % i for i in range (len (symbols))]
+
+  def run ():
+    km.SymbolIndex (t.basedir, KVER, symvers = False).providers (symbols)
+    return len (symbols)
+
+  return run
+
+@benchmark ('depmod')
+def _ (t):
+
+  outdir = tempfile.mkdtemp (dir = t.basedir)
+
+  def run ():
+    return km.depmod (t.basedir, KVER, workers = args.workers, outdir = outdir)['modules']
+
+  return run
+
+@benchmark ('depmod_incremental')
+def _ (t):
+
+  #
+  # Every module taken from the state of the first, untimed, run.
+  #
+  outdir = tempfile.mkdtemp (dir = t.basedir)
+  state  = os.path.join (outdir, 'state')
+
+  def run ():
+    return km.depmod (t.basedir, KVER, workers = args.workers, cache = state, outdir = outdir)['modules']
+
+  return run
+
+@benchmark ('diff_trees')
+def _ (t):
+
+  #
+  # The tree against itself: every module read twice, matched and
+  # compared in full.
+  #
+  tree = (t.basedir, KVER)
+
+  def run ():
+    d = km.diff_trees (tree, tree, workers = args.workers)
+    return d['old'] + d['new']
+
+  return run
+
+def compressions ():
+
+  if args.compress is not None:
+    return args.compress
+
+  features = km.version.KMOD_FEATURES.split ()
+  return [kind for kind, feature in (('xz', '+XZ'), ('gz', '+ZLIB'), ('zst', '+ZSTD')) if feature in features]
+
+class Tree:
+
+  #
+  # One module in two is compressed, in turn with each compression.
+  #
+  def __init__ (self, basedir, count):
+
+    kinds = []
+    for kind in compressions ():
+      kinds += ['', kind]
+
+    self.basedir = basedir
+    self.count   = count
+    self.moddir  = kofile.tree (basedir, KVER, count, compress_kinds = kinds or [''], depmod = True)
+    self.proc    = os.path.join (basedir, 'proc_modules')
+    kofile.proc_modules (self.proc, count)
+
+def measure (name, setup, tree):
+
+  run = setup (tree)
+  run ()
+
+  times = []
+  km.reset_stats ()
+
+  for _ in range (args.repeat):
+    t0 = time.perf_counter ()
+    ops = run ()
+    times.append (time.perf_counter () - t0)
+
+  t = statistics.median (times)
+  stats = km.stats ()
+
+  return {
+    'name':       name,
+    'ops':        ops,
+    'seconds':    t,
+    'min':        min (times),
+    'max':        max (times),
+    'us_per_op':  t / ops * 1e6 if ops else None,
+    'ops_per_s':  ops / t if t else None,
+    'phases':     {p: v['time'] / args.repeat for p, v in stats['phases'].items () if v['count']},
+  }
+
+def compare (results, baseline):
+
+  old = {r['name']: r for r in baseline['results']}
+  failed = []
+
+  for r in results:
+    b = old.get (r['name'])
+    if b is None or not b['us_per_op'] or not r['us_per_op']:
+      continue
+    r['change'] = r['us_per_op'] / b['us_per_op'] - 1
+    if r['change'] > args.threshold:
+      failed.append (r['name'])
+
+  return failed
+
+with tempfile.TemporaryDirectory () as tmp:
+  tree = Tree (tmp, args.modules)
+
+  results = [measure (name, setup, tree) for name, setup in benchmarks.items ()
+             if not args.only or name in args.only]
+
+report = {
+  'kmodule':  km.version.KMODULE_VER,
+  'python':   platform.python_version (),
+  'machine':  platform.machine (),
+  'cpus':     os.cpu_count (),
+  'modules':  args.modules,
+  'compress': compressions (),
+  'repeat':   args.repeat,
+  'results':  results,
+}
+
+failed = []
+if args.compare:
+  with open (args.compare) as f:
+    failed = compare (results, json.load (f))
+  report['regressions'] = failed
+
+if args.output:
+  with open (args.output, 'w') as f:
+    json.dump (report, f, indent = 2)
+else:
+  json.dump (report, sys.stdout, indent = 2)
+  print ()
+
+sys.exit (1 if failed else 0)
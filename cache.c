@@ -0,0 +1,740 @@
+/*
+ * cache.c: persistent modinfo cache
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/hash.h>
+#include <shared/util.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// The cache file is the header, Count entries sorted by path hash
+/// then path, then for each entry its NUL terminated path and its
+/// packed modinfo, both 8 byte aligned. It is mapped read only and
+/// looked up in place; modules read since are kept in memory until
+/// the next save writes a new file and renames it over the old one.
+///
+/// An entry is used only while the module file keeps its inode, size
+/// and modification time, so a hit needs a stat() of the file but
+/// never opens it. A blob whose checksum does not match is a miss.
+///
+///////////////////////////////////////////////////////////////////////
+
+#define CACHE_MAGIC     "KMODINFO"
+#define CACHE_VERSION   1
+
+#define CACHE_ALIGN(n)  (((uint64_t) (n) + 7) & ~(uint64_t) 7)
+
+struct cache_header {
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  count;
+  uint64_t  size;
+};
+
+struct cache_entry {
+  uint64_t  ino;
+  uint64_t  size;
+  int64_t   mtime;
+  uint32_t  hash;
+  uint32_t  pathlen;
+  uint64_t  path;
+  uint64_t  blob;
+  uint32_t  sum;          // cache_hash() of the blob
+  uint32_t  reserved;
+};
+
+//
+// An entry of the next save: read since the last one, or kept from the
+// mapped file.
+//
+struct cache_record {
+  struct cache_entry                  key;
+  const char                          *path;
+  const struct kmodule_modinfo_blob   *blob;
+};
+
+struct kmodule_cache {
+  pthread_mutex_t     lock;
+  char                *path;
+
+  void                *map;
+  size_t              map_size;
+  uint32_t            count;
+
+  struct cache_record *pending;
+  unsigned            npending;
+  unsigned            pending_alloc;
+  struct hash         *index;       // path -> pending index + 1
+
+  unsigned long       hits;
+  unsigned long       misses;
+};
+
+#define MAP_ENTRIES(c)  ((const struct cache_entry *) ((const struct cache_header *) (c)->map + 1))
+
+/***********************************************************************
+ *
+ * cache_hash:
+ *
+ ***********************************************************************/
+static uint32_t
+cache_hash (
+  const char  *path,
+  size_t      len
+  )
+{
+  uint32_t h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char) path[i]) * 16777619u;
+
+  return h;
+} // cache_hash
+
+/***********************************************************************
+ *
+ * cache_key:
+ *
+ ***********************************************************************/
+static void
+cache_key (
+  struct cache_entry  *key,
+  const char          *path,
+  const struct stat   *st
+  )
+{
+  memset (key, 0, sizeof (*key));
+  key->pathlen = strlen (path);
+  key->hash    = cache_hash (path, key->pathlen);
+  key->ino     = st->st_ino;
+  key->size    = st->st_size;
+  key->mtime   = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+} // cache_key
+
+/***********************************************************************
+ *
+ * cache_unmap:
+ *
+ ***********************************************************************/
+static void
+cache_unmap (
+  struct kmodule_cache  *cache
+  )
+{
+  if (cache->map != NULL)
+    munmap (cache->map, cache->map_size);
+  cache->map      = NULL;
+  cache->map_size = 0;
+  cache->count    = 0;
+} // cache_unmap
+
+/***********************************************************************
+ *
+ * cache_map:
+ *
+ *   Map the cache file. A missing, foreign or truncated file leaves
+ *   the cache empty, it is replaced on the next save.
+ *
+ ***********************************************************************/
+static void
+cache_map (
+  struct kmodule_cache  *cache
+  )
+{
+  const struct cache_header *hdr;
+  struct stat st;
+  void        *map;
+  int         fd;
+
+  cache_unmap (cache);
+
+  fd = open (cache->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  if (fstat (fd, &st) < 0 || (size_t) st.st_size < sizeof (*hdr)) {
+    close (fd);
+    return;
+  }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return;
+
+  hdr = map;
+  if (memcmp (hdr->magic, CACHE_MAGIC, sizeof (hdr->magic)) != 0 ||
+      hdr->version != CACHE_VERSION ||
+      hdr->size != (uint64_t) st.st_size ||
+      hdr->count > (st.st_size - sizeof (*hdr)) / sizeof (struct cache_entry)) {
+    munmap (map, st.st_size);
+    return;
+  }
+
+  cache->map      = map;
+  cache->map_size = st.st_size;
+  cache->count    = hdr->count;
+} // cache_map
+
+/***********************************************************************
+ *
+ * cache_map_find:
+ *
+ *   Entry of Key in the mapped file, whatever its stat fields, or NULL.
+ *
+ ***********************************************************************/
+static const struct cache_entry *
+cache_map_find (
+  struct kmodule_cache      *cache,
+  const struct cache_entry  *key,
+  const char                *path
+  )
+{
+  const struct cache_entry *entries = MAP_ENTRIES (cache);
+  uint32_t lo = 0, hi = cache->count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (entries[mid].hash < key->hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < cache->count && entries[lo].hash == key->hash; lo++) {
+    const struct cache_entry *e = &entries[lo];
+
+    if (e->pathlen == key->pathlen &&
+        e->path < cache->map_size &&
+        key->pathlen < cache->map_size - e->path &&
+        memcmp ((const char *) cache->map + e->path, path, key->pathlen + 1) == 0)
+      return e;
+  }
+
+  return NULL;
+} // cache_map_find
+
+/***********************************************************************
+ *
+ * kmodule_cache_open:
+ *
+ *   Cache kept in the file Path, created on the first save. Returns
+ *   NULL when out of memory.
+ *
+ ***********************************************************************/
+struct kmodule_cache *
+kmodule_cache_open (
+  const char  *path
+  )
+{
+  struct kmodule_cache *cache;
+
+  cache = calloc (1, sizeof (*cache));
+  if (cache == NULL)
+    return NULL;
+
+  cache->path  = strdup (path);
+  cache->index = hash_new (256, NULL);
+  if (cache->path == NULL || cache->index == NULL) {
+    free (cache->path);
+    if (cache->index != NULL)
+      hash_free (cache->index);
+    free (cache);
+    return NULL;
+  }
+
+  pthread_mutex_init (&cache->lock, NULL);
+  cache_map (cache);
+
+  return cache;
+} // kmodule_cache_open
+
+/***********************************************************************
+ *
+ * cache_drop_pending:
+ *
+ ***********************************************************************/
+static void
+cache_drop_pending (
+  struct kmodule_cache  *cache
+  )
+{
+  unsigned i;
+
+  for (i = 0; i < cache->npending; i++) {
+    hash_del (cache->index, cache->pending[i].path);
+    free ((void *) cache->pending[i].path);
+    free ((void *) cache->pending[i].blob);
+  }
+  cache->npending = 0;
+} // cache_drop_pending
+
+/***********************************************************************
+ *
+ * kmodule_cache_close:
+ *
+ *   Save what was read since the last save, then free Cache.
+ *
+ ***********************************************************************/
+void
+kmodule_cache_close (
+  struct kmodule_cache  *cache
+  )
+{
+  if (cache == NULL)
+    return;
+
+  kmodule_cache_save (cache);
+
+  cache_drop_pending (cache);
+  cache_unmap (cache);
+  hash_free (cache->index);
+  free (cache->pending);
+  free (cache->path);
+  pthread_mutex_destroy (&cache->lock);
+  free (cache);
+} // kmodule_cache_close
+
+/***********************************************************************
+ *
+ * kmodule_cache_get:
+ *
+ *   Copy of the modinfo cached for the module file Path of status St,
+ *   or NULL when there is none or the file changed since.
+ *
+ ***********************************************************************/
+struct kmodule_modinfo_blob *
+kmodule_cache_get (
+  struct kmodule_cache  *cache,
+  const char            *path,
+  const struct stat     *st
+  )
+{
+  const struct kmodule_modinfo_blob *blob = NULL;
+  const struct cache_entry          *e = NULL;
+  struct kmodule_modinfo_blob       *copy = NULL;
+  struct cache_entry  key;
+  intptr_t            index;
+
+  cache_key (&key, path, st);
+
+  pthread_mutex_lock (&cache->lock);
+
+  index = (intptr_t) hash_find (cache->index, path);
+  if (index != 0) {
+    e    = &cache->pending[index - 1].key;
+    blob = cache->pending[index - 1].blob;
+  } else if (cache->map != NULL) {
+    e = cache_map_find (cache, &key, path);
+    if (e != NULL && e->blob < cache->map_size) {
+      blob = (const void *) ((const char *) cache->map + e->blob);
+      if (!kmodule_modinfo_check (blob, cache->map_size - e->blob) ||
+          cache_hash ((const char *) blob, blob->size) != e->sum)
+        blob = NULL;
+    }
+  }
+
+  if (blob != NULL && e->ino == key.ino && e->size == key.size && e->mtime == key.mtime) {
+    copy = malloc (blob->size);
+    if (copy != NULL)
+      memcpy (copy, blob, blob->size);
+  }
+
+  if (copy != NULL)
+    cache->hits++;
+  else
+    cache->misses++;
+
+  pthread_mutex_unlock (&cache->lock);
+
+  return copy;
+} // kmodule_cache_get
+
+/***********************************************************************
+ *
+ * kmodule_cache_put:
+ *
+ *   Remember Blob as the modinfo of the module file Path of status St
+ *   for the next save. Blob is copied.
+ *
+ ***********************************************************************/
+void
+kmodule_cache_put (
+  struct kmodule_cache              *cache,
+  const char                        *path,
+  const struct stat                 *st,
+  const struct kmodule_modinfo_blob *blob
+  )
+{
+  struct cache_record *record;
+  void                *copy;
+  intptr_t            index;
+
+  copy = malloc (blob->size);
+  if (copy == NULL)
+    return;
+  memcpy (copy, blob, blob->size);
+
+  pthread_mutex_lock (&cache->lock);
+
+  index = (intptr_t) hash_find (cache->index, path);
+  if (index != 0) {
+    record = &cache->pending[index - 1];
+    free ((void *) record->blob);
+  } else {
+    if (cache->npending == cache->pending_alloc) {
+      unsigned alloc = cache->pending_alloc ? cache->pending_alloc * 2 : 64;
+      void *tmp = realloc (cache->pending, alloc * sizeof (*cache->pending));
+
+      if (tmp == NULL)
+        goto fail;
+      cache->pending = tmp;
+      cache->pending_alloc = alloc;
+    }
+
+    record = &cache->pending[cache->npending];
+    record->path = strdup (path);
+    if (record->path == NULL)
+      goto fail;
+    if (hash_add (cache->index, record->path, (void *) (intptr_t) (cache->npending + 1)) < 0) {
+      free ((void *) record->path);
+      goto fail;
+    }
+    cache->npending++;
+  }
+
+  cache_key (&record->key, path, st);
+  record->key.sum = cache_hash (copy, blob->size);
+  record->blob = copy;
+
+  pthread_mutex_unlock (&cache->lock);
+  return;
+
+fail:
+  pthread_mutex_unlock (&cache->lock);
+  free (copy);
+} // kmodule_cache_put
+
+/***********************************************************************
+ *
+ * cache_record_cmp:
+ *
+ ***********************************************************************/
+static int
+cache_record_cmp (
+  const void  *a,
+  const void  *b
+  )
+{
+  const struct cache_record *ra = a, *rb = b;
+
+  if (ra->key.hash != rb->key.hash)
+    return ra->key.hash < rb->key.hash ? -1 : 1;
+
+  return strcmp (ra->path, rb->path);
+} // cache_record_cmp
+
+/***********************************************************************
+ *
+ * cache_write:
+ *
+ ***********************************************************************/
+static int
+cache_write (
+  FILE                *fp,
+  struct cache_record *records,
+  uint32_t            count
+  )
+{
+  static const char   zero[8];
+  struct cache_header hdr;
+  struct cache_entry  e;
+  uint64_t            offset;
+  uint32_t            i;
+
+  offset = sizeof (hdr) + (uint64_t) count * sizeof (e);
+  for (i = 0; i < count; i++) {
+    records[i].key.path = offset;
+    offset += CACHE_ALIGN (records[i].key.pathlen + 1);
+    records[i].key.blob = offset;
+    offset += CACHE_ALIGN (records[i].blob->size);
+  }
+
+  memcpy (hdr.magic, CACHE_MAGIC, sizeof (hdr.magic));
+  hdr.version = CACHE_VERSION;
+  hdr.count   = count;
+  hdr.size    = offset;
+  if (fwrite (&hdr, sizeof (hdr), 1, fp) != 1)
+    return -EIO;
+
+  for (i = 0; i < count; i++) {
+    e = records[i].key;
+    if (fwrite (&e, sizeof (e), 1, fp) != 1)
+      return -EIO;
+  }
+
+  for (i = 0; i < count; i++) {
+    size_t len = records[i].key.pathlen + 1;
+    size_t size = records[i].blob->size;
+
+    if (fwrite (records[i].path, len, 1, fp) != 1 ||
+        fwrite (zero, 1, CACHE_ALIGN (len) - len, fp) != CACHE_ALIGN (len) - len ||
+        fwrite (records[i].blob, size, 1, fp) != 1 ||
+        fwrite (zero, 1, CACHE_ALIGN (size) - size, fp) != CACHE_ALIGN (size) - size)
+      return -EIO;
+  }
+
+  return 0;
+} // cache_write
+
+/***********************************************************************
+ *
+ * kmodule_cache_save:
+ *
+ *   Write the mapped entries and the ones read since into a new cache
+ *   file, replace the old one and map it. Returns 0 or a negative
+ *   errno. Needs no GIL.
+ *
+ ***********************************************************************/
+int
+kmodule_cache_save (
+  struct kmodule_cache  *cache
+  )
+{
+  struct cache_record *records;
+  char                tmp[PATH_MAX];
+  FILE                *fp;
+  uint32_t            count = 0, i;
+  int                 err;
+
+  pthread_mutex_lock (&cache->lock);
+
+  if (cache->npending == 0) {
+    pthread_mutex_unlock (&cache->lock);
+    return 0;
+  }
+
+  records = malloc ((cache->count + cache->npending) * sizeof (*records));
+  if (records == NULL) {
+    pthread_mutex_unlock (&cache->lock);
+    return -ENOMEM;
+  }
+
+  //
+  // Entries of the mapped file first, but the ones read again, then
+  // everything read since the last save.
+  //
+  for (i = 0; i < cache->count; i++) {
+    const struct cache_entry *e = &MAP_ENTRIES (cache)[i];
+    const struct kmodule_modinfo_blob *blob;
+    const char *path;
+    struct cache_entry key;
+    struct stat st;
+
+    if (e->path >= cache->map_size || e->pathlen >= cache->map_size - e->path ||
+        e->blob >= cache->map_size)
+      continue;
+    path = (const char *) cache->map + e->path;
+    blob = (const void *) ((const char *) cache->map + e->blob);
+    if (path[e->pathlen] != '\0' || hash_find (cache->index, path) != NULL)
+      continue;
+    if (!kmodule_modinfo_check (blob, cache->map_size - e->blob) ||
+        cache_hash ((const char *) blob, blob->size) != e->sum)
+      continue;
+
+    //
+    // Entries of module files removed or replaced since are dropped, so
+    // the file does not only grow.
+    //
+    if (stat (path, &st) < 0)
+      continue;
+    cache_key (&key, path, &st);
+    if (key.ino != e->ino || key.size != e->size || key.mtime != e->mtime)
+      continue;
+
+    records[count].key  = *e;
+    records[count].path = path;
+    records[count].blob = blob;
+    count++;
+  }
+  memcpy (&records[count], cache->pending, cache->npending * sizeof (*records));
+  count += cache->npending;
+
+  qsort (records, count, sizeof (*records), cache_record_cmp);
+
+  mkdir_parents (cache->path, 0755);
+
+  fp = kmodule_tmpfile (cache->path, tmp, sizeof (tmp));
+  if (fp == NULL) {
+    err = -errno;
+  } else {
+    err = cache_write (fp, records, count);
+    if (fclose (fp) != 0 && err == 0)
+      err = -errno;
+    if (err == 0 && rename (tmp, cache->path) < 0)
+      err = -errno;
+    if (err < 0)
+      unlink (tmp);
+  }
+
+  free (records);
+
+  if (err == 0) {
+    cache_drop_pending (cache);
+    cache_map (cache);
+  }
+
+  pthread_mutex_unlock (&cache->lock);
+
+  return err;
+} // kmodule_cache_save
+
+/***********************************************************************
+ *
+ * kmodule_tmpfile:
+ *
+ *   Create a file of a unique name beside Path, copied into Tmp, for
+ *   its content to be renamed over Path, readable by all as the files
+ *   it replaces. Threads and processes writing the same Path each get
+ *   their own. Returns NULL with errno set.
+ *
+ ***********************************************************************/
+FILE *
+kmodule_tmpfile (
+  const char  *path,
+  char        *tmp,
+  size_t      size
+  )
+{
+  FILE  *fp;
+  int   fd;
+
+  if ((size_t) snprintf (tmp, size, "%s.XXXXXX", path) >= size) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  fd = mkostemp (tmp, O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  fp = fchmod (fd, 0644) == 0 ? fdopen (fd, "w") : NULL;
+  if (fp == NULL) {
+    int err = errno;
+
+    close (fd);
+    unlink (tmp);
+    errno = err;
+  }
+
+  return fp;
+} // kmodule_tmpfile
+
+/***********************************************************************
+ *
+ * kmodule_cache_info:
+ *
+ *   dict of the cache counters. Called with the GIL.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_cache_info (
+  struct kmodule_cache  *cache
+  )
+{
+  PyObject *ret;
+
+  pthread_mutex_lock (&cache->lock);
+  ret = Py_BuildValue ("{s:s,s:I,s:I,s:k,s:k}",
+          "path",     cache->path,
+          "entries",  cache->count,
+          "pending",  cache->npending,
+          "hits",     cache->hits,
+          "misses",   cache->misses);
+  pthread_mutex_unlock (&cache->lock);
+
+  return ret;
+} // kmodule_cache_info
+
+/***********************************************************************
+ *
+ * kmodule_cache_path:
+ *
+ *   File of the Cache argument into Buf: a path, or with True the
+ *   default XDG_CACHE_HOME/kmodule/<kernel version>.<Suffix> of the
+ *   modules directory Dirname. Returns 0 when no cache is asked for,
+ *   1 when Buf is set, -1 with an exception set.
+ *
+ ***********************************************************************/
+int
+kmodule_cache_path (
+  PyObject    *cache,
+  const char  *dirname,
+  const char  *suffix,
+  char        *buf,
+  size_t      size
+  )
+{
+  const char *home, *kversion;
+  int         len;
+
+  if (cache == NULL || cache == Py_None || cache == Py_False)
+    return 0;
+
+  if (PyUnicode_Check (cache)) {
+    const char *path = PyUnicode_AsUTF8 (cache);
+
+    if (path == NULL)
+      return -1;
+    len = snprintf (buf, size, "%s", path);
+  } else if (cache != Py_True) {
+    PyErr_Format (PyExc_TypeError, "cache must be a path, True or None.");
+    return -1;
+  } else {
+    kversion = strrchr (dirname, '/');
+    kversion = kversion != NULL ? kversion + 1 : dirname;
+
+    home = getenv ("XDG_CACHE_HOME");
+    if (home != NULL && home[0] != '\0') {
+      len = snprintf (buf, size, "%s/kmodule/%s.%s", home, kversion, suffix);
+    } else {
+      home = getenv ("HOME");
+      if (home == NULL || home[0] == '\0') {
+        PyErr_Format (PyExc_OSError, "no HOME for the default cache file.\n");
+        return -1;
+      }
+      len = snprintf (buf, size, "%s/.cache/kmodule/%s.%s", home, kversion, suffix);
+    }
+  }
+
+  if (len < 0 || (size_t) len >= size) {
+    errno = ENAMETOOLONG;
+    PyErr_SetFromErrno (PyExc_OSError);
+    return -1;
+  }
+
+  return 1;
+} // kmodule_cache_path
@@ -0,0 +1,481 @@
+/*
+ * coldplug.c: load the modules of the devices already present in sysfs
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/hash.h>
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// static function for coldplug
+///
+///   Three steps, all under the Context lock and without the GIL:
+///   the sysfs tree is walked with openat() from its root, the distinct
+///   modaliases found are resolved through the alias cache of the
+///   Context, and the modules are inserted as modprobe does, on Jobs
+///   threads in dependency order. Modules blacklisted by the config of
+///   the Context are left out, as modprobe does for aliases.
+///
+///////////////////////////////////////////////////////////////////////
+
+#define COLDPLUG_DEPTH      64      // sysfs device paths are far shorter
+#define COLDPLUG_MODALIAS   4096    // a sysfs attribute is one page
+
+struct coldplug {
+  struct hash             *seen;        // modalias -> 1
+  char                    **aliases;
+  unsigned                count;
+  unsigned                alloc;
+  unsigned                devices;      // modalias files read
+  char                    **unmatched;
+  unsigned                nunmatched;
+  struct hash             *blacklisted; // name -> 1
+  struct kmodule_config   *config;
+  struct kmodule_modprobe *mp;
+};
+
+/***********************************************************************
+ *
+ * coldplug_elapsed:
+ *
+ ***********************************************************************/
+static double
+coldplug_elapsed (
+  const struct timespec *t0
+  )
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - t0->tv_sec) + (now.tv_nsec - t0->tv_nsec) / 1e9;
+} // coldplug_elapsed
+
+/***********************************************************************
+ *
+ * coldplug_modalias:
+ *
+ *   Read the modalias attribute Name of Dirfd and keep it when it was
+ *   not seen yet. Returns 0 or a negative errno.
+ *
+ ***********************************************************************/
+static int
+coldplug_modalias (
+  struct coldplug *cp,
+  int             dirfd,
+  const char      *name
+  )
+{
+  char    buf[COLDPLUG_MODALIAS];
+  char    *alias;
+  ssize_t len;
+  int     fd, err;
+
+  fd = openat (dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  len = read (fd, buf, sizeof (buf) - 1);
+  close (fd);
+  if (len <= 0)
+    return 0;
+
+  while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\0'))
+    len--;
+  if (len == 0)
+    return 0;
+  buf[len] = '\0';
+
+  cp->devices++;
+
+  if (hash_find (cp->seen, buf) != NULL)
+    return 0;
+
+  if (cp->count == cp->alloc) {
+    unsigned alloc = cp->alloc ? cp->alloc * 2 : 256;
+    void *tmp = realloc (cp->aliases, alloc * sizeof (char *));
+
+    if (tmp == NULL)
+      return -ENOMEM;
+    cp->aliases = tmp;
+    cp->alloc   = alloc;
+  }
+
+  alias = strdup (buf);
+  if (alias == NULL)
+    return -ENOMEM;
+
+  err = hash_add (cp->seen, alias, (void *) 1);
+  if (err < 0) {
+    free (alias);
+    return err;
+  }
+
+  cp->aliases[cp->count++] = alias;
+
+  return 0;
+} // coldplug_modalias
+
+/***********************************************************************
+ *
+ * coldplug_walk:
+ *
+ *   Collect the modalias files under Dirfd, which is closed on return.
+ *   Symbolic links, of which sysfs has many pointing back up the tree,
+ *   are not followed.
+ *
+ ***********************************************************************/
+static int
+coldplug_walk (
+  struct coldplug *cp,
+  int             dirfd,
+  int             depth
+  )
+{
+  DIR           *dir;
+  struct dirent *de;
+  int           err = 0;
+
+  dir = fdopendir (dirfd);
+  if (dir == NULL) {
+    close (dirfd);
+    return 0;
+  }
+
+  while (err == 0 && (de = readdir (dir)) != NULL) {
+    unsigned char type = de->d_type;
+    size_t len = strlen (de->d_name);
+
+    if (de->d_name[0] == '.' &&
+        (len == 1 || (len == 2 && de->d_name[1] == '.')))
+      continue;
+
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+
+      if (fstatat (dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        continue;
+      type = S_ISDIR (st.st_mode) ? DT_DIR : S_ISREG (st.st_mode) ? DT_REG : DT_LNK;
+    }
+
+    if (type == DT_REG) {
+      if (streq (de->d_name, "modalias"))
+        err = coldplug_modalias (cp, dirfd, de->d_name);
+    } else if (type == DT_DIR && depth < COLDPLUG_DEPTH) {
+      int fd = openat (dirfd, de->d_name,
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+      if (fd >= 0)
+        err = coldplug_walk (cp, fd, depth + 1);
+    }
+  }
+
+  closedir (dir);
+
+  return err;
+} // coldplug_walk
+
+/***********************************************************************
+ *
+ * coldplug_resolve:
+ *
+ *   Add the modules of every modalias to the modprobe set. Returns 0 or
+ *   a negative errno.
+ *
+ ***********************************************************************/
+static int
+coldplug_resolve (
+  struct coldplug             *cp,
+  struct kmod_ctx             *ctx,
+  struct kmodule_alias_cache  *cache
+  )
+{
+  unsigned i;
+  int err = 0;
+
+  cp->unmatched = calloc (cp->count + 1, sizeof (char *));
+  if (cp->unmatched == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < cp->count && err == 0; i++) {
+    const char *p;
+    char *names;
+
+    err = kmodule_alias_resolve (ctx, cache, cp->aliases[i], &names);
+    if (err < 0)
+      break;
+
+    if (*names == '\0')
+      cp->unmatched[cp->nunmatched++] = cp->aliases[i];
+
+    for (p = names; err == 0 && *p != '\0'; p += strlen (p) + 1) {
+      struct kmod_module *mod;
+
+      if (cp->config != NULL && kmodule_config_blacklisted (cp->config, p)) {
+        char *name;
+
+        if (hash_find (cp->blacklisted, p) != NULL)
+          continue;
+        name = strdup (p);
+        if (name == NULL) {
+          err = -ENOMEM;
+          break;
+        }
+        err = hash_add (cp->blacklisted, name, name);
+        if (err < 0)
+          free (name);
+        continue;
+      }
+
+      err = kmod_module_new_from_name (ctx, p, &mod);
+      if (err < 0)
+        break;
+      err = kmodule_modprobe_add (cp->mp, mod);
+      kmod_module_unref (mod);
+    }
+
+    free (names);
+  }
+
+  return err;
+} // coldplug_resolve
+
+/***********************************************************************
+ *
+ * coldplug_free:
+ *
+ *   Called with the Context lock held and without the GIL.
+ *
+ ***********************************************************************/
+static void
+coldplug_free (
+  struct coldplug *cp
+  )
+{
+  unsigned i;
+
+  kmodule_modprobe_free (cp->mp);
+  kmodule_config_unref (cp->config);
+  if (cp->blacklisted != NULL)
+    hash_free (cp->blacklisted);
+
+  for (i = 0; i < cp->count; i++)
+    free (cp->aliases[i]);
+  free (cp->aliases);
+  free (cp->unmatched);
+  if (cp->seen != NULL)
+    hash_free (cp->seen);
+} // coldplug_free
+
+/***********************************************************************
+ *
+ * coldplug_strings:
+ *
+ ***********************************************************************/
+static PyObject *
+coldplug_strings (
+  char      **strings,
+  unsigned  count
+  )
+{
+  PyObject  *tuple;
+  unsigned  i;
+
+  tuple = PyTuple_New (count);
+  for (i = 0; tuple != NULL && i < count; i++) {
+    PyObject *s = PyUnicode_DecodeUTF8 (strings[i], strlen (strings[i]), "replace");
+
+    if (s == NULL) {
+      Py_CLEAR (tuple);
+      break;
+    }
+    PyTuple_SET_ITEM (tuple, i, s);
+  }
+
+  return tuple;
+} // coldplug_strings
+
+/***********************************************************************
+ *
+ * coldplug_blacklisted:
+ *
+ ***********************************************************************/
+static PyObject *
+coldplug_blacklisted (
+  struct coldplug *cp
+  )
+{
+  struct hash_iter  iter;
+  const char        *name;
+  PyObject          *list;
+
+  list = PyList_New (0);
+  hash_iter_init (cp->blacklisted, &iter);
+  while (list != NULL && hash_iter_next (&iter, &name, NULL)) {
+    PyObject *s = PyUnicode_FromString (name);
+
+    if (s == NULL || PyList_Append (list, s) < 0)
+      Py_CLEAR (list);
+    Py_XDECREF (s);
+  }
+
+  if (list != NULL && PyList_Sort (list) < 0)
+    Py_CLEAR (list);
+
+  return list != NULL ? PyList_AsTuple (list) : NULL;
+} // coldplug_blacklisted
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule public function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_coldplug:
+ *
+ *   Context._coldplug (sysfs="/sys/devices", jobs=1, insert=None)
+ *
+ *   Insert the modules of every device under Sysfs. Insert is the
+ *   python backend as in Context._modprobe.
+ *
+ *   Returns {'devices', 'aliases', 'unmatched', 'blacklisted', 'modules',
+ *   'walk', 'resolve', 'load', 'total'}, modules as Context._modprobe
+ *   returns and the times in seconds, total the time to all loaded.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_coldplug (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  PyObject        *insert = Py_None, *modules, *unmatched, *blacklisted, *ret = NULL;
+  const char      *sysfs = "/sys/devices";
+  int             jobs = 1, err = 0, fd;
+  double          walk = 0, resolve = 0, load = 0;
+  struct timespec t0;
+
+  struct kmod_ctx *ctx;
+  struct coldplug cp;
+  KmodContextObject *Context = (KmodContextObject *) Self;
+
+  static char   *kwlist[] = {"sysfs", "jobs", "insert", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "|siO",
+      kwlist,
+      &sysfs,
+      &jobs,
+      &insert)) {
+    return NULL;
+  }
+
+  ctx = kmodule_context_get (Self);
+  if (ctx == NULL)
+    return NULL;
+
+  if (insert != Py_None && !PyCallable_Check (insert)) {
+    PyErr_Format (PyExc_TypeError, "insert must be callable.");
+    return NULL;
+  }
+
+  memset (&cp, 0, sizeof (cp));
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+
+  ctx            = Context->ctx;
+  cp.config      = kmodule_config_ref (Context->config);
+  cp.seen        = hash_new (256, NULL);
+  cp.blacklisted = hash_new (16, free);
+  cp.mp          = kmodule_modprobe_new (ctx, cp.config, Context->decompress, insert != Py_None ? insert : NULL);
+  if (cp.seen == NULL || cp.blacklisted == NULL || cp.mp == NULL)
+    err = -ENOMEM;
+
+  if (err == 0) {
+    fd = open (sysfs, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    err = fd < 0 ? -errno : coldplug_walk (&cp, fd, 0);
+  }
+  walk = coldplug_elapsed (&t0);
+
+  if (err == 0) {
+    if (Context->aliases == NULL && Context->alias_capacity > 0)
+      Context->aliases = kmodule_alias_cache_new (Context->alias_capacity);
+    err = coldplug_resolve (&cp, ctx, Context->aliases);
+  }
+  resolve = coldplug_elapsed (&t0) - walk;
+
+  if (err == 0)
+    err = kmodule_modprobe_run (cp.mp, Self, jobs);
+  load = coldplug_elapsed (&t0) - walk - resolve;
+
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  if (err < 0) {
+    PyErr_Format (PyExc_OSError, "coldplug of %s failed: %s\n", sysfs, strerror (-err));
+  } else {
+    //
+    // Built before the dict, so one that fails does not leak the others.
+    //
+    modules     = kmodule_modprobe_result (cp.mp);
+    unmatched   = coldplug_strings (cp.unmatched, cp.nunmatched);
+    blacklisted = coldplug_blacklisted (&cp);
+    if (modules != NULL && unmatched != NULL && blacklisted != NULL)
+      ret = Py_BuildValue ("{s:I,s:I,s:O,s:O,s:O,s:d,s:d,s:d,s:d}",
+              "devices",   cp.devices,
+              "aliases",   cp.count,
+              "unmatched", unmatched,
+              "blacklisted", blacklisted,
+              "modules",   modules,
+              "walk",      walk,
+              "resolve",   resolve,
+              "load",      load,
+              "total",     walk + resolve + load);
+    Py_XDECREF (modules);
+    Py_XDECREF (unmatched);
+    Py_XDECREF (blacklisted);
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+  coldplug_free (&cp);
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  return ret;
+
+} // kmodule_coldplug
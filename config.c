@@ -0,0 +1,1225 @@
+/*
+ * config.c: modprobe.d and modules-load.d compiled into lookup tables
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/hash.h>
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// static function for config
+///
+///   libkmod parses modprobe.d when the kmod_ctx is made, but answers
+///   each options or softdep question by walking its lists. The lists
+///   are read once into hashes keyed by module name. modules-load.d,
+///   which libkmod does not read, is parsed here.
+///
+///   A kmodule_config is shared by the calls running on its Context and
+///   freed once the last one drops it; its reference count is only
+///   changed under the Context lock.
+///
+///////////////////////////////////////////////////////////////////////
+
+static const char *config_modprobe_dirs [] = {
+  "/etc/modprobe.d",
+  "/run/modprobe.d",
+  "/usr/local/lib/modprobe.d",
+  "/usr/lib/modprobe.d",
+  "/lib/modprobe.d",
+  NULL
+};
+
+static const char *config_load_dirs [] = {
+  "/etc/modules-load.d",
+  "/run/modules-load.d",
+  "/usr/local/lib/modules-load.d",
+  "/usr/lib/modules-load.d",
+  "/lib/modules-load.d",
+  NULL
+};
+
+struct kmodule_config {
+  unsigned    refs;
+  char        **paths;        // modprobe.d, NULL terminated for kmod_new()
+  char        **load_paths;   // modules-load.d, NULL terminated
+  uint64_t    stamp;
+  struct hash *options;       // name -> config_entry, options joined
+  struct hash *blacklist;
+  struct hash *softdeps;      // name -> config_entry, pre in value
+  struct hash *install;
+  struct hash *remove;
+  char        **load;
+  unsigned    nload;
+};
+
+struct config_entry {
+  const char  *value;
+  const char  *post;
+  char        key[];
+};
+
+/***********************************************************************
+ *
+ * config_entry_new:
+ *
+ ***********************************************************************/
+static struct config_entry *
+config_entry_new (
+  const char  *key,
+  const char  *value,
+  const char  *post
+  )
+{
+  struct config_entry *e;
+  size_t  klen = strlen (key) + 1, vlen = strlen (value) + 1;
+  size_t  plen = post != NULL ? strlen (post) + 1 : 0;
+  char    *p;
+
+  e = malloc (sizeof (*e) + klen + vlen + plen);
+  if (e == NULL)
+    return NULL;
+
+  p = e->key;
+  memcpy (p, key, klen);
+  p += klen;
+  e->value = memcpy (p, value, vlen);
+  p += vlen;
+  e->post = post != NULL ? memcpy (p, post, plen) : NULL;
+
+  return e;
+} // config_entry_new
+
+/***********************************************************************
+ *
+ * config_put:
+ *
+ *   Set Key of Hash to a new entry, replacing the one before.
+ *
+ ***********************************************************************/
+static int
+config_put (
+  struct hash *hash,
+  const char  *key,
+  const char  *value,
+  const char  *post
+  )
+{
+  struct config_entry *e = config_entry_new (key, value, post);
+  int err;
+
+  if (e == NULL)
+    return -ENOMEM;
+
+  err = hash_add (hash, e->key, e);
+  if (err < 0)
+    free (e);
+
+  return err;
+} // config_put
+
+/***********************************************************************
+ *
+ * config_words:
+ *
+ *   The words of Start .. End into List, joined by one space.
+ *
+ ***********************************************************************/
+static void
+config_words (
+  const char  *start,
+  const char  *end,
+  char        *list
+  )
+{
+  char *p = list;
+
+  while (start < end) {
+    size_t n;
+
+    while (start < end && (*start == ' ' || *start == '\t'))
+      start++;
+    for (n = 0; start + n < end && start[n] != ' ' && start[n] != '\t'; n++)
+      ;
+    if (n == 0)
+      break;
+    if (p != list)
+      *p++ = ' ';
+    memcpy (p, start, n);
+    p += n;
+    start += n;
+  }
+
+  *p = '\0';
+} // config_words
+
+/***********************************************************************
+ *
+ * config_softdep:
+ *
+ *   Split a softdep as libkmod prints it, "pre: a b" and "post: c" one
+ *   after the other, into the space separated Pre and Post, each with
+ *   room for the whole Value.
+ *
+ ***********************************************************************/
+static void
+config_softdep (
+  const char  *value,
+  char        *pre,
+  char        *post
+  )
+{
+  const char  *end = value + strlen (value);
+  const char  *p = strstr (value, "pre:"), *q = strstr (value, "post:");
+
+  *pre = *post = '\0';
+
+  if (p != NULL && (q == NULL || p < q))
+    config_words (p + 4, q != NULL ? q : end, pre);
+  if (q != NULL)
+    config_words (q + 5, p != NULL && p > q ? p : end, post);
+} // config_softdep
+
+/***********************************************************************
+ *
+ * config_compile_iter:
+ *
+ *   Read Iter into Hash. Options of the same module are joined, the
+ *   last of anything else is kept. Iter is freed.
+ *
+ ***********************************************************************/
+static int
+config_compile_iter (
+  struct hash             *hash,
+  struct kmod_config_iter *iter,
+  bool                    options,
+  bool                    softdeps
+  )
+{
+  int err = 0;
+
+  if (iter == NULL)
+    return 0;
+
+  while (err == 0 && kmod_config_iter_next (iter)) {
+    const char *key   = kmod_config_iter_get_key (iter);
+    const char *value = kmod_config_iter_get_value (iter);
+    struct config_entry *old;
+
+    if (key == NULL)
+      continue;
+    if (value == NULL)
+      value = "";
+
+    old = hash_find (hash, key);
+
+    if (options && old != NULL) {
+      char *joined = malloc (strlen (old->value) + strlen (value) + 2);
+
+      if (joined == NULL) {
+        err = -ENOMEM;
+        break;
+      }
+      sprintf (joined, "%s %s", old->value, value);
+      err = config_put (hash, key, joined, NULL);
+      free (joined);
+    } else if (softdeps) {
+      size_t len = strlen (value) + 1;
+      char *pre = malloc (2 * len);
+
+      if (pre == NULL) {
+        err = -ENOMEM;
+        break;
+      }
+      config_softdep (value, pre, pre + len);
+      err = config_put (hash, key, pre, pre + len);
+      free (pre);
+    } else {
+      err = config_put (hash, key, value, NULL);
+    }
+  }
+
+  kmod_config_iter_free_iter (iter);
+
+  return err;
+} // config_compile_iter
+
+/***********************************************************************
+ *
+ * config_name_cmp:
+ *
+ ***********************************************************************/
+static int
+config_name_cmp (
+  const void  *a,
+  const void  *b
+  )
+{
+  const char *x = strrchr (*(char * const *) a, '/');
+  const char *y = strrchr (*(char * const *) b, '/');
+
+  return strcmp (x, y);
+} // config_name_cmp
+
+/***********************************************************************
+ *
+ * config_load_file:
+ *
+ *   Add the modules listed by one modules-load.d file, one per line,
+ *   '#' and ';' starting comments.
+ *
+ ***********************************************************************/
+static int
+config_load_file (
+  struct kmodule_config *cfg,
+  struct hash           *seen,
+  const char            *path
+  )
+{
+  char  line[PATH_MAX];
+  FILE  *fp;
+  int   err = 0;
+
+  fp = fopen (path, "re");
+  if (fp == NULL)
+    return 0;
+
+  while (err == 0 && fgets (line, sizeof (line), fp) != NULL) {
+    char *p = line, *end, *name;
+    void *tmp;
+
+    while (*p == ' ' || *p == '\t')
+      p++;
+    end = p + strcspn (p, " \t\r\n");
+    *end = '\0';
+    if (*p == '\0' || *p == '#' || *p == ';' || hash_find (seen, p) != NULL)
+      continue;
+
+    tmp = realloc (cfg->load, (cfg->nload + 1) * sizeof (char *));
+    name = strdup (p);
+    if (tmp != NULL)
+      cfg->load = tmp;
+    if (tmp == NULL || name == NULL) {
+      free (name);
+      err = -ENOMEM;
+      break;
+    }
+    cfg->load[cfg->nload++] = name;
+    err = hash_add (seen, name, name);
+  }
+
+  fclose (fp);
+
+  return err;
+} // config_load_file
+
+/***********************************************************************
+ *
+ * config_load:
+ *
+ *   modules-load.d: the *.conf files of every directory, the first
+ *   directory giving a file name hiding the others, read in file name
+ *   order.
+ *
+ ***********************************************************************/
+static int
+config_load (
+  struct kmodule_config *cfg
+  )
+{
+  struct hash *names, *seen;
+  char        **files = NULL, path[PATH_MAX];
+  unsigned    count = 0, i;
+  int         err = 0;
+
+  names = hash_new (64, NULL);
+  seen  = hash_new (64, NULL);
+  if (names == NULL || seen == NULL) {
+    err = -ENOMEM;
+    goto done;
+  }
+
+  for (i = 0; err == 0 && cfg->load_paths[i] != NULL; i++) {
+    struct dirent *de;
+    struct stat   st;
+    DIR           *dir;
+
+    if (stat (cfg->load_paths[i], &st) < 0)
+      continue;
+
+    if (!S_ISDIR (st.st_mode)) {
+      err = config_load_file (cfg, seen, cfg->load_paths[i]);
+      continue;
+    }
+
+    dir = opendir (cfg->load_paths[i]);
+    if (dir == NULL)
+      continue;
+
+    while (err == 0 && (de = readdir (dir)) != NULL) {
+      size_t len = strlen (de->d_name);
+      void *tmp;
+
+      if (len < 6 || !streq (de->d_name + len - 5, ".conf") || hash_find (names, de->d_name) != NULL)
+        continue;
+
+      snprintf (path, sizeof (path), "%s/%s", cfg->load_paths[i], de->d_name);
+      tmp = realloc (files, (count + 1) * sizeof (char *));
+      if (tmp == NULL || (((char **) tmp)[count] = strdup (path)) == NULL) {
+        if (tmp != NULL)
+          files = tmp;
+        err = -ENOMEM;
+        break;
+      }
+      files = tmp;
+      err = hash_add (names, strrchr (files[count], '/') + 1, files[count]);
+      count++;
+    }
+
+    closedir (dir);
+  }
+
+  if (files != NULL)
+    qsort (files, count, sizeof (char *), config_name_cmp);
+
+  for (i = 0; err == 0 && i < count; i++)
+    err = config_load_file (cfg, seen, files[i]);
+
+done:
+  for (i = 0; i < count; i++)
+    free (files[i]);
+  free (files);
+  if (names != NULL)
+    hash_free (names);
+  if (seen != NULL)
+    hash_free (seen);
+
+  return err;
+} // config_load
+
+/***********************************************************************
+ *
+ * config_mix:
+ *
+ ***********************************************************************/
+static uint64_t
+config_mix (
+  uint64_t    h,
+  const void  *data,
+  size_t      len
+  )
+{
+  const unsigned char *p = data;
+
+  while (len-- > 0)
+    h = (h ^ *p++) * 0x100000001b3ULL;
+
+  return h;
+} // config_mix
+
+/***********************************************************************
+ *
+ * config_stamp_path:
+ *
+ *   Hash of what stat() tells of Path and, for a directory, of every
+ *   entry in it, independent of the order they are listed in.
+ *
+ ***********************************************************************/
+static uint64_t
+config_stamp_path (
+  const char  *path
+  )
+{
+  struct stat st;
+  uint64_t    h = 0xcbf29ce484222325ULL, entries = 0;
+  DIR         *dir;
+  struct dirent *de;
+
+  h = config_mix (h, path, strlen (path));
+  if (stat (path, &st) < 0)
+    return h;
+
+  h = config_mix (h, &st.st_ino, sizeof (st.st_ino));
+  h = config_mix (h, &st.st_size, sizeof (st.st_size));
+  h = config_mix (h, &st.st_mtim, sizeof (st.st_mtim));
+
+  if (!S_ISDIR (st.st_mode))
+    return h;
+
+  dir = opendir (path);
+  if (dir == NULL)
+    return h;
+
+  while ((de = readdir (dir)) != NULL) {
+    uint64_t e = 0xcbf29ce484222325ULL;
+
+    if (de->d_name[0] == '.')
+      continue;
+
+    e = config_mix (e, de->d_name, strlen (de->d_name));
+    if (fstatat (dirfd (dir), de->d_name, &st, 0) == 0) {
+      e = config_mix (e, &st.st_ino, sizeof (st.st_ino));
+      e = config_mix (e, &st.st_size, sizeof (st.st_size));
+      e = config_mix (e, &st.st_mtim, sizeof (st.st_mtim));
+    }
+    entries += e;
+  }
+
+  closedir (dir);
+
+  return config_mix (h, &entries, sizeof (entries));
+} // config_stamp_path
+
+/***********************************************************************
+ *
+ * config_stamp:
+ *
+ ***********************************************************************/
+static uint64_t
+config_stamp (
+  const struct kmodule_config *cfg
+  )
+{
+  uint64_t  h = 0, s;
+  unsigned  i;
+
+  for (i = 0; cfg->paths[i] != NULL; i++) {
+    s = config_stamp_path (cfg->paths[i]);
+    h = config_mix (h, &s, sizeof (s));
+  }
+  for (i = 0; cfg->load_paths[i] != NULL; i++) {
+    s = config_stamp_path (cfg->load_paths[i]);
+    h = config_mix (h, &s, sizeof (s));
+  }
+
+  return h;
+} // config_stamp
+
+/***********************************************************************
+ *
+ * config_strv_free:
+ *
+ ***********************************************************************/
+static void
+config_strv_free (
+  char  **strv
+  )
+{
+  unsigned i;
+
+  for (i = 0; strv != NULL && strv[i] != NULL; i++)
+    free (strv[i]);
+  free (strv);
+} // config_strv_free
+
+/***********************************************************************
+ *
+ * config_strv_add:
+ *
+ ***********************************************************************/
+static int
+config_strv_add (
+  char        ***strv,
+  unsigned    *count,
+  const char  *prefix,
+  const char  *path
+  )
+{
+  char  *s;
+  void  *tmp;
+
+  tmp = realloc (*strv, (*count + 2) * sizeof (char *));
+  if (tmp == NULL)
+    return -ENOMEM;
+  *strv = tmp;
+
+  s = malloc (strlen (prefix) + strlen (path) + 1);
+  if (s == NULL)
+    return -ENOMEM;
+  sprintf (s, "%s%s", prefix, path);
+
+  (*strv)[(*count)++] = s;
+  (*strv)[*count] = NULL;
+
+  return 0;
+} // config_strv_add
+
+/***********************************************************************
+ *
+ * config_is_load:
+ *
+ *   Whether Path is a modules-load.d directory or a file in one.
+ *
+ ***********************************************************************/
+static bool
+config_is_load (
+  const char  *path
+  )
+{
+  const char  *end = path + strlen (path), *p;
+
+  while (end > path && end[-1] == '/')
+    end--;
+
+  for (p = end; p > path && p[-1] != '/'; p--)
+    ;
+  if (end - p == 14 && strncmp (p, "modules-load.d", 14) == 0)
+    return true;
+
+  if (p > path) {
+    end = p - 1;
+    for (p = end; p > path && p[-1] != '/'; p--)
+      ;
+    return end - p == 14 && strncmp (p, "modules-load.d", 14) == 0;
+  }
+
+  return false;
+} // config_is_load
+
+/***********************************************************************
+ *
+ * config_free:
+ *
+ ***********************************************************************/
+static void
+config_free (
+  struct kmodule_config *cfg
+  )
+{
+  unsigned i;
+
+  config_strv_free (cfg->paths);
+  config_strv_free (cfg->load_paths);
+  if (cfg->options != NULL)
+    hash_free (cfg->options);
+  if (cfg->blacklist != NULL)
+    hash_free (cfg->blacklist);
+  if (cfg->softdeps != NULL)
+    hash_free (cfg->softdeps);
+  if (cfg->install != NULL)
+    hash_free (cfg->install);
+  if (cfg->remove != NULL)
+    hash_free (cfg->remove);
+  for (i = 0; i < cfg->nload; i++)
+    free (cfg->load[i]);
+  free (cfg->load);
+  free (cfg);
+} // config_free
+
+/***********************************************************************
+ *
+ * config_split:
+ *
+ *   List of the words of Str, with the GIL.
+ *
+ ***********************************************************************/
+static PyObject *
+config_split (
+  const char  *str
+  )
+{
+  PyObject  *s, *words;
+
+  s = PyUnicode_FromString (str);
+  if (s == NULL)
+    return NULL;
+
+  words = PyUnicode_Split (s, NULL, -1);
+  Py_DECREF (s);
+
+  return words;
+} // config_split
+
+/***********************************************************************
+ *
+ * config_split_pair:
+ *
+ *   (pre, post) word lists of a softdep, with the GIL.
+ *
+ ***********************************************************************/
+static PyObject *
+config_split_pair (
+  const char  *pre,
+  const char  *post
+  )
+{
+  PyObject  *p, *q;
+
+  p = config_split (pre);
+  if (p == NULL)
+    return NULL;
+
+  q = config_split (post);
+  if (q == NULL) {
+    Py_DECREF (p);
+    return NULL;
+  }
+
+  return Py_BuildValue ("(NN)", p, q);
+} // config_split_pair
+
+/***********************************************************************
+ *
+ * config_dict:
+ *
+ *   {name: value} of Hash, with the GIL.
+ *
+ ***********************************************************************/
+static PyObject *
+config_dict (
+  struct hash *hash,
+  bool        softdeps
+  )
+{
+  struct hash_iter    iter;
+  const char          *key;
+  const void          *value;
+  PyObject            *dict;
+
+  dict = PyDict_New ();
+  if (dict == NULL)
+    return NULL;
+
+  hash_iter_init (hash, &iter);
+  while (hash_iter_next (&iter, &key, &value)) {
+    const struct config_entry *e = value;
+    PyObject *v;
+
+    if (softdeps)
+      v = config_split_pair (e->value, e->post);
+    else
+      v = PyUnicode_FromString (e->value);
+
+    if (v == NULL || PyDict_SetItemString (dict, key, v) < 0) {
+      Py_XDECREF (v);
+      Py_DECREF (dict);
+      return NULL;
+    }
+    Py_DECREF (v);
+  }
+
+  return dict;
+} // config_dict
+
+/***********************************************************************
+ *
+ * config_tuple:
+ *
+ ***********************************************************************/
+static PyObject *
+config_tuple (
+  char      **strv,
+  unsigned  count
+  )
+{
+  PyObject  *tuple;
+  unsigned  i;
+
+  tuple = PyTuple_New (count);
+  for (i = 0; tuple != NULL && i < count; i++) {
+    PyObject *s = PyUnicode_DecodeFSDefault (strv[i]);
+
+    if (s == NULL) {
+      Py_CLEAR (tuple);
+      break;
+    }
+    PyTuple_SET_ITEM (tuple, i, s);
+  }
+
+  return tuple;
+} // config_tuple
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule internal function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_config_new:
+ *
+ *   Config from Spec, with the GIL: True for the default modprobe.d
+ *   and modules-load.d directories under Root, or a path or iterable
+ *   of paths, modules-load.d directories and files in them apart.
+ *   Nothing is read until kmodule_config_compile(). Returns NULL with
+ *   an exception set on failure.
+ *
+ ***********************************************************************/
+struct kmodule_config *
+kmodule_config_new (
+  const char  *root,
+  PyObject    *Spec
+  )
+{
+  struct kmodule_config *cfg;
+  PyObject  *seq = NULL, *item, *bytes;
+  unsigned  npaths = 0, nload = 0, i;
+  Py_ssize_t  n;
+  int       err = 0;
+
+  cfg = calloc (1, sizeof (*cfg));
+  if (cfg == NULL)
+    return (struct kmodule_config *) PyErr_NoMemory ();
+
+  cfg->refs       = 1;
+  cfg->paths      = calloc (1, sizeof (char *));
+  cfg->load_paths = calloc (1, sizeof (char *));
+  if (cfg->paths == NULL || cfg->load_paths == NULL)
+    err = -ENOMEM;
+
+  if (err == 0 && Spec == Py_True) {
+    if (root == NULL)
+      root = "";
+    for (i = 0; err == 0 && config_modprobe_dirs[i] != NULL; i++)
+      err = config_strv_add (&cfg->paths, &npaths, root, config_modprobe_dirs[i]);
+    for (i = 0; err == 0 && config_load_dirs[i] != NULL; i++)
+      err = config_strv_add (&cfg->load_paths, &nload, root, config_load_dirs[i]);
+  } else if (err == 0) {
+    if (PyUnicode_Check (Spec) || PyBytes_Check (Spec) || PyObject_HasAttrString (Spec, "__fspath__"))
+      seq = Py_BuildValue ("(O)", Spec);
+    else
+      seq = PySequence_Fast (Spec, "config must be True, a path or an iterable of paths.");
+    if (seq == NULL) {
+      config_free (cfg);
+      return NULL;
+    }
+
+    n = PySequence_Fast_GET_SIZE (seq);
+    for (i = 0; err == 0 && i < n; i++) {
+      item = PySequence_Fast_GET_ITEM (seq, i);
+      if (!PyUnicode_FSConverter (item, &bytes)) {
+        Py_DECREF (seq);
+        config_free (cfg);
+        return NULL;
+      }
+      if (config_is_load (PyBytes_AS_STRING (bytes)))
+        err = config_strv_add (&cfg->load_paths, &nload, "", PyBytes_AS_STRING (bytes));
+      else
+        err = config_strv_add (&cfg->paths, &npaths, "", PyBytes_AS_STRING (bytes));
+      Py_DECREF (bytes);
+    }
+    Py_DECREF (seq);
+  }
+
+  if (err < 0) {
+    config_free (cfg);
+    return (struct kmodule_config *) PyErr_NoMemory ();
+  }
+
+  return cfg;
+} // kmodule_config_new
+
+/***********************************************************************
+ *
+ * kmodule_config_paths:
+ *
+ *   modprobe.d paths, NULL terminated, for kmod_new().
+ *
+ ***********************************************************************/
+const char * const *
+kmodule_config_paths (
+  const struct kmodule_config *cfg
+  )
+{
+  return (const char * const *) cfg->paths;
+} // kmodule_config_paths
+
+/***********************************************************************
+ *
+ * kmodule_config_compile:
+ *
+ *   Read what Ctx parsed of modprobe.d and modules-load.d into Cfg.
+ *   Called without the GIL, Ctx being made from kmodule_config_paths().
+ *
+ ***********************************************************************/
+int
+kmodule_config_compile (
+  struct kmodule_config *cfg,
+  struct kmod_ctx       *ctx
+  )
+{
+  int err = 0;
+
+  cfg->stamp     = config_stamp (cfg);
+  cfg->options   = hash_new (256, free);
+  cfg->blacklist = hash_new (256, free);
+  cfg->softdeps  = hash_new (64, free);
+  cfg->install   = hash_new (16, free);
+  cfg->remove    = hash_new (16, free);
+  if (cfg->options == NULL || cfg->blacklist == NULL || cfg->softdeps == NULL ||
+      cfg->install == NULL || cfg->remove == NULL)
+    return -ENOMEM;
+
+  err = config_compile_iter (cfg->options, kmod_config_get_options (ctx), true, false);
+  if (err == 0)
+    err = config_compile_iter (cfg->blacklist, kmod_config_get_blacklists (ctx), false, false);
+  if (err == 0)
+    err = config_compile_iter (cfg->softdeps, kmod_config_get_softdeps (ctx), false, true);
+  if (err == 0)
+    err = config_compile_iter (cfg->install, kmod_config_get_install_commands (ctx), false, false);
+  if (err == 0)
+    err = config_compile_iter (cfg->remove, kmod_config_get_remove_commands (ctx), false, false);
+  if (err == 0)
+    err = config_load (cfg);
+
+  return err;
+} // kmodule_config_compile
+
+/***********************************************************************
+ *
+ * kmodule_config_changed:
+ *
+ *   Whether a file or directory of Cfg changed since it was compiled.
+ *
+ ***********************************************************************/
+bool
+kmodule_config_changed (
+  const struct kmodule_config *cfg
+  )
+{
+  return config_stamp (cfg) != cfg->stamp;
+} // kmodule_config_changed
+
+/***********************************************************************
+ *
+ * kmodule_config_copy:
+ *
+ *   A new config of the same paths, not compiled. NULL on failure.
+ *
+ ***********************************************************************/
+struct kmodule_config *
+kmodule_config_copy (
+  const struct kmodule_config *cfg
+  )
+{
+  struct kmodule_config *copy;
+  unsigned  npaths = 0, nload = 0, i;
+  int       err = 0;
+
+  copy = calloc (1, sizeof (*copy));
+  if (copy == NULL)
+    return NULL;
+
+  copy->refs       = 1;
+  copy->paths      = calloc (1, sizeof (char *));
+  copy->load_paths = calloc (1, sizeof (char *));
+  if (copy->paths == NULL || copy->load_paths == NULL)
+    err = -ENOMEM;
+
+  for (i = 0; err == 0 && cfg->paths[i] != NULL; i++)
+    err = config_strv_add (&copy->paths, &npaths, "", cfg->paths[i]);
+  for (i = 0; err == 0 && cfg->load_paths[i] != NULL; i++)
+    err = config_strv_add (&copy->load_paths, &nload, "", cfg->load_paths[i]);
+
+  if (err < 0) {
+    config_free (copy);
+    return NULL;
+  }
+
+  return copy;
+} // kmodule_config_copy
+
+/***********************************************************************
+ *
+ * kmodule_config_ref:
+ *
+ *   With the Context lock held, as kmodule_config_unref().
+ *
+ ***********************************************************************/
+struct kmodule_config *
+kmodule_config_ref (
+  struct kmodule_config *cfg
+  )
+{
+  if (cfg != NULL)
+    cfg->refs++;
+
+  return cfg;
+} // kmodule_config_ref
+
+/***********************************************************************
+ *
+ * kmodule_config_unref:
+ *
+ ***********************************************************************/
+void
+kmodule_config_unref (
+  struct kmodule_config *cfg
+  )
+{
+  if (cfg != NULL && --cfg->refs == 0)
+    config_free (cfg);
+} // kmodule_config_unref
+
+/***********************************************************************
+ *
+ * kmodule_config_options:
+ *
+ *   modprobe.d options of module Name, NULL for none.
+ *
+ ***********************************************************************/
+const char *
+kmodule_config_options (
+  const struct kmodule_config *cfg,
+  const char                  *name
+  )
+{
+  const struct config_entry *e = hash_find (cfg->options, name);
+
+  return e != NULL ? e->value : NULL;
+} // kmodule_config_options
+
+/***********************************************************************
+ *
+ * kmodule_config_blacklisted:
+ *
+ ***********************************************************************/
+bool
+kmodule_config_blacklisted (
+  const struct kmodule_config *cfg,
+  const char                  *name
+  )
+{
+  return hash_find (cfg->blacklist, name) != NULL;
+} // kmodule_config_blacklisted
+
+/***********************************************************************
+ *
+ * kmodule_config_softdeps:
+ *
+ *   Space separated modules to load before and after Name, false when
+ *   it has no softdep.
+ *
+ ***********************************************************************/
+bool
+kmodule_config_softdeps (
+  const struct kmodule_config *cfg,
+  const char                  *name,
+  const char                  **pre,
+  const char                  **post
+  )
+{
+  const struct config_entry *e = hash_find (cfg->softdeps, name);
+
+  if (e == NULL)
+    return false;
+
+  *pre  = e->value;
+  *post = e->post;
+
+  return true;
+} // kmodule_config_softdeps
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule public function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_config_info:
+ *
+ *   Context._config ()
+ *
+ *   None for a Context made without config, else {'paths',
+ *   'load_paths', 'options', 'blacklist', 'softdeps', 'install',
+ *   'remove', 'load'}: options, install and remove as {name: string},
+ *   softdeps as {name: (pre, post)}, blacklist a frozenset and load the
+ *   tuple of modules modules-load.d lists.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_config_info (
+  PyObject    *Self,
+  PyObject    *Unused
+  )
+{
+  KmodContextObject     *Context = (KmodContextObject *) Self;
+  struct kmodule_config *cfg;
+  struct hash_iter      iter;
+  const char            *key;
+  PyObject              *blacklist, *value[8], *ret = NULL;
+  unsigned              npaths, nload;
+  size_t                i;
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+  cfg = kmodule_config_ref (Context->config);
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  if (cfg == NULL) {
+    Py_INCREF (Py_None);
+    return Py_None;
+  }
+
+  for (npaths = 0; cfg->paths[npaths] != NULL; npaths++)
+    ;
+  for (nload = 0; cfg->load_paths[nload] != NULL; nload++)
+    ;
+
+  blacklist = PySet_New (NULL);
+  if (blacklist != NULL) {
+    hash_iter_init (cfg->blacklist, &iter);
+    while (hash_iter_next (&iter, &key, NULL)) {
+      PyObject *name = PyUnicode_FromString (key);
+
+      if (name == NULL || PySet_Add (blacklist, name) < 0) {
+        Py_XDECREF (name);
+        Py_CLEAR (blacklist);
+        break;
+      }
+      Py_DECREF (name);
+    }
+  }
+
+  //
+  // Every value is built before the dict, so one that fails does not
+  // leak the others.
+  //
+  if (blacklist != NULL) {
+    value[0] = config_tuple (cfg->paths, npaths);
+    value[1] = config_tuple (cfg->load_paths, nload);
+    value[2] = config_dict (cfg->options, false);
+    value[3] = PyFrozenSet_New (blacklist);
+    value[4] = config_dict (cfg->softdeps, true);
+    value[5] = config_dict (cfg->install, false);
+    value[6] = config_dict (cfg->remove, false);
+    value[7] = config_tuple (cfg->load, cfg->nload);
+
+    for (i = 0; i < ARRAY_SIZE (value) && value[i] != NULL; i++)
+      ;
+    if (i == ARRAY_SIZE (value))
+      ret = Py_BuildValue ("{s:O,s:O,s:O,s:O,s:O,s:O,s:O,s:O}",
+              "paths",      value[0],
+              "load_paths", value[1],
+              "options",    value[2],
+              "blacklist",  value[3],
+              "softdeps",   value[4],
+              "install",    value[5],
+              "remove",     value[6],
+              "load",       value[7]);
+
+    for (i = 0; i < ARRAY_SIZE (value); i++)
+      Py_XDECREF (value[i]);
+  }
+  Py_XDECREF (blacklist);
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+  kmodule_config_unref (cfg);
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  return ret;
+} // kmodule_config_info
+
+/***********************************************************************
+ *
+ * kmodule_config_reload:
+ *
+ *   Context._reload_config ()
+ *
+ *   Nothing is read again when neither the config files nor the
+ *   modules.* indexes changed. Changed indexes are mapped again in the
+ *   same kmod_ctx; a changed config needs a new kmod_ctx, which the
+ *   Context switches to once its tables are compiled. The alias cache
+ *   is emptied in both cases.
+ *
+ *   Returns "unchanged", "indexes" or "config".
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_config_reload (
+  PyObject    *Self,
+  PyObject    *Unused
+  )
+{
+  KmodContextObject     *Context = (KmodContextObject *) Self;
+  struct kmodule_config *cfg = NULL;
+  struct kmod_ctx       *ctx, *fresh = NULL;
+  const char            *done = "unchanged";
+  int                   err = 0, state;
+
+  ctx = kmodule_context_get (Self);
+  if (ctx == NULL)
+    return NULL;
+
+  if (Context->config == NULL) {
+    PyErr_Format (PyExc_ValueError, "Context was made without config.");
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+
+  ctx   = Context->ctx;
+  state = kmod_validate_resources (ctx);
+
+  if (kmodule_config_changed (Context->config) || state == KMOD_RESOURCES_MUST_RECREATE) {
+    cfg = kmodule_config_copy (Context->config);
+    if (cfg != NULL)
+      fresh = kmodule_context_kmod_new (kmod_get_dirname (ctx), kmodule_config_paths (cfg));
+    if (fresh != NULL)
+      kmod_set_log_priority (fresh, kmod_get_log_priority (ctx));
+    err = fresh == NULL ? -ENOMEM : kmodule_config_compile (cfg, fresh);
+
+    if (err == 0) {
+      kmodule_context_retire (Self, ctx);
+      kmodule_config_unref (Context->config);
+      Context->config = cfg;
+      Context->ctx    = fresh;
+      cfg   = NULL;
+      fresh = NULL;
+      done  = "config";
+    }
+  } else if (state == KMOD_RESOURCES_MUST_RELOAD) {
+    kmod_unload_resources (ctx);
+    kmod_load_resources (ctx);
+    done = "indexes";
+  }
+
+  if (err == 0 && !streq (done, "unchanged") && Context->aliases != NULL)
+    kmodule_alias_cache_clear (Context->aliases);
+
+  if (cfg != NULL)
+    kmodule_config_unref (cfg);
+  if (fresh != NULL)
+    kmod_unref (fresh);
+
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  if (err < 0) {
+    PyErr_Format (PyExc_OSError, "config reload failed: %s\n", strerror (-err));
+    return NULL;
+  }
+
+  return PyUnicode_FromString (done);
+} // kmodule_config_reload
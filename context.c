@@ -0,0 +1,573 @@
+/*
+ * context.c: python wrapper for a long-lived kmod_ctx
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <sys/utsname.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Context type slots
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * KmodContext_init:
+ *
+ *   Context (basedir=None, kversion=None, cache=None, decompress="auto",
+ *            alias_cache=4096, config=None)
+ *
+ *   With neither argument the running kernel's /lib/modules is used,
+ *   the same as kmod_new(NULL). Cache, a file or True for the default
+ *   one, keeps the modinfo read between runs. Decompress picks who
+ *   decompresses the modules inserted, see kmodule_insert_module().
+ *   Alias_cache bounds the aliases resolve_aliases() remembers, 0 for
+ *   none. Config, True or modprobe.d and modules-load.d paths, is read
+ *   and compiled once, see kmodule_config_new(); without it no config
+ *   is read at all.
+ *
+ ***********************************************************************/
+static int
+KmodContext_init (
+  KmodContextObject *Self,
+  PyObject          *Args,
+  PyObject          *KwArgs
+  )
+{
+  char      *root = NULL, *kversion = NULL;
+  char      *decompress = NULL;
+  PyObject  *cache = NULL, *config = Py_None;
+
+  struct kmod_ctx *ctx;
+  struct kmodule_cache *kcache = NULL;
+  struct kmodule_config *kconfig = NULL;
+  char dirname_buf[PATH_MAX];
+  char cache_buf[PATH_MAX];
+  const char *dirname = NULL;
+  int mode = KMODULE_DECOMPRESS_AUTO;
+  int alias_cache = 4096;
+  int err = 0;
+
+  static char   *kwlist[] = {"basedir", "kversion", "cache", "decompress", "alias_cache", "config", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "|zzOziO",
+      kwlist,
+      &root,
+      &kversion,
+      &cache,
+      &decompress,
+      &alias_cache,
+      &config)) {
+    return -1;
+  }
+
+  if (alias_cache < 0) {
+    PyErr_Format (PyExc_ValueError, "alias_cache must not be negative.");
+    return -1;
+  }
+
+  if (decompress != NULL) {
+    mode = kmodule_decompress_mode (decompress);
+    if (mode < 0) {
+      PyErr_Format (PyExc_ValueError, "decompress must be auto, kernel or user.");
+      return -1;
+    }
+  }
+
+  if (Self->ctx != NULL) {
+    PyErr_Format (PyExc_RuntimeError, "Context is already initialized.");
+    return -1;
+  }
+
+  if (root != NULL || kversion != NULL) {
+    if (kmodule_dirname (root, kversion, dirname_buf, sizeof (dirname_buf)) < 0)
+      return -1;
+    dirname = dirname_buf;
+  }
+
+  if (config != Py_None && config != Py_False) {
+    kconfig = kmodule_config_new (root, config);
+    if (kconfig == NULL)
+      return -1;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  ctx = kmodule_context_kmod_new (dirname, kconfig != NULL ? kmodule_config_paths (kconfig) : NULL);
+  if (ctx != NULL && kconfig != NULL)
+    err = kmodule_config_compile (kconfig, ctx);
+  Py_END_ALLOW_THREADS
+
+  if (!ctx) {
+    kmodule_config_unref (kconfig);
+    PyErr_Format (PyExc_MemoryError, "kmod_new() failed!\n");
+    return -1;
+  }
+
+  if (err < 0) {
+    kmod_unref (ctx);
+    kmodule_config_unref (kconfig);
+    PyErr_Format (PyExc_OSError, "could not read config: %s\n", strerror (-err));
+    return -1;
+  }
+
+  switch (kmodule_cache_path (cache, kmod_get_dirname (ctx), "modinfo", cache_buf, sizeof (cache_buf))) {
+  case -1:
+    kmod_unref (ctx);
+    kmodule_config_unref (kconfig);
+    return -1;
+
+  case 1:
+    Py_BEGIN_ALLOW_THREADS
+    kcache = kmodule_cache_open (cache_buf);
+    Py_END_ALLOW_THREADS
+    if (kcache == NULL) {
+      kmod_unref (ctx);
+      kmodule_config_unref (kconfig);
+      PyErr_NoMemory ();
+      return -1;
+    }
+    break;
+  }
+
+  Self->ctx   = ctx;
+  Self->cache = kcache;
+  Self->config = kconfig;
+  Self->decompress = mode;
+  Self->alias_capacity = alias_cache;
+
+  return 0;
+} // KmodContext_init
+
+/***********************************************************************
+ *
+ * KmodContext_new:
+ *
+ ***********************************************************************/
+static PyObject *
+KmodContext_new (
+  PyTypeObject  *Type,
+  PyObject      *Args,
+  PyObject      *KwArgs
+  )
+{
+  KmodContextObject *Self;
+
+  Self = (KmodContextObject *) Type->tp_alloc (Type, 0);
+  if (Self == NULL)
+    return NULL;
+
+  Self->ctx   = NULL;
+  Self->cache = NULL;
+  Self->decompress = KMODULE_DECOMPRESS_AUTO;
+  Self->aliases = NULL;
+  Self->alias_capacity = 0;
+  Self->config   = NULL;
+  pthread_mutex_init (&Self->lock, NULL);
+
+  return (PyObject *) Self;
+} // KmodContext_new
+
+/***********************************************************************
+ *
+ * KmodContext_dealloc:
+ *
+ ***********************************************************************/
+static void
+KmodContext_dealloc (
+  KmodContextObject *Self
+  )
+{
+  if (Self->cache != NULL) {
+    Py_BEGIN_ALLOW_THREADS
+    kmodule_cache_close (Self->cache);
+    Py_END_ALLOW_THREADS
+  }
+  kmodule_alias_cache_free (Self->aliases);
+  kmodule_config_unref (Self->config);
+  if (Self->ctx != NULL)
+    kmod_unref(Self->ctx);
+  pthread_mutex_destroy (&Self->lock);
+
+  Py_TYPE (Self)->tp_free ((PyObject *) Self);
+} // KmodContext_dealloc
+
+/***********************************************************************
+ *
+ * KmodContext_get_dirname:
+ *
+ ***********************************************************************/
+static PyObject *
+KmodContext_get_dirname (
+  KmodContextObject *Self,
+  void              *Closure
+  )
+{
+  char  dirname[PATH_MAX];
+
+  if (Self->ctx == NULL) {
+    Py_INCREF (Py_None);
+    return Py_None;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock ((PyObject *) Self);
+  snprintf (dirname, sizeof (dirname), "%s", kmod_get_dirname (Self->ctx));
+  kmodule_context_unlock ((PyObject *) Self);
+  Py_END_ALLOW_THREADS
+
+  return PyUnicode_FromString (dirname);
+} // KmodContext_get_dirname
+
+/***********************************************************************
+ *
+ * KmodContext_get_decompress:
+ *
+ ***********************************************************************/
+static PyObject *
+KmodContext_get_decompress (
+  KmodContextObject *Self,
+  void              *Closure
+  )
+{
+  return PyUnicode_FromString (kmodule_decompress_name (Self->decompress));
+} // KmodContext_get_decompress
+
+/***********************************************************************
+ *
+ * KmodContext_get_log_priority:
+ *
+ ***********************************************************************/
+static PyObject *
+KmodContext_get_log_priority (
+  KmodContextObject *Self,
+  void              *Closure
+  )
+{
+  int priority;
+
+  if (kmodule_context_get ((PyObject *) Self) == NULL)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock ((PyObject *) Self);
+  priority = kmod_get_log_priority (Self->ctx);
+  kmodule_context_unlock ((PyObject *) Self);
+  Py_END_ALLOW_THREADS
+
+  return PyLong_FromLong (priority);
+} // KmodContext_get_log_priority
+
+/***********************************************************************
+ *
+ * KmodContext_set_log_priority:
+ *
+ *   syslog priority of the messages libkmod emits for this Context, the
+ *   others are dropped before they are formatted.
+ *
+ ***********************************************************************/
+static int
+KmodContext_set_log_priority (
+  KmodContextObject *Self,
+  PyObject          *Value,
+  void              *Closure
+  )
+{
+  long priority;
+
+  if (kmodule_context_get ((PyObject *) Self) == NULL)
+    return -1;
+
+  if (Value == NULL) {
+    PyErr_Format (PyExc_TypeError, "log_priority can not be deleted.");
+    return -1;
+  }
+
+  priority = PyLong_AsLong (Value);
+  if (priority == -1 && PyErr_Occurred ())
+    return -1;
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock ((PyObject *) Self);
+  kmod_set_log_priority (Self->ctx, (int) priority);
+  kmodule_context_unlock ((PyObject *) Self);
+  Py_END_ALLOW_THREADS
+
+  return 0;
+} // KmodContext_set_log_priority
+
+/***********************************************************************
+ *
+ * KmodContext_cache_flush:
+ *
+ *   Context._cache_flush ()
+ *
+ *   Write the modinfo read since the last flush to the cache file.
+ *
+ ***********************************************************************/
+static PyObject *
+KmodContext_cache_flush (
+  KmodContextObject *Self,
+  PyObject          *Unused
+  )
+{
+  int err = 0;
+
+  if (Self->cache != NULL) {
+    Py_BEGIN_ALLOW_THREADS
+    err = kmodule_cache_save (Self->cache);
+    Py_END_ALLOW_THREADS
+  }
+
+  if (err < 0) {
+    errno = -err;
+    return PyErr_SetFromErrno (PyExc_OSError);
+  }
+
+  Py_INCREF (Py_None);
+  return Py_None;
+} // KmodContext_cache_flush
+
+/***********************************************************************
+ *
+ * KmodContext_cache_info:
+ *
+ *   Context._cache_info ()
+ *
+ *   dict of the cache file path and counters, None without a cache.
+ *
+ ***********************************************************************/
+static PyObject *
+KmodContext_cache_info (
+  KmodContextObject *Self,
+  PyObject          *Unused
+  )
+{
+  if (Self->cache == NULL) {
+    Py_INCREF (Py_None);
+    return Py_None;
+  }
+
+  return kmodule_cache_info (Self->cache);
+} // KmodContext_cache_info
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule internal function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_dirname:
+ *
+ *   Modules directory Root/lib/modules/Kversion into Buf, the running
+ *   kernel version when Kversion is NULL. Returns -1 with an exception
+ *   set on failure.
+ *
+ ***********************************************************************/
+int
+kmodule_dirname (
+  const char  *root,
+  const char  *kversion,
+  char        *buf,
+  size_t      size
+  )
+{
+  struct utsname u;
+
+  if (root == NULL)
+    root = "";
+  if (kversion == NULL) {
+    if (uname(&u) < 0) {
+      PyErr_Format (PyExc_MemoryError, "uname() failed: %m\n");
+      return -1;
+    }
+    kversion = u.release;
+  }
+  snprintf(buf, size, "%s/lib/modules/%s", root, kversion);
+
+  return 0;
+} // kmodule_dirname
+
+/***********************************************************************
+ *
+ * kmodule_context_get:
+ *
+ *   Return the kmod_ctx of a Context, or NULL with an exception set
+ *   when __init__ has not run.
+ *
+ ***********************************************************************/
+struct kmod_ctx *
+kmodule_context_get (
+  PyObject    *Self
+  )
+{
+  struct kmod_ctx *ctx = ((KmodContextObject *) Self)->ctx;
+
+  if (ctx == NULL)
+    PyErr_Format (PyExc_ValueError, "Context is not initialized.");
+
+  return ctx;
+} // kmodule_context_get
+
+/***********************************************************************
+ *
+ * kmodule_context_lock:
+ *
+ ***********************************************************************/
+void
+kmodule_context_lock (
+  PyObject    *Self
+  )
+{
+  pthread_mutex_lock (&((KmodContextObject *) Self)->lock);
+} // kmodule_context_lock
+
+/***********************************************************************
+ *
+ * kmodule_context_unlock:
+ *
+ ***********************************************************************/
+void
+kmodule_context_unlock (
+  PyObject    *Self
+  )
+{
+  pthread_mutex_unlock (&((KmodContextObject *) Self)->lock);
+} // kmodule_context_unlock
+
+/***********************************************************************
+ *
+ * kmodule_context_kmod_new:
+ *
+ *   kmod_ctx of Dirname reading the modprobe.d Config paths, none when
+ *   NULL, with its indexes loaded. Called without the GIL.
+ *
+ ***********************************************************************/
+struct kmod_ctx *
+kmodule_context_kmod_new (
+  const char          *dirname,
+  const char * const  *config
+  )
+{
+  struct kmod_ctx *ctx;
+  const char *null_config = NULL;
+
+  KMODULE_STATS_START (start);
+
+  ctx = kmod_new(dirname, config != NULL ? config : &null_config);
+
+  //
+  // Map the indexes once. A tree without them is still usable for
+  // path based calls, libkmod then opens each index on demand.
+  //
+  if (ctx != NULL) {
+    kmodule_log_attach(ctx);
+    kmod_load_resources(ctx);
+  }
+
+  KMODULE_STATS_PHASE (KMODULE_PHASE_CONTEXT, start);
+
+  return ctx;
+} // kmodule_context_kmod_new
+
+/***********************************************************************
+ *
+ * kmodule_context_retire:
+ *
+ *   Drop the Context reference of Ctx, replaced by a new kmod_ctx, with
+ *   the lock held. Calls read the ctx only under the lock, and a call
+ *   that drops it keeps the modules it works on, which reference their
+ *   kmod_ctx: Ctx is freed with the last of them.
+ *
+ ***********************************************************************/
+void
+kmodule_context_retire (
+  PyObject        *Self,
+  struct kmod_ctx *ctx
+  )
+{
+  kmod_unref (ctx);
+} // kmodule_context_retire
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Context type
+///
+///////////////////////////////////////////////////////////////////////
+
+static PyMethodDef KmodContext_methods [] = {
+
+  { "_modinfo",     (PyCFunction) kmodule_modinfo,  METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_modinfo_batch", (PyCFunction) kmodule_modinfo_batch, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_rmmod",       (PyCFunction) kmodule_rmmod,    METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_rmmod_batch", (PyCFunction) kmodule_rmmod_batch, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_insmod",      (PyCFunction) kmodule_insmod,   METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_insmod_fd",   (PyCFunction) kmodule_insmod_fd, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_insmod_buffer", (PyCFunction) kmodule_insmod_buffer, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_modprobe",    (PyCFunction) kmodule_modprobe, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_coldplug",    (PyCFunction) kmodule_coldplug, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_closure",     (PyCFunction) kmodule_closure, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_cache_flush", (PyCFunction) KmodContext_cache_flush, METH_NOARGS, NULL},
+  { "_cache_info",  (PyCFunction) KmodContext_cache_info,  METH_NOARGS, NULL},
+  { "_resolve_aliases", (PyCFunction) kmodule_resolve_aliases, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_alias_cache_info", (PyCFunction) kmodule_alias_cache_info, METH_NOARGS, NULL},
+  { "_config",      (PyCFunction) kmodule_config_info,   METH_NOARGS, NULL},
+  { "_reload_config", (PyCFunction) kmodule_config_reload, METH_NOARGS, NULL},
+
+  { NULL, NULL, 0, NULL}
+
+}; // KmodContext_methods
+
+static PyGetSetDef KmodContext_getset [] = {
+
+  { "dirname",      (getter) KmodContext_get_dirname, NULL, "modules directory of this context", NULL},
+  { "decompress",   (getter) KmodContext_get_decompress, NULL, "who decompresses the modules inserted", NULL},
+  { "log_priority", (getter) KmodContext_get_log_priority, (setter) KmodContext_set_log_priority, "syslog priority of the libkmod messages", NULL},
+
+  { NULL, NULL, NULL, NULL, NULL}
+
+}; // KmodContext_getset
+
+PyTypeObject KmodContextType = {
+
+  PyVarObject_HEAD_INIT (NULL, 0)
+
+  .tp_name      = "_kmodule._Context",
+  .tp_doc       = "long-lived libkmod context",
+  .tp_basicsize = sizeof (KmodContextObject),
+  .tp_itemsize  = 0,
+  .tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_new       = KmodContext_new,
+  .tp_init      = (initproc) KmodContext_init,
+  .tp_dealloc   = (destructor) KmodContext_dealloc,
+  .tp_methods   = KmodContext_methods,
+  .tp_getset    = KmodContext_getset,
+
+}; // KmodContextType
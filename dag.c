@@ -0,0 +1,373 @@
+/*
+ * dag.c: dependency ordered execution on a pool of worker threads
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+
+#include <time.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/util.h>
+
+#include "kmodule.h"
+
+struct dag_edge {
+  unsigned  before;
+  unsigned  after;
+  bool      required;
+};
+
+struct dag_run {
+  struct kmodule_dag  *dag;
+  kmodule_dag_fn      fn;
+  void                *data;
+
+  pthread_mutex_t     lock;
+  pthread_cond_t      cond;
+
+  unsigned            *ready;
+  unsigned            nready;
+  unsigned            running;
+  unsigned            done;
+  unsigned            workers;
+  unsigned            seq;
+
+  unsigned            *succ_first;
+  struct dag_edge     *succ;
+
+  struct timespec     t0;
+};
+
+/***********************************************************************
+ *
+ * dag_elapsed:
+ *
+ ***********************************************************************/
+static double
+dag_elapsed (
+  const struct timespec *t0
+  )
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - t0->tv_sec) + (now.tv_nsec - t0->tv_nsec) / 1e9;
+} // dag_elapsed
+
+/***********************************************************************
+ *
+ * dag_finish:
+ *
+ *   Account a finished node and release the nodes waiting on it.
+ *   Called with the run lock held.
+ *
+ ***********************************************************************/
+static void
+dag_finish (
+  struct dag_run  *run,
+  unsigned        index
+  )
+{
+  struct kmodule_dag_node *nodes = run->dag->nodes;
+  unsigned i;
+
+  nodes[index].finished = true;
+  run->done++;
+
+  for (i = run->succ_first[index]; i < run->succ_first[index + 1]; i++) {
+    struct kmodule_dag_node *next = &nodes[run->succ[i].after];
+
+    if (run->succ[i].required) {
+      next->required--;
+      if (nodes[index].err < 0)
+        next->cancel = true;
+    }
+
+    if (--next->pending == 0 && !next->queued) {
+      next->queued = true;
+      run->ready[run->nready++] = run->succ[i].after;
+    }
+  }
+
+  pthread_cond_broadcast (&run->cond);
+} // dag_finish
+
+/***********************************************************************
+ *
+ * dag_worker:
+ *
+ ***********************************************************************/
+static void *
+dag_worker (
+  void  *arg
+  )
+{
+  struct dag_run  *run = arg;
+  struct kmodule_dag *dag = run->dag;
+  unsigned i, index, worker;
+
+  pthread_mutex_lock (&run->lock);
+
+  worker = run->workers++;
+
+  for (;;) {
+    while (run->nready == 0 && run->running != 0 && run->done < dag->count)
+      pthread_cond_wait (&run->cond, &run->lock);
+
+    if (run->done == dag->count)
+      break;
+
+    if (run->nready == 0) {
+      //
+      // Nothing runs and nothing is ready: the remaining nodes wait on
+      // each other. Break the cycle at a node held only by ordering
+      // edges, if there is none the cycle is made of required edges.
+      //
+      for (i = 0; i < dag->count; i++) {
+        if (!dag->nodes[i].queued && dag->nodes[i].required == 0)
+          break;
+      }
+
+      if (i < dag->count) {
+        dag->nodes[i].queued = true;
+        run->ready[run->nready++] = i;
+        continue;
+      }
+
+      for (i = 0; i < dag->count; i++) {
+        if (!dag->nodes[i].finished) {
+          dag->nodes[i].err = -ELOOP;
+          dag->nodes[i].finished = true;
+          run->done++;
+        }
+      }
+      pthread_cond_broadcast (&run->cond);
+      break;
+    }
+
+    index = run->ready[--run->nready];
+    run->running++;
+    pthread_mutex_unlock (&run->lock);
+
+    if (dag->nodes[index].cancel) {
+      dag->nodes[index].err = -ECANCELED;
+    } else {
+      dag->nodes[index].start = dag_elapsed (&run->t0);
+      dag->nodes[index].err = run->fn (run->data, &dag->nodes[index], worker);
+      dag->nodes[index].time = dag_elapsed (&run->t0) - dag->nodes[index].start;
+    }
+
+    pthread_mutex_lock (&run->lock);
+    run->running--;
+    if (!dag->nodes[index].cancel)
+      dag->nodes[index].seq = ++run->seq;
+    dag_finish (run, index);
+  }
+
+  pthread_mutex_unlock (&run->lock);
+
+  return NULL;
+} // dag_worker
+
+/***********************************************************************
+ *
+ * kmodule_dag_add:
+ *
+ *   Add a node carrying Data, return its index or a negative errno.
+ *
+ ***********************************************************************/
+int
+kmodule_dag_add (
+  struct kmodule_dag  *dag,
+  void                *data
+  )
+{
+  struct kmodule_dag_node *node;
+
+  if (dag->count == dag->alloc) {
+    unsigned alloc = dag->alloc ? dag->alloc * 2 : 32;
+    void *tmp = realloc (dag->nodes, alloc * sizeof (*dag->nodes));
+
+    if (tmp == NULL)
+      return -ENOMEM;
+    dag->nodes = tmp;
+    dag->alloc = alloc;
+  }
+
+  node = &dag->nodes[dag->count];
+  memset (node, 0, sizeof (*node));
+  node->data = data;
+
+  return dag->count++;
+} // kmodule_dag_add
+
+/***********************************************************************
+ *
+ * kmodule_dag_edge:
+ *
+ *   Order Before ahead of After. With Required, After is cancelled when
+ *   Before fails; otherwise the edge only orders the two.
+ *
+ ***********************************************************************/
+int
+kmodule_dag_edge (
+  struct kmodule_dag  *dag,
+  unsigned            before,
+  unsigned            after,
+  bool                required
+  )
+{
+  struct dag_edge *edge;
+
+  if (before == after)
+    return 0;
+
+  if (dag->nedges == dag->edges_alloc) {
+    unsigned alloc = dag->edges_alloc ? dag->edges_alloc * 2 : 64;
+    void *tmp = realloc (dag->edges, alloc * sizeof (struct dag_edge));
+
+    if (tmp == NULL)
+      return -ENOMEM;
+    dag->edges = tmp;
+    dag->edges_alloc = alloc;
+  }
+
+  edge = &((struct dag_edge *) dag->edges)[dag->nedges++];
+  edge->before   = before;
+  edge->after    = after;
+  edge->required = required;
+
+  return 0;
+} // kmodule_dag_edge
+
+/***********************************************************************
+ *
+ * kmodule_dag_run:
+ *
+ *   Call Fn once for every node, a node only after all the nodes
+ *   ordered ahead of it have finished, on up to Jobs threads including
+ *   the caller. A cycle is broken at an ordering only edge, nodes left
+ *   waiting on a cycle of required edges end with -ELOOP, nodes
+ *   whose required predecessor failed end with -ECANCELED without Fn
+ *   being called. Called without the GIL.
+ *
+ ***********************************************************************/
+int
+kmodule_dag_run (
+  struct kmodule_dag  *dag,
+  int                 jobs,
+  kmodule_dag_fn      fn,
+  void                *data
+  )
+{
+  struct dag_run  run;
+  struct dag_edge *edges = dag->edges;
+  pthread_t       *threads = NULL;
+  int             i, started = 0;
+
+  memset (&run, 0, sizeof (run));
+  run.dag  = dag;
+  run.fn   = fn;
+  run.data = data;
+
+  run.ready      = calloc (dag->count + 1, sizeof (unsigned));
+  run.succ_first = calloc (dag->count + 1, sizeof (unsigned));
+  run.succ       = calloc (dag->nedges + 1, sizeof (struct dag_edge));
+  if (run.ready == NULL || run.succ_first == NULL || run.succ == NULL) {
+    free (run.ready);
+    free (run.succ_first);
+    free (run.succ);
+    return -ENOMEM;
+  }
+
+  //
+  // Successor lists in compressed row form, indexed by Before.
+  //
+  for (i = 0; i < (int) dag->nedges; i++) {
+    run.succ_first[edges[i].before + 1]++;
+    dag->nodes[edges[i].after].pending++;
+    if (edges[i].required)
+      dag->nodes[edges[i].after].required++;
+  }
+  for (i = 0; i < (int) dag->count; i++)
+    run.succ_first[i + 1] += run.succ_first[i];
+  {
+    unsigned *fill = calloc (dag->count + 1, sizeof (unsigned));
+
+    if (fill == NULL) {
+      free (run.ready);
+      free (run.succ_first);
+      free (run.succ);
+      return -ENOMEM;
+    }
+    for (i = 0; i < (int) dag->nedges; i++)
+      run.succ[run.succ_first[edges[i].before] + fill[edges[i].before]++] = edges[i];
+    free (fill);
+  }
+
+  for (i = dag->count - 1; i >= 0; i--) {
+    if (dag->nodes[i].pending == 0) {
+      dag->nodes[i].queued = true;
+      run.ready[run.nready++] = i;
+    }
+  }
+
+  pthread_mutex_init (&run.lock, NULL);
+  pthread_cond_init (&run.cond, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &run.t0);
+
+  if (jobs > (int) dag->count)
+    jobs = dag->count;
+  if (jobs > 1)
+    threads = calloc (jobs - 1, sizeof (pthread_t));
+  if (threads != NULL) {
+    for (i = 0; i < jobs - 1; i++) {
+      if (pthread_create (&threads[i], NULL, dag_worker, &run) != 0)
+        break;
+      started++;
+    }
+  }
+
+  dag_worker (&run);
+
+  for (i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+
+  pthread_cond_destroy (&run.cond);
+  pthread_mutex_destroy (&run.lock);
+  free (threads);
+  free (run.ready);
+  free (run.succ_first);
+  free (run.succ);
+
+  return 0;
+} // kmodule_dag_run
+
+/***********************************************************************
+ *
+ * kmodule_dag_free:
+ *
+ ***********************************************************************/
+void
+kmodule_dag_free (
+  struct kmodule_dag  *dag
+  )
+{
+  free (dag->nodes);
+  free (dag->edges);
+  memset (dag, 0, sizeof (*dag));
+} // kmodule_dag_free
@@ -0,0 +1,1253 @@
+/*
+ * depgraph.c: modules.dep as an in-memory graph in compressed sparse rows
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/hash.h>
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// static function for DepGraph
+///
+///   Every module named by modules.dep, as a line or as a dependency,
+///   gets an integer id. The edges "a depends on b" are kept twice, by
+///   a in fwd and by b in rev, each as an offset array of Count + 1
+///   entries into one array of ids: the ids next to x are
+///   adj[off[x]] .. adj[off[x + 1] - 1].
+///
+///   The graph is read without the GIL and never changes afterwards.
+///
+///////////////////////////////////////////////////////////////////////
+
+#define DEPGRAPH_NONE       UINT32_MAX
+
+#define INDEX_MAGIC         0xB007F457
+#define INDEX_VERSION_MAJOR 0x0002
+#define INDEX_NODE_PREFIX   0x80000000
+#define INDEX_NODE_VALUES   0x40000000
+#define INDEX_NODE_CHILDS   0x20000000
+#define INDEX_NODE_MASK     0x0FFFFFFF
+#define INDEX_DEPTH         256     // far longer than any module name
+
+typedef struct {
+  PyObject_HEAD
+  uint32_t    count;
+  char        **names;
+  char        **paths;
+  uint32_t    *fwd_off;
+  uint32_t    *fwd;
+  uint32_t    *rev_off;
+  uint32_t    *rev;
+  struct hash *ids;         // name -> id + 1
+} DepGraphObject;
+
+struct depgraph_build {
+  uint32_t    count;
+  uint32_t    alloc;
+  char        **names;
+  char        **paths;
+  uint32_t    *edges;       // (module, dependency) pairs
+  size_t      nedges;
+  size_t      edge_alloc;
+  struct hash *ids;
+};
+
+/***********************************************************************
+ *
+ * depgraph_intern:
+ *
+ *   Id of the module at Path, Len bytes, added when new. Returns the id
+ *   or a negative errno.
+ *
+ ***********************************************************************/
+static int64_t
+depgraph_intern (
+  struct depgraph_build *b,
+  const char            *path,
+  size_t                len
+  )
+{
+  char        name[PATH_MAX];
+  const char  *base = path, *p;
+  size_t      n;
+  void        *id;
+  int         err;
+
+  for (p = path; p < path + len; p++)
+    if (*p == '/')
+      base = p + 1;
+
+  for (n = 0; base + n < path + len && n < sizeof (name) - 1; n++) {
+    if (base[n] == '.' && base + n + 3 <= path + len && strncmp (base + n, ".ko", 3) == 0)
+      break;
+    name[n] = base[n] == '-' ? '_' : base[n];
+  }
+  name[n] = '\0';
+
+  id = hash_find (b->ids, name);
+  if (id != NULL)
+    return (uintptr_t) id - 1;
+
+  if (b->count == b->alloc) {
+    uint32_t alloc = b->alloc ? b->alloc * 2 : 1024;
+    void *names = realloc (b->names, alloc * sizeof (char *));
+
+    if (names == NULL)
+      return -ENOMEM;
+    b->names = names;
+
+    names = realloc (b->paths, alloc * sizeof (char *));
+    if (names == NULL)
+      return -ENOMEM;
+    b->paths = names;
+    b->alloc = alloc;
+  }
+
+  b->names[b->count] = strdup (name);
+  b->paths[b->count] = strndup (path, len);
+  if (b->names[b->count] == NULL || b->paths[b->count] == NULL) {
+    free (b->names[b->count]);
+    free (b->paths[b->count]);
+    return -ENOMEM;
+  }
+
+  err = hash_add (b->ids, b->names[b->count], (void *) (uintptr_t) (b->count + 1));
+  if (err < 0) {
+    free (b->names[b->count]);
+    free (b->paths[b->count]);
+    return err;
+  }
+
+  return b->count++;
+} // depgraph_intern
+
+/***********************************************************************
+ *
+ * depgraph_line:
+ *
+ *   Add one "path: dependency ..." line of Len bytes.
+ *
+ ***********************************************************************/
+static int
+depgraph_line (
+  struct depgraph_build *b,
+  const char            *line,
+  size_t                len
+  )
+{
+  const char  *end = line + len, *colon, *p;
+  int64_t     mod, dep;
+
+  colon = memchr (line, ':', len);
+  if (colon == NULL || colon == line)
+    return 0;
+
+  mod = depgraph_intern (b, line, colon - line);
+  if (mod < 0)
+    return mod;
+
+  for (p = colon + 1; p < end; ) {
+    const char *tok;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    for (tok = p; p < end && *p != ' ' && *p != '\t'; p++)
+      ;
+    if (p == tok)
+      continue;
+
+    dep = depgraph_intern (b, tok, p - tok);
+    if (dep < 0)
+      return dep;
+
+    if (b->nedges == b->edge_alloc) {
+      size_t alloc = b->edge_alloc ? b->edge_alloc * 2 : 4096;
+      void *tmp = realloc (b->edges, alloc * 2 * sizeof (uint32_t));
+
+      if (tmp == NULL)
+        return -ENOMEM;
+      b->edges      = tmp;
+      b->edge_alloc = alloc;
+    }
+
+    b->edges[2 * b->nedges]     = mod;
+    b->edges[2 * b->nedges + 1] = dep;
+    b->nedges++;
+  }
+
+  return 0;
+} // depgraph_line
+
+/***********************************************************************
+ *
+ * depgraph_file:
+ *
+ *   The whole of Path into a NUL terminated malloc'd buffer.
+ *
+ ***********************************************************************/
+static int
+depgraph_file (
+  const char  *path,
+  char        **buf,
+  size_t      *size
+  )
+{
+  struct stat st;
+  size_t      done = 0;
+  ssize_t     len;
+  int         fd, err = 0;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  if (fstat (fd, &st) < 0) {
+    err = -errno;
+    close (fd);
+    return err;
+  }
+
+  *buf = malloc (st.st_size + 1);
+  if (*buf == NULL) {
+    close (fd);
+    return -ENOMEM;
+  }
+
+  while (done < (size_t) st.st_size) {
+    len = read (fd, *buf + done, st.st_size - done);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0) {
+      err = len < 0 ? -errno : -EIO;
+      break;
+    }
+    done += len;
+  }
+  close (fd);
+
+  if (err < 0) {
+    free (*buf);
+    return err;
+  }
+
+  (*buf)[done] = '\0';
+  *size = done;
+
+  return 0;
+} // depgraph_file
+
+/***********************************************************************
+ *
+ * depgraph_read_text:
+ *
+ ***********************************************************************/
+static int
+depgraph_read_text (
+  struct depgraph_build *b,
+  const char            *path
+  )
+{
+  char    *buf, *line, *nl;
+  size_t  size;
+  int     err;
+
+  err = depgraph_file (path, &buf, &size);
+  if (err < 0)
+    return err;
+
+  for (line = buf; err == 0 && line < buf + size; line = nl + 1) {
+    nl = memchr (line, '\n', buf + size - line);
+    if (nl == NULL)
+      nl = buf + size;
+    if (*line != '#')
+      err = depgraph_line (b, line, nl - line);
+  }
+
+  free (buf);
+
+  return err;
+} // depgraph_read_text
+
+/***********************************************************************
+ *
+ * depgraph_be32:
+ *
+ ***********************************************************************/
+static uint32_t
+depgraph_be32 (
+  const unsigned char *p
+  )
+{
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+} // depgraph_be32
+
+/***********************************************************************
+ *
+ * depgraph_node:
+ *
+ *   Add the values of the libkmod index node at Offset and of its
+ *   children. A node is [prefix\0] [first last child...] [count
+ *   (priority value\0)...], each part there when its flag is set.
+ *
+ ***********************************************************************/
+static int
+depgraph_node (
+  struct depgraph_build *b,
+  const unsigned char   *buf,
+  size_t                size,
+  uint32_t              offset,
+  int                   depth
+  )
+{
+  const unsigned char *p, *end = buf + size, *str;
+  uint32_t  pos = offset & INDEX_NODE_MASK;
+  uint32_t  i, count;
+  int       err = 0;
+
+  if (pos == 0 || pos >= size || depth > INDEX_DEPTH)
+    return pos == 0 ? 0 : -EINVAL;
+  p = buf + pos;
+
+  if (offset & INDEX_NODE_PREFIX) {
+    str = memchr (p, '\0', end - p);
+    if (str == NULL)
+      return -EINVAL;
+    p = str + 1;
+  }
+
+  if (offset & INDEX_NODE_CHILDS) {
+    unsigned first, last;
+
+    if (end - p < 2)
+      return -EINVAL;
+    first = p[0];
+    last  = p[1];
+    p += 2;
+    if (last < first || (size_t) (end - p) < (last - first + 1) * 4)
+      return -EINVAL;
+    for (i = 0; err == 0 && i <= last - first; i++)
+      err = depgraph_node (b, buf, size, depgraph_be32 (p + 4 * i), depth + 1);
+    p += (last - first + 1) * 4;
+  }
+
+  if (err == 0 && (offset & INDEX_NODE_VALUES)) {
+    if (end - p < 4)
+      return -EINVAL;
+    count = depgraph_be32 (p);
+    p += 4;
+    for (i = 0; err == 0 && i < count; i++) {
+      if (end - p < 4)
+        return -EINVAL;
+      p += 4;
+      str = memchr (p, '\0', end - p);
+      if (str == NULL)
+        return -EINVAL;
+      err = depgraph_line (b, (const char *) p, str - p);
+      p = str + 1;
+    }
+  }
+
+  return err;
+} // depgraph_node
+
+/***********************************************************************
+ *
+ * depgraph_read_bin:
+ *
+ *   modules.dep.bin, for trees installed without the text modules.dep.
+ *
+ ***********************************************************************/
+static int
+depgraph_read_bin (
+  struct depgraph_build *b,
+  const char            *path
+  )
+{
+  char    *buf;
+  size_t  size;
+  int     err;
+
+  err = depgraph_file (path, &buf, &size);
+  if (err < 0)
+    return err;
+
+  if (size < 12 ||
+      depgraph_be32 ((unsigned char *) buf) != INDEX_MAGIC ||
+      depgraph_be32 ((unsigned char *) buf + 4) >> 16 != INDEX_VERSION_MAJOR)
+    err = -EINVAL;
+  else
+    err = depgraph_node (b, (unsigned char *) buf, size, depgraph_be32 ((unsigned char *) buf + 8), 0);
+
+  free (buf);
+
+  return err;
+} // depgraph_read_bin
+
+/***********************************************************************
+ *
+ * depgraph_csr:
+ *
+ *   Rows of the Count ids from the (From, To) Edges pairs, To being
+ *   0 or 1, the edges of a row in the order of Edges.
+ *
+ ***********************************************************************/
+static int
+depgraph_csr (
+  uint32_t        count,
+  const uint32_t  *edges,
+  size_t          nedges,
+  int             to,
+  uint32_t        **off,
+  uint32_t        **adj
+  )
+{
+  uint32_t  *next;
+  size_t    i;
+
+  *off = calloc (count + 1, sizeof (uint32_t));
+  *adj = malloc ((nedges ? nedges : 1) * sizeof (uint32_t));
+  next = malloc ((count ? count : 1) * sizeof (uint32_t));
+  if (*off == NULL || *adj == NULL || next == NULL) {
+    free (next);
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < nedges; i++)
+    (*off)[edges[2 * i + 1 - to] + 1]++;
+  for (i = 0; i < count; i++)
+    (*off)[i + 1] += (*off)[i];
+
+  memcpy (next, *off, count * sizeof (uint32_t));
+  for (i = 0; i < nedges; i++)
+    (*adj)[next[edges[2 * i + 1 - to]]++] = edges[2 * i + to];
+
+  free (next);
+
+  return 0;
+} // depgraph_csr
+
+/***********************************************************************
+ *
+ * depgraph_clear:
+ *
+ ***********************************************************************/
+static void
+depgraph_clear (
+  DepGraphObject  *Self
+  )
+{
+  uint32_t i;
+
+  if (Self->ids != NULL)
+    hash_free (Self->ids);
+  for (i = 0; i < Self->count; i++) {
+    free (Self->names[i]);
+    free (Self->paths[i]);
+  }
+  free (Self->names);
+  free (Self->paths);
+  free (Self->fwd_off);
+  free (Self->fwd);
+  free (Self->rev_off);
+  free (Self->rev);
+
+  Self->count   = 0;
+  Self->names   = NULL;
+  Self->paths   = NULL;
+  Self->fwd_off = NULL;
+  Self->fwd     = NULL;
+  Self->rev_off = NULL;
+  Self->rev     = NULL;
+  Self->ids     = NULL;
+} // depgraph_clear
+
+/***********************************************************************
+ *
+ * depgraph_load:
+ *
+ *   Read the graph of Dirname into Self. Called without the GIL.
+ *
+ ***********************************************************************/
+static int
+depgraph_load (
+  DepGraphObject  *Self,
+  const char      *dirname
+  )
+{
+  struct depgraph_build b;
+  char  path[PATH_MAX];
+  int   err;
+
+  memset (&b, 0, sizeof (b));
+  b.ids = hash_new (2048, NULL);
+  if (b.ids == NULL)
+    return -ENOMEM;
+
+  if (snprintf (path, sizeof (path), "%s/modules.dep", dirname) >= (int) sizeof (path))
+    err = -ENAMETOOLONG;
+  else
+    err = depgraph_read_text (&b, path);
+  if (err == -ENOENT) {
+    if (snprintf (path, sizeof (path), "%s/modules.dep.bin", dirname) >= (int) sizeof (path))
+      err = -ENAMETOOLONG;
+    else
+      err = depgraph_read_bin (&b, path);
+  }
+
+  Self->count = b.count;
+  Self->names = b.names;
+  Self->paths = b.paths;
+  Self->ids   = b.ids;
+
+  if (err == 0)
+    err = depgraph_csr (b.count, b.edges, b.nedges, 1, &Self->fwd_off, &Self->fwd);
+  if (err == 0)
+    err = depgraph_csr (b.count, b.edges, b.nedges, 0, &Self->rev_off, &Self->rev);
+
+  free (b.edges);
+
+  if (err < 0)
+    depgraph_clear (Self);
+
+  return err;
+} // depgraph_load
+
+/***********************************************************************
+ *
+ * depgraph_id:
+ *
+ *   Id of Module, a name or an id. Returns -1 with an exception set
+ *   when there is no such module.
+ *
+ ***********************************************************************/
+static int64_t
+depgraph_id (
+  DepGraphObject  *Self,
+  PyObject        *Module
+  )
+{
+  char        name[PATH_MAX];
+  const char  *s;
+  size_t      i;
+  void        *id;
+
+  if (PyLong_Check (Module)) {
+    long long n = PyLong_AsLongLong (Module);
+
+    if (n == -1 && PyErr_Occurred ())
+      return -1;
+    if (n < 0 || n >= Self->count) {
+      PyErr_Format (PyExc_IndexError, "module id %lld out of range.", n);
+      return -1;
+    }
+    return n;
+  }
+
+  s = PyUnicode_AsUTF8 (Module);
+  if (s == NULL)
+    return -1;
+
+  for (i = 0; s[i] != '\0' && i < sizeof (name) - 1; i++)
+    name[i] = s[i] == '-' ? '_' : s[i];
+  name[i] = '\0';
+
+  id = Self->ids != NULL ? hash_find (Self->ids, name) : NULL;
+  if (id == NULL) {
+    PyErr_SetObject (PyExc_KeyError, Module);
+    return -1;
+  }
+
+  return (uintptr_t) id - 1;
+} // depgraph_id
+
+/***********************************************************************
+ *
+ * depgraph_ids:
+ *
+ *   Ids of Modules, one name or id or an iterable of them, into a
+ *   malloc'd array. Returns the count or -1 with an exception set.
+ *
+ ***********************************************************************/
+static Py_ssize_t
+depgraph_ids (
+  DepGraphObject  *Self,
+  PyObject        *Modules,
+  uint32_t        **Ids
+  )
+{
+  PyObject    *seq;
+  Py_ssize_t  i, n;
+  int64_t     id;
+
+  if (PyUnicode_Check (Modules) || PyLong_Check (Modules)) {
+    id = depgraph_id (Self, Modules);
+    if (id < 0)
+      return -1;
+    *Ids = malloc (sizeof (uint32_t));
+    if (*Ids == NULL) {
+      PyErr_NoMemory ();
+      return -1;
+    }
+    **Ids = id;
+    return 1;
+  }
+
+  seq = PySequence_Fast (Modules, "modules must be a name, an id or an iterable of them.");
+  if (seq == NULL)
+    return -1;
+
+  n = PySequence_Fast_GET_SIZE (seq);
+  *Ids = malloc ((n ? n : 1) * sizeof (uint32_t));
+  if (*Ids == NULL) {
+    Py_DECREF (seq);
+    PyErr_NoMemory ();
+    return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    id = depgraph_id (Self, PySequence_Fast_GET_ITEM (seq, i));
+    if (id < 0) {
+      free (*Ids);
+      Py_DECREF (seq);
+      return -1;
+    }
+    (*Ids)[i] = id;
+  }
+
+  Py_DECREF (seq);
+
+  return n;
+} // depgraph_ids
+
+/***********************************************************************
+ *
+ * depgraph_names:
+ *
+ *   Tuple of the names of the Count Ids.
+ *
+ ***********************************************************************/
+static PyObject *
+depgraph_names (
+  DepGraphObject  *Self,
+  const uint32_t  *Ids,
+  size_t          Count
+  )
+{
+  PyObject  *tuple;
+  size_t    i;
+
+  tuple = PyTuple_New (Count);
+  for (i = 0; tuple != NULL && i < Count; i++) {
+    PyObject *name = PyUnicode_FromString (Self->names[Ids[i]]);
+
+    if (name == NULL) {
+      Py_CLEAR (tuple);
+      break;
+    }
+    PyTuple_SET_ITEM (tuple, i, name);
+  }
+
+  return tuple;
+} // depgraph_names
+
+/***********************************************************************
+ *
+ * depgraph_closure:
+ *
+ *   Breadth first from the Count Ids over Adj, marking the ids reached
+ *   in Seen and listing them in Out, which has room for every id.
+ *   Returns the ids listed.
+ *
+ ***********************************************************************/
+static uint32_t
+depgraph_closure (
+  const uint32_t  *off,
+  const uint32_t  *adj,
+  const uint32_t  *Ids,
+  size_t          Count,
+  unsigned char   *Seen,
+  uint32_t        *Out
+  )
+{
+  uint32_t  head, tail = 0, e;
+  size_t    i;
+
+  for (i = 0; i < Count; i++) {
+    if (!Seen[Ids[i]]) {
+      Seen[Ids[i]] = 1;
+      Out[tail++] = Ids[i];
+    }
+  }
+
+  for (head = 0; head < tail; head++) {
+    for (e = off[Out[head]]; e < off[Out[head] + 1]; e++) {
+      if (!Seen[adj[e]]) {
+        Seen[adj[e]] = 1;
+        Out[tail++] = adj[e];
+      }
+    }
+  }
+
+  return tail;
+} // depgraph_closure
+
+///////////////////////////////////////////////////////////////////////
+///
+/// DepGraph type
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * DepGraph_init:
+ *
+ *   _DepGraph (basedir=None, kversion=None)
+ *
+ ***********************************************************************/
+static int
+DepGraph_init (
+  DepGraphObject  *Self,
+  PyObject        *Args,
+  PyObject        *KwArgs
+  )
+{
+  char  *root = NULL, *kversion = NULL;
+  char  dirname[PATH_MAX];
+  int   err;
+
+  static char   *kwlist[] = {"basedir", "kversion", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "|zz",
+      kwlist,
+      &root,
+      &kversion)) {
+    return -1;
+  }
+
+  if (kmodule_dirname (root, kversion, dirname, sizeof (dirname)) < 0)
+    return -1;
+
+  Py_BEGIN_ALLOW_THREADS
+  depgraph_clear (Self);
+  err = depgraph_load (Self, dirname);
+  Py_END_ALLOW_THREADS
+
+  if (err < 0) {
+    PyErr_Format (PyExc_OSError, "could not read modules.dep of %s: %s\n", dirname, strerror (-err));
+    return -1;
+  }
+
+  return 0;
+} // DepGraph_init
+
+/***********************************************************************
+ *
+ * DepGraph_dealloc:
+ *
+ ***********************************************************************/
+static void
+DepGraph_dealloc (
+  DepGraphObject  *Self
+  )
+{
+  depgraph_clear (Self);
+
+  Py_TYPE (Self)->tp_free ((PyObject *) Self);
+} // DepGraph_dealloc
+
+/***********************************************************************
+ *
+ * DepGraph_len:
+ *
+ ***********************************************************************/
+static Py_ssize_t
+DepGraph_len (
+  DepGraphObject  *Self
+  )
+{
+  return Self->count;
+} // DepGraph_len
+
+/***********************************************************************
+ *
+ * DepGraph_contains:
+ *
+ ***********************************************************************/
+static int
+DepGraph_contains (
+  DepGraphObject  *Self,
+  PyObject        *Module
+  )
+{
+  if (depgraph_id (Self, Module) >= 0)
+    return 1;
+
+  if (PyErr_ExceptionMatches (PyExc_KeyError) || PyErr_ExceptionMatches (PyExc_IndexError)) {
+    PyErr_Clear ();
+    return 0;
+  }
+
+  return -1;
+} // DepGraph_contains
+
+/***********************************************************************
+ *
+ * DepGraph_get_names:
+ *
+ *   Names of all modules, by id.
+ *
+ ***********************************************************************/
+static PyObject *
+DepGraph_get_names (
+  DepGraphObject  *Self,
+  void            *Closure
+  )
+{
+  PyObject  *tuple;
+  uint32_t  i;
+
+  tuple = PyTuple_New (Self->count);
+  for (i = 0; tuple != NULL && i < Self->count; i++) {
+    PyObject *name = PyUnicode_FromString (Self->names[i]);
+
+    if (name == NULL) {
+      Py_CLEAR (tuple);
+      break;
+    }
+    PyTuple_SET_ITEM (tuple, i, name);
+  }
+
+  return tuple;
+} // DepGraph_get_names
+
+/***********************************************************************
+ *
+ * DepGraph_id:
+ *
+ ***********************************************************************/
+static PyObject *
+DepGraph_id (
+  DepGraphObject  *Self,
+  PyObject        *Module
+  )
+{
+  int64_t id = depgraph_id (Self, Module);
+
+  return id < 0 ? NULL : PyLong_FromLongLong (id);
+} // DepGraph_id
+
+/***********************************************************************
+ *
+ * DepGraph_name:
+ *
+ ***********************************************************************/
+static PyObject *
+DepGraph_name (
+  DepGraphObject  *Self,
+  PyObject        *Module
+  )
+{
+  int64_t id = depgraph_id (Self, Module);
+
+  return id < 0 ? NULL : PyUnicode_FromString (Self->names[id]);
+} // DepGraph_name
+
+/***********************************************************************
+ *
+ * DepGraph_path:
+ *
+ *   Path of the module, relative to the modules directory.
+ *
+ ***********************************************************************/
+static PyObject *
+DepGraph_path (
+  DepGraphObject  *Self,
+  PyObject        *Module
+  )
+{
+  int64_t id = depgraph_id (Self, Module);
+
+  return id < 0 ? NULL : PyUnicode_DecodeFSDefault (Self->paths[id]);
+} // DepGraph_path
+
+/***********************************************************************
+ *
+ * DepGraph_depends:
+ *
+ *   The modules Module depends on, as modules.dep lists them.
+ *
+ ***********************************************************************/
+static PyObject *
+DepGraph_depends (
+  DepGraphObject  *Self,
+  PyObject        *Module
+  )
+{
+  int64_t id = depgraph_id (Self, Module);
+
+  if (id < 0)
+    return NULL;
+
+  return depgraph_names (Self, Self->fwd + Self->fwd_off[id], Self->fwd_off[id + 1] - Self->fwd_off[id]);
+} // DepGraph_depends
+
+/***********************************************************************
+ *
+ * DepGraph_dependents:
+ *
+ *   The modules that depend on Module.
+ *
+ ***********************************************************************/
+static PyObject *
+DepGraph_dependents (
+  DepGraphObject  *Self,
+  PyObject        *Module
+  )
+{
+  int64_t id = depgraph_id (Self, Module);
+
+  if (id < 0)
+    return NULL;
+
+  return depgraph_names (Self, Self->rev + Self->rev_off[id], Self->rev_off[id + 1] - Self->rev_off[id]);
+} // DepGraph_dependents
+
+/***********************************************************************
+ *
+ * DepGraph_closure:
+ *
+ *   closure (modules, reverse=False)
+ *
+ *   Modules and all they depend on, or with Reverse all that depend on
+ *   them, breadth first.
+ *
+ ***********************************************************************/
+static PyObject *
+DepGraph_closure (
+  DepGraphObject  *Self,
+  PyObject        *Args,
+  PyObject        *KwArgs
+  )
+{
+  PyObject      *modules, *ret = NULL;
+  int           reverse = 0;
+  uint32_t      *ids, *out, count;
+  unsigned char *seen;
+  Py_ssize_t    n;
+
+  static char   *kwlist[] = {"modules", "reverse", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "O|p",
+      kwlist,
+      &modules,
+      &reverse)) {
+    return NULL;
+  }
+
+  n = depgraph_ids (Self, modules, &ids);
+  if (n < 0)
+    return NULL;
+
+  seen = calloc (Self->count + 1, 1);
+  out  = malloc ((Self->count + 1) * sizeof (uint32_t));
+  if (seen == NULL || out == NULL) {
+    PyErr_NoMemory ();
+  } else {
+    count = reverse ?
+      depgraph_closure (Self->rev_off, Self->rev, ids, n, seen, out) :
+      depgraph_closure (Self->fwd_off, Self->fwd, ids, n, seen, out);
+    ret = depgraph_names (Self, out, count);
+  }
+
+  free (ids);
+  free (seen);
+  free (out);
+
+  return ret;
+} // DepGraph_closure
+
+/***********************************************************************
+ *
+ * DepGraph_order:
+ *
+ *   order (modules=None)
+ *
+ *   Modules and all they depend on, all modules when None, in an order
+ *   to load them: every module after its dependencies. Raises
+ *   ValueError when some are on a dependency cycle.
+ *
+ ***********************************************************************/
+static PyObject *
+DepGraph_order (
+  DepGraphObject  *Self,
+  PyObject        *Args,
+  PyObject        *KwArgs
+  )
+{
+  PyObject      *modules = Py_None, *ret = NULL;
+  uint32_t      *ids = NULL, *set, *out, *deps, count, head, tail = 0, i, e;
+  unsigned char *seen;
+  Py_ssize_t    n = 0;
+
+  static char   *kwlist[] = {"modules", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "|O",
+      kwlist,
+      &modules)) {
+    return NULL;
+  }
+
+  if (modules != Py_None) {
+    n = depgraph_ids (Self, modules, &ids);
+    if (n < 0)
+      return NULL;
+  }
+
+  seen = calloc (Self->count + 1, 1);
+  set  = malloc ((Self->count + 1) * sizeof (uint32_t));
+  out  = malloc ((Self->count + 1) * sizeof (uint32_t));
+  deps = malloc ((Self->count + 1) * sizeof (uint32_t));
+  if (seen == NULL || set == NULL || out == NULL || deps == NULL) {
+    PyErr_NoMemory ();
+    goto done;
+  }
+
+  if (modules != Py_None) {
+    count = depgraph_closure (Self->fwd_off, Self->fwd, ids, n, seen, set);
+  } else {
+    for (i = 0; i < Self->count; i++) {
+      seen[i] = 1;
+      set[i]  = i;
+    }
+    count = Self->count;
+  }
+
+  //
+  // Kahn: a module is ready once none of its dependencies is left,
+  // dependencies outside the set being none here as the set is closed.
+  //
+  for (i = 0; i < count; i++) {
+    deps[set[i]] = Self->fwd_off[set[i] + 1] - Self->fwd_off[set[i]];
+    if (deps[set[i]] == 0)
+      out[tail++] = set[i];
+  }
+
+  for (head = 0; head < tail; head++) {
+    for (e = Self->rev_off[out[head]]; e < Self->rev_off[out[head] + 1]; e++) {
+      uint32_t x = Self->rev[e];
+
+      if (seen[x] && --deps[x] == 0)
+        out[tail++] = x;
+    }
+  }
+
+  if (tail < count)
+    PyErr_Format (PyExc_ValueError, "%u modules are on or behind a dependency cycle.", count - tail);
+  else
+    ret = depgraph_names (Self, out, count);
+
+done:
+  free (ids);
+  free (seen);
+  free (set);
+  free (out);
+  free (deps);
+
+  return ret;
+} // DepGraph_order
+
+/***********************************************************************
+ *
+ * DepGraph_cycles:
+ *
+ *   The dependency cycles, as a list of tuples of the modules of each
+ *   strongly connected component of more than one module or depending
+ *   on itself. Tarjan's algorithm, with an explicit stack.
+ *
+ ***********************************************************************/
+static PyObject *
+DepGraph_cycles (
+  DepGraphObject  *Self,
+  PyObject        *Unused
+  )
+{
+  PyObject      *ret, *scc;
+  uint32_t      *index, *low, *pos, *stack, *calls;
+  unsigned char *on;
+  uint32_t      n = Self->count, next = 0, sp = 0, cp, s, v, w, i, size;
+
+  ret   = PyList_New (0);
+  index = malloc ((n + 1) * sizeof (uint32_t));
+  low   = malloc ((n + 1) * sizeof (uint32_t));
+  pos   = malloc ((n + 1) * sizeof (uint32_t));
+  stack = malloc ((n + 1) * sizeof (uint32_t));
+  calls = malloc ((n + 1) * sizeof (uint32_t));
+  on    = calloc (n + 1, 1);
+  if (ret == NULL || index == NULL || low == NULL || pos == NULL ||
+      stack == NULL || calls == NULL || on == NULL) {
+    if (ret != NULL)
+      PyErr_NoMemory ();
+    Py_CLEAR (ret);
+    goto done;
+  }
+
+  for (i = 0; i < n; i++)
+    index[i] = DEPGRAPH_NONE;
+
+  for (s = 0; s < n && ret != NULL; s++) {
+    if (index[s] != DEPGRAPH_NONE)
+      continue;
+
+    cp = 0;
+    calls[cp++] = s;
+    index[s] = low[s] = next++;
+    pos[s] = Self->fwd_off[s];
+    stack[sp++] = s;
+    on[s] = 1;
+
+    while (cp > 0 && ret != NULL) {
+      v = calls[cp - 1];
+
+      if (pos[v] < Self->fwd_off[v + 1]) {
+        w = Self->fwd[pos[v]++];
+        if (index[w] == DEPGRAPH_NONE) {
+          calls[cp++] = w;
+          index[w] = low[w] = next++;
+          pos[w] = Self->fwd_off[w];
+          stack[sp++] = w;
+          on[w] = 1;
+        } else if (on[w] && index[w] < low[v]) {
+          low[v] = index[w];
+        }
+        continue;
+      }
+
+      cp--;
+      if (cp > 0 && low[v] < low[calls[cp - 1]])
+        low[calls[cp - 1]] = low[v];
+
+      if (low[v] != index[v])
+        continue;
+
+      for (size = 1; stack[sp - size] != v; size++)
+        ;
+
+      if (size == 1) {
+        //
+        // A lone module is a cycle only when it depends on itself.
+        //
+        bool self = false;
+
+        for (i = Self->fwd_off[v]; i < Self->fwd_off[v + 1]; i++)
+          self = self || Self->fwd[i] == v;
+        if (!self)
+          size = 0;
+      }
+
+      if (size != 0) {
+        scc = depgraph_names (Self, stack + sp - size, size);
+        if (scc == NULL || PyList_Append (ret, scc) < 0)
+          Py_CLEAR (ret);
+        Py_XDECREF (scc);
+      }
+
+      do {
+        w = stack[--sp];
+        on[w] = 0;
+      } while (w != v);
+    }
+  }
+
+done:
+  free (index);
+  free (low);
+  free (pos);
+  free (stack);
+  free (calls);
+  free (on);
+
+  return ret;
+} // DepGraph_cycles
+
+static PyMethodDef DepGraph_methods [] = {
+
+  { "id",           (PyCFunction) DepGraph_id,          METH_O, "id of a module"},
+  { "name",         (PyCFunction) DepGraph_name,        METH_O, "name of a module"},
+  { "path",         (PyCFunction) DepGraph_path,        METH_O, "path of a module in the modules directory"},
+  { "depends",      (PyCFunction) DepGraph_depends,     METH_O, "modules a module depends on"},
+  { "dependents",   (PyCFunction) DepGraph_dependents,  METH_O, "modules depending on a module"},
+  { "closure",      (PyCFunction) DepGraph_closure,     METH_VARARGS | METH_KEYWORDS, "modules and all they depend on"},
+  { "order",        (PyCFunction) DepGraph_order,       METH_VARARGS | METH_KEYWORDS, "load order of modules"},
+  { "cycles",       (PyCFunction) DepGraph_cycles,      METH_NOARGS, "dependency cycles"},
+
+  { NULL, NULL, 0, NULL}
+
+}; // DepGraph_methods
+
+static PyGetSetDef DepGraph_getset [] = {
+
+  { "names",        (getter) DepGraph_get_names, NULL, "names of all modules, by id", NULL},
+
+  { NULL, NULL, NULL, NULL, NULL}
+
+}; // DepGraph_getset
+
+static PySequenceMethods DepGraph_sequence = {
+
+  .sq_length    = (lenfunc) DepGraph_len,
+  .sq_contains  = (objobjproc) DepGraph_contains,
+
+}; // DepGraph_sequence
+
+PyTypeObject DepGraphType = {
+
+  PyVarObject_HEAD_INIT (NULL, 0)
+
+  .tp_name      = "_kmodule._DepGraph",
+  .tp_doc       = "modules.dep dependency graph",
+  .tp_basicsize = sizeof (DepGraphObject),
+  .tp_itemsize  = 0,
+  .tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_new       = PyType_GenericNew,
+  .tp_init      = (initproc) DepGraph_init,
+  .tp_dealloc   = (destructor) DepGraph_dealloc,
+  .tp_methods   = DepGraph_methods,
+  .tp_getset    = DepGraph_getset,
+  .tp_as_sequence = &DepGraph_sequence,
+
+}; // DepGraphType
@@ -0,0 +1,1933 @@
+/*
+ * depmod.c: modules.* indexes of a tree, built on parallel threads
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/hash.h>
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// static function for depmod
+///
+///   The tree is walked once, then every module is read on Workers
+///   threads, each with its own kmod_ctx: its aliases, softdeps and
+///   modinfo depends, the symbols it exports and those it needs. What
+///   was read is kept in a state file by path with the inode, size and
+///   modification time of the module, so an incremental run reads only
+///   the modules that changed.
+///
+///   Dependencies are resolved from the symbols, as depmod does, joined
+///   with the modinfo depends. The indexes are then written as libkmod
+///   reads them, each to a temporary file renamed over the old one.
+///
+///////////////////////////////////////////////////////////////////////
+
+#define DEPMOD_MAGIC          "KDEPMOD1"
+
+#define INDEX_MAGIC           0xB007F457
+#define INDEX_VERSION         0x00020001
+#define INDEX_NODE_PREFIX     0x80000000
+#define INDEX_NODE_VALUES     0x40000000
+#define INDEX_NODE_CHILDS     0x20000000
+
+enum depmod_list {
+  DEPMOD_ALIAS,
+  DEPMOD_EXPORT,
+  DEPMOD_NEED,
+  DEPMOD_WEAK,
+  DEPMOD_DEPENDS,
+  DEPMOD_LISTS
+};
+
+struct depmod_buf {
+  char    *data;
+  size_t  len;
+  size_t  alloc;
+};
+
+//
+// Data is the name, the softdep ("" for none) and the strings of every
+// list in enum depmod_list order, each NUL terminated; Strs points at
+// them in the same order.
+//
+struct depmod_mod {
+  char        *path;
+  const char  *rel;           // Path under the modules directory
+  uint64_t    ino;
+  uint64_t    size;
+  int64_t     mtime;
+  char        *data;
+  uint32_t    datalen;
+  uint32_t    count[DEPMOD_LISTS];
+  const char  **strs;
+  int         err;
+  bool        cached;
+  bool        dropped;        // another module of the same name won
+  int         order;          // line in modules.order, INT_MAX if none
+  uint32_t    *deps;
+  uint32_t    ndeps;
+  uint32_t    sort;           // position in load order
+};
+
+struct depmod_record {
+  uint64_t    ino;
+  uint64_t    size;
+  int64_t     mtime;
+  uint32_t    pathlen;        // NUL included
+  uint32_t    datalen;
+  uint32_t    count[DEPMOD_LISTS];
+};
+
+struct depmod_line {
+  int         n;
+  char        path[];
+};
+
+struct depmod_entry {
+  char        *key;           // key, then the value
+  const char  *value;
+  uint32_t    priority;
+  uint32_t    seq;
+};
+
+struct depmod_index {
+  struct depmod_entry *entries;
+  size_t              count;
+  size_t              alloc;
+};
+
+struct depmod {
+  char              dirname[PATH_MAX];
+  char              outdir[PATH_MAX];
+  size_t            dirlen;
+
+  struct depmod_mod *mods;
+  size_t            count;
+  size_t            alloc;
+
+  pthread_mutex_t   lock;
+  size_t            next;
+
+  char              *state;         // state file read, records by path
+  size_t            statelen;
+  struct hash       *records;
+
+  struct depmod_mod **order;        // kept modules, output order
+  size_t            norder;
+
+  size_t            read;
+  size_t            cached;
+  char              **cycles;
+  size_t            ncycles;
+};
+
+/***********************************************************************
+ *
+ * depmod_elapsed:
+ *
+ ***********************************************************************/
+static double
+depmod_elapsed (
+  const struct timespec *t0
+  )
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - t0->tv_sec) + (now.tv_nsec - t0->tv_nsec) / 1e9;
+} // depmod_elapsed
+
+/***********************************************************************
+ *
+ * depmod_buf_add:
+ *
+ *   Append Len bytes of S and a NUL.
+ *
+ ***********************************************************************/
+static int
+depmod_buf_add (
+  struct depmod_buf *b,
+  const char        *s,
+  size_t            len
+  )
+{
+  if (b->len + len + 1 > b->alloc) {
+    size_t alloc = b->alloc ? b->alloc : 256;
+    void *tmp;
+
+    while (alloc < b->len + len + 1)
+      alloc *= 2;
+    tmp = realloc (b->data, alloc);
+    if (tmp == NULL)
+      return -ENOMEM;
+    b->data  = tmp;
+    b->alloc = alloc;
+  }
+
+  memcpy (b->data + b->len, s, len);
+  b->len += len;
+  b->data[b->len++] = '\0';
+
+  return 0;
+} // depmod_buf_add
+
+/***********************************************************************
+ *
+ * depmod_buf_raw:
+ *
+ *   Append Len bytes of S, no NUL.
+ *
+ ***********************************************************************/
+static int
+depmod_buf_raw (
+  struct depmod_buf *b,
+  const void        *s,
+  size_t            len
+  )
+{
+  int err = depmod_buf_add (b, s, len);
+
+  if (err == 0)
+    b->len--;
+
+  return err;
+} // depmod_buf_raw
+
+/***********************************************************************
+ *
+ * depmod_strs:
+ *
+ *   Point Strs of Mod at the strings of its data.
+ *
+ ***********************************************************************/
+static int
+depmod_strs (
+  struct depmod_mod *mod
+  )
+{
+  size_t      n = 2, i;
+  const char  *p = mod->data, *end = mod->data + mod->datalen;
+
+  for (i = 0; i < DEPMOD_LISTS; i++)
+    n += mod->count[i];
+
+  mod->strs = malloc (n * sizeof (char *));
+  if (mod->strs == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < n; i++) {
+    if (p >= end)
+      return -EINVAL;
+    mod->strs[i] = p;
+    p += strlen (p) + 1;
+  }
+
+  return 0;
+} // depmod_strs
+
+/***********************************************************************
+ *
+ * depmod_list:
+ *
+ *   The strings of list Kind of Mod, *Count of them.
+ *
+ ***********************************************************************/
+static const char **
+depmod_list (
+  const struct depmod_mod *mod,
+  enum depmod_list        kind,
+  uint32_t                *count
+  )
+{
+  size_t  first = 2;
+  int     i;
+
+  for (i = 0; i < (int) kind; i++)
+    first += mod->count[i];
+
+  *count = mod->count[kind];
+
+  return mod->strs + first;
+} // depmod_list
+
+#define DEPMOD_NAME(mod)      ((mod)->strs[0])
+#define DEPMOD_SOFTDEP(mod)   ((mod)->strs[1])
+
+/***********************************************************************
+ *
+ * depmod_add:
+ *
+ ***********************************************************************/
+static int
+depmod_add (
+  struct depmod *dm,
+  char          *path
+  )
+{
+  if (dm->count == dm->alloc) {
+    size_t alloc = dm->alloc ? dm->alloc * 2 : 1024;
+    void *tmp = realloc (dm->mods, alloc * sizeof (struct depmod_mod));
+
+    if (tmp == NULL) {
+      free (path);
+      return -ENOMEM;
+    }
+    dm->mods  = tmp;
+    dm->alloc = alloc;
+  }
+
+  memset (&dm->mods[dm->count], 0, sizeof (struct depmod_mod));
+  dm->mods[dm->count].path  = path;
+  dm->mods[dm->count].rel   = path + dm->dirlen + 1;
+  dm->mods[dm->count].order = INT_MAX;
+  dm->count++;
+
+  return 0;
+} // depmod_add
+
+/***********************************************************************
+ *
+ * depmod_walk:
+ *
+ *   Add every module file under Dirfd, which is closed on return.
+ *   Symbolic links are not followed.
+ *
+ ***********************************************************************/
+static int
+depmod_walk (
+  struct depmod *dm,
+  int           dirfd,
+  const char    *path
+  )
+{
+  DIR           *dir;
+  struct dirent *de;
+  char          *sub;
+  int           err = 0;
+
+  dir = fdopendir (dirfd);
+  if (dir == NULL) {
+    close (dirfd);
+    return 0;
+  }
+
+  while (err == 0 && (de = readdir (dir)) != NULL) {
+    unsigned char type = de->d_type;
+    size_t len = strlen (de->d_name);
+
+    if (de->d_name[0] == '.' &&
+        (len == 1 || (len == 2 && de->d_name[1] == '.')))
+      continue;
+
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+
+      if (fstatat (dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        continue;
+      type = S_ISDIR (st.st_mode) ? DT_DIR : S_ISREG (st.st_mode) ? DT_REG : DT_LNK;
+    }
+
+    if (type == DT_REG && !path_ends_with_kmod_ext (de->d_name, len))
+      continue;
+    if (type != DT_REG && type != DT_DIR)
+      continue;
+
+    if (asprintf (&sub, "%s/%s", path, de->d_name) < 0) {
+      err = -ENOMEM;
+      break;
+    }
+
+    if (type == DT_REG) {
+      err = depmod_add (dm, sub);
+    } else {
+      int fd = openat (dirfd, de->d_name,
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+      if (fd >= 0)
+        err = depmod_walk (dm, fd, sub);
+      free (sub);
+    }
+  }
+
+  closedir (dir);
+
+  return err;
+} // depmod_walk
+
+/***********************************************************************
+ *
+ * depmod_state_read:
+ *
+ *   Map the records of the state file Path by module path. A missing
+ *   or foreign file is an empty state.
+ *
+ ***********************************************************************/
+static int
+depmod_state_read (
+  struct depmod *dm,
+  const char    *path
+  )
+{
+  struct stat st;
+  const char  *p, *end;
+  ssize_t     len;
+  size_t      done = 0;
+  uint32_t    count, i;
+  int         fd;
+
+  dm->records = hash_new (1024, NULL);
+  if (dm->records == NULL)
+    return -ENOMEM;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  if (fstat (fd, &st) < 0 || st.st_size < 12) {
+    close (fd);
+    return 0;
+  }
+
+  dm->state = malloc (st.st_size);
+  if (dm->state == NULL) {
+    close (fd);
+    return -ENOMEM;
+  }
+
+  while (done < (size_t) st.st_size) {
+    len = read (fd, dm->state + done, st.st_size - done);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      break;
+    done += len;
+  }
+  close (fd);
+
+  dm->statelen = done;
+  if (done != (size_t) st.st_size || memcmp (dm->state, DEPMOD_MAGIC, 8) != 0)
+    return 0;
+
+  memcpy (&count, dm->state + 8, sizeof (count));
+  p   = dm->state + 12;
+  end = dm->state + done;
+
+  for (i = 0; i < count; i++) {
+    struct depmod_record rec;
+
+    if ((size_t) (end - p) < sizeof (rec))
+      break;
+    memcpy (&rec, p, sizeof (rec));
+    if ((size_t) (end - p) < sizeof (rec) + rec.pathlen + rec.datalen ||
+        rec.pathlen == 0 || p[sizeof (rec) + rec.pathlen - 1] != '\0')
+      break;
+
+    if (hash_add (dm->records, p + sizeof (rec), p) < 0)
+      return -ENOMEM;
+    p += sizeof (rec) + rec.pathlen + rec.datalen;
+  }
+
+  return 0;
+} // depmod_state_read
+
+/***********************************************************************
+ *
+ * depmod_state_find:
+ *
+ *   Take the data of Mod from its record when the module did not
+ *   change. Returns true when it did so.
+ *
+ ***********************************************************************/
+static bool
+depmod_state_find (
+  struct depmod     *dm,
+  struct depmod_mod *mod
+  )
+{
+  struct depmod_record rec;
+  const char *p = hash_find (dm->records, mod->path);
+
+  if (p == NULL)
+    return false;
+
+  memcpy (&rec, p, sizeof (rec));
+  if (rec.ino != mod->ino || rec.size != mod->size || rec.mtime != mod->mtime)
+    return false;
+
+  mod->data = malloc (rec.datalen);
+  if (mod->data == NULL)
+    return false;
+
+  memcpy (mod->data, p + sizeof (rec) + rec.pathlen, rec.datalen);
+  mod->datalen = rec.datalen;
+  memcpy (mod->count, rec.count, sizeof (mod->count));
+
+  if (depmod_strs (mod) < 0) {
+    free (mod->data);
+    free (mod->strs);
+    mod->data = NULL;
+    mod->strs = NULL;
+    return false;
+  }
+
+  return true;
+} // depmod_state_find
+
+/***********************************************************************
+ *
+ * depmod_state_write:
+ *
+ *   Records of every module read, and those of the other trees the
+ *   state held, written to a temporary file renamed over Path.
+ *
+ ***********************************************************************/
+static int
+depmod_state_write (
+  struct depmod *dm,
+  const char    *path
+  )
+{
+  struct depmod_buf b = { NULL, 0, 0 };
+  char      tmp[PATH_MAX];
+  uint32_t  count = 0;
+  size_t    i;
+  FILE      *fp;
+  int       err = 0;
+
+  err = depmod_buf_raw (&b, DEPMOD_MAGIC, 8);
+  if (err == 0)
+    err = depmod_buf_raw (&b, &count, sizeof (count));
+
+  for (i = 0; err == 0 && i < dm->count; i++) {
+    struct depmod_mod *mod = &dm->mods[i];
+    struct depmod_record rec;
+
+    if (mod->err < 0 || mod->data == NULL)
+      continue;
+
+    memset (&rec, 0, sizeof (rec));
+    rec.ino     = mod->ino;
+    rec.size    = mod->size;
+    rec.mtime   = mod->mtime;
+    rec.pathlen = strlen (mod->path) + 1;
+    rec.datalen = mod->datalen;
+    memcpy (rec.count, mod->count, sizeof (rec.count));
+
+    err = depmod_buf_raw (&b, &rec, sizeof (rec));
+    if (err == 0)
+      err = depmod_buf_add (&b, mod->path, rec.pathlen - 1);
+    if (err == 0)
+      err = depmod_buf_raw (&b, mod->data, mod->datalen);
+    count++;
+  }
+
+  if (err == 0) {
+    struct hash_iter iter;
+    const char *key;
+    const void *value;
+
+    hash_iter_init (dm->records, &iter);
+    while (err == 0 && hash_iter_next (&iter, &key, &value)) {
+      struct depmod_record rec;
+
+      if (strncmp (key, dm->dirname, dm->dirlen) == 0 && key[dm->dirlen] == '/')
+        continue;
+      memcpy (&rec, value, sizeof (rec));
+      err = depmod_buf_raw (&b, value, sizeof (rec) + rec.pathlen + rec.datalen);
+      count++;
+    }
+  }
+
+  if (err == 0) {
+    memcpy (b.data + 8, &count, sizeof (count));
+
+    mkdir_parents (path, 0755);
+
+    fp = kmodule_tmpfile (path, tmp, sizeof (tmp));
+    if (fp == NULL) {
+      err = -errno;
+    } else {
+      if (fwrite (b.data, 1, b.len, fp) != b.len)
+        err = -EIO;
+      if (fclose (fp) != 0 && err == 0)
+        err = -errno;
+      if (err == 0 && rename (tmp, path) < 0)
+        err = -errno;
+      if (err < 0)
+        unlink (tmp);
+    }
+  }
+
+  free (b.data);
+
+  return err;
+} // depmod_state_write
+
+/***********************************************************************
+ *
+ * depmod_read:
+ *
+ *   Read Mod with libkmod into its data. Returns 0 or a negative errno.
+ *
+ ***********************************************************************/
+static int
+depmod_read (
+  struct kmod_ctx   *ctx,
+  struct depmod_mod *mod
+  )
+{
+  struct depmod_buf   lists[DEPMOD_LISTS], head = { NULL, 0, 0 }, softdep = { NULL, 0, 0 };
+  struct kmod_module  *kmod;
+  struct kmod_list    *l, *list = NULL;
+  const char          *name;
+  int                 err, i;
+
+  memset (lists, 0, sizeof (lists));
+
+  KMODULE_STATS_START (start);
+  err = kmod_module_new_from_path (ctx, mod->path, &kmod);
+  KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+  if (err < 0)
+    return err;
+
+  name = kmod_module_get_name (kmod);
+  err  = depmod_buf_add (&head, name, strlen (name));
+
+  KMODULE_STATS_START (info);
+  if (err == 0 && kmod_module_get_info (kmod, &list) < 0)
+    err = -ENOEXEC;
+  KMODULE_STATS_PHASE (KMODULE_PHASE_MODINFO, info);
+
+  kmod_list_foreach (l, list) {
+    const char *key   = kmod_module_info_get_key (l);
+    const char *value = kmod_module_info_get_value (l);
+
+    if (err < 0 || key == NULL || value == NULL)
+      continue;
+
+    if (streq (key, "alias")) {
+      err = depmod_buf_add (&lists[DEPMOD_ALIAS], value, strlen (value));
+      mod->count[DEPMOD_ALIAS]++;
+    } else if (streq (key, "softdep")) {
+      if (softdep.len != 0)
+        softdep.data[softdep.len - 1] = ' ';
+      err = depmod_buf_add (&softdep, value, strlen (value));
+    } else if (streq (key, "depends")) {
+      while (err == 0 && *value != '\0') {
+        size_t n = strcspn (value, ",");
+
+        if (n != 0) {
+          err = depmod_buf_add (&lists[DEPMOD_DEPENDS], value, n);
+          mod->count[DEPMOD_DEPENDS]++;
+        }
+        value += n + (value[n] == ',');
+      }
+    }
+  }
+  kmod_module_info_free_list (list);
+
+  list = NULL;
+  if (err == 0 && kmod_module_get_symbols (kmod, &list) >= 0) {
+    kmod_list_foreach (l, list) {
+      const char *sym = kmod_module_symbol_get_symbol (l);
+
+      if (err == 0 && sym != NULL) {
+        err = depmod_buf_add (&lists[DEPMOD_EXPORT], sym, strlen (sym));
+        mod->count[DEPMOD_EXPORT]++;
+      }
+    }
+    kmod_module_symbols_free_list (list);
+  }
+
+  list = NULL;
+  if (err == 0 && kmod_module_get_dependency_symbols (kmod, &list) >= 0) {
+    kmod_list_foreach (l, list) {
+      const char *sym = kmod_module_dependency_symbol_get_symbol (l);
+      int kind = kmod_module_dependency_symbol_get_bind (l) == KMOD_SYMBOL_WEAK ? DEPMOD_WEAK : DEPMOD_NEED;
+
+      if (err == 0 && sym != NULL) {
+        err = depmod_buf_add (&lists[kind], sym, strlen (sym));
+        mod->count[kind]++;
+      }
+    }
+    kmod_module_dependency_symbols_free_list (list);
+  }
+
+  kmod_module_unref (kmod);
+
+  if (err == 0)
+    err = softdep.len != 0 ? depmod_buf_raw (&head, softdep.data, softdep.len) : depmod_buf_add (&head, "", 0);
+
+  for (i = 0; err == 0 && i < DEPMOD_LISTS; i++) {
+    if (lists[i].len != 0)
+      err = depmod_buf_raw (&head, lists[i].data, lists[i].len);
+  }
+
+  for (i = 0; i < DEPMOD_LISTS; i++)
+    free (lists[i].data);
+  free (softdep.data);
+
+  if (err < 0) {
+    free (head.data);
+    return err;
+  }
+
+  mod->data    = head.data;
+  mod->datalen = head.len;
+
+  return depmod_strs (mod);
+} // depmod_read
+
+/***********************************************************************
+ *
+ * depmod_thread:
+ *
+ ***********************************************************************/
+static void *
+depmod_thread (
+  void  *arg
+  )
+{
+  struct depmod   *dm = arg;
+  struct kmod_ctx *ctx = NULL;
+  const char      *null_config = NULL;
+  size_t          i, read = 0, cached = 0;
+
+  for (;;) {
+    struct depmod_mod *mod;
+    struct stat st;
+
+    pthread_mutex_lock (&dm->lock);
+    i = dm->next++;
+    pthread_mutex_unlock (&dm->lock);
+    if (i >= dm->count)
+      break;
+
+    mod = &dm->mods[i];
+    if (stat (mod->path, &st) < 0) {
+      mod->err = -errno;
+      continue;
+    }
+    mod->ino   = st.st_ino;
+    mod->size  = st.st_size;
+    mod->mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+    if (depmod_state_find (dm, mod)) {
+      mod->cached = true;
+      cached++;
+      continue;
+    }
+
+    //
+    // The kmod_ctx is made on the first module not in the state, none
+    // at all for a tree that did not change.
+    //
+    if (ctx == NULL) {
+      KMODULE_STATS_START (start);
+      ctx = kmod_new (dm->dirname, &null_config);
+      if (ctx != NULL)
+        kmodule_log_attach (ctx);
+      KMODULE_STATS_PHASE (KMODULE_PHASE_CONTEXT, start);
+    }
+
+    mod->err = ctx != NULL ? depmod_read (ctx, mod) : -ENOMEM;
+    read++;
+  }
+
+  if (ctx != NULL)
+    kmod_unref (ctx);
+
+  pthread_mutex_lock (&dm->lock);
+  dm->read   += read;
+  dm->cached += cached;
+  pthread_mutex_unlock (&dm->lock);
+
+  return NULL;
+} // depmod_thread
+
+/***********************************************************************
+ *
+ * depmod_order_read:
+ *
+ *   Number the modules by their line in modules.order, which names them
+ *   without the compression suffix.
+ *
+ ***********************************************************************/
+static void
+depmod_order_read (
+  struct depmod *dm
+  )
+{
+  struct hash *lines;
+  char        path[PATH_MAX], line[PATH_MAX];
+  FILE        *fp;
+  size_t      i;
+  int         n = 0;
+
+  snprintf (path, sizeof (path), "%s/modules.order", dm->dirname);
+  fp = fopen (path, "re");
+  if (fp == NULL)
+    return;
+
+  //
+  // The first line of a path wins.
+  //
+  lines = hash_new (1024, free);
+  while (lines != NULL && fgets (line, sizeof (line), fp) != NULL) {
+    struct depmod_line *l;
+
+    line[strcspn (line, "\r\n")] = '\0';
+    n++;
+    if (hash_find (lines, line) != NULL)
+      continue;
+    l = malloc (sizeof (*l) + strlen (line) + 1);
+    if (l == NULL)
+      break;
+    l->n = n;
+    strcpy (l->path, line);
+    if (hash_add (lines, l->path, l) < 0) {
+      free (l);
+      break;
+    }
+  }
+  fclose (fp);
+
+  for (i = 0; lines != NULL && i < dm->count; i++) {
+    const char *ko = strstr (dm->mods[i].rel, ".ko");
+    const struct depmod_line *l;
+
+    if (ko == NULL)
+      continue;
+    snprintf (line, sizeof (line), "%.*s", (int) (ko + 3 - dm->mods[i].rel), dm->mods[i].rel);
+    l = hash_find (lines, line);
+    if (l != NULL)
+      dm->mods[i].order = l->n;
+  }
+
+  if (lines != NULL)
+    hash_free (lines);
+} // depmod_order_read
+
+/***********************************************************************
+ *
+ * depmod_cmp_output:
+ *
+ *   modules.order first, then by path.
+ *
+ ***********************************************************************/
+static int
+depmod_cmp_output (
+  const void  *a,
+  const void  *b
+  )
+{
+  const struct depmod_mod *x = *(const struct depmod_mod * const *) a;
+  const struct depmod_mod *y = *(const struct depmod_mod * const *) b;
+
+  if (x->order != y->order)
+    return x->order < y->order ? -1 : 1;
+
+  return strcmp (x->rel, y->rel);
+} // depmod_cmp_output
+
+/***********************************************************************
+ *
+ * depmod_cmp_search:
+ *
+ *   Which of two modules of the same name wins: updates/ first, as in
+ *   the default depmod search, then the output order.
+ *
+ ***********************************************************************/
+static int
+depmod_cmp_search (
+  const void  *a,
+  const void  *b
+  )
+{
+  const struct depmod_mod *x = *(const struct depmod_mod * const *) a;
+  const struct depmod_mod *y = *(const struct depmod_mod * const *) b;
+  bool ux = strncmp (x->rel, "updates/", 8) == 0;
+  bool uy = strncmp (y->rel, "updates/", 8) == 0;
+
+  if (ux != uy)
+    return ux ? -1 : 1;
+
+  return depmod_cmp_output (a, b);
+} // depmod_cmp_search
+
+/***********************************************************************
+ *
+ * depmod_resolve:
+ *
+ *   Keep one module per name, resolve the dependencies of each from the
+ *   symbols and modinfo depends, and number the modules in load order.
+ *
+ ***********************************************************************/
+static int
+depmod_resolve (
+  struct depmod *dm
+  )
+{
+  struct hash *names = NULL, *symbols = NULL;
+  uint32_t    *mark = NULL, *queue = NULL, *left = NULL, *off = NULL, *users = NULL;
+  size_t      i, j, n = 0, head, tail = 0;
+  int         err = 0;
+
+  dm->order = malloc ((dm->count + 1) * sizeof (struct depmod_mod *));
+  if (dm->order == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < dm->count; i++)
+    if (dm->mods[i].err == 0 && dm->mods[i].strs != NULL)
+      dm->order[n++] = &dm->mods[i];
+
+  names   = hash_new (2048, NULL);
+  symbols = hash_new (8192, NULL);
+  if (names == NULL || symbols == NULL) {
+    err = -ENOMEM;
+    goto done;
+  }
+
+  qsort (dm->order, n, sizeof (struct depmod_mod *), depmod_cmp_search);
+  for (i = 0, j = 0; i < n && err == 0; i++) {
+    if (hash_find (names, DEPMOD_NAME (dm->order[i])) != NULL) {
+      dm->order[i]->dropped = true;
+      continue;
+    }
+    err = hash_add (names, DEPMOD_NAME (dm->order[i]), dm->order[i]);
+    dm->order[j++] = dm->order[i];
+  }
+  n = j;
+  dm->norder = n;
+  qsort (dm->order, n, sizeof (struct depmod_mod *), depmod_cmp_output);
+
+  //
+  // The index of every kept module is kept in Sort until the load
+  // order replaces it. The first module exporting a symbol provides it.
+  //
+  for (i = 0; i < n && err == 0; i++) {
+    const char **syms;
+    uint32_t count, k;
+
+    dm->order[i]->sort = i;
+    syms = depmod_list (dm->order[i], DEPMOD_EXPORT, &count);
+    for (k = 0; k < count && err == 0; k++)
+      if (hash_find (symbols, syms[k]) == NULL)
+        err = hash_add (symbols, syms[k], dm->order[i]);
+  }
+
+  mark = calloc (n + 1, sizeof (uint32_t));
+  if (err == 0 && mark == NULL)
+    err = -ENOMEM;
+
+  for (i = 0; i < n && err == 0; i++) {
+    struct depmod_mod *mod = dm->order[i];
+    static const enum depmod_list kinds[] = { DEPMOD_NEED, DEPMOD_WEAK, DEPMOD_DEPENDS };
+    uint32_t k, t, count, total = 0;
+
+    for (t = 0; t < 3; t++)
+      total += mod->count[kinds[t]];
+    mod->deps = malloc ((total + 1) * sizeof (uint32_t));
+    if (mod->deps == NULL) {
+      err = -ENOMEM;
+      break;
+    }
+
+    for (t = 0; t < 3; t++) {
+      const char **strs = depmod_list (mod, kinds[t], &count);
+
+      for (k = 0; k < count; k++) {
+        struct depmod_mod *dep = hash_find (kinds[t] == DEPMOD_DEPENDS ? names : symbols, strs[k]);
+
+        if (dep == NULL && kinds[t] == DEPMOD_DEPENDS) {
+          char name[PATH_MAX];
+          size_t c;
+
+          for (c = 0; strs[k][c] != '\0' && c < sizeof (name) - 1; c++)
+            name[c] = strs[k][c] == '-' ? '_' : strs[k][c];
+          name[c] = '\0';
+          dep = hash_find (names, name);
+        }
+        if (dep == NULL || dep == mod || mark[dep->sort] == i + 1)
+          continue;
+        mark[dep->sort] = i + 1;
+        mod->deps[mod->ndeps++] = dep->sort;
+      }
+    }
+  }
+
+  //
+  // Kahn, dependencies first. Modules left are on or behind a cycle and
+  // go last, in output order.
+  //
+  queue = malloc ((n + 1) * sizeof (uint32_t));
+  left  = calloc (n + 1, sizeof (uint32_t));
+  off   = calloc (n + 2, sizeof (uint32_t));
+  if (err == 0 && (queue == NULL || left == NULL || off == NULL))
+    err = -ENOMEM;
+
+  if (err == 0) {
+    uint32_t *next;
+
+    for (i = 0; i < n; i++) {
+      left[i] = dm->order[i]->ndeps;
+      for (j = 0; j < dm->order[i]->ndeps; j++)
+        off[dm->order[i]->deps[j] + 1]++;
+    }
+    for (i = 0; i < n; i++)
+      off[i + 1] += off[i];
+
+    users = malloc ((off[n] + 1) * sizeof (uint32_t));
+    next  = malloc ((n + 1) * sizeof (uint32_t));
+    if (users == NULL || next == NULL) {
+      free (next);
+      err = -ENOMEM;
+      goto done;
+    }
+    memcpy (next, off, n * sizeof (uint32_t));
+    for (i = 0; i < n; i++)
+      for (j = 0; j < dm->order[i]->ndeps; j++)
+        users[next[dm->order[i]->deps[j]]++] = i;
+    free (next);
+
+    for (i = 0; i < n; i++)
+      if (left[i] == 0)
+        queue[tail++] = i;
+    for (head = 0; head < tail; head++)
+      for (j = off[queue[head]]; j < off[queue[head] + 1]; j++)
+        if (--left[users[j]] == 0)
+          queue[tail++] = users[j];
+
+    if (tail < n) {
+      dm->cycles = calloc (n - tail + 1, sizeof (char *));
+      if (dm->cycles == NULL) {
+        err = -ENOMEM;
+        goto done;
+      }
+      for (i = 0; i < n; i++) {
+        if (left[i] != 0) {
+          dm->cycles[dm->ncycles++] = (char *) DEPMOD_NAME (dm->order[i]);
+          queue[tail++] = i;
+        }
+      }
+    }
+
+    //
+    // Deps still hold output indexes; Sort becomes the load position.
+    //
+    for (i = 0; i < n; i++)
+      mark[queue[i]] = i;
+    for (i = 0; i < n; i++)
+      dm->order[i]->sort = mark[i];
+  }
+
+done:
+  free (mark);
+  free (queue);
+  free (left);
+  free (off);
+  free (users);
+  if (names != NULL)
+    hash_free (names);
+  if (symbols != NULL)
+    hash_free (symbols);
+
+  return err;
+} // depmod_resolve
+
+/***********************************************************************
+ *
+ * depmod_index_add:
+ *
+ ***********************************************************************/
+static int
+depmod_index_add (
+  struct depmod_index *idx,
+  const char          *key,
+  const char          *value,
+  uint32_t            priority
+  )
+{
+  size_t klen = strlen (key) + 1, vlen = strlen (value) + 1;
+  struct depmod_entry *e;
+
+  if (idx->count == idx->alloc) {
+    size_t alloc = idx->alloc ? idx->alloc * 2 : 1024;
+    void *tmp = realloc (idx->entries, alloc * sizeof (struct depmod_entry));
+
+    if (tmp == NULL)
+      return -ENOMEM;
+    idx->entries = tmp;
+    idx->alloc   = alloc;
+  }
+
+  e = &idx->entries[idx->count];
+  e->key = malloc (klen + vlen);
+  if (e->key == NULL)
+    return -ENOMEM;
+  memcpy (e->key, key, klen);
+  e->value = memcpy (e->key + klen, value, vlen);
+  e->priority = priority;
+  e->seq = idx->count++;
+
+  return 0;
+} // depmod_index_add
+
+/***********************************************************************
+ *
+ * depmod_index_free:
+ *
+ ***********************************************************************/
+static void
+depmod_index_free (
+  struct depmod_index *idx
+  )
+{
+  size_t i;
+
+  for (i = 0; i < idx->count; i++)
+    free (idx->entries[i].key);
+  free (idx->entries);
+  memset (idx, 0, sizeof (*idx));
+} // depmod_index_free
+
+/***********************************************************************
+ *
+ * depmod_entry_cmp:
+ *
+ ***********************************************************************/
+static int
+depmod_entry_cmp (
+  const void  *a,
+  const void  *b
+  )
+{
+  const struct depmod_entry *x = a, *y = b;
+  int c = strcmp (x->key, y->key);
+
+  if (c != 0)
+    return c;
+  if (x->priority != y->priority)
+    return x->priority < y->priority ? -1 : 1;
+
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+} // depmod_entry_cmp
+
+/***********************************************************************
+ *
+ * depmod_be32:
+ *
+ ***********************************************************************/
+static int
+depmod_be32 (
+  struct depmod_buf *b,
+  uint32_t          v
+  )
+{
+  unsigned char be[4] = { v >> 24, v >> 16, v >> 8, v };
+
+  return depmod_buf_raw (b, be, 4);
+} // depmod_be32
+
+/***********************************************************************
+ *
+ * depmod_index_node:
+ *
+ *   Write the node of Entries Lo .. Hi, whose keys share their first
+ *   Depth bytes, after its children. The node takes the longest prefix
+ *   the keys share as its own. Returns the node offset with its flags,
+ *   or 0 when out of memory.
+ *
+ ***********************************************************************/
+static uint32_t
+depmod_index_node (
+  struct depmod_buf         *b,
+  const struct depmod_entry *e,
+  size_t                    lo,
+  size_t                    hi,
+  size_t                    depth
+  )
+{
+  size_t    end = depth, i, first_child, ngroups = 0;
+  uint32_t  *childs = NULL, offset, flags = 0;
+  unsigned  first = 0, last = 0;
+  int       err = 0;
+
+  if (lo < hi) {
+    const char *a = e[lo].key, *z = e[hi - 1].key;
+
+    while (a[end] != '\0' && a[end] == z[end])
+      end++;
+  }
+
+  for (first_child = lo; first_child < hi && e[first_child].key[end] == '\0'; first_child++)
+    ;
+
+  if (first_child < hi) {
+    first = (unsigned char) e[first_child].key[end];
+    last  = (unsigned char) e[hi - 1].key[end];
+    childs = calloc (last - first + 1, sizeof (uint32_t));
+    if (childs == NULL)
+      return 0;
+
+    for (i = first_child; i < hi; ) {
+      unsigned char c = e[i].key[end];
+      size_t g = i;
+
+      while (g < hi && (unsigned char) e[g].key[end] == c)
+        g++;
+      childs[c - first] = depmod_index_node (b, e, i, g, end + 1);
+      if (childs[c - first] == 0) {
+        free (childs);
+        return 0;
+      }
+      ngroups++;
+      i = g;
+    }
+  }
+
+  offset = b->len;
+
+  if (end > depth) {
+    err = depmod_buf_add (b, e[lo].key + depth, end - depth);
+    flags |= INDEX_NODE_PREFIX;
+  }
+
+  if (err == 0 && ngroups != 0) {
+    unsigned char range[2] = { first, last };
+
+    err = depmod_buf_raw (b, range, 2);
+    for (i = 0; err == 0 && i <= last - first; i++)
+      err = depmod_be32 (b, childs[i]);
+    flags |= INDEX_NODE_CHILDS;
+  }
+
+  if (err == 0 && first_child > lo) {
+    uint32_t count = 0;
+    size_t pos;
+
+    //
+    // The same value twice under one key is written once.
+    //
+    pos = b->len;
+    err = depmod_be32 (b, 0);
+    for (i = lo; err == 0 && i < first_child; i++) {
+      size_t k;
+
+      for (k = lo; k < i && !streq (e[k].value, e[i].value); k++)
+        ;
+      if (k < i)
+        continue;
+      err = depmod_be32 (b, e[i].priority);
+      if (err == 0)
+        err = depmod_buf_add (b, e[i].value, strlen (e[i].value));
+      count++;
+    }
+    if (err == 0) {
+      unsigned char be[4] = { count >> 24, count >> 16, count >> 8, count };
+
+      memcpy (b->data + pos, be, 4);
+    }
+    flags |= INDEX_NODE_VALUES;
+  }
+
+  free (childs);
+
+  return err < 0 ? 0 : offset | flags;
+} // depmod_index_node
+
+/***********************************************************************
+ *
+ * depmod_file_open:
+ *
+ ***********************************************************************/
+static FILE *
+depmod_file_open (
+  struct depmod *dm,
+  const char    *name,
+  char          *tmp,
+  size_t        size
+  )
+{
+  char path[PATH_MAX];
+
+  if (snprintf (path, sizeof (path), "%s/%s", dm->outdir, name) >= (int) sizeof (path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  return kmodule_tmpfile (path, tmp, size);
+} // depmod_file_open
+
+/***********************************************************************
+ *
+ * depmod_file_close:
+ *
+ *   Close Fp, written to Tmp, and rename it to Name when all went well.
+ *
+ ***********************************************************************/
+static int
+depmod_file_close (
+  struct depmod *dm,
+  FILE          *fp,
+  const char    *tmp,
+  const char    *name,
+  int           err
+  )
+{
+  char path[PATH_MAX];
+
+  if (ferror (fp) && err == 0)
+    err = -EIO;
+  if (fclose (fp) != 0 && err == 0)
+    err = -errno;
+
+  if (err == 0 && snprintf (path, sizeof (path), "%s/%s", dm->outdir, name) >= (int) sizeof (path))
+    err = -ENAMETOOLONG;
+  if (err == 0 && rename (tmp, path) < 0)
+    err = -errno;
+  if (err < 0)
+    unlink (tmp);
+
+  return err;
+} // depmod_file_close
+
+/***********************************************************************
+ *
+ * depmod_index_write:
+ *
+ *   Write Idx as the libkmod index Name. Idx is emptied.
+ *
+ ***********************************************************************/
+static int
+depmod_index_write (
+  struct depmod       *dm,
+  struct depmod_index *idx,
+  const char          *name
+  )
+{
+  struct depmod_buf b = { NULL, 0, 0 };
+  char      tmp[PATH_MAX];
+  uint32_t  root;
+  FILE      *fp;
+  int       err;
+
+  qsort (idx->entries, idx->count, sizeof (struct depmod_entry), depmod_entry_cmp);
+
+  err = depmod_be32 (&b, INDEX_MAGIC);
+  if (err == 0)
+    err = depmod_be32 (&b, INDEX_VERSION);
+  if (err == 0)
+    err = depmod_be32 (&b, 0);
+
+  if (err == 0) {
+    root = depmod_index_node (&b, idx->entries, 0, idx->count, 0);
+    if (root == 0) {
+      err = -ENOMEM;
+    } else {
+      unsigned char be[4] = { root >> 24, root >> 16, root >> 8, root };
+
+      memcpy (b.data + 8, be, 4);
+    }
+  }
+
+  if (err == 0) {
+    fp = depmod_file_open (dm, name, tmp, sizeof (tmp));
+    if (fp == NULL) {
+      err = -errno;
+    } else {
+      fwrite (b.data, 1, b.len, fp);
+      err = depmod_file_close (dm, fp, tmp, name, 0);
+    }
+  }
+
+  free (b.data);
+  depmod_index_free (idx);
+
+  return err;
+} // depmod_index_write
+
+/***********************************************************************
+ *
+ * depmod_alias_normalize:
+ *
+ *   '-' as '_' out of bracket expressions, as depmod stores aliases.
+ *   Returns false for an alias with an unbalanced bracket.
+ *
+ ***********************************************************************/
+static bool
+depmod_alias_normalize (
+  const char  *alias,
+  char        *buf,
+  size_t      size
+  )
+{
+  size_t i;
+
+  for (i = 0; alias[i] != '\0' && i < size - 1; i++) {
+    if (alias[i] == ']')
+      return false;
+    if (alias[i] == '[') {
+      while (alias[i] != ']' && alias[i] != '\0' && i < size - 1) {
+        buf[i] = alias[i];
+        i++;
+      }
+      if (alias[i] != ']')
+        return false;
+    }
+    buf[i] = alias[i] == '-' ? '_' : alias[i];
+  }
+  buf[i] = '\0';
+
+  return alias[i] == '\0';
+} // depmod_alias_normalize
+
+/***********************************************************************
+ *
+ * depmod_cmp_load:
+ *
+ *   By load position, the last loaded first.
+ *
+ ***********************************************************************/
+static int
+depmod_cmp_load (
+  const void  *a,
+  const void  *b
+  )
+{
+  const struct depmod_mod *x = *(const struct depmod_mod * const *) a;
+  const struct depmod_mod *y = *(const struct depmod_mod * const *) b;
+
+  return x->sort < y->sort ? 1 : x->sort > y->sort ? -1 : 0;
+} // depmod_cmp_load
+
+/***********************************************************************
+ *
+ * depmod_write_dep:
+ *
+ *   modules.dep and modules.dep.bin: every module with all it depends
+ *   on, those loaded last first.
+ *
+ ***********************************************************************/
+static int
+depmod_write_dep (
+  struct depmod *dm
+  )
+{
+  struct depmod_index idx = { NULL, 0, 0 };
+  struct depmod_buf   line = { NULL, 0, 0 };
+  struct depmod_mod   **closure;
+  uint32_t            *seen, *stack;
+  char                tmp[PATH_MAX];
+  size_t              i, n = dm->norder;
+  FILE                *fp;
+  int                 err = 0;
+
+  closure = malloc ((n + 1) * sizeof (struct depmod_mod *));
+  seen    = calloc (n + 1, sizeof (uint32_t));
+  stack   = malloc ((n + 1) * sizeof (uint32_t));
+  fp      = depmod_file_open (dm, "modules.dep", tmp, sizeof (tmp));
+  if (closure == NULL || seen == NULL || stack == NULL || fp == NULL)
+    err = fp == NULL ? -errno : -ENOMEM;
+
+  for (i = 0; i < n && err == 0; i++) {
+    struct depmod_mod *mod = dm->order[i];
+    size_t count = 0, sp = 0, k;
+
+    //
+    // Deps are output indexes: the closure is walked through them.
+    //
+    seen[i] = i + 1;
+    stack[sp++] = i;
+    while (sp > 0) {
+      struct depmod_mod *m = dm->order[stack[--sp]];
+
+      for (k = 0; k < m->ndeps; k++) {
+        if (seen[m->deps[k]] == i + 1)
+          continue;
+        seen[m->deps[k]] = i + 1;
+        stack[sp++] = m->deps[k];
+        closure[count++] = dm->order[m->deps[k]];
+      }
+    }
+
+    qsort (closure, count, sizeof (struct depmod_mod *), depmod_cmp_load);
+
+    line.len = 0;
+    err = depmod_buf_raw (&line, mod->rel, strlen (mod->rel));
+    if (err == 0)
+      err = depmod_buf_raw (&line, ":", 1);
+    for (k = 0; k < count && err == 0; k++) {
+      err = depmod_buf_raw (&line, " ", 1);
+      if (err == 0)
+        err = depmod_buf_raw (&line, closure[k]->rel, strlen (closure[k]->rel));
+    }
+    if (err == 0)
+      err = depmod_buf_add (&line, "", 0);
+
+    if (err == 0) {
+      fprintf (fp, "%s\n", line.data);
+      err = depmod_index_add (&idx, DEPMOD_NAME (mod), line.data, 0);
+    }
+  }
+
+  if (fp != NULL)
+    err = depmod_file_close (dm, fp, tmp, "modules.dep", err);
+  if (err == 0)
+    err = depmod_index_write (dm, &idx, "modules.dep.bin");
+
+  depmod_index_free (&idx);
+  free (line.data);
+  free (closure);
+  free (seen);
+  free (stack);
+
+  return err;
+} // depmod_write_dep
+
+/***********************************************************************
+ *
+ * depmod_write_aliases:
+ *
+ *   modules.alias(.bin), modules.symbols(.bin), modules.softdep and
+ *   modules.devname.
+ *
+ ***********************************************************************/
+static int
+depmod_write_aliases (
+  struct depmod *dm
+  )
+{
+  struct depmod_index aliases = { NULL, 0, 0 }, symbols = { NULL, 0, 0 };
+  char    buf[PATH_MAX], tmp[4][PATH_MAX];
+  FILE    *fa, *fs, *fd, *fn;
+  size_t  i;
+  int     err = 0;
+
+  fa = depmod_file_open (dm, "modules.alias", tmp[0], sizeof (tmp[0]));
+  fs = depmod_file_open (dm, "modules.symbols", tmp[1], sizeof (tmp[1]));
+  fd = depmod_file_open (dm, "modules.softdep", tmp[2], sizeof (tmp[2]));
+  fn = depmod_file_open (dm, "modules.devname", tmp[3], sizeof (tmp[3]));
+  if (fa == NULL || fs == NULL || fd == NULL || fn == NULL)
+    err = -errno;
+
+  if (err == 0) {
+    fprintf (fa, "# Aliases extracted from modules themselves.\n");
+    fprintf (fs, "# Aliases for symbols, used by symbol_request().\n");
+    fprintf (fd, "# Soft dependencies extracted from modules themselves.\n");
+    fprintf (fn, "# Device nodes to trigger on-demand module loading.\n");
+  }
+
+  for (i = 0; i < dm->norder && err == 0; i++) {
+    struct depmod_mod *mod = dm->order[i];
+    const char  *name = DEPMOD_NAME (mod), *devname = NULL;
+    const char  **strs;
+    uint32_t    count, k;
+    unsigned    major = 0, minor = 0;
+    char        type = 0;
+
+    strs = depmod_list (mod, DEPMOD_ALIAS, &count);
+    for (k = 0; k < count && err == 0; k++) {
+      char t[8];
+
+      if (strncmp (strs[k], "devname:", 8) == 0)
+        devname = strs[k] + 8;
+      else if (sscanf (strs[k], "%7[a-z]-major-%u-%u", t, &major, &minor) == 3 &&
+               (streq (t, "char") || streq (t, "block")))
+        type = t[0] == 'c' ? 'c' : 'b';
+
+      if (!depmod_alias_normalize (strs[k], buf, sizeof (buf)))
+        continue;
+      fprintf (fa, "alias %s %s\n", strs[k], name);
+      err = depmod_index_add (&aliases, buf, name, i);
+    }
+
+    strs = depmod_list (mod, DEPMOD_EXPORT, &count);
+    for (k = 0; k < count && err == 0; k++) {
+      fprintf (fs, "alias symbol:%s %s\n", strs[k], name);
+      snprintf (buf, sizeof (buf), "symbol:%s", strs[k]);
+      err = depmod_index_add (&symbols, buf, name, i);
+    }
+
+    if (*DEPMOD_SOFTDEP (mod) != '\0')
+      fprintf (fd, "softdep %s %s\n", name, DEPMOD_SOFTDEP (mod));
+
+    if (devname != NULL && type != 0)
+      fprintf (fn, "%s %s %c%u:%u\n", name, devname, type, major, minor);
+  }
+
+  if (fa != NULL)
+    err = depmod_file_close (dm, fa, tmp[0], "modules.alias", err);
+  if (fs != NULL)
+    err = depmod_file_close (dm, fs, tmp[1], "modules.symbols", err);
+  if (fd != NULL)
+    err = depmod_file_close (dm, fd, tmp[2], "modules.softdep", err);
+  if (fn != NULL)
+    err = depmod_file_close (dm, fn, tmp[3], "modules.devname", err);
+
+  if (err == 0)
+    err = depmod_index_write (dm, &aliases, "modules.alias.bin");
+  if (err == 0)
+    err = depmod_index_write (dm, &symbols, "modules.symbols.bin");
+
+  depmod_index_free (&aliases);
+  depmod_index_free (&symbols);
+
+  return err;
+} // depmod_write_aliases
+
+/***********************************************************************
+ *
+ * depmod_write_builtin:
+ *
+ *   modules.builtin.bin from modules.builtin and modules.builtin.alias.bin
+ *   from modules.builtin.modinfo, when the kernel build installed them.
+ *
+ ***********************************************************************/
+static int
+depmod_write_builtin (
+  struct depmod *dm
+  )
+{
+  struct depmod_index idx = { NULL, 0, 0 };
+  char    path[PATH_MAX], line[PATH_MAX], *info, *p;
+  size_t  size;
+  FILE    *fp;
+  int     err = 0;
+
+  snprintf (path, sizeof (path), "%s/modules.builtin", dm->dirname);
+  fp = fopen (path, "re");
+  if (fp != NULL) {
+    while (err == 0 && fgets (line, sizeof (line), fp) != NULL) {
+      char *base, *ko, *c;
+
+      line[strcspn (line, "\r\n")] = '\0';
+      base = strrchr (line, '/');
+      base = base != NULL ? base + 1 : line;
+      ko = strstr (base, ".ko");
+      if (ko != NULL)
+        *ko = '\0';
+      for (c = base; *c != '\0'; c++)
+        if (*c == '-')
+          *c = '_';
+      if (*base != '\0')
+        err = depmod_index_add (&idx, base, "", 0);
+    }
+    fclose (fp);
+    if (err == 0)
+      err = depmod_index_write (dm, &idx, "modules.builtin.bin");
+  }
+
+  snprintf (path, sizeof (path), "%s/modules.builtin.modinfo", dm->dirname);
+  fp = err == 0 ? fopen (path, "re") : NULL;
+  if (fp != NULL) {
+    struct depmod_buf b = { NULL, 0, 0 };
+    char chunk[4096];
+
+    while (err == 0 && (size = fread (chunk, 1, sizeof (chunk), fp)) > 0)
+      err = depmod_buf_raw (&b, chunk, size);
+    if (err == 0)
+      err = depmod_buf_add (&b, "", 0);
+    fclose (fp);
+    info = b.data;
+    size = b.len;
+
+    for (p = info; err == 0 && info != NULL && p < info + size; p += strlen (p) + 1) {
+      char *dot = strchr (p, '.'), *eq;
+
+      if (dot == NULL || strncmp (dot + 1, "alias=", 6) != 0)
+        continue;
+      eq = dot + 6;
+      *dot = '\0';
+      if (depmod_alias_normalize (eq + 1, line, sizeof (line)))
+        err = depmod_index_add (&idx, line, p, 0);
+      *dot = '.';
+    }
+    free (info);
+    if (err == 0)
+      err = depmod_index_write (dm, &idx, "modules.builtin.alias.bin");
+  }
+
+  depmod_index_free (&idx);
+
+  return err;
+} // depmod_write_builtin
+
+/***********************************************************************
+ *
+ * depmod_free:
+ *
+ ***********************************************************************/
+static void
+depmod_free (
+  struct depmod *dm
+  )
+{
+  size_t i;
+
+  for (i = 0; i < dm->count; i++) {
+    free (dm->mods[i].path);
+    free (dm->mods[i].data);
+    free (dm->mods[i].strs);
+    free (dm->mods[i].deps);
+  }
+  free (dm->mods);
+  free (dm->order);
+  free (dm->cycles);
+  free (dm->state);
+  if (dm->records != NULL)
+    hash_free (dm->records);
+  pthread_mutex_destroy (&dm->lock);
+} // depmod_free
+
+/***********************************************************************
+ *
+ * depmod_result:
+ *
+ ***********************************************************************/
+static PyObject *
+depmod_result (
+  struct depmod *dm,
+  double        scan,
+  double        build,
+  double        write
+  )
+{
+  PyObject  *dups, *errors, *cycles, *ret = NULL;
+  size_t    i;
+
+  dups   = PyList_New (0);
+  errors = PyDict_New ();
+  cycles = PyTuple_New (dm->ncycles);
+  if (dups == NULL || errors == NULL || cycles == NULL)
+    goto fail;
+
+  for (i = 0; i < dm->count; i++) {
+    struct depmod_mod *mod = &dm->mods[i];
+    PyObject *rel;
+
+    if (!mod->dropped && mod->err == 0)
+      continue;
+
+    rel = PyUnicode_DecodeFSDefault (mod->rel);
+    if (rel == NULL)
+      goto fail;
+
+    if (mod->dropped) {
+      if (PyList_Append (dups, rel) < 0) {
+        Py_DECREF (rel);
+        goto fail;
+      }
+    } else {
+      PyObject *msg = PyUnicode_FromString (strerror (-mod->err));
+
+      if (msg == NULL || PyDict_SetItem (errors, rel, msg) < 0) {
+        Py_XDECREF (msg);
+        Py_DECREF (rel);
+        goto fail;
+      }
+      Py_DECREF (msg);
+    }
+    Py_DECREF (rel);
+  }
+
+  for (i = 0; i < dm->ncycles; i++) {
+    PyObject *name = PyUnicode_FromString (dm->cycles[i]);
+
+    if (name == NULL)
+      goto fail;
+    PyTuple_SET_ITEM (cycles, i, name);
+  }
+
+  ret = Py_BuildValue ("{s:n,s:n,s:n,s:N,s:O,s:O,s:d,s:d,s:d,s:d}",
+          "modules",    (Py_ssize_t) dm->norder,
+          "read",       (Py_ssize_t) dm->read,
+          "cached",     (Py_ssize_t) dm->cached,
+          "duplicates", PyList_AsTuple (dups),
+          "errors",     errors,
+          "cycles",     cycles,
+          "scan",       scan,
+          "build",      build,
+          "write",      write,
+          "total",      scan + build + write);
+
+fail:
+  Py_XDECREF (dups);
+  Py_XDECREF (errors);
+  Py_XDECREF (cycles);
+
+  return ret;
+} // depmod_result
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule public function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_depmod:
+ *
+ *   _depmod (basedir=None, kversion=None, workers=0, cache=None,
+ *            outdir=None)
+ *
+ *   Write the modules.* indexes of the modules directory into Outdir,
+ *   the modules directory itself by default, reading the modules on
+ *   Workers threads, one per CPU for 0. Cache, a path or True for the
+ *   default as in kmodule_cache_path with the depmod suffix, keeps what
+ *   was read for the next run.
+ *
+ *   Returns {'modules', 'read', 'cached', 'duplicates', 'errors',
+ *   'cycles', 'scan', 'build', 'write', 'total'}, the times in
+ *   seconds.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_depmod (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  char            *root = NULL, *kversion = NULL, *outdir = NULL;
+  char            state[PATH_MAX];
+  PyObject        *cache = Py_None, *ret;
+  int             workers = 0, err = 0, fd;
+  unsigned        i, nthreads;
+  pthread_t       *threads;
+  double          scan = 0, build = 0, write = 0;
+  struct timespec t0;
+  struct stat     st;
+  struct depmod   dm;
+
+  static char   *kwlist[] = {"basedir", "kversion", "workers", "cache", "outdir", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "|zziOz",
+      kwlist,
+      &root,
+      &kversion,
+      &workers,
+      &cache,
+      &outdir)) {
+    return NULL;
+  }
+
+  memset (&dm, 0, sizeof (dm));
+  if (kmodule_dirname (root, kversion, dm.dirname, sizeof (dm.dirname)) < 0)
+    return NULL;
+  dm.dirlen = strlen (dm.dirname);
+  snprintf (dm.outdir, sizeof (dm.outdir), "%s", outdir != NULL ? outdir : dm.dirname);
+
+  if (stat (dm.dirname, &st) < 0 || !S_ISDIR (st.st_mode)) {
+    if (errno == 0)
+      errno = ENOTDIR;
+    return PyErr_SetFromErrnoWithFilename (PyExc_OSError, dm.dirname);
+  }
+
+  state[0] = '\0';
+  if (kmodule_cache_path (cache, dm.dirname, "depmod", state, sizeof (state)) < 0)
+    return NULL;
+
+  if (workers <= 0)
+    workers = sysconf (_SC_NPROCESSORS_ONLN);
+  if (workers <= 0)
+    workers = 1;
+
+  pthread_mutex_init (&dm.lock, NULL);
+
+  Py_BEGIN_ALLOW_THREADS
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+
+  fd = open (dm.dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  err = fd < 0 ? -errno : depmod_walk (&dm, fd, dm.dirname);
+  if (err == 0)
+    err = state[0] != '\0' ? depmod_state_read (&dm, state) : 0;
+  if (err == 0 && dm.records == NULL)
+    dm.records = hash_new (16, NULL);
+
+  if (err == 0) {
+    nthreads = (unsigned) workers < dm.count ? (unsigned) workers : dm.count;
+    threads  = calloc (nthreads + 1, sizeof (pthread_t));
+    if (threads == NULL) {
+      err = -ENOMEM;
+    } else {
+      for (i = 0; i < nthreads; i++)
+        if (pthread_create (&threads[i], NULL, depmod_thread, &dm) != 0)
+          break;
+      nthreads = i;
+      if (nthreads == 0)
+        depmod_thread (&dm);
+      for (i = 0; i < nthreads; i++)
+        pthread_join (threads[i], NULL);
+      free (threads);
+    }
+  }
+  scan = depmod_elapsed (&t0);
+
+  if (err == 0) {
+    depmod_order_read (&dm);
+    err = depmod_resolve (&dm);
+  }
+  build = depmod_elapsed (&t0) - scan;
+
+  if (err == 0)
+    err = depmod_write_dep (&dm);
+  if (err == 0)
+    err = depmod_write_aliases (&dm);
+  if (err == 0)
+    err = depmod_write_builtin (&dm);
+  if (err == 0 && state[0] != '\0')
+    err = depmod_state_write (&dm, state);
+  write = depmod_elapsed (&t0) - scan - build;
+
+  Py_END_ALLOW_THREADS
+
+  if (err < 0) {
+    PyErr_Format (PyExc_OSError, "depmod of %s failed: %s\n", dm.dirname, strerror (-err));
+    ret = NULL;
+  } else {
+    ret = depmod_result (&dm, scan, build, write);
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  depmod_free (&dm);
+  Py_END_ALLOW_THREADS
+
+  return ret;
+
+} // kmodule_depmod
@@ -0,0 +1,27 @@
+#!/bin/env python3
+
+# aio1.py: python sample code for loading Linux kernel modules from asyncio
+#  Copyright (C) 2022  MaxWu <EfiPy.core@gmail.com>.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+
+import asyncio
+import sys
+
+import kmodule.aio as kaio
+
+async def main (modules):
+
+  for m, r in zip (modules, await asyncio.gather (*(kaio.insmod (m) for m in modules), return_exceptions = True)):
+    print (f'{m}: {r}')
+
+asyncio.run (main (sys.argv[1:]))
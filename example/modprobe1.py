@@ -0,0 +1,22 @@
+#!/bin/env python3
+
+# modprobe1.py: python sample code for loading a Linux kernel module with its dependencies.
+#  Copyright (C) 2022  MaxWu <EfiPy.core@gmail.com>.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+
+import kmodule as km
+
+mname = 'snd_hda_intel'
+
+for m in km.modprobe(mname, jobs = 4):
+  print(f'{m["name"]:24} {m["status"]:10} {m["start"]:8.3f} {m["time"]:8.3f}')
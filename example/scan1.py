@@ -0,0 +1,23 @@
+#!/bin/env python3
+
+# scan1.py: python sample code for listing license and firmware of every Linux kernel module
+#  Copyright (C) 2022  MaxWu <EfiPy.core@gmail.com>.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+
+import kmodule as km
+
+for path, m in km.scan(workers = 4):
+  if isinstance(m, Exception):
+    print(f'{path}: {m}')
+    continue
+  print(f'{m.get("name", path):24} {m.get("license", "-"):12} {" ".join(m.getall("firmware"))}')
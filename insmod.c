@@ -19,15 +19,25 @@
 #define PYSAMPLE_MODULE
 #include "structmember.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/utsname.h>
+#include <unistd.h>
 #include <libkmod/libkmod.h>
 
 #include <shared/util.h>
 #include <tools/kmod.h>
 
+#include "kmodule.h"
+
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE   4
+#endif
+
 ///////////////////////////////////////////////////////////////////////
 ///
-/// static function insmod
+/// kmodule internal function
 ///
 ///////////////////////////////////////////////////////////////////////
 
@@ -36,7 +46,7 @@
  * mod_strerror:
  *
  ***********************************************************************/
-static const char *
+const char *
 mod_strerror (
   int err
   )
@@ -55,6 +65,345 @@ mod_strerror (
   }
 } // mod_strerror
 
+///////////////////////////////////////////////////////////////////////
+///
+/// static function for compressed modules
+///
+///////////////////////////////////////////////////////////////////////
+
+static const char *decompress_str [] = {
+  "auto",
+  "kernel",
+  "user",
+};
+
+static char           kernel_compression[16];
+static pthread_once_t kernel_compression_once = PTHREAD_ONCE_INIT;
+
+/***********************************************************************
+ *
+ * kernel_compression_read:
+ *
+ *   The running kernel names the one format it decompresses in
+ *   /sys/module/compression, the file is missing when it can not.
+ *
+ ***********************************************************************/
+static void
+kernel_compression_read (
+  void
+  )
+{
+  ssize_t n = 0;
+  int     fd;
+
+  fd = open ("/sys/module/compression", O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    n = read (fd, kernel_compression, sizeof (kernel_compression) - 1);
+    close (fd);
+  }
+
+  if (n < 0)
+    n = 0;
+  while (n > 0 && (kernel_compression[n - 1] == '\n' || kernel_compression[n - 1] == ' '))
+    n--;
+  kernel_compression[n] = '\0';
+} // kernel_compression_read
+
+/***********************************************************************
+ *
+ * module_compression:
+ *
+ *   Compression of the module file Path by its extension, in the names
+ *   of /sys/module/compression, NULL for a plain .ko.
+ *
+ ***********************************************************************/
+static const char *
+module_compression (
+  const char  *path
+  )
+{
+  size_t len = strlen (path);
+
+  if (len > 6 && streq (path + len - 6, ".ko.xz"))
+    return "xz";
+  if (len > 7 && streq (path + len - 7, ".ko.zst"))
+    return "zstd";
+  if (len > 6 && streq (path + len - 6, ".ko.gz"))
+    return "gzip";
+
+  return NULL;
+} // module_compression
+
+/***********************************************************************
+ *
+ * fd_compression:
+ *
+ *   Compression of the module open on Fd by its magic, as in
+ *   module_compression(), NULL for a plain image or a pipe.
+ *
+ ***********************************************************************/
+static const char *
+fd_compression (
+  int         fd
+  )
+{
+  uint8_t magic[6];
+
+  if (pread (fd, magic, sizeof (magic), 0) != sizeof (magic))
+    return NULL;
+
+  if (!memcmp (magic, "\xfd" "7zXZ\0", 6))
+    return "xz";
+  if (!memcmp (magic, "\x28\xb5\x2f\xfd", 4))
+    return "zstd";
+  if (!memcmp (magic, "\x1f\x8b", 2))
+    return "gzip";
+
+  return NULL;
+} // fd_compression
+
+/***********************************************************************
+ *
+ * read_varint:
+ *
+ *   xz multibyte integer at *Pos of Buf, 0 past the end.
+ *
+ ***********************************************************************/
+static uint64_t
+read_varint (
+  const uint8_t *buf,
+  size_t        size,
+  size_t        *pos
+  )
+{
+  uint64_t  v = 0;
+  int       shift;
+
+  for (shift = 0; *pos < size && shift < 63; shift += 7) {
+    uint8_t b = buf[(*pos)++];
+
+    v |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return v;
+  }
+
+  *pos = size;
+  return 0;
+} // read_varint
+
+/***********************************************************************
+ *
+ * module_image_size:
+ *
+ *   Decompressed size of the module open on Fd, Size bytes long, from
+ *   the container metadata: the gzip trailer, the zstd frame header or
+ *   the xz index. 0 when the container does not record it.
+ *
+ ***********************************************************************/
+static uint64_t
+module_image_size (
+  int         fd,
+  const char  *compression,
+  uint64_t    size
+  )
+{
+  uint8_t   buf[18];
+
+  if (streq (compression, "gzip")) {
+    if (size < 18 || pread (fd, buf, 4, size - 4) != 4)
+      return 0;
+    return (uint64_t) buf[0] | (uint64_t) buf[1] << 8 |
+           (uint64_t) buf[2] << 16 | (uint64_t) buf[3] << 24;
+  }
+
+  if (streq (compression, "zstd")) {
+    static const int did_size [] = {0, 1, 2, 4};
+    int       fhd, fcs, pos;
+    uint64_t  v = 0;
+    int       i;
+
+    if (pread (fd, buf, sizeof (buf), 0) != sizeof (buf) ||
+        buf[0] != 0x28 || buf[1] != 0xb5 || buf[2] != 0x2f || buf[3] != 0xfd)
+      return 0;
+
+    fhd = buf[4];
+    pos = 5 + ((fhd & 0x20) ? 0 : 1) + did_size[fhd & 3];
+    switch (fhd >> 6) {
+    case 0: fcs = (fhd & 0x20) ? 1 : 0; break;
+    case 1: fcs = 2; break;
+    case 2: fcs = 4; break;
+    default: fcs = 8; break;
+    }
+
+    for (i = fcs - 1; i >= 0; i--)
+      v = v << 8 | buf[pos + i];
+
+    return fcs == 2 ? v + 256 : v;
+  }
+
+  if (streq (compression, "xz")) {
+    uint8_t   *index;
+    uint64_t  end = size, backward, count, total = 0;
+    size_t    pos = 1;
+
+    //
+    // Skip the stream padding, then read the footer for the index size.
+    //
+    while (end >= 12 + 12 && pread (fd, buf, 4, end - 4) == 4 &&
+           !buf[0] && !buf[1] && !buf[2] && !buf[3])
+      end -= 4;
+
+    if (end < 12 + 12 || pread (fd, buf, 12, end - 12) != 12 ||
+        buf[10] != 'Y' || buf[11] != 'Z')
+      return 0;
+
+    backward = ((uint64_t) buf[4] | (uint64_t) buf[5] << 8 |
+               (uint64_t) buf[6] << 16 | (uint64_t) buf[7] << 24) * 4 + 4;
+    if (backward > end - 24)
+      return 0;
+
+    index = malloc (backward);
+    if (index == NULL)
+      return 0;
+
+    if (pread (fd, index, backward, end - 12 - backward) == (ssize_t) backward &&
+        index[0] == 0) {
+      count = read_varint (index, backward, &pos);
+      while (count-- > 0 && pos < backward) {
+        read_varint (index, backward, &pos);
+        total += read_varint (index, backward, &pos);
+      }
+    }
+
+    free (index);
+    return total;
+  }
+
+  return 0;
+} // module_image_size
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule internal function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_decompress_mode:
+ *
+ *   KMODULE_DECOMPRESS_* of "auto", "kernel" or "user", -1 otherwise.
+ *
+ ***********************************************************************/
+int
+kmodule_decompress_mode (
+  const char  *name
+  )
+{
+  int mode;
+
+  for (mode = 0; mode < (int) ARRAY_SIZE (decompress_str); mode++) {
+    if (streq (name, decompress_str[mode]))
+      return mode;
+  }
+
+  return -1;
+} // kmodule_decompress_mode
+
+/***********************************************************************
+ *
+ * kmodule_decompress_name:
+ *
+ ***********************************************************************/
+const char *
+kmodule_decompress_name (
+  int         mode
+  )
+{
+  return decompress_str[mode];
+} // kmodule_decompress_name
+
+/***********************************************************************
+ *
+ * kmodule_insert_module:
+ *
+ *   Insert Mod with Options, letting the kernel decompress it as
+ *   Decompress allows. In auto mode a kernel that refuses the
+ *   compressed file falls back to libkmod. Returns 0 or a negative
+ *   errno. Called without the GIL.
+ *
+ ***********************************************************************/
+int
+kmodule_insert_module (
+  struct kmod_module            *mod,
+  const char                    *options,
+  int                           decompress,
+  struct kmodule_insert_result  *result
+  )
+{
+  const char  *path = kmod_module_get_path (mod);
+  const char  *compression = NULL;
+  struct stat st;
+  bool        kernel;
+  int         fd, err;
+
+  result->method  = "none";
+  result->size    = 0;
+  result->avoided = 0;
+
+  if (path != NULL)
+    compression = module_compression (path);
+  if (compression != NULL)
+    result->method = "user";
+
+  kernel = compression != NULL && decompress != KMODULE_DECOMPRESS_USER;
+  if (kernel && decompress == KMODULE_DECOMPRESS_AUTO) {
+    pthread_once (&kernel_compression_once, kernel_compression_read);
+    kernel = streq (kernel_compression, compression);
+  }
+
+  if (kernel) {
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return -errno;
+
+    if (fstat (fd, &st) == 0)
+      result->size = st.st_size;
+
+    KMODULE_STATS_START (start);
+    err = syscall (__NR_finit_module, fd, options ? options : "", MODULE_INIT_COMPRESSED_FILE);
+    if (err < 0)
+      err = -errno;
+    KMODULE_STATS_PHASE (KMODULE_PHASE_INIT_MODULE, start);
+    if (err == 0)
+      result->avoided = module_image_size (fd, compression, result->size);
+
+    close (fd);
+
+    if (decompress == KMODULE_DECOMPRESS_KERNEL ||
+        (err != -EOPNOTSUPP && err != -ENOSYS)) {
+      result->method = "kernel";
+      KMODULE_STATS_COUNT (KMODULE_COUNTER_READ, result->size);
+      KMODULE_STATS_COUNT (KMODULE_COUNTER_DECOMPRESSED, result->avoided);
+      return err;
+    }
+  }
+
+  if (path != NULL && result->size == 0 && stat (path, &st) == 0)
+    result->size = st.st_size;
+
+  //
+  // libkmod decompresses and calls init_module in one go, the two are
+  // only told apart by whether the file was compressed.
+  //
+  KMODULE_STATS_START (insert);
+  err = kmod_module_insert_module (mod, 0, options);
+  KMODULE_STATS_PHASE (compression != NULL ? KMODULE_PHASE_DECOMPRESS : KMODULE_PHASE_INIT_MODULE, insert);
+  KMODULE_STATS_COUNT (KMODULE_COUNTER_READ, result->size);
+
+  return err;
+} // kmodule_insert_module
+
 ///////////////////////////////////////////////////////////////////////
 ///
 /// kmodule public function
@@ -65,6 +414,11 @@ mod_strerror (
  *
  * kmodule_insmod:
  *
+ *   Context._insmod (module, parameter=None)
+ *
+ *   Returns {'path', 'decompress', 'size', 'avoided'}, see
+ *   kmodule_insert_module().
+ *
  ***********************************************************************/
 PyObject *
 kmodule_insmod (
@@ -75,57 +429,239 @@ kmodule_insmod (
 {
   int    ret;
   char  *ModuleName;
-  char  *Parameters;
+  char  *Parameters = NULL;
   static char   *kwlist[] = {"Module name", "parameter", NULL};
 
+  struct kmod_ctx *ctx;
+
   if (!PyArg_ParseTupleAndKeywords (
       Args,
       KwArgs,
-      "s|s",
+      "s|z",
       kwlist,
       &ModuleName,
       &Parameters)) {
     return NULL;
   }
 
+  ctx = kmodule_context_get (Self);
+  if (ctx == NULL)
+    return NULL;
+
   {
 
-    struct kmod_ctx *ctx;
     struct kmod_module *mod;
+    struct kmodule_insert_result result = {"none", 0, 0};
 
-    unsigned int flags = 0;
+    int          decompress = ((KmodContextObject *) Self)->decompress;
+    int          load;
 
-    const char *null_config = NULL;
+    Py_BEGIN_ALLOW_THREADS
+    kmodule_context_lock (Self);
 
-    ctx = kmod_new(NULL, &null_config);
-    if (!ctx) {
-      PyErr_Format (PyExc_MemoryError, "Internal resource initial fail.\n");
-      return NULL;
+    ctx = ((KmodContextObject *) Self)->ctx;
+
+    KMODULE_STATS_START (start);
+    ret = load = kmod_module_new_from_path(ctx, ModuleName, &mod);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+    if (load == 0) {
+      ret = kmodule_insert_module(mod, Parameters, decompress, &result);
+      kmod_module_unref(mod);
     }
 
-    ret = kmod_module_new_from_path(ctx, ModuleName, &mod);
-    if (ret < 0) {
-      PyErr_Format (PyExc_SystemError, "Could not load module %s: %s\n", ModuleName, strerror(-ret));
-      goto end;
+    kmodule_context_unlock (Self);
+    Py_END_ALLOW_THREADS
+
+    if (load < 0) {
+      PyErr_Format (PyExc_SystemError, "Could not load module %s: %s\n", ModuleName, strerror(-load));
+      return NULL;
     }
 
-    ret = kmod_module_insert_module(mod, flags, Parameters);
     if (ret < 0) {
       PyErr_Format (PyExc_SystemError, "could not insert module %s: %s\n", ModuleName, mod_strerror(-ret));
-    } else {
-      ret = 0;
+      return NULL;
     }
-    kmod_module_unref(mod);
 
-    end:
-      kmod_unref(ctx);
+    return Py_BuildValue ("{s:s,s:s,s:K,s:K}",
+             "path",       ModuleName,
+             "decompress", result.method,
+             "size",       (unsigned long long) result.size,
+             "avoided",    (unsigned long long) result.avoided);
   }
 
-  if (ret != 0) {
-      return NULL;
-  } else {
-    Py_INCREF (Py_None);
-    return Py_None;
+} // kmodule_insmod
+
+/***********************************************************************
+ *
+ * kmodule_insmod_fd:
+ *
+ *   Context._insmod_fd (fd, parameter=None, flags=0)
+ *
+ *   Insert the module image open on fd, or on the file object fd, with
+ *   finit_module(2). Flags are its MODULE_INIT_* flags. A compressed
+ *   image is handed to the kernel compressed, ValueError is raised when
+ *   the Context decompress mode is user. Returns the dict of kmodule_insmod()
+ *   with a None path.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_insmod_fd (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  PyObject  *File;
+  char      *Parameters = NULL;
+  int        Flags = 0;
+  int        fd, ret = 0;
+  bool       refused;
+
+  struct kmodule_insert_result result = {"none", 0, 0};
+  const char  *compression;
+  struct stat st;
+  int         decompress;
+
+  static char   *kwlist[] = {"fd", "parameter", "flags", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "O|zi",
+      kwlist,
+      &File,
+      &Parameters,
+      &Flags)) {
+    return NULL;
   }
 
-} // kmodule_insmod
+  if (kmodule_context_get (Self) == NULL)
+    return NULL;
+
+  fd = PyObject_AsFileDescriptor (File);
+  if (fd < 0)
+    return NULL;
+
+  decompress = ((KmodContextObject *) Self)->decompress;
+
+  //
+  // No kmod_ctx is used past this point, the Context lock is not taken.
+  //
+  Py_BEGIN_ALLOW_THREADS
+
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode))
+    result.size = st.st_size;
+
+  //
+  // There is no path to fall back to libkmod with: a compressed file goes
+  // to the kernel compressed, and cannot be inserted when the Context
+  // asks for user space decompression.
+  //
+  compression = fd_compression (fd);
+  refused = compression != NULL && decompress == KMODULE_DECOMPRESS_USER;
+  if (!refused) {
+    if (compression != NULL) {
+      Flags |= MODULE_INIT_COMPRESSED_FILE;
+      result.method = "kernel";
+    }
+
+    KMODULE_STATS_START (start);
+    ret = syscall (__NR_finit_module, fd, Parameters ? Parameters : "", Flags);
+    if (ret < 0)
+      ret = -errno;
+    KMODULE_STATS_PHASE (KMODULE_PHASE_INIT_MODULE, start);
+    KMODULE_STATS_COUNT (KMODULE_COUNTER_READ, result.size);
+
+    if (ret == 0 && (Flags & MODULE_INIT_COMPRESSED_FILE)) {
+      result.avoided = module_image_size (fd, compression, result.size);
+      KMODULE_STATS_COUNT (KMODULE_COUNTER_DECOMPRESSED, result.avoided);
+    }
+  }
+
+  Py_END_ALLOW_THREADS
+
+  if (refused) {
+    PyErr_Format (PyExc_ValueError, "module fd %d is %s compressed: decompress user needs insmod() with a path, or decompress auto or kernel\n", fd, compression);
+    return NULL;
+  }
+
+  if (ret < 0) {
+    PyErr_Format (PyExc_SystemError, "could not insert module fd %d: %s\n", fd, mod_strerror(-ret));
+    return NULL;
+  }
+
+  return Py_BuildValue ("{s:O,s:s,s:K,s:K}",
+           "path",       Py_None,
+           "decompress", result.method,
+           "size",       (unsigned long long) result.size,
+           "avoided",    (unsigned long long) result.avoided);
+} // kmodule_insmod_fd
+
+/***********************************************************************
+ *
+ * kmodule_insmod_buffer:
+ *
+ *   Context._insmod_buffer (image, parameter=None)
+ *
+ *   Insert the module image held by any object of the buffer protocol
+ *   with init_module(2), straight from its memory. Returns the dict of
+ *   kmodule_insmod() with a None path.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_insmod_buffer (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  PyObject  *Image;
+  char      *Parameters = NULL;
+  Py_buffer  view;
+  int        ret;
+
+  static char   *kwlist[] = {"image", "parameter", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "O|z",
+      kwlist,
+      &Image,
+      &Parameters)) {
+    return NULL;
+  }
+
+  if (kmodule_context_get (Self) == NULL)
+    return NULL;
+
+  if (PyObject_GetBuffer (Image, &view, PyBUF_SIMPLE) < 0)
+    return NULL;
+
+  //
+  // No kmod_ctx is used, the Context lock is not taken.
+  //
+  Py_BEGIN_ALLOW_THREADS
+
+  KMODULE_STATS_START (start);
+  ret = syscall (__NR_init_module, view.buf, (unsigned long) view.len, Parameters ? Parameters : "");
+  if (ret < 0)
+    ret = -errno;
+  KMODULE_STATS_PHASE (KMODULE_PHASE_INIT_MODULE, start);
+  KMODULE_STATS_COUNT (KMODULE_COUNTER_READ, view.len);
+
+  Py_END_ALLOW_THREADS
+
+  PyBuffer_Release (&view);
+
+  if (ret < 0) {
+    PyErr_Format (PyExc_SystemError, "could not insert module image: %s\n", mod_strerror(-ret));
+    return NULL;
+  }
+
+  return Py_BuildValue ("{s:O,s:s,s:K,s:K}",
+           "path",       Py_None,
+           "decompress", "none",
+           "size",       (unsigned long long) view.len,
+           "avoided",    (unsigned long long) 0);
+} // kmodule_insmod_buffer
@@ -26,49 +26,14 @@
 #include <shared/util.h>
 #include <tools/kmod.h>
 
+#include "kmodule.h"
+
 ///////////////////////////////////////////////////////////////////////
 ///
 /// kmodule public function
 ///
 ///////////////////////////////////////////////////////////////////////
 
-PyObject *
-kmodule_insmod (
-  PyObject    *Self,
-  PyObject    *Args,
-  PyObject    *KwArgs
-  );
-
-PyObject *
-kmodule_rmmod (
-  PyObject    *Self,
-  PyObject    *Args,
-  PyObject    *KwArgs
-  );
-
-/***********************************************************************
- *
- * kmodule_modprobe:
- *
- ***********************************************************************/
-static PyObject *
-kmodule_modprobe (
-  PyObject    *Self,
-  PyObject    *Args,
-  PyObject    *KwArgs
-  )
-{
-  PyErr_Format (PyExc_MemoryError, "modprobe not implement, yet.");
-  return NULL;
-} // kmodule_modprobe
-
-PyObject *
-kmodule_modinfo (
-  PyObject    *Self,
-  PyObject    *Args,
-  PyObject    *KwArgs
-  );
-
 /***********************************************************************
  *
  * kmodule_logging:
@@ -98,6 +63,99 @@ kmodule_logging (
 
 } // kmodule_logging
 
+/***********************************************************************
+ *
+ * kmodule_log_capture:
+ *
+ *   _log_sink (enable) -> previous state
+ *
+ *   Route the libkmod and tool messages to the in-memory ring instead of
+ *   stderr or syslog.
+ *
+ ***********************************************************************/
+static PyObject *
+kmodule_log_capture (
+  PyObject    *Self,
+  PyObject    *Args
+  )
+{
+  int enable;
+
+  if (!PyArg_ParseTuple (Args, "p", &enable)) {
+      return NULL;
+  }
+
+  return PyBool_FromLong (kmodule_log_sink (enable));
+
+} // kmodule_log_capture
+
+/***********************************************************************
+ *
+ * kmodule_log_drain:
+ *
+ *   _log_drain (max=256) -> ([(priority, file, line, function, message)], dropped)
+ *
+ *   Take up to max entries out of the ring, oldest first, and the count
+ *   of messages dropped on a full ring since the last call.
+ *
+ ***********************************************************************/
+static PyObject *
+kmodule_log_drain (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  int           max = 256, count, i;
+  unsigned long dropped;
+  PyObject      *list;
+
+  struct kmodule_log_entry  *entries;
+
+  static char   *kwlist[] = {"max", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "|i",
+      kwlist,
+      &max)) {
+    return NULL;
+  }
+
+  if (max <= 0)
+    max = 256;
+
+  entries = PyMem_Malloc (max * sizeof (*entries));
+  if (entries == NULL)
+    return PyErr_NoMemory ();
+
+  count = kmodule_log_read (entries, max, &dropped);
+
+  list = PyList_New (count);
+  for (i = 0; list != NULL && i < count; i++) {
+    PyObject *item = Py_BuildValue ("(izizs)",
+                       entries[i].priority,
+                       entries[i].file,
+                       entries[i].line,
+                       entries[i].fn,
+                       entries[i].message);
+    if (item == NULL) {
+      Py_CLEAR (list);
+      break;
+    }
+    PyList_SET_ITEM (list, i, item);
+  }
+
+  PyMem_Free (entries);
+
+  if (list == NULL)
+    return NULL;
+
+  return Py_BuildValue ("(Nk)", list, dropped);
+
+} // kmodule_log_drain
+
 ///////////////////////////////////////////////////////////////////////
 ///
 /// PyMethodDef of kmodule
@@ -106,11 +164,17 @@ kmodule_logging (
 
 static PyMethodDef kmodule_methods [] = {
 
-  { "_modinfo",     (PyCFunction) kmodule_modinfo,  METH_VARARGS | METH_KEYWORDS, NULL},
-  { "_rmmod",       (PyCFunction) kmodule_rmmod,    METH_VARARGS | METH_KEYWORDS, NULL},
-  { "_insmod",      (PyCFunction) kmodule_insmod,   METH_VARARGS | METH_KEYWORDS, NULL},
-  { "_modprobe",    (PyCFunction) kmodule_modprobe, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_lsmod_read",   (PyCFunction) kmodule_lsmod,    METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_lsmod_sysfs",  (PyCFunction) kmodule_lsmod_sysfs, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_scan",         (PyCFunction) kmodule_scan,     METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_depmod",       (PyCFunction) kmodule_depmod,   METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_diff_trees",   (PyCFunction) kmodule_diff_trees, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_aio",          (PyCFunction) kmodule_aio,      METH_VARARGS | METH_KEYWORDS, NULL},
   { "_logging",     kmodule_logging,                METH_VARARGS, NULL},
+  { "_log_sink",    kmodule_log_capture,            METH_VARARGS, NULL},
+  { "_log_drain",   (PyCFunction) kmodule_log_drain, METH_VARARGS | METH_KEYWORDS, NULL},
+  { "_stats",       kmodule_stats,                  METH_NOARGS, NULL},
+  { "_stats_reset", kmodule_stats_reset,            METH_NOARGS, NULL},
 
   { NULL, NULL, 0, NULL}
 
@@ -152,9 +216,52 @@ PyInit__kmodule (
 
   Py_Initialize();
 
+  if (PyType_Ready (&KmodContextType) < 0) return NULL;
+  if (PyType_Ready (&LsmodType) < 0) return NULL;
+  if (PyType_Ready (&ModinfoType) < 0) return NULL;
+  if (PyType_Ready (&ScanType) < 0) return NULL;
+  if (PyType_Ready (&AioType) < 0) return NULL;
+  if (PyType_Ready (&DepGraphType) < 0) return NULL;
+  if (PyType_Ready (&SymbolIndexType) < 0) return NULL;
+
   kmodule = PyModule_Create(&kmoduledef);
   if (kmodule == NULL) return NULL;
 
+  Py_INCREF (&KmodContextType);
+  if (PyModule_AddObject (kmodule, "_Context", (PyObject *) &KmodContextType) < 0) {
+      Py_DECREF (&KmodContextType);
+      Py_DECREF (kmodule);
+      return NULL;
+  }
+
+  Py_INCREF (&LsmodType);
+  if (PyModule_AddObject (kmodule, "_lsmod", (PyObject *) &LsmodType) < 0) {
+      Py_DECREF (&LsmodType);
+      Py_DECREF (kmodule);
+      return NULL;
+  }
+
+  Py_INCREF (&ModinfoType);
+  if (PyModule_AddObject (kmodule, "_modinfo", (PyObject *) &ModinfoType) < 0) {
+      Py_DECREF (&ModinfoType);
+      Py_DECREF (kmodule);
+      return NULL;
+  }
+
+  Py_INCREF (&DepGraphType);
+  if (PyModule_AddObject (kmodule, "_DepGraph", (PyObject *) &DepGraphType) < 0) {
+      Py_DECREF (&DepGraphType);
+      Py_DECREF (kmodule);
+      return NULL;
+  }
+
+  Py_INCREF (&SymbolIndexType);
+  if (PyModule_AddObject (kmodule, "_SymbolIndex", (PyObject *) &SymbolIndexType) < 0) {
+      Py_DECREF (&SymbolIndexType);
+      Py_DECREF (kmodule);
+      return NULL;
+  }
+
   verInfo = Py_BuildValue ("(ssss)", __DATE__" "__TIME__, PACKAGE, VERSION, KMOD_FEATURES);
   if (verInfo == NULL) {
       Py_DECREF (kmodule);
@@ -0,0 +1,818 @@
+/*
+ * kmodule.h: internal interface shared by the python wrapper for kmod/tools
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#ifndef _KMODULE_H_
+#define _KMODULE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule Context object
+///
+///   Wraps one long-lived kmod_ctx so configuration and the modules.*
+///   indexes are loaded once and shared by every call made through it.
+///
+///////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  PyObject_HEAD
+  struct kmod_ctx       *ctx;
+  struct kmodule_cache  *cache;
+  int                   decompress;
+  pthread_mutex_t       lock;
+  struct kmodule_alias_cache  *aliases;         // made on first use
+  unsigned                    alias_capacity;
+  struct kmodule_config       *config;          // NULL without config=
+} KmodContextObject;
+
+extern PyTypeObject KmodContextType;
+
+int
+kmodule_dirname (
+  const char  *root,
+  const char  *kversion,
+  char        *buf,
+  size_t      size
+  );
+
+struct kmod_ctx *
+kmodule_context_get (
+  PyObject    *Self
+  );
+
+//
+// A kmod_ctx is not thread safe, every use of it is serialized by the
+// Context lock. The lock is only taken with the GIL released, so a
+// thread waiting for it never blocks other python threads.
+//
+void
+kmodule_context_lock (
+  PyObject    *Self
+  );
+
+void
+kmodule_context_unlock (
+  PyObject    *Self
+  );
+
+struct kmod_ctx *
+kmodule_context_kmod_new (
+  const char          *dirname,
+  const char * const  *config
+  );
+
+void
+kmodule_context_retire (
+  PyObject        *Self,
+  struct kmod_ctx *ctx
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Context methods, implemented in insmod.c, rmmod.c, modinfo.c and
+/// modprobe.c
+///
+///////////////////////////////////////////////////////////////////////
+
+PyObject *
+kmodule_modinfo_batch (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_resolve_aliases (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_alias_cache_info (
+  PyObject    *Self,
+  PyObject    *Unused
+  );
+
+PyObject *
+kmodule_config_info (
+  PyObject    *Self,
+  PyObject    *Unused
+  );
+
+PyObject *
+kmodule_config_reload (
+  PyObject    *Self,
+  PyObject    *Unused
+  );
+
+PyObject *
+kmodule_coldplug (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_modprobe (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_closure (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_insmod (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_insmod_fd (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_insmod_buffer (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_rmmod (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_rmmod_batch (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_modinfo (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+//
+// Module insertion shared by insmod and modprobe, in insmod.c
+//
+//   A compressed module is handed to finit_module() as it is, with
+//   MODULE_INIT_COMPRESSED_FILE, when the running kernel decompresses
+//   that format (/sys/module/compression), and decompressed by libkmod
+//   otherwise. The result tells which way was taken.
+//
+
+enum {
+  KMODULE_DECOMPRESS_AUTO,      // the kernel when it can, else user space
+  KMODULE_DECOMPRESS_KERNEL,    // the kernel only, fail when it can not
+  KMODULE_DECOMPRESS_USER,      // always libkmod, the former behaviour
+};
+
+struct kmodule_insert_result {
+  const char  *method;          // "none", "kernel" or "user"
+  uint64_t    size;             // size of the module file
+  uint64_t    avoided;          // bytes not decompressed in user space
+};
+
+int
+kmodule_decompress_mode (
+  const char  *name
+  );
+
+const char *
+kmodule_decompress_name (
+  int         mode
+  );
+
+int
+kmodule_insert_module (
+  struct kmod_module            *mod,
+  const char                    *options,
+  int                           decompress,
+  struct kmodule_insert_result  *result
+  );
+
+//
+// Error text of init_module(), in insmod.c
+//
+const char *
+mod_strerror (
+  int err
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// modinfo mapping, implemented in modinfomap.c
+///
+///   The .modinfo of a module is packed in one block: the header, Count
+///   fields, the keys the mapping shows, then the NUL terminated
+///   strings. Offsets are from the start of the block, so a block can
+///   be copied or mapped from a file as it is.
+///
+///////////////////////////////////////////////////////////////////////
+
+#define KMODULE_MODINFO_BUILTIN   0x01
+
+enum {
+  KMODULE_MODINFO_FIELD,        // a .modinfo key, its last value
+  KMODULE_MODINFO_NAME,         // "name" of a builtin module
+  KMODULE_MODINFO_FILENAME,
+  KMODULE_MODINFO_PARM,         // dict of the parm and parmtype fields
+  KMODULE_MODINFO_ALIAS,        // tuple of the alias fields
+};
+
+struct kmodule_modinfo_field {
+  uint32_t  key;
+  uint32_t  keylen;
+  uint32_t  value;
+  uint32_t  valuelen;
+};
+
+struct kmodule_modinfo_key {
+  uint32_t  kind;
+  uint32_t  field;
+};
+
+struct kmodule_modinfo_blob {
+  uint32_t  size;
+  uint32_t  flags;
+  uint32_t  filename;
+  uint32_t  filenamelen;
+  uint32_t  count;
+  uint32_t  nkeys;
+};
+
+extern PyTypeObject ModinfoType;
+
+struct kmodule_modinfo_blob *
+kmodule_modinfo_pack (
+  const char        *filename,
+  struct kmod_list  *info
+  );
+
+struct kmodule_cache;
+
+int
+kmodule_modinfo_read (
+  struct kmod_module            *mod,
+  struct kmodule_cache          *cache,
+  struct kmodule_modinfo_blob   **blob
+  );
+
+bool
+kmodule_modinfo_check (
+  const struct kmodule_modinfo_blob *blob,
+  size_t                            avail
+  );
+
+PyObject *
+kmodule_modinfo_new (
+  const struct kmodule_modinfo_blob *blob,
+  PyObject                          *owner
+  );
+
+//
+// modinfo of a name, in modinfo.c. kmodule_modinfo_collect() resolves
+// the name and reads the .modinfo of every match without the GIL,
+// kmodule_modinfo_build() wraps the blocks in mappings with it.
+//
+struct kmodule_modinfo_entry {
+  struct kmodule_modinfo_blob *blob;
+  char                        *name;    // module name, when Err is set
+  int                         err;
+};
+
+struct kmodule_modinfo_result {
+  struct kmodule_modinfo_entry  *entries;
+  int                           count;
+  int                           err;
+  bool                          is_path;
+};
+
+void
+kmodule_modinfo_collect (
+  struct kmod_ctx               *ctx,
+  struct kmodule_cache          *cache,
+  const char                    *name,
+  struct kmodule_modinfo_result *result
+  );
+
+PyObject *
+kmodule_modinfo_build (
+  struct kmodule_modinfo_result *result,
+  const char                    *name
+  );
+
+void
+kmodule_modinfo_release (
+  struct kmodule_modinfo_result *result
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Persistent modinfo cache, implemented in cache.c
+///
+///   Keyed by module path, checked against the inode, size and mtime of
+///   the file. Every function but kmodule_cache_path and
+///   kmodule_cache_info can be called without the GIL, from any thread.
+///
+///////////////////////////////////////////////////////////////////////
+
+struct stat;
+
+struct kmodule_cache *
+kmodule_cache_open (
+  const char  *path
+  );
+
+void
+kmodule_cache_close (
+  struct kmodule_cache  *cache
+  );
+
+struct kmodule_modinfo_blob *
+kmodule_cache_get (
+  struct kmodule_cache  *cache,
+  const char            *path,
+  const struct stat     *st
+  );
+
+void
+kmodule_cache_put (
+  struct kmodule_cache              *cache,
+  const char                        *path,
+  const struct stat                 *st,
+  const struct kmodule_modinfo_blob *blob
+  );
+
+int
+kmodule_cache_save (
+  struct kmodule_cache  *cache
+  );
+
+PyObject *
+kmodule_cache_info (
+  struct kmodule_cache  *cache
+  );
+
+int
+kmodule_cache_path (
+  PyObject    *cache,
+  const char  *dirname,
+  const char  *suffix,
+  char        *buf,
+  size_t      size
+  );
+
+//
+// New file beside Path to be renamed over it, its name into Tmp.
+//
+FILE *
+kmodule_tmpfile (
+  const char  *path,
+  char        *tmp,
+  size_t      size
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Whole tree modinfo, implemented in scan.c
+///
+///////////////////////////////////////////////////////////////////////
+
+extern PyTypeObject ScanType;
+
+PyObject *
+kmodule_scan (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// modules.dep graph, implemented in depgraph.c
+///
+///////////////////////////////////////////////////////////////////////
+
+extern PyTypeObject DepGraphType;
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Exported symbol index, implemented in symbols.c
+///
+///////////////////////////////////////////////////////////////////////
+
+extern PyTypeObject SymbolIndexType;
+
+///////////////////////////////////////////////////////////////////////
+///
+/// modules.* indexes writer, implemented in depmod.c
+///
+///////////////////////////////////////////////////////////////////////
+
+PyObject *
+kmodule_depmod (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Module difference of two trees, implemented in treediff.c
+///
+///////////////////////////////////////////////////////////////////////
+
+PyObject *
+kmodule_diff_trees (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Worker pool of kmodule.aio, implemented in aio.c
+///
+///////////////////////////////////////////////////////////////////////
+
+extern PyTypeObject AioType;
+
+PyObject *
+kmodule_aio (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// lsmod, implemented in lsmod.c
+///
+///////////////////////////////////////////////////////////////////////
+
+extern PyTypeObject LsmodType;
+
+PyObject *
+kmodule_lsmod (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+PyObject *
+kmodule_lsmod_sysfs (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  );
+
+struct kmodule_proc_module {
+  const char  *name;
+  const char  *usedby;          // "a,b," as in /proc/modules, or "-"
+  const char  *state;
+  long        refcnt;
+};
+
+int
+kmodule_proc_modules (
+  const char                  *path,
+  struct kmodule_proc_module  **mods
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// In-memory log sink, implemented in log.c
+///
+///   Once the sink is on, the messages of libkmod and of the tools are
+///   written to a preallocated ring from any thread, without a lock or
+///   an allocation, and drained to python logging. Each Context keeps
+///   its own libkmod priority, checked before a message is formatted.
+///
+///////////////////////////////////////////////////////////////////////
+
+struct kmodule_log_entry {
+  int         priority;
+  int         line;
+  const char  *file;            // NULL for the messages of the tools
+  const char  *fn;
+  char        message[232];
+};
+
+void
+kmodule_log_attach (
+  struct kmod_ctx *ctx
+  );
+
+bool
+kmodule_log_sink (
+  bool        enable
+  );
+
+int
+kmodule_log_read (
+  struct kmodule_log_entry  *entries,
+  int                       max,
+  unsigned long             *dropped
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Dependency ordered execution, implemented in dag.c
+///
+///////////////////////////////////////////////////////////////////////
+
+struct kmodule_dag_node {
+  void      *data;
+  int       err;          // result of the node, see kmodule_dag_run()
+  double    start;        // seconds from the start of the run
+  double    time;         // seconds spent in the node
+  unsigned  seq;          // finish order from 1 when Fn ran, else 0
+  unsigned  pending;
+  unsigned  required;
+  bool      queued;
+  bool      cancel;
+  bool      finished;
+};
+
+struct kmodule_dag {
+  struct kmodule_dag_node *nodes;
+  unsigned                count;
+  unsigned                alloc;
+  void                    *edges;
+  unsigned                nedges;
+  unsigned                edges_alloc;
+};
+
+//
+// Worker numbers the threads of a run from 0 to Jobs - 1, for state
+// each thread keeps to itself such as its own kmod_ctx.
+//
+typedef int (*kmodule_dag_fn) (void *data, struct kmodule_dag_node *node, unsigned worker);
+
+int
+kmodule_dag_add (
+  struct kmodule_dag  *dag,
+  void                *data
+  );
+
+int
+kmodule_dag_edge (
+  struct kmodule_dag  *dag,
+  unsigned            before,
+  unsigned            after,
+  bool                required
+  );
+
+int
+kmodule_dag_run (
+  struct kmodule_dag  *dag,
+  int                 jobs,
+  kmodule_dag_fn      fn,
+  void                *data
+  );
+
+void
+kmodule_dag_free (
+  struct kmodule_dag  *dag
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Dependency ordered insertion, implemented in modprobe.c
+///
+///////////////////////////////////////////////////////////////////////
+
+struct kmodule_modprobe;
+
+struct kmodule_modprobe *
+kmodule_modprobe_new (
+  struct kmod_ctx       *ctx,
+  struct kmodule_config *config,
+  int                   decompress,
+  PyObject              *insert
+  );
+
+int
+kmodule_modprobe_add (
+  struct kmodule_modprobe *mp,
+  struct kmod_module      *mod
+  );
+
+int
+kmodule_modprobe_run (
+  struct kmodule_modprobe *mp,
+  PyObject                *Context,
+  int                     jobs
+  );
+
+PyObject *
+kmodule_modprobe_result (
+  struct kmodule_modprobe *mp
+  );
+
+void
+kmodule_modprobe_free (
+  struct kmodule_modprobe *mp
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// modprobe.d and modules-load.d tables, implemented in config.c
+///
+///////////////////////////////////////////////////////////////////////
+
+struct kmodule_config;
+
+struct kmodule_config *
+kmodule_config_new (
+  const char  *root,
+  PyObject    *Spec
+  );
+
+const char * const *
+kmodule_config_paths (
+  const struct kmodule_config *cfg
+  );
+
+int
+kmodule_config_compile (
+  struct kmodule_config *cfg,
+  struct kmod_ctx       *ctx
+  );
+
+bool
+kmodule_config_changed (
+  const struct kmodule_config *cfg
+  );
+
+struct kmodule_config *
+kmodule_config_copy (
+  const struct kmodule_config *cfg
+  );
+
+struct kmodule_config *
+kmodule_config_ref (
+  struct kmodule_config *cfg
+  );
+
+void
+kmodule_config_unref (
+  struct kmodule_config *cfg
+  );
+
+const char *
+kmodule_config_options (
+  const struct kmodule_config *cfg,
+  const char                  *name
+  );
+
+bool
+kmodule_config_blacklisted (
+  const struct kmodule_config *cfg,
+  const char                  *name
+  );
+
+bool
+kmodule_config_softdeps (
+  const struct kmodule_config *cfg,
+  const char                  *name,
+  const char                  **pre,
+  const char                  **post
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Alias resolution cache, implemented in alias.c
+///
+///////////////////////////////////////////////////////////////////////
+
+struct kmodule_alias_cache;
+
+struct kmodule_alias_cache *
+kmodule_alias_cache_new (
+  unsigned  capacity
+  );
+
+void
+kmodule_alias_cache_clear (
+  struct kmodule_alias_cache  *cache
+  );
+
+void
+kmodule_alias_cache_free (
+  struct kmodule_alias_cache  *cache
+  );
+
+int
+kmodule_alias_resolve (
+  struct kmod_ctx             *ctx,
+  struct kmodule_alias_cache  *cache,
+  const char                  *alias,
+  char                        **names
+  );
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Per-phase timers and counters, implemented in stats.c
+///
+///   Built unless KMODULE_NO_STATS is defined, the KMODULE_STATS_*
+///   macros then compile to nothing.
+///
+///////////////////////////////////////////////////////////////////////
+
+enum kmodule_stats_phase {
+  KMODULE_PHASE_CONTEXT,        // kmod_new() and the indexes
+  KMODULE_PHASE_LOOKUP,         // module by path, name or alias
+  KMODULE_PHASE_MODINFO,        // .modinfo read, decompressed and parsed by libkmod
+  KMODULE_PHASE_DECOMPRESS,     // insert decompressed by libkmod, init_module included
+  KMODULE_PHASE_INIT_MODULE,    // init_module(2) and finit_module(2)
+  KMODULE_PHASE_STATE,          // initstate, holders and refcnt
+  KMODULE_PHASE_DELETE_MODULE,  // delete_module(2)
+  KMODULE_PHASE_MAX
+};
+
+enum kmodule_stats_counter {
+  KMODULE_COUNTER_READ,         // module bytes given to the kernel or libkmod
+  KMODULE_COUNTER_DECOMPRESSED, // image bytes decompressed by the kernel
+  KMODULE_COUNTER_CACHE_HIT,    // .modinfo found in the cache
+  KMODULE_COUNTER_MAX
+};
+
+#ifndef KMODULE_NO_STATS
+
+#define KMODULE_STATS_ENABLED       1
+#define KMODULE_STATS_START(t)      uint64_t t = kmodule_stats_clock ()
+#define KMODULE_STATS_PHASE(p, t)   kmodule_stats_phase ((p), (t))
+#define KMODULE_STATS_COUNT(c, v)   kmodule_stats_count ((c), (v))
+
+uint64_t
+kmodule_stats_clock (
+  void
+  );
+
+void
+kmodule_stats_phase (
+  int       phase,
+  uint64_t  start
+  );
+
+void
+kmodule_stats_count (
+  int       counter,
+  uint64_t  value
+  );
+
+#else
+
+#define KMODULE_STATS_ENABLED       0
+#define KMODULE_STATS_START(t)      ((void) 0)
+#define KMODULE_STATS_PHASE(p, t)   ((void) 0)
+#define KMODULE_STATS_COUNT(c, v)   ((void) 0)
+
+#endif // KMODULE_NO_STATS
+
+PyObject *
+kmodule_stats (
+  PyObject    *Self,
+  PyObject    *Args
+  );
+
+PyObject *
+kmodule_stats_reset (
+  PyObject    *Self,
+  PyObject    *Args
+  );
+
+#endif // _KMODULE_H_
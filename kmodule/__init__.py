@@ -13,7 +13,18 @@
 #  GNU General Public License for more details.
 #
 
-from _kmodule import _rmmod, _logging, _modinfo, _insmod, _verInfo
+import atexit
+import logging
+import os
+import threading
+import weakref
+
+from collections.abc import Mapping
+
+from _kmodule import _Context, _logging, _verInfo, _lsmod, _lsmod_read, _modinfo, _scan, _depmod, _diff_trees, _DepGraph, _SymbolIndex
+from _kmodule import _log_sink, _log_drain, _stats, _stats_reset
+
+Mapping.register (_modinfo)
 
 class _version:
 
@@ -31,34 +42,129 @@ class _version:
 
 version = _version()
 
-class _lsmod:
+#
+# syslog priorities of libkmod and python logging levels
+#
+_log_levels = (logging.CRITICAL, logging.CRITICAL, logging.CRITICAL, logging.ERROR,
+               logging.WARNING, logging.INFO, logging.INFO, logging.DEBUG)
+
+def _log_priority (level):
 
-  def __init__ (self, line):
+  for priority in range (len (_log_levels) - 1, -1, -1):
+    if _log_levels[priority] >= level:
+      return priority
 
-    mName, mSize, mUsedOpen, mUsedBy, mStatus, mOffset = line.split ()[:6]
-    self.name   = mName
-    self.size   = int(mSize)
-    self.opened = int(mUsedOpen)
-    self.status = mStatus
-    self.offset = int(mOffset, 16)
+  return 0
 
-    if mUsedBy == '-':
-      self.usedby = None
-    else:
-      self.usedby = mUsedBy.split (',')[:-1]
+def log_capture (enable = True):
+  '''
+NAME
+       kmodule.log_capture() - Keep libkmod messages for python logging
+
+DESCRIPTION
+       With enable, the messages of libkmod and of kmodule are no longer
+       written to stderr or syslog but recorded, from any thread and without
+       a lock, into a fixed size in-memory ring, to be handed to python
+       logging by log_drain(). Messages that find the ring full are dropped
+       and counted. A critical message never ends the process.
 
-  def __str__ (self):
-    return "%-24s %8d, %3d, %10s, 0x%016X, %s" % (
-             self.name,
-             self.size,
-             self.opened,
-             self.status,
-             self.offset,
-             self.usedby)
+       Which messages are recorded is set per Context by its log_level, they
+       are filtered before being formatted.
 
-  __repr__ = __str__
+RETURN
+  Previous state.
+'''
+  return _log_sink (enable)
 
-def lsmod ():
+def log_drain (logger = None, batch = 256):
+  '''
+NAME
+       kmodule.log_drain() - Hand the recorded libkmod messages to python logging
+
+DESCRIPTION
+       kmodule.log_drain empties the ring filled since log_capture(), batch
+       entries at a time, into logger, logging.getLogger('kmodule') by
+       default. Each record carries the priority as its level and the
+       libkmod source file, line and function of the message. A warning
+       tells how many messages were dropped on a full ring.
+
+RETURN
+  Number of messages handed to logger.
+'''
+  if logger is None:
+    logger = logging.getLogger ('kmodule')
+
+  count = 0
+
+  while True:
+    entries, dropped = _log_drain (batch)
+
+    for priority, file, line, function, message in entries:
+      level = _log_levels[min (max (priority, 0), len (_log_levels) - 1)]
+      if logger.isEnabledFor (level):
+        logger.handle (logger.makeRecord (logger.name, level, file or '(kmodule)', line, message, None, None, function))
+
+    count += len (entries)
+
+    if dropped:
+      logger.warning ('%d libkmod messages dropped, the log ring was full', dropped)
+
+    if len (entries) < batch:
+      return count
+
+def stats ():
+  '''
+NAME
+       kmodule.stats() - Where the time of the kmodule calls went
+
+DESCRIPTION
+       kmodule.stats reports the time spent in each phase of the calls made
+       since the last reset_stats(), summed over every thread, including the
+       ones of scan(), modprobe() and kmodule.aio:
+
+           context        kmod_new() and loading the modules.* indexes
+           lookup         finding a module by path, name or alias
+           modinfo        reading and parsing .modinfo in libkmod
+           decompress     insert of a module decompressed by libkmod,
+                          init_module included
+           init_module    init_module and finit_module system calls
+           state          initstate, holders and refcount of loaded modules
+           delete_module  delete_module system call
+
+       and the counters read (module bytes handed to the kernel or
+       libkmod), decompressed (image bytes the kernel decompressed) and
+       cache_hit (.modinfo served by a Context cache).
+
+       Every thread counts into its own memory, so keeping the figures costs
+       two clock reads per phase and no lock. A build with --without-stats
+       leaves them out, the figures are then all zero and enabled is False.
+
+RETURN
+  dict if success.
+
+RETURN DATA
+
+  {'enabled': ..., 'phases': {phase: {'count': ..., 'time': ..., 'p50': ..., 'p90': ...,
+                              'p99': ..., 'histogram': ...}, ...}, 'counters': {...}}
+
+       time is the total in seconds. p50, p90 and p99 are the upper bounds of
+       the histogram buckets holding those percentiles, None for a phase
+       never run. histogram is a tuple of (upper bound in seconds, count),
+       one bucket per power of two nanoseconds.
+'''
+  return _stats ()
+
+def reset_stats ():
+  '''
+NAME
+       kmodule.reset_stats() - Start the figures of kmodule.stats() over
+
+RETURN
+  None.
+'''
+  _stats_reset ()
+
+def lsmod (fields = None):
   '''
 NAME
        kmodule.lsmod() - Show the status of modules in the Linux Kernel
@@ -67,6 +173,11 @@ DESCRIPTION
        kmodule.lsmod() is a trivial program which nicely formats the contents
        of the /proc/modules, showing what kernel modules are currently loaded.
 
+OPTIONS
+       fields
+           Iterable of the _lsmod fields to fill in, all of them by default.
+           name is always filled in, the others are None when not asked for.
+
 RETURN
   Dict with module name as key, value is class _lsmod if success. Exception if fail.
 
@@ -89,17 +200,11 @@ DATA STRUCT
         mouses using this module.
 '''
 
-  ret = {}
-
-  with open("/proc/modules", "r") as mf:
-    lines = mf.readlines()
+  return _lsmod_read (fields)
 
-  for line in lines:
-    _a = _lsmod(line)
-    ret[_a.name] = _a
-    del (_a)
+def _BuildParams (params):
 
-  return ret
+  return " ".join (BuildParam (key, value) for key, value in params.items ()) or None
 
 def BuildParam (key, value):
 
@@ -145,19 +250,70 @@ DESCRIPTION
   trying to link the module is now done inside the kernel, the dmesg
   usually gives more information about errors.
 
+  module is a path, str, bytes or os.PathLike. An int or an object with
+  fileno() is passed to insmod_fd(), any other object, such as a
+  bytearray or memoryview, to insmod_buffer(). An image held in bytes
+  is read as a path: call insmod_buffer() for it.
+
+  A compressed module (.ko.xz, .ko.zst, .ko.gz) is handed to the kernel
+  still compressed when the running kernel decompresses that format,
+  and decompressed in user space otherwise. See Context decompress.
+
 RETURN
-  None if success. Exception if fail.
+  dict if success. Exception if fail.
+
+RETURN DATA
+
+  {'path': ..., 'decompress': ..., 'size': ..., 'avoided': ...}
+
+  decompress is none for a plain module, kernel or user for the side
+  that decompressed it. size is the module file size and avoided the
+  decompressed size the kernel spared user space from allocating.
+
+'''
+
+  return _context ().insmod (module, **params)
+
+def insmod_fd (fd, **params):
+  '''
+NAME
+  kmodule.insmod_fd() - Insert a module from an open file into the Linux Kernel
+
+DESCRIPTION
+  kmodule.insmod_fd inserts the module image read from the file descriptor
+  fd, an int or an object with fileno(), with the finit_module system call.
+  The file is read by the kernel, nothing is copied in user space and no
+  path is needed.
+
+  A compressed image is passed to the kernel compressed. ValueError is
+  raised when the Context decompress mode is user: use insmod() with a
+  path to decompress in user space.
+
+RETURN
+  dict if success, as in insmod() with a None path. Exception if fail.
 
 '''
 
-  pString = ""
+  return _context ().insmod_fd (fd, **params)
+
+def insmod_buffer (image, **params):
+  '''
+NAME
+  kmodule.insmod_buffer() - Insert a module image in memory into the Linux Kernel
+
+DESCRIPTION
+  kmodule.insmod_buffer inserts the uncompressed module image held by
+  image, any object of the buffer protocol such as bytes, bytearray,
+  memoryview or mmap, with the init_module system call. The kernel reads
+  the image straight from the buffer memory, without a temporary file or
+  a copy.
 
-  for key, value in params.items():
+RETURN
+  dict if success, as in insmod() with a None path. Exception if fail.
 
-    pString += "%s " % BuildParam (key, value)
-    vf = 0;
+'''
 
-  _insmod (module, pString)
+  return _context ().insmod_buffer (image, **params)
 
 def modinfo (*modules, basedir = '', kernel = None):
   '''
@@ -190,19 +346,212 @@ OPTIONS
            initrd/initramfs image prior to booting.
 
 RETURN
-  Dict in tuple if success. Exception if fail.
+  Mapping in tuple if success. Exception if fail.
 
 RETURN DATA
 
-  (dict1, ... dictN)
+  (modinfo1, ... modinfoN)
+
+  Each modinfo is a read only mapping used like a dict: filename, every
+  .modinfo key, parm (dict) and alias (tuple). Values are only turned into
+  python objects when first read. getall(key) lists every value of a
+  repeated key such as firmware, copy() returns a plain dict.
+
+'''
+  return _context (basedir, kernel).modinfo (*modules)
+
+def modinfo_batch (modules, basedir = '', kernel = None):
+  '''
+NAME
+       kmodule.modinfo_batch - Show information about many Linux Kernel modules
+
+DESCRIPTION
+       kmodule.modinfo_batch looks up every module name, alias or filename of
+       the iterable modules in a single call, sharing one libkmod context and
+       releasing the GIL once for the whole batch.
+
+       A name that cannot be resolved does not stop the batch: its exception
+       is returned in place of its result.
+
+OPTIONS
+       basedir
+           Root directory for modules, / by default.
+
+       kernel
+           Provide information about a kernel other than the running one.
+
+RETURN
+  List with one item per name, in the same order: a list of modinfo as in
+  kmodule.modinfo, or the exception raised for that name.
+
+'''
+  return _context (basedir, kernel).modinfo_batch (modules)
+
+def resolve_aliases (aliases, basedir = '', kernel = None):
+  '''
+NAME
+       kmodule.resolve_aliases() - Modules of many aliases at once
 
+DESCRIPTION
+       kmodule.resolve_aliases looks up every alias of the iterable, such as
+       the modaliases of the devices found at coldplug, as modprobe would:
+       module name, alias and builtin. Only the module names are returned,
+       no modinfo is read.
+
+       An alias given several times is looked up once. The answers are kept
+       by the Context in a bounded LRU (see Context alias_cache), so an alias
+       seen by an earlier call is not looked up again.
+
+RETURN
+  List, in the order of aliases, of the tuple of module names each one
+  resolves to, () for none. Exception if fail.
+
+EXAMPLE
+       >>> km.resolve_aliases (['pci:v00008086d00001533sv*sd*bc02sc00i00', 'ext4'])
+       [('igb',), ('ext4',)]
 '''
-  ret = []
+  return _context (basedir, kernel).resolve_aliases (aliases)
+
+def scan (basedir = '', kversion = None, workers = 0, cache = None):
+  '''
+NAME
+       kmodule.scan - Show information about every module of a kernel
+
+DESCRIPTION
+       kmodule.scan walks basedir/lib/modules/kversion and extracts the
+       information of every module file found, as kmodule.modinfo does.
+
+       The files are read by a pool of native threads, each with its own
+       libkmod context, while python consumes the results. Results come
+       in the order the files are read, not in directory order. Symbolic
+       links are not followed.
+
+OPTIONS
+       basedir
+           Root directory for modules, / by default.
+
+       kversion
+           Kernel version of the modules directory, the running one by default.
+
+       workers
+           Number of threads reading modules, one per CPU by default.
 
-  for _m in modules:
-    ret.extend (_modinfo (_m, basedir, kernel))
+       cache
+           modinfo cache file as in kmodule.Context, written when the scan
+           ends.
 
-  return tuple(ret)
+RETURN
+  Iterator of (path, modinfo) tuples. modinfo is the exception raised for
+  path when its information could not be read. Exception if the modules
+  directory does not exist, OSError from the iterator if it can not be
+  opened.
+
+'''
+  return _scan (basedir or None, kversion, workers, cache)
+
+def depmod (basedir = '', kversion = None, workers = 0, cache = None, outdir = None):
+  '''
+NAME
+       kmodule.depmod - Write the modules.* indexes of a kernel
+
+DESCRIPTION
+       kmodule.depmod does what depmod -a does for basedir/lib/modules/kversion,
+       in process: every module file is read by a pool of native threads, each
+       with its own libkmod context, dependencies are resolved from the symbols
+       modules export and need together with their modinfo depends, and
+       modules.dep, modules.alias, modules.symbols, modules.softdep,
+       modules.devname, modules.builtin and their .bin indexes are written.
+       Every file is written to a temporary file and renamed over the old one.
+
+       Of two modules of the same name, the one under updates/ wins, then
+       the first in modules.order, then by path. A module is listed in
+       modules.dep with what it depends on, the last to load first.
+
+       With cache, what was read of every module is kept by path with its
+       inode, size and modification time; a later run reads only the modules
+       that changed since.
+
+OPTIONS
+       workers
+           Number of threads reading modules, one per CPU by default.
+
+       cache
+           State file of the incremental run, read first and written when
+           done. True for $XDG_CACHE_HOME/kmodule/<kversion>.depmod, off by
+           default. It holds the modules of any number of trees.
+
+       outdir
+           Directory written, the modules directory by default.
+
+RETURN
+  Exception if the modules directory does not exist or an index could not
+  be written.
+
+RETURN DATA
+  dict:
+    modules     Number of modules in the indexes.
+    read        Number of modules read.
+    cached      Number of modules taken from cache.
+    duplicates  Tuple of the paths left out for another module of the same name.
+    errors      Dict of the paths that could not be read, by path.
+    cycles      Tuple of the names of the modules on a dependency cycle or behind one.
+    scan, build, write, total
+                Seconds spent reading the modules, resolving, writing, in all.
+'''
+  return _depmod (basedir or None, kversion, workers, cache, outdir)
+
+def diff_trees (old, new, workers = 0):
+  '''
+NAME
+       kmodule.diff_trees - Module difference of two kernels
+
+DESCRIPTION
+       kmodule.diff_trees reads every module of two modules directories, each
+       given as a (basedir, kversion) pair, on one pool of native threads, each
+       thread with its own libkmod context per tree. The modules of each tree
+       are sorted by name, of two modules of the same name the one under
+       updates/ wins as in depmod(), and the two trees are merged by name; the
+       aliases, firmware and parameters of a module in both are compared as
+       sorted arrays in the same way.
+
+       vermagic is compared without the leading kernel release of its own
+       tree, so only the build options, or a module left from another
+       release, show.
+
+OPTIONS
+       old, new
+           (basedir, kversion) of the trees compared. basedir '' or None is /,
+           kversion None the running kernel.
+
+       workers
+           Number of threads reading modules, one per CPU by default.
+
+RETURN
+  Exception if a modules directory does not exist.
+
+RETURN DATA
+  dict:
+    added       Tuple of the names of the modules only in new.
+    removed     Tuple of the names of the modules only in old.
+    changed     Dict by module name of what changed, only the keys that did:
+                  vermagic  (old, new)
+                  params    {'added': names, 'removed': names,
+                             'changed': ((name, old type, new type), ...)}
+                  aliases   {'added': ..., 'removed': ...}
+                  firmware  {'added': ..., 'removed': ...}
+    unchanged   Number of modules in both trees that did not change.
+    old, new    Number of modules of each tree.
+    duplicates  Tuple of the paths left out for another module of the same name.
+    errors      Dict of the paths that could not be read, by path.
+    scan, diff  Seconds spent reading both trees and comparing them.
+
+EXAMPLE
+       >>> d = kmodule.diff_trees (('', '6.1.0-old'), ('/mnt', '6.1.0-new'))
+       >>> print (d['removed'], sorted (d['changed']))
+'''
+  (old_basedir, old_kversion), (new_basedir, new_kversion) = old, new
+
+  return _diff_trees (old_basedir or None, old_kversion, new_basedir or None, new_kversion, workers)
 
 def rmmod (*modules, force=False, syslog=False, wait=False, verbose=0):
   '''
@@ -232,15 +581,573 @@ OPTIONS
 RETURN
   None if success. Exception if fail.
 '''
-  if syslog == True:
-    _logging (True)
+  _context ().rmmod (*modules, force=force, syslog=syslog, wait=wait, verbose=verbose)
+
+def rmmod_batch (*modules, recursive = False, jobs = 1, force = False, wait = False):
+  '''
+NAME
+       kmodule.rmmod_batch() - Remove a set of modules from the Linux Kernel
+
+DESCRIPTION
+       kmodule.rmmod_batch reads the holders of every loaded module once,
+       from /proc/modules, and removes the modules given in holder order: a
+       module only after the modules holding it are gone. Modules that do
+       not hold each other are removed concurrently on up to jobs threads.
+
+       A module held by a module not in the batch is reported busy and left
+       alone, unless recursive is set, then its holders are removed first.
+
+OPTIONS
+       recursive
+           Also remove every module holding one of the modules given.
+
+       jobs
+           Number of modules removed at the same time, 1 by default.
+
+       force
+           As in rmmod(). Modules held from outside the batch are removed
+           as well.
+
+       wait
+           Wait for a module in use to be released instead of failing busy.
+
+RETURN
+  Tuple of dict, one per module in the order they were removed. Exception if
+  a name is not found.
+
+RETURN DATA
+
+  ({'name': ..., 'status': ..., 'holders': ..., 'error': ..., 'start': ..., 'time': ...}, ...)
+
+       status is one of removed, busy, builtin, not loaded, failed, or
+       skipped (a holder was not removed). holders are the modules that held
+       it in the snapshot. start and time are in seconds from the start of
+       the call.
+'''
+  return _context ().rmmod_batch (*modules, recursive = recursive, jobs = jobs, force = force, wait = wait)
+
+def modprobe (*modules, basedir = '', kernel = None, jobs = 1, insert = None, **params):
+  '''
+NAME
+       kmodule.modprobe() - Add modules and their dependencies to the Linux Kernel
+
+DESCRIPTION
+       kmodule.modprobe looks up every name given, as a module name or an
+       alias, and inserts the matching modules together with the modules
+       they depend on (modules.dep) and their softdeps.
+
+       A module is only inserted after the modules it depends on. Branches
+       of the dependency graph that do not depend on each other are
+       inserted concurrently on up to jobs threads. Modules already loaded
+       are left alone.
+
+       params are passed to the named modules, as in insmod().
+
+OPTIONS
+       basedir
+           Root directory for modules, / by default.
+
+       kernel
+           Provide information about a kernel other than the running one.
+
+       jobs
+           Number of modules inserted at the same time, 1 by default.
+
+       insert
+           Callable insert (name, path, options) used instead of the
+           init_module system call, e.g. for a dry run. It returns None or a
+           negative errno, or raises OSError.
+
+RETURN
+  Tuple of dict, one per module in the order they were started. Exception if
+  a name is not found or any module failed to insert.
+
+RETURN DATA
+
+  ({'name': ..., 'path': ..., 'status': ..., 'error': ..., 'start': ..., 'time': ...,
+    'decompress': ..., 'avoided': ...}, ...)
+
+       status is one of inserted, loaded (already in the kernel), builtin,
+       failed, or skipped (a dependency failed). start and time are in
+       seconds from the start of the call. decompress and avoided are as
+       in insmod(), decompress is None for a module not inserted.
+'''
+  return _context (basedir, kernel).modprobe (*modules, jobs = jobs, insert = insert, **params)
+
+def coldplug (sysfs = '/sys/devices', jobs = 0, insert = None, basedir = '', kernel = None):
+  '''
+NAME
+       kmodule.coldplug() - Load the modules of the devices already present
+
+DESCRIPTION
+       kmodule.coldplug walks sysfs, without following symbolic links, and
+       reads the modalias of every device. The distinct modaliases are
+       resolved to modules as resolve_aliases() does, through the alias
+       cache of the Context, and the modules are inserted as modprobe()
+       does: after their dependencies, on up to jobs threads. Modules
+       already loaded or builtin are left alone.
+
+       Everything runs natively with the GIL released, in one call.
+
+OPTIONS
+       sysfs
+           Root of the devices walked, /sys/devices by default. Any
+           directory tree of modalias files can stand in for it.
+
+       jobs
+           Number of modules inserted at the same time, one per CPU by
+           default.
+
+       insert
+           Callable insert (name, path, options) used instead of the
+           init_module system call, as in modprobe().
+
+       basedir
+           Root directory for modules, / by default.
+
+       kernel
+           Modules of a kernel other than the running one.
+
+RETURN
+  dict if success, failed modules included. Exception if sysfs can not be
+  read.
+
+RETURN DATA
+
+  {'devices': ..., 'aliases': ..., 'unmatched': ..., 'blacklisted': ...,
+   'modules': ..., 'walk': ..., 'resolve': ..., 'load': ..., 'total': ...}
+
+       devices is the number of modalias files read, aliases the number of
+       distinct ones, unmatched the tuple of those no module claims.
+       blacklisted is the tuple of modules left out by the blacklist of a
+       Context made with config, () otherwise.
+       modules is the tuple of dict of modprobe(). walk, resolve and load
+       are the seconds each step took, total the time to all loaded.
+'''
+  return _context (basedir, kernel).coldplug (sysfs, jobs = jobs, insert = insert)
+
+def closure (*modules, basedir = '', kernel = None, jobs = 0):
+  '''
+NAME
+       kmodule.closure() - Modules and firmware a set of modules needs
+
+DESCRIPTION
+       kmodule.closure looks up every name given, as modprobe() does, and
+       collects the modules they depend on (modules.dep) and their softdeps,
+       without inserting anything. The .modinfo of every module collected is
+       read on up to jobs threads, a module after the modules it needs, and
+       the firmware fields of all of them are merged.
+
+       With basedir and kernel it computes what an initramfs for a kernel
+       that is not running needs, in one call.
+
+OPTIONS
+       basedir
+           Root directory for modules, / by default.
+
+       kernel
+           Modules of a kernel other than the running one.
+
+       jobs
+           Number of modules read at the same time, one per CPU by default.
+
+RETURN
+  dict if success. Names no module matches are reported in it, not raised.
+
+RETURN DATA
+
+  {'modules': ..., 'paths': ..., 'builtin': ..., 'firmware': ...,
+   'missing': ..., 'errors': ...}
+
+       modules is the tuple of module names in an order they can be loaded
+       in, paths the tuple of their files. builtin is the tuple of modules
+       built into the kernel. firmware is the sorted tuple of the distinct
+       firmware files. missing is the tuple of the names not found. errors
+       is a dict of module name to the reason its .modinfo could not be
+       read, or Dependency cycle.
+'''
+  return _context (basedir, kernel).closure (*modules, jobs = jobs)
+
+def watch (source = None, fields = None, proc = '/proc/modules', sysfs = '/sys/module', context = None):
+  '''
+NAME
+       kmodule.watch() - Follow modules coming and going in the Linux Kernel
+
+DESCRIPTION
+       kmodule.watch listens to the module add and remove uevents of the
+       kernel and keeps table, an lsmod() dict, up to date from them. The
+       table is read from /proc/modules once; each event then only reads
+       /sys/module of the module it names, and of the modules it depends on
+       whose usedby and opened changed.
+
+       Iterating a Watch blocks until the next event. poll() returns the
+       events already queued without blocking, and fileno() lets a
+       selector or an event loop wait for them.
+
+OPTIONS
+       source
+           Socket-like object with recvfrom() and fileno() the uevents are read
+           from, a NETLINK_KOBJECT_UEVENT socket by default. A socketpair
+           fed recorded uevents can stand in for the kernel.
+
+       fields
+           lsmod fields kept in the table, all of them by default.
+
+       proc
+           File the table is first read from, /proc/modules by default.
+
+       sysfs
+           Directory the modules are read from, /sys/module by default.
+
+       context
+           kmodule.Context used to find the modules a module depends on,
+           the default one by default.
+
+RETURN DATA
+
+  (action, name, record)
+
+       action is add or remove. record is the _lsmod of name, the one just
+       dropped from table for remove. action is resync, with name and record
+       None, when events were lost and table was read again.
+'''
+  from .uevent import Watch
+
+  return Watch (source, fields, proc, sysfs, context)
+
+class Context (_Context):
+  '''
+NAME
+       kmodule.Context(basedir=None, kversion=None, cache=None, decompress='auto', alias_cache=4096, config=None) - Reusable libkmod context
+
+DESCRIPTION
+       kmodule.Context keeps one libkmod context alive, so the configuration
+       and the modules.* indexes are loaded once and shared by every
+       insmod, rmmod, modinfo, modprobe and lsmod made through it.
+
+       The module level functions use a cached default Context per
+       (basedir, kernel) pair and per thread.
+
+       Every libkmod and kernel call is made with the GIL released. Calls
+       through one Context are serialized, use one Context per thread for
+       concurrent work.
+
+OPTIONS
+       basedir
+           Root directory for modules, / by default.
+
+       kversion
+           Kernel version of the modules directory, the running one by default.
+
+       cache
+           File keeping the modinfo read, so later runs do not open module
+           files that did not change (same inode, size and mtime). True for
+           $XDG_CACHE_HOME/kmodule/<kversion>.modinfo, off by default.
+           Modules read are written to it by flush_cache(), when the Context
+           is freed and at exit.
+
+       decompress
+           Who decompresses the compressed modules inserted. auto lets the
+           kernel do it with finit_module(MODULE_INIT_COMPRESSED_FILE) when
+           /sys/module/compression names the format, and libkmod otherwise.
+           kernel always asks the kernel and fails when it can not, user
+           always decompresses in user space.
+
+       alias_cache
+           Number of aliases whose modules resolve_aliases() remembers, the
+           least recently used forgotten first. 0 remembers none.
+
+       config
+           modprobe.d and modules-load.d read once and compiled into tables
+           by module name. True for the default directories (/etc, /run,
+           /usr/local/lib, /usr/lib and /lib) under basedir, or a path or a
+           list of paths, those named modules-load.d and the files in them
+           being modules-load.d. Without it, the default, no config is read.
+
+           modprobe() and coldplug() then insert each module with its
+           options, follow the softdeps and leave out blacklisted modules
+           found through an alias. install and remove commands are reported
+           by config() but not run.
+
+           config() returns the tables, None without config. reload_config()
+           reads the config again when a file or directory of it changed,
+           returning 'config', maps the modules.* indexes again when only
+           they changed, returning 'indexes', and otherwise returns
+           'unchanged'. Both empty the alias cache.
+'''
+
+  def __init__ (self, basedir = None, kversion = None, cache = None, decompress = 'auto', alias_cache = 4096, config = None):
+
+    super ().__init__ (basedir, kversion, cache, decompress, alias_cache, config)
+
+    if cache:
+      _cached.add (self)
+
+  def flush_cache (self):
+    self._cache_flush ()
+
+  def cache_info (self):
+    return self._cache_info ()
+
+  def alias_cache_info (self):
+    return self._alias_cache_info ()
+
+  def resolve_aliases (self, aliases):
+    return self._resolve_aliases (aliases)
+
+  def config (self):
+    return self._config ()
+
+  def reload_config (self):
+    return self._reload_config ()
+
+  @property
+  def log_level (self):
+    return _log_levels[min (self.log_priority, len (_log_levels) - 1)]
+
+  @log_level.setter
+  def log_level (self, level):
+    self.log_priority = _log_priority (level)
+
+  def lsmod (self, fields = None):
+    return lsmod (fields)
+
+  def insmod (self, module, **params):
+
+    if isinstance (module, int) or hasattr (module, 'fileno'):
+      return self.insmod_fd (module, **params)
+
+    if not isinstance (module, (str, bytes, os.PathLike)):
+      return self.insmod_buffer (module, **params)
+
+    return self._insmod (os.fsdecode (module), _BuildParams (params))
+
+  def insmod_fd (self, fd, **params):
+    return self._insmod_fd (fd, _BuildParams (params))
+
+  def insmod_buffer (self, image, **params):
+    return self._insmod_buffer (image, _BuildParams (params))
+
+  def modinfo (self, *modules):
+
+    ret = []
+
+    for _m in self._modinfo_batch (modules):
+      if isinstance (_m, BaseException):
+        raise _m
+      ret.extend (_m)
+
+    return tuple(ret)
+
+  def modinfo_batch (self, modules):
+
+    if not isinstance (modules, (list, tuple)):
+      modules = list (modules)
+
+    return self._modinfo_batch (modules)
+
+  def modprobe (self, *modules, jobs = 1, insert = None, **params):
+
+    ret = self._modprobe (modules, _BuildParams (params), jobs, insert)
+
+    failed = [m for m in ret if m['status'] == 'failed']
+    if failed:
+      e = OSError ("could not insert module %s: %s" % (failed[0]['name'], failed[0]['error']))
+      e.result = ret
+      raise e
+
+    return ret
+
+  def coldplug (self, sysfs = '/sys/devices', jobs = 0, insert = None):
+
+    return self._coldplug (os.fspath (sysfs), jobs or os.cpu_count () or 1, insert)
+
+  def closure (self, *modules, jobs = 0):
+
+    return self._closure (modules, jobs or os.cpu_count () or 1)
+
+  def rmmod (self, *modules, force=False, syslog=False, wait=False, verbose=0):
+
+    if syslog == True:
+      _logging (True)
+
+    if verbose < 0:
+      verbose = 0
+
+    try:
+      self._rmmod (modules, force, wait, verbose)
+    finally:
+      if syslog == True:
+        _logging (False)
+
+  def rmmod_batch (self, *modules, recursive = False, jobs = 1, force = False, wait = False):
+
+    return self._rmmod_batch ([os.fspath (m) for m in modules], force, wait, recursive, jobs)
+
+class DepGraph (_DepGraph):
+  '''
+NAME
+       kmodule.DepGraph(basedir=None, kversion=None) - Module dependency graph
+
+DESCRIPTION
+       kmodule.DepGraph reads modules.dep, or modules.dep.bin when there is
+       no modules.dep, once into memory. Every module gets an integer id,
+       0 to len(graph) - 1, and the dependencies are kept both ways as
+       arrays of ids, so the queries below need no modinfo call.
+
+       A module is given by name, '-' and '_' alike, or by id. An unknown
+       name raises KeyError, an id out of range IndexError.
+
+       The graph is what depmod wrote when it was read and does not follow
+       later changes of the tree.
+
+OPTIONS
+       basedir
+           Root directory for modules, / by default.
+
+       kversion
+           Kernel version of the modules directory, the running one by default.
+
+METHODS
+       len(graph), module in graph, graph.names
+           Number of modules, membership, names of all modules by id.
+
+       id(module), name(module), path(module)
+           Id, name, and path relative to the modules directory.
+
+       depends(module), dependents(module)
+           Modules the module depends on, as modules.dep lists them, and
+           modules listing it.
+
+       closure(modules, reverse=False)
+           Modules and all they depend on, or with reverse all that depend
+           on them, breadth first from modules.
+
+       order(modules=None)
+           Modules and all they depend on, all modules when None, each after
+           its dependencies: an order to load them, reversed an order to
+           remove them. ValueError when some are on a dependency cycle.
+
+       cycles()
+           List of the dependency cycles, each a tuple of modules.
+
+RETURN DATA
+       Modules are returned as tuples of names.
+'''
+
+  def __init__ (self, basedir = None, kversion = None):
+
+    super ().__init__ (basedir or None, kversion)
+
+  def __repr__ (self):
+    return '<kmodule.DepGraph of %d modules>' % len (self)
+
+class SymbolIndex (_SymbolIndex):
+  '''
+NAME
+       kmodule.SymbolIndex(basedir=None, kversion=None, symvers=None) - Which module exports a symbol
+
+DESCRIPTION
+       kmodule.SymbolIndex reads modules.symbols, or modules.symbols.bin when
+       there is no modules.symbols, and Module.symvers files once into
+       memory. Module.symvers adds the crc, GPL only export and namespace of
+       a symbol, and what the kernel itself exports as module vmlinux.
+
+       It tells which module exports a symbol, and what a module file would
+       miss before insmod fails with "Unknown symbol in module" or "Module
+       has wrong symbol version".
+
+       The index is what was read and does not follow later changes of the
+       tree.
+
+OPTIONS
+       basedir
+           Root directory for modules, / by default.
+
+       kversion
+           Kernel version of the modules directory, the running one by default.
+
+       symvers
+           Path, or list of paths, of Module.symvers files; False for none.
+           build/Module.symvers of the modules directory by default, when
+           there is one.
+
+METHODS
+       len(index), symbol in index
+           Number of symbols, membership.
+
+       providers(symbols)
+           Modules exporting a symbol, or for a list of symbols the list of
+           those in the same order, all in one call.
+
+       lookup(symbol)
+           Exports of a symbol, each a dict of module, crc, gpl and namespace;
+           crc and namespace are None when not known.
+
+       exports(module)
+           Symbols a module exports.
+
+       check(path)
+           Symbols the module file at path needs that would fail it, as a
+           dict of sorted tuples:
+             unresolved  exported by nothing known.
+             weak        weak, exported by nothing known; these do not fail.
+             mismatch    exported, with another crc than the module was
+                         built for.
+             gpl         exported GPL only, the module license is not GPL.
+             modules     modules it would take what it needs from, the first
+                         export its license allows, vmlinux left out.
+
+RETURN DATA
+       Modules are returned as tuples of names, () for none.
+
+EXAMPLE
+       >>> s = km.SymbolIndex ()
+       >>> s.providers (['crc32c', 'drm_dev_register'])
+       [('libcrc32c',), ('drm',)]
+'''
+
+  def __init__ (self, basedir = None, kversion = None, symvers = None):
+
+    super ().__init__ (basedir or None, kversion, symvers)
+
+  def __repr__ (self):
+    return '<kmodule.SymbolIndex of %d symbols>' % len (self)
+
+#
+# Contexts with a cache file write it out at exit, even those still
+# referenced then.
+#
+_cached = weakref.WeakSet ()
+
+@atexit.register
+def _flush_caches ():
+  for ctx in list (_cached):
+    try:
+      ctx.flush_cache ()
+    except OSError:
+      pass
+
+#
+# Default contexts are cached per thread: a Context serializes the calls
+# made through it, so sharing one would make threads wait on each other.
+#
+_contexts = threading.local ()
+
+def _context (basedir = None, kernel = None):
+
+  if not basedir and kernel is None:
+    basedir = None
 
-  if verbose < 0:
-    verbose = 0
+  try:
+    cache = _contexts.cache
+  except AttributeError:
+    cache = _contexts.cache = {}
 
-  _rmmod (modules, force, wait, verbose)
+  ctx = cache.get ((basedir, kernel))
+  if ctx is None:
+    ctx = cache[(basedir, kernel)] = Context (basedir, kernel)
 
-  if syslog == True:
-    _logging (False)
+  return ctx
 
-__all__ = ["insmod", "rmmod", "lsmod", "modinfo", "version"]
+__all__ = ["insmod", "insmod_fd", "insmod_buffer", "rmmod", "rmmod_batch", "lsmod", "modinfo", "modinfo_batch", "resolve_aliases", "modprobe", "coldplug", "closure", "scan", "depmod", "diff_trees", "watch", "log_capture", "log_drain", "stats", "reset_stats", "version", "Context", "DepGraph", "SymbolIndex"]
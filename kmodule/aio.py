@@ -0,0 +1,192 @@
+# kmodule.aio: asyncio interface of kmodule
+#          insmod, rmmod, modinfo
+#  Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+
+import asyncio
+import os
+import weakref
+
+from _kmodule import _aio
+
+from . import _BuildParams
+
+_INSMOD  = 0
+_RMMOD   = 1
+_MODINFO = 2
+
+class Pool:
+  '''
+NAME
+       kmodule.aio.Pool(basedir=None, kversion=None, workers=0, decompress='auto') - Native worker pool for asyncio
+
+DESCRIPTION
+       kmodule.aio.Pool runs insmod, rmmod and modinfo on native threads, each
+       with its own libkmod context, and completes asyncio futures on the
+       event loop it is first used from.
+
+       Finished jobs are signalled through an eventfd watched by the loop,
+       so no python thread is parked per call and any number of calls can
+       be in flight. Cancelling a call does not stop a job already started
+       in the kernel, its result is dropped.
+
+OPTIONS
+       basedir
+           Root directory for modules, / by default.
+
+       kversion
+           Kernel version of the modules directory, the running one by default.
+
+       workers
+           Number of threads, one per CPU by default.
+
+       decompress
+           Who decompresses the compressed modules inserted, as in
+           kmodule.Context.
+'''
+
+  def __init__ (self, basedir = None, kversion = None, workers = 0, decompress = 'auto'):
+
+    self._pool    = _aio (basedir, kversion, workers, decompress)
+    self._futures = {}
+    self._loop    = None
+
+  def _complete (self):
+
+    for job, result in self._pool.completed ():
+      future = self._futures.pop (job, None)
+      if future is None or future.done ():
+        continue
+      if isinstance (result, BaseException):
+        future.set_exception (result)
+      else:
+        future.set_result (result)
+
+  def _submit (self, op, name, parameter = None, force = False, wait = False):
+
+    loop = asyncio.get_running_loop ()
+
+    #
+    # The loop is only referenced weakly, the default pools are kept per
+    # loop and must not keep it alive.
+    #
+    if self._loop is None or self._loop () is None:
+      loop.add_reader (self._pool.fileno (), self._complete)
+      self._loop = weakref.ref (loop)
+    elif self._loop () is not loop:
+      raise RuntimeError ('Pool is bound to another event loop')
+
+    future = loop.create_future ()
+    self._futures[self._pool.submit (op, name, parameter, force, wait)] = future
+
+    return future
+
+  async def insmod (self, module, **params):
+
+    return await self._submit (_INSMOD, os.fspath (module), _BuildParams (params))
+
+  async def rmmod (self, *modules, force = False, wait = False):
+
+    await asyncio.gather (*(self._submit (_RMMOD, os.fspath (m), None, force, wait) for m in modules))
+
+  async def modinfo (self, *modules):
+
+    ret = []
+
+    for _m in await asyncio.gather (*(self._submit (_MODINFO, os.fspath (m)) for m in modules)):
+      ret.extend (_m)
+
+    return tuple (ret)
+
+  @property
+  def active (self):
+    return self._pool.active
+
+  def close (self):
+
+    loop = self._loop () if self._loop is not None else None
+    if loop is not None and not loop.is_closed ():
+      loop.remove_reader (self._pool.fileno ())
+    self._loop = None
+
+    self._pool.close ()
+
+    for future in self._futures.values ():
+      future.cancel ()
+    self._futures.clear ()
+
+#
+# The module level functions share one default Pool per event loop and
+# per (basedir, kernel) pair.
+#
+_pools = weakref.WeakKeyDictionary ()
+
+def _pool (basedir = None, kernel = None):
+
+  if not basedir and kernel is None:
+    basedir = None
+
+  loop = asyncio.get_running_loop ()
+  pools = _pools.setdefault (loop, {})
+
+  pool = pools.get ((basedir, kernel))
+  if pool is None:
+    pool = pools[(basedir, kernel)] = Pool (basedir, kernel)
+
+  return pool
+
+async def insmod (module, **params):
+  '''
+NAME
+  kmodule.aio.insmod() - Insert a module into the Linux Kernel without blocking the event loop
+
+DESCRIPTION
+  Awaitable kmodule.insmod() for a module path, run on the default Pool of
+  the running loop.
+
+RETURN
+  dict as kmodule.insmod() if success. Exception if fail.
+
+'''
+  return await _pool ().insmod (module, **params)
+
+async def rmmod (*modules, force = False, wait = False):
+  '''
+NAME
+  kmodule.aio.rmmod() - Remove modules from the Linux Kernel without blocking the event loop
+
+DESCRIPTION
+  Awaitable kmodule.rmmod(), the modules are removed concurrently. A module
+  in use is not removed unless force is set.
+
+RETURN
+  None if success. OSError of the first module that failed.
+
+'''
+  await _pool ().rmmod (*modules, force = force, wait = wait)
+
+async def modinfo (*modules, basedir = '', kernel = None):
+  '''
+NAME
+  kmodule.aio.modinfo() - Show information about Linux Kernel modules without blocking the event loop
+
+DESCRIPTION
+  Awaitable kmodule.modinfo(), the names are looked up concurrently.
+
+RETURN
+  Mapping in tuple if success. Exception if fail.
+
+'''
+  return await _pool (basedir, kernel).modinfo (*modules)
+
+__all__ = ["insmod", "rmmod", "modinfo", "Pool"]
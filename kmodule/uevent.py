@@ -0,0 +1,183 @@
+# kmodule.uevent: module add and remove events of the Linux Kernel
+#  Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+
+import errno
+import socket
+
+from _kmodule import _lsmod_read, _lsmod_sysfs
+
+_NETLINK_KOBJECT_UEVENT = 15
+_UEVENT_BUFFER          = 8192
+
+def _uevent_socket ():
+
+  #
+  # Group 1 carries the events of the kernel itself, the ones udev
+  # sends again to its clients are on group 2.
+  #
+  sock = socket.socket (socket.AF_NETLINK, socket.SOCK_DGRAM | socket.SOCK_CLOEXEC, _NETLINK_KOBJECT_UEVENT)
+  try:
+    sock.setsockopt (socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+    sock.bind ((0, 1))
+  except OSError:
+    sock.close ()
+    raise
+
+  return sock
+
+def _uevent_parse (data):
+
+  env = {}
+
+  for field in data.split (b'\0')[1:]:
+    key, sep, value = field.partition (b'=')
+    if sep:
+      env[key.decode (errors = 'replace')] = value.decode (errors = 'replace')
+
+  return env
+
+class Watch:
+  '''
+NAME
+       kmodule.uevent.Watch - lsmod table kept up to date from module uevents
+
+DESCRIPTION
+       See kmodule.watch().
+'''
+
+  def __init__ (self, source = None, fields = None, proc = '/proc/modules', sysfs = '/sys/module', context = None):
+
+    self._kernel  = source is None
+    self._source  = _uevent_socket () if source is None else source
+    self._fields  = fields
+    self._proc    = proc
+    self._sysfs   = sysfs
+    self._context = context
+    self._depends = {}
+
+    #
+    # Subscribe first, then read the table: a module that comes in
+    # between is then both in the table and in an event.
+    #
+    self.table = _lsmod_read (fields, proc)
+
+  def _record (self, name):
+
+    return _lsmod_sysfs (name, self._fields, self._sysfs)
+
+  def _dependencies (self, name):
+
+    from . import _context
+
+    try:
+      info = (self._context or _context ()).modinfo (name)[0]
+    except Exception:
+      return ()
+
+    return tuple (d for d in info.get ('depends', '').split (',') if d)
+
+  def _refresh (self, names):
+
+    for name in names:
+      if name in self.table:
+        self.table[name] = self._record (name)
+
+  def _handle (self, data):
+
+    env = _uevent_parse (data)
+    if env.get ('SUBSYSTEM') != 'module':
+      return None
+
+    action = env.get ('ACTION')
+    name   = env.get ('DEVPATH', '').rpartition ('/')[2]
+    if not name:
+      return None
+
+    if action == 'add':
+      record = self.table[name] = self._record (name)
+      self._depends[name] = depends = self._dependencies (name)
+      self._refresh (depends)
+    elif action == 'remove':
+      record = self.table.pop (name, None)
+      self._refresh (self._depends.pop (name, None) or self._dependencies (name))
+    else:
+      return None
+
+    return (action, name, record)
+
+  def _resync (self):
+
+    self.table = _lsmod_read (self._fields, self._proc)
+    self._depends.clear ()
+
+    return ('resync', None, None)
+
+  def _recv (self, flags):
+
+    while True:
+      try:
+        data, addr = self._source.recvfrom (_UEVENT_BUFFER, flags)
+      except OSError as e:
+        if e.errno == errno.ENOBUFS:
+          return self._resync ()
+        raise
+
+      if not data:
+        return None
+
+      #
+      # Only the kernel, port 0, sends on the kernel group.
+      #
+      if self._kernel and addr[0] != 0:
+        continue
+
+      event = self._handle (data)
+      if event is not None:
+        return event
+
+  def poll (self):
+
+    events = []
+
+    while True:
+      try:
+        event = self._recv (socket.MSG_DONTWAIT)
+      except BlockingIOError:
+        return events
+      if event is None:
+        return events
+      events.append (event)
+
+  def fileno (self):
+    return self._source.fileno ()
+
+  def close (self):
+    self._source.close ()
+
+  def __iter__ (self):
+    return self
+
+  def __next__ (self):
+
+    event = self._recv (0)
+    if event is None:
+      raise StopIteration
+
+    return event
+
+  def __enter__ (self):
+    return self
+
+  def __exit__ (self, *exc):
+    self.close ()
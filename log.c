@@ -20,7 +20,10 @@
 
 #include <config.h>
 
+#include <Python.h>
+
 #include <errno.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
@@ -29,11 +32,97 @@
 
 #include <tools/kmod.h>
 
+#include "kmodule.h"
+
 #define PRIO_MAX_SIZE 32
 
 static bool log_use_syslog;
 static int log_priority = LOG_WARNING;
 
+/*
+ * In-memory sink: a bounded multi-producer ring of preallocated entries,
+ * each slot carrying a sequence number so producers claim slots with a
+ * single compare-and-swap and the one consumer (the drain, under the
+ * GIL) never blocks them. When the ring is full new messages are
+ * dropped and counted.
+ */
+#define LOG_RING_SIZE 1024
+
+struct log_slot {
+	atomic_size_t seq;
+	struct kmodule_log_entry entry;
+};
+
+static struct log_slot log_ring[LOG_RING_SIZE];
+static atomic_size_t log_tail;
+static size_t log_head;
+static atomic_ulong log_dropped;
+static atomic_bool log_sink;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+
+static void log_ring_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		atomic_init(&log_ring[i].seq, i);
+}
+
+static struct log_slot *log_ring_claim(size_t *pos)
+{
+	struct log_slot *slot;
+	size_t p = atomic_load_explicit(&log_tail, memory_order_relaxed);
+
+	for (;;) {
+		size_t seq;
+
+		slot = &log_ring[p % LOG_RING_SIZE];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+		if (seq == p) {
+			if (atomic_compare_exchange_weak_explicit(&log_tail,
+					&p, p + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if ((ssize_t)(seq - p) < 0) {
+			atomic_fetch_add_explicit(&log_dropped, 1,
+						  memory_order_relaxed);
+			return NULL;
+		} else {
+			p = atomic_load_explicit(&log_tail,
+						 memory_order_relaxed);
+		}
+	}
+
+	*pos = p;
+	return slot;
+}
+
+_printf_format_(5, 0)
+static void log_ring_put(int priority, const char *file, int line,
+			 const char *fn, const char *format, va_list args)
+{
+	struct log_slot *slot;
+	size_t pos, len;
+
+	slot = log_ring_claim(&pos);
+	if (slot == NULL)
+		return;
+
+	slot->entry.priority = priority;
+	slot->entry.file = file;
+	slot->entry.line = line;
+	slot->entry.fn = fn;
+	vsnprintf(slot->entry.message, sizeof(slot->entry.message), format,
+		  args);
+
+	len = strlen(slot->entry.message);
+	while (len > 0 && slot->entry.message[len - 1] == '\n')
+		slot->entry.message[--len] = '\0';
+
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
 static const char *prio_to_str(char buf[static PRIO_MAX_SIZE], int prio)
 {
 	const char *prioname;
@@ -73,6 +162,11 @@ static void log_kmod(void *data, int priority, const char *file, int line,
 	const char *prioname;
 	char *str;
 
+	if (atomic_load_explicit(&log_sink, memory_order_acquire)) {
+		log_ring_put(priority, file, line, fn, format, args);
+		return;
+	}
+
 	prioname = prio_to_str(buf, priority);
 
 	if (vasprintf(&str, format, args) < 0)
@@ -123,6 +217,13 @@ void log_printf(int prio, const char *fmt, ...)
 	if (prio > log_priority)
 		return;
 
+	if (atomic_load_explicit(&log_sink, memory_order_acquire)) {
+		va_start(args, fmt);
+		log_ring_put(prio, NULL, 0, NULL, fmt, args);
+		va_end(args);
+		return;
+	}
+
 	va_start(args, fmt);
 	if (vasprintf(&msg, fmt, args) < 0)
 		msg = NULL;
@@ -139,8 +240,10 @@ void log_printf(int prio, const char *fmt, ...)
 			prioname, msg);
 	free(msg);
 
-	if (prio <= LOG_CRIT)
-		exit(EXIT_FAILURE);
+	/*
+	 * kmod tools exit on LOG_CRIT, here it would take the whole python
+	 * process down: the caller gets the error back instead.
+	 */
 }
 
 void log_setup_kmod_log(struct kmod_ctx *ctx, int priority)
@@ -150,3 +253,44 @@ void log_setup_kmod_log(struct kmod_ctx *ctx, int priority)
 	kmod_set_log_priority(ctx, log_priority);
 	kmod_set_log_fn(ctx, log_kmod, NULL);
 }
+
+void kmodule_log_attach(struct kmod_ctx *ctx)
+{
+	kmod_set_log_fn(ctx, log_kmod, NULL);
+}
+
+bool kmodule_log_sink(bool enable)
+{
+	if (enable)
+		pthread_once(&log_ring_once, log_ring_init);
+
+	return atomic_exchange_explicit(&log_sink, enable,
+					memory_order_acq_rel);
+}
+
+int kmodule_log_read(struct kmodule_log_entry *entries, int max,
+		     unsigned long *dropped)
+{
+	int n;
+
+	pthread_once(&log_ring_once, log_ring_init);
+
+	for (n = 0; n < max; n++) {
+		struct log_slot *slot = &log_ring[log_head % LOG_RING_SIZE];
+		size_t seq = atomic_load_explicit(&slot->seq,
+						  memory_order_acquire);
+
+		if (seq != log_head + 1)
+			break;
+
+		entries[n] = slot->entry;
+		atomic_store_explicit(&slot->seq, log_head + LOG_RING_SIZE,
+				      memory_order_release);
+		log_head++;
+	}
+
+	*dropped = atomic_exchange_explicit(&log_dropped, 0,
+					    memory_order_relaxed);
+
+	return n;
+}
@@ -0,0 +1,869 @@
+/*
+ * lsmod.c: python wrapper for python wrapper for kmod/tools/lsmod.c
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// lsmod record type
+///
+///////////////////////////////////////////////////////////////////////
+
+#define LSMOD_NAME    0x01
+#define LSMOD_SIZE    0x02
+#define LSMOD_OPENED  0x04
+#define LSMOD_USEDBY  0x08
+#define LSMOD_STATUS  0x10
+#define LSMOD_OFFSET  0x20
+#define LSMOD_ALL     0x3F
+
+typedef struct {
+  PyObject_HEAD
+  PyObject  *name;
+  PyObject  *size;
+  PyObject  *opened;
+  PyObject  *usedby;
+  PyObject  *status;
+  PyObject  *offset;
+} LsmodObject;
+
+static const struct {
+  const char  *name;
+  int         bit;
+} lsmod_fields [] = {
+  { "name",   LSMOD_NAME   },
+  { "size",   LSMOD_SIZE   },
+  { "opened", LSMOD_OPENED },
+  { "usedby", LSMOD_USEDBY },
+  { "status", LSMOD_STATUS },
+  { "offset", LSMOD_OFFSET },
+  { NULL,     0            }
+};
+
+/***********************************************************************
+ *
+ * Lsmod_dealloc:
+ *
+ ***********************************************************************/
+static void
+Lsmod_dealloc (
+  LsmodObject *Self
+  )
+{
+  Py_XDECREF (Self->name);
+  Py_XDECREF (Self->size);
+  Py_XDECREF (Self->opened);
+  Py_XDECREF (Self->usedby);
+  Py_XDECREF (Self->status);
+  Py_XDECREF (Self->offset);
+
+  Py_TYPE (Self)->tp_free ((PyObject *) Self);
+} // Lsmod_dealloc
+
+/***********************************************************************
+ *
+ * Lsmod_repr:
+ *
+ *   Same layout as the former python _lsmod class. Records built with
+ *   a reduced field set print only the fields they carry.
+ *
+ ***********************************************************************/
+static PyObject *
+Lsmod_repr (
+  LsmodObject *Self
+  )
+{
+  PyObject  *args, *fmt, *ret;
+
+  if (Self->size != NULL && Self->opened != NULL &&
+      Self->status != NULL && Self->offset != NULL) {
+    fmt  = PyUnicode_FromString ("%-24s %8d, %3d, %10s, 0x%016X, %s");
+    args = PyTuple_Pack (6, Self->name, Self->size, Self->opened,
+             Self->status, Self->offset,
+             Self->usedby != NULL ? Self->usedby : Py_None);
+  } else {
+    PyObject  *fields = PyDict_New ();
+
+    if (fields == NULL) return NULL;
+
+#define LSMOD_REPR_FIELD(f) \
+    if (Self->f != NULL && PyDict_SetItemString (fields, #f, Self->f) < 0) { \
+      Py_DECREF (fields); \
+      return NULL; \
+    }
+
+    LSMOD_REPR_FIELD (size);
+    LSMOD_REPR_FIELD (opened);
+    LSMOD_REPR_FIELD (usedby);
+    LSMOD_REPR_FIELD (status);
+    LSMOD_REPR_FIELD (offset);
+
+#undef LSMOD_REPR_FIELD
+
+    fmt  = PyUnicode_FromString ("%-24s %s");
+    args = PyTuple_Pack (2, Self->name, fields);
+    Py_DECREF (fields);
+  }
+
+  if (fmt == NULL || args == NULL) {
+    Py_XDECREF (fmt);
+    Py_XDECREF (args);
+    return NULL;
+  }
+
+  ret = PyUnicode_Format (fmt, args);
+  Py_DECREF (fmt);
+  Py_DECREF (args);
+
+  return ret;
+} // Lsmod_repr
+
+static PyMemberDef Lsmod_members [] = {
+
+  { "name",   T_OBJECT, offsetof (LsmodObject, name),   READONLY, "module name"},
+  { "size",   T_OBJECT, offsetof (LsmodObject, size),   READONLY, "module size"},
+  { "opened", T_OBJECT, offsetof (LsmodObject, opened), READONLY, "module is opened"},
+  { "usedby", T_OBJECT, offsetof (LsmodObject, usedby), READONLY, "modules using this module"},
+  { "status", T_OBJECT, offsetof (LsmodObject, status), READONLY, "module status"},
+  { "offset", T_OBJECT, offsetof (LsmodObject, offset), READONLY, "offset in memory"},
+
+  { NULL, 0, 0, 0, NULL}
+
+}; // Lsmod_members
+
+PyTypeObject LsmodType = {
+
+  PyVarObject_HEAD_INIT (NULL, 0)
+
+  .tp_name      = "_kmodule._lsmod",
+  .tp_doc       = "one line of /proc/modules",
+  .tp_basicsize = sizeof (LsmodObject),
+  .tp_itemsize  = 0,
+  .tp_flags     = Py_TPFLAGS_DEFAULT,
+  .tp_dealloc   = (destructor) Lsmod_dealloc,
+  .tp_repr      = (reprfunc) Lsmod_repr,
+  .tp_str       = (reprfunc) Lsmod_repr,
+  .tp_members   = Lsmod_members,
+
+}; // LsmodType
+
+///////////////////////////////////////////////////////////////////////
+///
+/// static function for lsmod
+///
+///////////////////////////////////////////////////////////////////////
+
+//
+// /proc/modules is read into one buffer per thread, kept between calls.
+//
+struct lsmod_buffer {
+  char    *data;
+  size_t  size;
+};
+
+static pthread_key_t  lsmod_key;
+static pthread_once_t lsmod_once = PTHREAD_ONCE_INIT;
+
+/***********************************************************************
+ *
+ * lsmod_buffer_free:
+ *
+ ***********************************************************************/
+static void
+lsmod_buffer_free (
+  void  *data
+  )
+{
+  struct lsmod_buffer *buf = data;
+
+  free (buf->data);
+  free (buf);
+} // lsmod_buffer_free
+
+/***********************************************************************
+ *
+ * lsmod_key_create:
+ *
+ ***********************************************************************/
+static void
+lsmod_key_create (
+  void
+  )
+{
+  pthread_key_create (&lsmod_key, lsmod_buffer_free);
+} // lsmod_key_create
+
+/***********************************************************************
+ *
+ * lsmod_read:
+ *
+ *   Read the whole of Path into the thread's buffer. Returns the length
+ *   read or a negative errno. Called without the GIL.
+ *
+ ***********************************************************************/
+static ssize_t
+lsmod_read (
+  const char  *path,
+  char        **data
+  )
+{
+  struct lsmod_buffer *buf;
+  ssize_t len = 0, r;
+  int     fd;
+
+  pthread_once (&lsmod_once, lsmod_key_create);
+
+  buf = pthread_getspecific (lsmod_key);
+  if (buf == NULL) {
+    buf = calloc (1, sizeof (*buf));
+    if (buf == NULL)
+      return -ENOMEM;
+    pthread_setspecific (lsmod_key, buf);
+  }
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  for (;;) {
+    if (buf->size - len < 4096) {
+      size_t  size = buf->size ? buf->size * 2 : 65536;
+      char    *tmp = realloc (buf->data, size);
+
+      if (tmp == NULL) {
+        close (fd);
+        return -ENOMEM;
+      }
+      buf->data = tmp;
+      buf->size = size;
+    }
+
+    r = read (fd, buf->data + len, buf->size - len - 1);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      r = -errno;
+      close (fd);
+      return r;
+    }
+    if (r == 0)
+      break;
+    len += r;
+  }
+
+  close (fd);
+
+  buf->data[len] = '\0';
+  *data = buf->data;
+
+  return len;
+} // lsmod_read
+
+/***********************************************************************
+ *
+ * lsmod_token:
+ *
+ *   Split the next blank separated token of a line in place.
+ *
+ ***********************************************************************/
+static char *
+lsmod_token (
+  char    **cursor,
+  size_t  *len
+  )
+{
+  char  *p = *cursor, *start;
+
+  while (*p == ' ' || *p == '\t')
+    p++;
+
+  start = p;
+  while (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\0')
+    p++;
+
+  *len = p - start;
+  *cursor = p;
+
+  return *len ? start : NULL;
+} // lsmod_token
+
+/***********************************************************************
+ *
+ * lsmod_usedby:
+ *
+ *   "a,b," -> ['a', 'b'], "-" -> None
+ *
+ ***********************************************************************/
+static PyObject *
+lsmod_usedby (
+  const char  *usedby,
+  size_t      len
+  )
+{
+  PyObject    *list, *item;
+  const char  *p = usedby, *end = usedby + len, *comma;
+
+  if (len == 1 && usedby[0] == '-') {
+    Py_INCREF (Py_None);
+    return Py_None;
+  }
+
+  list = PyList_New (0);
+  if (list == NULL) return NULL;
+
+  while (p < end) {
+    comma = memchr (p, ',', end - p);
+    if (comma == NULL)
+      break;
+
+    item = PyUnicode_FromStringAndSize (p, comma - p);
+    if (item == NULL || PyList_Append (list, item) < 0) {
+      Py_XDECREF (item);
+      Py_DECREF (list);
+      return NULL;
+    }
+    Py_DECREF (item);
+
+    p = comma + 1;
+  }
+
+  return list;
+} // lsmod_usedby
+
+/***********************************************************************
+ *
+ * lsmod_build:
+ *
+ *   Build one record from a /proc/modules line:
+ *     name size refcnt usedby status offset [taint]
+ *
+ ***********************************************************************/
+static LsmodObject *
+lsmod_build (
+  char    **cursor,
+  int     fields
+  )
+{
+  LsmodObject *m;
+  char        *tok[6];
+  size_t      len[6];
+  int         i;
+
+  for (i = 0; i < 6; i++) {
+    tok[i] = lsmod_token (cursor, &len[i]);
+    if (tok[i] == NULL) {
+      PyErr_Format (PyExc_ValueError, "Invalid /proc/modules line.");
+      return NULL;
+    }
+  }
+
+  m = PyObject_New (LsmodObject, &LsmodType);
+  if (m == NULL) return NULL;
+
+  m->name = PyUnicode_FromStringAndSize (tok[0], len[0]);
+  m->size = m->opened = m->usedby = m->status = m->offset = NULL;
+  if (m->name == NULL) goto fail;
+
+  if (fields & LSMOD_SIZE) {
+    m->size = PyLong_FromUnsignedLong (strtoul (tok[1], NULL, 10));
+    if (m->size == NULL) goto fail;
+  }
+  if (fields & LSMOD_OPENED) {
+    m->opened = PyLong_FromLong (strtol (tok[2], NULL, 10));
+    if (m->opened == NULL) goto fail;
+  }
+  if (fields & LSMOD_USEDBY) {
+    m->usedby = lsmod_usedby (tok[3], len[3]);
+    if (m->usedby == NULL) goto fail;
+  }
+  if (fields & LSMOD_STATUS) {
+    m->status = PyUnicode_FromStringAndSize (tok[4], len[4]);
+    if (m->status == NULL) goto fail;
+  }
+  if (fields & LSMOD_OFFSET) {
+    m->offset = PyLong_FromUnsignedLongLong (strtoull (tok[5], NULL, 16));
+    if (m->offset == NULL) goto fail;
+  }
+
+  return m;
+
+fail:
+  Py_DECREF (m);
+  return NULL;
+} // lsmod_build
+
+/***********************************************************************
+ *
+ * lsmod_fields_mask:
+ *
+ ***********************************************************************/
+static int
+lsmod_fields_mask (
+  PyObject  *fields
+  )
+{
+  PyObject    *iter, *item;
+  const char  *name;
+  int         mask = LSMOD_NAME, i;
+
+  if (fields == NULL || fields == Py_None)
+    return LSMOD_ALL;
+
+  iter = PyObject_GetIter (fields);
+  if (iter == NULL) return -1;
+
+  while ((item = PyIter_Next (iter)) != NULL) {
+    name = PyUnicode_AsUTF8 (item);
+    if (name == NULL) {
+      Py_DECREF (item);
+      Py_DECREF (iter);
+      return -1;
+    }
+
+    for (i = 0; lsmod_fields[i].name != NULL; i++) {
+      if (streq (name, lsmod_fields[i].name))
+        break;
+    }
+
+    if (lsmod_fields[i].name == NULL) {
+      PyErr_Format (PyExc_ValueError, "Unknown lsmod field %s.", name);
+      Py_DECREF (item);
+      Py_DECREF (iter);
+      return -1;
+    }
+
+    mask |= lsmod_fields[i].bit;
+    Py_DECREF (item);
+  }
+
+  Py_DECREF (iter);
+
+  if (PyErr_Occurred ())
+    return -1;
+
+  return mask;
+} // lsmod_fields_mask
+
+//
+// One module read from its /sys/module directory, for watchers that
+// follow single modules coming and going.
+//
+struct lsmod_sysfs {
+  bool                found;
+  char                state[16];
+  unsigned long       size;
+  long                refcnt;
+  unsigned long long  offset;
+  char                *usedby;      // "a,b," as in /proc/modules, or "-"
+};
+
+/***********************************************************************
+ *
+ * lsmod_sysfs_file:
+ *
+ *   First line of File in the directory Dirfd, into Buf.
+ *
+ ***********************************************************************/
+static bool
+lsmod_sysfs_file (
+  int         dirfd,
+  const char  *file,
+  char        *buf,
+  size_t      size
+  )
+{
+  ssize_t n;
+  int     fd;
+
+  fd = openat (dirfd, file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  n = read (fd, buf, size - 1);
+  close (fd);
+  if (n < 0)
+    return false;
+
+  buf[n] = '\0';
+  buf[strcspn (buf, "\n")] = '\0';
+
+  return true;
+} // lsmod_sysfs_file
+
+/***********************************************************************
+ *
+ * lsmod_sysfs_read:
+ *
+ *   Fill M from Sysfs/Name. A module not loaded, or builtin, is left
+ *   not found. Called without the GIL.
+ *
+ ***********************************************************************/
+static void
+lsmod_sysfs_read (
+  const char          *sysfs,
+  const char          *name,
+  struct lsmod_sysfs  *m
+  )
+{
+  char          path[PATH_MAX], buf[64];
+  struct dirent *de;
+  DIR           *dir;
+  size_t        len = 0;
+  int           fd, hfd;
+
+  memset (m, 0, sizeof (*m));
+
+  snprintf (path, sizeof (path), "%s/%s", sysfs, name);
+  fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  if (!lsmod_sysfs_file (fd, "initstate", m->state, sizeof (m->state))) {
+    close (fd);
+    return;
+  }
+  m->found = true;
+
+  if (lsmod_sysfs_file (fd, "coresize", buf, sizeof (buf)))
+    m->size = strtoul (buf, NULL, 10);
+  if (lsmod_sysfs_file (fd, "refcnt", buf, sizeof (buf)))
+    m->refcnt = strtol (buf, NULL, 10);
+  if (lsmod_sysfs_file (fd, "sections/.text", buf, sizeof (buf)))
+    m->offset = strtoull (buf, NULL, 16);
+
+  hfd = openat (fd, "holders", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  dir = hfd >= 0 ? fdopendir (hfd) : NULL;
+  if (dir == NULL && hfd >= 0)
+    close (hfd);
+
+  while (dir != NULL && (de = readdir (dir)) != NULL) {
+    size_t  n = strlen (de->d_name);
+    char    *tmp;
+
+    if (de->d_name[0] == '.')
+      continue;
+
+    tmp = realloc (m->usedby, len + n + 2);
+    if (tmp == NULL)
+      break;
+    m->usedby = tmp;
+    memcpy (m->usedby + len, de->d_name, n);
+    len += n;
+    m->usedby[len++] = ',';
+    m->usedby[len] = '\0';
+  }
+  if (dir != NULL)
+    closedir (dir);
+
+  close (fd);
+} // lsmod_sysfs_read
+
+/***********************************************************************
+ *
+ * lsmod_sysfs_build:
+ *
+ *   Record of a module read by lsmod_sysfs_read(), with the field
+ *   values /proc/modules would show. Only the name is set when the
+ *   module was not found.
+ *
+ ***********************************************************************/
+static LsmodObject *
+lsmod_sysfs_build (
+  const char          *name,
+  struct lsmod_sysfs  *s,
+  int                 fields
+  )
+{
+  LsmodObject *m;
+  const char  *status = s->state;
+
+  m = PyObject_New (LsmodObject, &LsmodType);
+  if (m == NULL) return NULL;
+
+  m->name = PyUnicode_FromString (name);
+  m->size = m->opened = m->usedby = m->status = m->offset = NULL;
+  if (m->name == NULL) goto fail;
+
+  if (!s->found)
+    return m;
+
+  if (streq (status, "live"))
+    status = "Live";
+  else if (streq (status, "coming"))
+    status = "Loading";
+  else if (streq (status, "going"))
+    status = "Unloading";
+
+  if (fields & LSMOD_SIZE) {
+    m->size = PyLong_FromUnsignedLong (s->size);
+    if (m->size == NULL) goto fail;
+  }
+  if (fields & LSMOD_OPENED) {
+    m->opened = PyLong_FromLong (s->refcnt);
+    if (m->opened == NULL) goto fail;
+  }
+  if (fields & LSMOD_USEDBY) {
+    m->usedby = s->usedby != NULL ? lsmod_usedby (s->usedby, strlen (s->usedby)) : lsmod_usedby ("-", 1);
+    if (m->usedby == NULL) goto fail;
+  }
+  if (fields & LSMOD_STATUS) {
+    m->status = PyUnicode_FromString (status);
+    if (m->status == NULL) goto fail;
+  }
+  if (fields & LSMOD_OFFSET) {
+    m->offset = PyLong_FromUnsignedLongLong (s->offset);
+    if (m->offset == NULL) goto fail;
+  }
+
+  return m;
+
+fail:
+  Py_DECREF (m);
+  return NULL;
+} // lsmod_sysfs_build
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule internal function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_proc_modules:
+ *
+ *   Snapshot of Path, /proc/modules, in one read. Mods points in the
+ *   thread's read buffer, valid until the thread reads again; free()
+ *   the array only. Returns the count or a negative errno. Called
+ *   without the GIL.
+ *
+ ***********************************************************************/
+int
+kmodule_proc_modules (
+  const char                  *path,
+  struct kmodule_proc_module  **mods
+  )
+{
+  struct kmodule_proc_module  *m = NULL;
+  char      *data, *cursor, *eol;
+  ssize_t   len;
+  int       count = 0, alloc = 0;
+
+  len = lsmod_read (path, &data);
+  if (len < 0)
+    return (int) len;
+
+  for (cursor = data; *cursor != '\0'; cursor = eol + 1) {
+    char    *tok[5];
+    size_t  toklen[5];
+    int     i;
+
+    eol = strchr (cursor, '\n');
+    if (eol == NULL)
+      eol = data + len;
+    else
+      *eol = '\0';
+
+    for (i = 0; i < 5; i++) {
+      tok[i] = lsmod_token (&cursor, &toklen[i]);
+      if (tok[i] == NULL)
+        break;
+    }
+
+    if (i == 5) {
+      if (count == alloc) {
+        void *tmp;
+
+        alloc = alloc ? alloc * 2 : 256;
+        tmp = realloc (m, alloc * sizeof (*m));
+        if (tmp == NULL) {
+          free (m);
+          return -ENOMEM;
+        }
+        m = tmp;
+      }
+
+      for (i = 0; i < 5; i++)
+        tok[i][toklen[i]] = '\0';
+
+      m[count].name   = tok[0];
+      m[count].refcnt = strtol (tok[2], NULL, 10);
+      m[count].usedby = tok[3];
+      m[count].state  = tok[4];
+      count++;
+    }
+
+    if (eol == data + len)
+      break;
+  }
+
+  *mods = m;
+
+  return count;
+} // kmodule_proc_modules
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule public function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_lsmod:
+ *
+ *   _lsmod_read (fields=None, path="/proc/modules")
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_lsmod (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  PyObject    *fields = NULL;
+  const char  *path = "/proc/modules";
+  PyObject    *ret;
+  LsmodObject *m;
+  char        *data = NULL, *cursor, *eol;
+  ssize_t     len;
+  int         mask;
+
+  static char   *kwlist[] = {"fields", "path", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "|Os",
+      kwlist,
+      &fields,
+      &path)) {
+    return NULL;
+  }
+
+  mask = lsmod_fields_mask (fields);
+  if (mask < 0)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  len = lsmod_read (path, &data);
+  Py_END_ALLOW_THREADS
+
+  if (len < 0) {
+    errno = (int) -len;
+    return PyErr_SetFromErrnoWithFilename (PyExc_OSError, path);
+  }
+
+  ret = PyDict_New ();
+  if (ret == NULL) return NULL;
+
+  for (cursor = data; *cursor != '\0'; cursor = eol + 1) {
+    eol = strchr (cursor, '\n');
+    if (eol == NULL)
+      eol = data + len;
+    else
+      *eol = '\0';
+
+    if (cursor == eol)
+      continue;
+
+    m = lsmod_build (&cursor, mask);
+    if (m == NULL || PyDict_SetItem (ret, m->name, (PyObject *) m) < 0) {
+      Py_XDECREF (m);
+      Py_DECREF (ret);
+      return NULL;
+    }
+    Py_DECREF (m);
+
+    if (eol == data + len)
+      break;
+  }
+
+  return ret;
+
+} // kmodule_lsmod
+
+/***********************************************************************
+ *
+ * kmodule_lsmod_sysfs:
+ *
+ *   _lsmod_sysfs (name, fields=None, sysfs="/sys/module")
+ *
+ *   One lsmod record read from /sys/module/name instead of the whole of
+ *   /proc/modules. Only name is set for a module that is not loaded.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_lsmod_sysfs (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  char        *name;
+  PyObject    *fields = NULL;
+  const char  *sysfs = "/sys/module";
+  LsmodObject *m;
+  int         mask;
+
+  struct lsmod_sysfs  s;
+
+  static char   *kwlist[] = {"name", "fields", "sysfs", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "s|Os",
+      kwlist,
+      &name,
+      &fields,
+      &sysfs)) {
+    return NULL;
+  }
+
+  if (strchr (name, '/') != NULL || streq (name, ".") || streq (name, "..")) {
+    PyErr_Format (PyExc_ValueError, "Invalid module name %s.", name);
+    return NULL;
+  }
+
+  mask = lsmod_fields_mask (fields);
+  if (mask < 0)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  lsmod_sysfs_read (sysfs, name, &s);
+  Py_END_ALLOW_THREADS
+
+  m = lsmod_sysfs_build (name, &s, mask);
+  free (s.usedby);
+
+  return (PyObject *) m;
+
+} // kmodule_lsmod_sysfs
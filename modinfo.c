@@ -25,6 +25,8 @@
 #include <shared/util.h>
 #include <tools/kmod.h>
 
+#include "kmodule.h"
+
 ///////////////////////////////////////////////////////////////////////
 ///
 /// static function for modinfo
@@ -50,396 +52,197 @@ is_module_filename (
   return false;
 } // is_module_filename
 
-static char separator = '\n';
-
-struct param {
-  struct param *next;
-  const char *name;
-  const char *param;
-  const char *type;
-  int namelen;
-  int paramlen;
-  int typelen;
-};
-
 /***********************************************************************
  *
- * add_param:
+ * modinfo_do:
  *
  ***********************************************************************/
-static struct param *add_param (
-  const char    *name,
-  int           namelen,
-  const char    *param,
-  int           paramlen,
-  const char    *type,
-  int           typelen,
-  struct param  **list
+static PyObject *modinfo_do (
+  struct kmodule_modinfo_entry *entry
   )
 {
-  struct param *it;
-
-  for (it = *list; it != NULL; it = it->next) {
-    if (it->namelen == namelen &&
-      memcmp(it->name, name, namelen) == 0)
-      break;
-  }
-
-  if (it == NULL) {
-    it = malloc(sizeof(struct param));
-    if (it == NULL)
-      return NULL;
-    it->next = *list;
-    *list = it;
-    it->name = name;
-    it->namelen = namelen;
-    it->param = NULL;
-    it->type = NULL;
-    it->paramlen = 0;
-    it->typelen = 0;
-  }
+  PyObject *ModInfo_info;
 
-  if (param != NULL) {
-    it->param = param;
-    it->paramlen = paramlen;
+  if (entry->err < 0) {
+    PyErr_Format (PyExc_MemoryError, "could not get modinfo from '%s': %s\n",
+      entry->name ? entry->name : "?", strerror(-entry->err));
+    return NULL;
   }
 
-  if (type != NULL) {
-    it->type = type;
-    it->typelen = typelen;
-  }
+  ModInfo_info = kmodule_modinfo_new (entry->blob, NULL);
+  if (ModInfo_info != NULL)
+    entry->blob = NULL;
 
-  return it;
-} // add_param
+  return ModInfo_info;
+} // modinfo_do
 
 /***********************************************************************
  *
- * process_parm:
+ * modinfo_read:
+ *
+ *   Read the .modinfo of Mod into Entry, keeping the module name only
+ *   for the error message.
  *
  ***********************************************************************/
-static int
-process_parm (
-  const char    *key,
-  const char    *value,
-  struct param  **params
-  )
-{
-  const char *name, *param, *type;
-  int namelen, paramlen, typelen;
-  struct param *it;
-  const char *colon = strchr(value, ':');
-  if (colon == NULL) {
-    fprintf (stderr, "Found invalid \"%s=%s\": missing ':'\n",
-        key, value);
-    return 0;
-  }
-
-  name = value;
-  namelen = colon - value;
-  if (streq(key, "parm")) {
-    param = colon + 1;
-    paramlen = strlen(param);
-    type = NULL;
-    typelen = 0;
-  } else {
-    param = NULL;
-    paramlen = 0;
-    type = colon + 1;
-    typelen = strlen(type);
-  }
-
-  it = add_param(name, namelen, param, paramlen, type, typelen, params);
-  if (it == NULL) {
-    PyErr_Format (PyExc_MemoryError, "Out of memory!\n");
-    return -ENOMEM;
-  }
-
-  return 0;
-} // process_parm
-
-/***********************************************************************
- * kmodule_modinf_build_info:
- ***********************************************************************/
-static int
-kmodule_modinf_build_info (
-  PyObject    *dict,
-  const char  *name,
-  const char  *val
+static void
+modinfo_read (
+  struct kmod_module            *mod,
+  struct kmodule_cache          *cache,
+  struct kmodule_modinfo_entry  *entry
   )
 {
-  int       ret;
-  PyObject *TempStr;
-
-  TempStr = PyUnicode_FromString (val);
-  if (TempStr == NULL) return (-1);
-
-  ret = PyDict_SetItemString (dict, name, TempStr);
-  Py_DECREF (TempStr);
+  entry->err = kmodule_modinfo_read(mod, cache, &entry->blob);
+  if (entry->err < 0)
+    entry->name = strdup(kmod_module_get_name(mod));
+} // modinfo_read
 
-  return ret;
-} // kmodule_modinf_build_info
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule internal function
+///
+///////////////////////////////////////////////////////////////////////
 
 /***********************************************************************
  *
- * modinfo_do:
+ * kmodule_modinfo_collect:
+ *
+ *   Resolve Name as a module file or an alias and read the .modinfo of
+ *   every match, through Cache when there is one. Called without the
+ *   GIL, with Ctx held by the calling thread. The result keeps no
+ *   reference on Ctx, it is built and released from any thread.
  *
  ***********************************************************************/
-static PyObject *modinfo_do (
-  struct kmod_module *mod
+void
+kmodule_modinfo_collect (
+  struct kmod_ctx               *ctx,
+  struct kmodule_cache          *cache,
+  const char                    *name,
+  struct kmodule_modinfo_result *result
   )
 {
   struct kmod_list *l, *list = NULL;
-  struct param *params = NULL;
-  int err, is_builtin;
-  const char *filename = kmod_module_get_path(mod);
-
-  is_builtin = (filename == NULL);
-
-  PyObject *ModInfo_info  = NULL;
-  PyObject *ModInfo_param = NULL;
-  int       alias_count   = 0;
-  PyObject *ModInfo_alias = NULL;
-  PyObject *ModInfo_string = NULL;
+  struct kmod_module *mod;
+  int count;
 
-  if (is_builtin) {
-    // printf("%-16s%s%c", "name:", kmod_module_get_name(mod), separator);
-    filename = "(builtin)";
+  memset (result, 0, sizeof (*result));
 
-    ModInfo_info = Py_BuildValue ("{s:s}", "name", "(builtin)");
-    if (ModInfo_info == NULL) return ModInfo_info;
-  }
+  KMODULE_STATS_START (start);
 
-  if (ModInfo_info == NULL) {
-    ModInfo_info = Py_BuildValue ("{s:s}", "filename", filename);
-    if (ModInfo_info == NULL) return NULL;
+  result->is_path = is_module_filename(name);
+  if (result->is_path) {
+    result->err = kmod_module_new_from_path(ctx, name, &mod);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+    if (result->err < 0)
+      return;
+    count = 1;
   } else {
-    err = kmodule_modinf_build_info (ModInfo_info, "filename", filename);
-    if (err < 0) goto end;
-  }
-
-  err = kmod_module_get_info(mod, &list);
-  if (err < 0) {
-    if (is_builtin && err == -ENOENT) {
-      /*
-       * This is an old kernel that does not have a file
-       * with information about built-in modules.
-       */
-    }
-    PyErr_Format (PyExc_MemoryError, "could not get modinfo from '%s': %s\n",
-      kmod_module_get_name(mod), strerror(-err));
-    goto end;
-  }
-
-  kmod_list_foreach(l, list) {
-
-    const char *key = kmod_module_info_get_key(l);
-    const char *value = kmod_module_info_get_value(l);
-
-    if (streq(key, "alias")) {
-      // printf("%s=%s%c", key, value, separator);
-      alias_count++;
-      continue;
-    }
-
-    if (streq(key, "parm") || streq(key, "parmtype")) {
-      err = process_parm(key, value, &params);
-      if (err < 0)
-        goto end;
-      continue;
-    }
-
-    if (separator == '\0') {
-      // printf("%s=%s%c", key, value, separator);
-      err = kmodule_modinf_build_info (ModInfo_info, key, value);
-      if (err < 0) goto end;
-      continue;
-    }
-
-    // keylen = strlen(key);
-    err = kmodule_modinf_build_info (ModInfo_info, key, value);
-    if (err < 0) goto end;
-    // printf("%s:%-*s%s%c", key, 15 - keylen, "", value, separator);
-  }
-
-  if (alias_count != 0) {
-
-    ModInfo_alias = PyTuple_New (alias_count);
-    if (ModInfo_alias == NULL) {
-      err = -1;
-      goto end;
-    }
-
-    alias_count = 0;
+    result->err = kmod_module_new_from_lookup(ctx, name, &list);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+    if (result->err < 0 || list == NULL)
+      return;
+    count = 0;
     kmod_list_foreach(l, list) {
-      const char *key = kmod_module_info_get_key(l);
-      const char *value = kmod_module_info_get_value(l);
-
-      if (streq(key, "alias")) {
-        // printf("%s=%s%c", key, value, separator);
-        ModInfo_string = PyUnicode_FromString (value);
-        PyTuple_SET_ITEM (ModInfo_alias, alias_count, ModInfo_string);
-        alias_count++;
-      }
+      count++;
     }
   }
 
-  if (params != NULL) {
-
-    ModInfo_param = PyDict_New ();
+  result->entries = calloc (count, sizeof (struct kmodule_modinfo_entry));
+  if (result->entries != NULL) {
+    if (result->is_path) {
+      modinfo_read (mod, cache, &result->entries[0]);
+    } else {
+      kmod_list_foreach(l, list) {
+        struct kmod_module *m = kmod_module_get_module(l);
 
-    if (ModInfo_param == NULL) {
-      goto end;
-    }
-  }
-
-  while (params != NULL) {
-    char parm_name[512];
-    char parm_value[2048];
-    struct param *p = params;
-    p = params;
-    params = p->next;
-
-    sprintf (parm_name, "%.*s", p->namelen, p->name);
-    if (p->param == NULL) {
-      // printf("%-16s%.*s:%.*s%c", "parm:",
-      //     p->namelen, p->name, p->typelen, p->type,
-      //     separator);
-
-      sprintf (parm_value, "%.*s", p->typelen, p->type);
-      kmodule_modinf_build_info (ModInfo_param, parm_name, parm_value);
-    }
-    else if (p->type != NULL) {
-      // printf("%-16s%.*s:%.*s (%.*s)%c", "parm:",
-      //        p->namelen, p->name,
-      //        p->paramlen, p->param,
-      //        p->typelen, p->type,
-      //        separator);
-      sprintf (parm_value, "%.*s (%.*s)", p->paramlen, p->param, p->typelen, p->type);
-      kmodule_modinf_build_info (ModInfo_param, parm_name, parm_value);
-    }
-    else {
-      // printf("%-16s%.*s:%.*s%c",
-      //        "parm:",
-      //        p->namelen, p->name,
-      //        p->paramlen, p->param,
-       //       separator);
-      sprintf (parm_value, "%.*s", p->paramlen, p->param);
-      kmodule_modinf_build_info (ModInfo_param, parm_name, parm_value);
+        modinfo_read (m, cache, &result->entries[result->count++]);
+        kmod_module_unref(m);
+      }
     }
-
-    free(p);
-  }
-
-end:
-  while (params != NULL) {
-    void *tmp = params;
-    params = params->next;
-    free(tmp);
-  }
-  kmod_module_info_free_list(list);
-
-  if (err < 0) {
-    Py_DECREF (ModInfo_info);
-    ModInfo_info = NULL;
-
-    if (ModInfo_param != NULL)
-      Py_DECREF (ModInfo_param);
-    if (ModInfo_alias != NULL)
-      Py_DECREF (ModInfo_alias);
-
+    result->count = count;
   } else {
-    if (ModInfo_param != NULL) {
-      PyDict_SetItemString (ModInfo_info, "parm", ModInfo_param);
-      Py_DECREF (ModInfo_param);
-    }
-    if (ModInfo_alias != NULL) {
-      PyDict_SetItemString (ModInfo_info, "alias", ModInfo_alias);
-      Py_DECREF (ModInfo_alias);
-    }
+    result->err = -ENOMEM;
   }
 
-  return ModInfo_info;
-} // modinfo_do
+  if (result->is_path)
+    kmod_module_unref(mod);
+  else
+    kmod_module_unref_list(list);
+} // kmodule_modinfo_collect
 
 /***********************************************************************
  *
- * modinfo_path_do:
+ * kmodule_modinfo_release:
+ *
+ *   Free what kmodule_modinfo_build() did not take over.
  *
  ***********************************************************************/
-static PyObject *
-modinfo_path_do (
-  struct kmod_ctx *ctx,
-  const char      *path
+void
+kmodule_modinfo_release (
+  struct kmodule_modinfo_result *result
   )
 {
-  PyObject *ret, *m;
-  struct kmod_module *mod;
-  int err = kmod_module_new_from_path(ctx, path, &mod);
-  if (err < 0) {
-    PyErr_Format (PyExc_MemoryError, "Module file %s not found.\n", path);
-    return NULL;
-  }
-  ret = PyList_New (1);
-  if (!ret) goto end;
+  int i;
 
-  m = modinfo_do(mod);
-
-  PyList_SET_ITEM (ret, 0, m);
-end:
-  kmod_module_unref(mod);
-  return ret;
-} // modinfo_path_do
+  for (i = 0; i < result->count; i++) {
+    free(result->entries[i].blob);
+    free(result->entries[i].name);
+  }
+  free (result->entries);
+  result->entries = NULL;
+  result->count   = 0;
+} // kmodule_modinfo_release
 
 /***********************************************************************
  *
- * modinfo_alias_do:
+ * kmodule_modinfo_build:
+ *
+ *   List of modinfo mapping of a collected Result, with the GIL.
  *
  ***********************************************************************/
-static PyObject * modinfo_alias_do (
-  struct kmod_ctx *ctx,
-  const char      *alias
+PyObject *
+kmodule_modinfo_build (
+  struct kmodule_modinfo_result *result,
+  const char                    *name
   )
 {
   PyObject  *ret;
-  int        count;
-  struct kmod_list *l, *list = NULL;
+  int        i;
 
-  int err = kmod_module_new_from_lookup(ctx, alias, &list);
-  if (err < 0) {
-    PyErr_Format (PyExc_MemoryError, "Module alias %s not found.\n", alias);
+  if (result->err == -ENOMEM) {
+    PyErr_NoMemory ();
     return NULL;
   }
 
-  if (list == NULL) {
-    PyErr_Format (PyExc_MemoryError, "Module %s not found.\n", alias);
+  if (result->err < 0) {
+    if (result->is_path)
+      PyErr_Format (PyExc_MemoryError, "Module file %s not found.\n", name);
+    else
+      PyErr_Format (PyExc_MemoryError, "Module alias %s not found.\n", name);
     return NULL;
   }
 
-  count = 0;
-  kmod_list_foreach(l, list) {
-    count++;
+  if (result->count == 0) {
+    PyErr_Format (PyExc_MemoryError, "Module %s not found.\n", name);
+    return NULL;
   }
 
-  ret = PyList_New (count);
-  if (!ret) goto end;
+  ret = PyList_New (result->count);
+  if (!ret) return NULL;
 
-  count = 0;
-  kmod_list_foreach(l, list) {
+  for (i = 0; i < result->count; i++) {
     PyObject *m;
-    struct kmod_module *mod = kmod_module_get_module(l);
 
-    m = modinfo_do(mod);
-
-    PyList_SET_ITEM (ret, count, m);
-    count++;
+    m = modinfo_do(&result->entries[i]);
+    if (m == NULL) {
+      Py_DECREF (ret);
+      return NULL;
+    }
 
-    kmod_module_unref(mod);
+    PyList_SET_ITEM (ret, i, m);
   }
-end:
-  kmod_module_unref_list(list);
 
   return ret;
-} // modinfo_alias_do
+} // kmodule_modinfo_build
 
 ///////////////////////////////////////////////////////////////////////
 ///
@@ -450,6 +253,8 @@ end:
  *
  * kmodule_modinfo:
  *
+ *   Context._modinfo (module)
+ *
  ***********************************************************************/
 PyObject *
 kmodule_modinfo (
@@ -458,58 +263,137 @@ kmodule_modinfo (
   PyObject    *KwArgs
   )
 {
-  char  *root, *kversion;
   char  *module;
 
   struct kmod_ctx *ctx;
-  char dirname_buf[PATH_MAX];
-  const char *dirname = NULL;
-  const char *null_config = NULL;
+  struct kmodule_modinfo_result result;
 
   PyObject   *ret;
 
-  static char   *kwlist[] = {"module", "basedir", "kversion", NULL};
+  static char   *kwlist[] = {"module", NULL};
 
   if (!PyArg_ParseTupleAndKeywords (
       Args,
       KwArgs,
-      "s|zz",
+      "s",
       kwlist,
-      &module,
-      &root,
-      &kversion)) {
+      &module)) {
     return NULL;
   }
 
-  if (root != NULL || kversion != NULL) {
-    struct utsname u;
-    if (root == NULL)
-      root = "";
-    if (kversion == NULL) {
-      if (uname(&u) < 0) {
-        PyErr_Format (PyExc_MemoryError, "uname() failed: %m\n");
-        return NULL;
-      }
-      kversion = u.release;
-    }
-    snprintf(dirname_buf, sizeof(dirname_buf), "%s/lib/modules/%s",
-       root, kversion);
-    dirname = dirname_buf;
+  ctx = kmodule_context_get (Self);
+  if (ctx == NULL)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+  ctx = ((KmodContextObject *) Self)->ctx;
+  kmodule_modinfo_collect (ctx, ((KmodContextObject *) Self)->cache, module, &result);
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  ret = kmodule_modinfo_build (&result, module);
+  kmodule_modinfo_release (&result);
+
+  return ret;
+
+} // kmodule_modinfo
+
+/***********************************************************************
+ *
+ * kmodule_modinfo_batch:
+ *
+ *   Context._modinfo_batch (modules)
+ *
+ *   Resolve every name of the sequence in one pass over the Context.
+ *   The result list holds, in order, a list of modinfo dict for each
+ *   name, or the exception raised for that name.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_modinfo_batch (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  PyObject    *modules, *ret = NULL;
+  const char  **names;
+  Py_ssize_t  i, count;
+
+  struct kmod_ctx *ctx;
+  struct kmodule_modinfo_result *results;
+
+  static char   *kwlist[] = {"modules", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "O",
+      kwlist,
+      &modules)) {
+    return NULL;
   }
 
-  ctx = kmod_new(dirname, &null_config);
-  if (!ctx) {
-    PyErr_Format (PyExc_MemoryError, "kmod_new() failed!\n");
+  ctx = kmodule_context_get (Self);
+  if (ctx == NULL)
     return NULL;
+
+  modules = PySequence_Fast (modules, "modules must be a sequence.");
+  if (modules == NULL)
+    return NULL;
+
+  count   = PySequence_Fast_GET_SIZE (modules);
+  names   = PyMem_Calloc (count + 1, sizeof (char *));
+  results = PyMem_Calloc (count + 1, sizeof (struct kmodule_modinfo_result));
+  if (names == NULL || results == NULL) {
+    PyErr_NoMemory ();
+    goto end;
   }
 
-  if (is_module_filename(module))
-    ret = modinfo_path_do(ctx, module);
-  else
-    ret = modinfo_alias_do(ctx, module);
+  for (i = 0; i < count; i++) {
+    names[i] = PyUnicode_AsUTF8 (PySequence_Fast_GET_ITEM (modules, i));
+    if (names[i] == NULL)
+      goto end;
+  }
 
-  kmod_unref(ctx);
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+  ctx = ((KmodContextObject *) Self)->ctx;
+  for (i = 0; i < count; i++)
+    kmodule_modinfo_collect (ctx, ((KmodContextObject *) Self)->cache, names[i], &results[i]);
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  ret = PyList_New (count);
+  if (ret != NULL) {
+    for (i = 0; i < count; i++) {
+      PyObject *item = kmodule_modinfo_build (&results[i], names[i]);
+
+      if (item == NULL) {
+        PyObject *type, *value, *tb;
+
+        PyErr_Fetch (&type, &value, &tb);
+        PyErr_NormalizeException (&type, &value, &tb);
+        if (tb != NULL)
+          PyException_SetTraceback (value, tb);
+        Py_XDECREF (type);
+        Py_XDECREF (tb);
+        item = value;
+      }
+
+      PyList_SET_ITEM (ret, i, item);
+    }
+  }
+
+  for (i = 0; i < count; i++)
+    kmodule_modinfo_release (&results[i]);
+
+end:
+  PyMem_Free (names);
+  PyMem_Free (results);
+  Py_DECREF (modules);
 
   return ret;
 
-} // kmodule_modinfo
+} // kmodule_modinfo_batch
@@ -0,0 +1,1208 @@
+/*
+ * modinfomap.c: lazy python mapping over the .modinfo of a module
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <libkmod/libkmod.h>
+
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// modinfo parameters
+///
+///////////////////////////////////////////////////////////////////////
+
+struct param {
+  const char *name;
+  const char *param;
+  const char *type;
+  int namelen;
+  int paramlen;
+  int typelen;
+};
+
+#define PARAM_STACK   32
+
+//
+// Parameters of one module, in the order they are first seen. Items
+// and the open addressing index (slot = item index + 1, 0 is empty)
+// start in the table itself and move to the heap past PARAM_STACK.
+//
+struct param_table {
+  struct param  *items;
+  unsigned      *slots;
+  unsigned      count;
+  unsigned      alloc;
+  unsigned      mask;
+  char          *scratch;
+  size_t        scratch_len;
+  struct param  stack_items[PARAM_STACK];
+  unsigned      stack_slots[PARAM_STACK * 2];
+};
+
+/***********************************************************************
+ *
+ * param_hash:
+ *
+ ***********************************************************************/
+static unsigned
+param_hash (
+  const char  *name,
+  int         namelen
+  )
+{
+  unsigned h = 2166136261u;
+  int i;
+
+  for (i = 0; i < namelen; i++)
+    h = (h ^ (unsigned char) name[i]) * 16777619u;
+
+  return h;
+} // param_hash
+
+/***********************************************************************
+ *
+ * param_table_init:
+ *
+ ***********************************************************************/
+static void
+param_table_init (
+  struct param_table  *table
+  )
+{
+  table->items       = table->stack_items;
+  table->slots       = table->stack_slots;
+  table->count       = 0;
+  table->alloc       = PARAM_STACK;
+  table->mask        = PARAM_STACK * 2 - 1;
+  table->scratch     = NULL;
+  table->scratch_len = 0;
+  memset (table->stack_slots, 0, sizeof (table->stack_slots));
+} // param_table_init
+
+/***********************************************************************
+ *
+ * param_table_release:
+ *
+ ***********************************************************************/
+static void
+param_table_release (
+  struct param_table  *table
+  )
+{
+  if (table->items != table->stack_items)
+    PyMem_Free (table->items);
+  if (table->slots != table->stack_slots)
+    PyMem_Free (table->slots);
+  PyMem_Free (table->scratch);
+} // param_table_release
+
+/***********************************************************************
+ *
+ * param_table_grow:
+ *
+ ***********************************************************************/
+static int
+param_table_grow (
+  struct param_table  *table
+  )
+{
+  unsigned      alloc = table->alloc * 2;
+  unsigned      mask  = alloc * 2 - 1;
+  struct param  *items;
+  unsigned      *slots;
+  unsigned      i, h;
+
+  items = PyMem_Malloc (alloc * sizeof (struct param));
+  slots = PyMem_Calloc (mask + 1, sizeof (unsigned));
+  if (items == NULL || slots == NULL) {
+    PyMem_Free (items);
+    PyMem_Free (slots);
+    return -ENOMEM;
+  }
+
+  memcpy (items, table->items, table->count * sizeof (struct param));
+  for (i = 0; i < table->count; i++) {
+    h = param_hash (items[i].name, items[i].namelen) & mask;
+    while (slots[h] != 0)
+      h = (h + 1) & mask;
+    slots[h] = i + 1;
+  }
+
+  if (table->items != table->stack_items)
+    PyMem_Free (table->items);
+  if (table->slots != table->stack_slots)
+    PyMem_Free (table->slots);
+
+  table->items = items;
+  table->slots = slots;
+  table->alloc = alloc;
+  table->mask  = mask;
+
+  return 0;
+} // param_table_grow
+
+/***********************************************************************
+ *
+ * add_param:
+ *
+ ***********************************************************************/
+static struct param *add_param (
+  const char          *name,
+  int                 namelen,
+  const char          *param,
+  int                 paramlen,
+  const char          *type,
+  int                 typelen,
+  struct param_table  *table
+  )
+{
+  struct param *it;
+  unsigned h;
+
+  h = param_hash (name, namelen) & table->mask;
+  for (; table->slots[h] != 0; h = (h + 1) & table->mask) {
+    it = &table->items[table->slots[h] - 1];
+    if (it->namelen == namelen &&
+      memcmp(it->name, name, namelen) == 0)
+      goto found;
+  }
+
+  if (table->count == table->alloc) {
+    if (param_table_grow (table) < 0)
+      return NULL;
+    h = param_hash (name, namelen) & table->mask;
+    while (table->slots[h] != 0)
+      h = (h + 1) & table->mask;
+  }
+
+  it = &table->items[table->count++];
+  table->slots[h] = table->count;
+  it->name = name;
+  it->namelen = namelen;
+  it->param = NULL;
+  it->type = NULL;
+  it->paramlen = 0;
+  it->typelen = 0;
+
+found:
+  if (param != NULL) {
+    it->param = param;
+    it->paramlen = paramlen;
+  }
+
+  if (type != NULL) {
+    it->type = type;
+    it->typelen = typelen;
+  }
+
+  return it;
+} // add_param
+
+/***********************************************************************
+ *
+ * process_parm:
+ *
+ ***********************************************************************/
+static int
+process_parm (
+  const char          *key,
+  const char          *value,
+  struct param_table  *params
+  )
+{
+  const char *name, *param, *type;
+  int namelen, paramlen, typelen;
+  struct param *it;
+  const char *colon = strchr(value, ':');
+  if (colon == NULL) {
+    fprintf (stderr, "Found invalid \"%s=%s\": missing ':'\n",
+        key, value);
+    return 0;
+  }
+
+  name = value;
+  namelen = colon - value;
+  if (streq(key, "parm")) {
+    param = colon + 1;
+    paramlen = strlen(param);
+    type = NULL;
+    typelen = 0;
+  } else {
+    param = NULL;
+    paramlen = 0;
+    type = colon + 1;
+    typelen = strlen(type);
+  }
+
+  it = add_param(name, namelen, param, paramlen, type, typelen, params);
+  if (it == NULL) {
+    PyErr_Format (PyExc_MemoryError, "Out of memory!\n");
+    return -ENOMEM;
+  }
+
+  return 0;
+} // process_parm
+
+/***********************************************************************
+ *
+ * param_value:
+ *
+ *   Description and type of P as one string, "param (type)" when both
+ *   are known, built straight from the .modinfo slices.
+ *
+ ***********************************************************************/
+static PyObject *
+param_value (
+  struct param_table  *table,
+  struct param        *p
+  )
+{
+  size_t len;
+
+  if (p->param == NULL)
+    return PyUnicode_DecodeUTF8 (p->type, p->typelen, NULL);
+  if (p->type == NULL)
+    return PyUnicode_DecodeUTF8 (p->param, p->paramlen, NULL);
+
+  len = p->paramlen + p->typelen + 3;
+  if (len > table->scratch_len) {
+    char *tmp = PyMem_Realloc (table->scratch, len);
+
+    if (tmp == NULL)
+      return PyErr_NoMemory ();
+    table->scratch     = tmp;
+    table->scratch_len = len;
+  }
+
+  memcpy (table->scratch, p->param, p->paramlen);
+  memcpy (table->scratch + p->paramlen, " (", 2);
+  memcpy (table->scratch + p->paramlen + 2, p->type, p->typelen);
+  table->scratch[len - 1] = ')';
+
+  return PyUnicode_DecodeUTF8 (table->scratch, len, NULL);
+} // param_value
+
+/***********************************************************************
+ *
+ * param_dict:
+ *
+ ***********************************************************************/
+static PyObject *
+param_dict (
+  struct param_table  *table
+  )
+{
+  PyObject  *dict, *name, *value;
+  unsigned  i;
+  int       err;
+
+  dict = PyDict_New ();
+  if (dict == NULL)
+    return NULL;
+
+  for (i = 0; i < table->count; i++) {
+    struct param *p = &table->items[i];
+
+    name  = PyUnicode_DecodeUTF8 (p->name, p->namelen, NULL);
+    value = name != NULL ? param_value (table, p) : NULL;
+    err   = value != NULL ? PyDict_SetItem (dict, name, value) : -1;
+    Py_XDECREF (name);
+    Py_XDECREF (value);
+    if (err < 0) {
+      Py_DECREF (dict);
+      return NULL;
+    }
+  }
+
+  return dict;
+} // param_dict
+
+///////////////////////////////////////////////////////////////////////
+///
+/// packed .modinfo
+///
+///////////////////////////////////////////////////////////////////////
+
+#define BLOB_FIELDS(b)  ((const struct kmodule_modinfo_field *) ((b) + 1))
+#define BLOB_KEYS(b)    ((const struct kmodule_modinfo_key *) (BLOB_FIELDS (b) + (b)->count))
+#define BLOB_STR(b, o)  ((const char *) (b) + (o))
+
+/***********************************************************************
+ *
+ * modinfo_key_text:
+ *
+ ***********************************************************************/
+static const char *
+modinfo_key_text (
+  const struct kmodule_modinfo_blob *blob,
+  const struct kmodule_modinfo_key  *key,
+  size_t                            *len
+  )
+{
+  const char *text;
+
+  switch (key->kind) {
+  case KMODULE_MODINFO_NAME:      text = "name";      break;
+  case KMODULE_MODINFO_FILENAME:  text = "filename";  break;
+  case KMODULE_MODINFO_PARM:      text = "parm";      break;
+  case KMODULE_MODINFO_ALIAS:     text = "alias";     break;
+  default:
+    *len = BLOB_FIELDS (blob)[key->field].keylen;
+    return BLOB_STR (blob, BLOB_FIELDS (blob)[key->field].key);
+  }
+
+  *len = strlen (text);
+  return text;
+} // modinfo_key_text
+
+/***********************************************************************
+ *
+ * kmodule_modinfo_pack:
+ *
+ *   Copy Filename and the key/value pairs of Info into one block, with
+ *   the keys the mapping shows in the order a dict of them would have:
+ *   "name" of a builtin module, "filename", the .modinfo keys, the last
+ *   value of a repeated key winning, then "parm" and "alias" gathering
+ *   their values. Returns NULL when out of memory. Needs no GIL.
+ *
+ ***********************************************************************/
+struct kmodule_modinfo_blob *
+kmodule_modinfo_pack (
+  const char        *filename,
+  struct kmod_list  *info
+  )
+{
+  struct kmodule_modinfo_blob   *blob;
+  struct kmodule_modinfo_field  *fields;
+  struct kmodule_modinfo_key    *keys;
+  struct kmod_list  *l;
+  size_t    size, strings = 0;
+  uint32_t  count = 0, offset, i, k;
+  bool      parm = false, alias = false;
+
+  if (filename != NULL)
+    strings += strlen (filename) + 1;
+
+  kmod_list_foreach (l, info) {
+    strings += strlen (kmod_module_info_get_key (l)) + 1;
+    strings += strlen (kmod_module_info_get_value (l)) + 1;
+    count++;
+  }
+
+  size = sizeof (*blob) + count * sizeof (*fields) +
+         (count + 2) * sizeof (*keys) + strings;
+  if (size > UINT32_MAX)
+    return NULL;
+
+  blob = malloc (size);
+  if (blob == NULL)
+    return NULL;
+
+  memset (blob, 0, sizeof (*blob));
+  blob->count = count;
+  fields = (struct kmodule_modinfo_field *) (blob + 1);
+  keys   = (struct kmodule_modinfo_key *) (fields + count);
+  offset = sizeof (*blob) + count * sizeof (*fields) + (count + 2) * sizeof (*keys);
+
+#define BLOB_COPY(s, o, n)  do {                          \
+    (n) = strlen (s);                                     \
+    (o) = offset;                                         \
+    memcpy ((char *) blob + offset, (s), (n) + 1);        \
+    offset += (n) + 1;                                    \
+  } while (0)
+
+  if (filename != NULL) {
+    BLOB_COPY (filename, blob->filename, blob->filenamelen);
+  } else {
+    blob->flags |= KMODULE_MODINFO_BUILTIN;
+    keys[blob->nkeys++].kind = KMODULE_MODINFO_NAME;
+  }
+  keys[blob->nkeys++].kind = KMODULE_MODINFO_FILENAME;
+
+  i = 0;
+  kmod_list_foreach (l, info) {
+    const char *key = kmod_module_info_get_key (l);
+    const char *value = kmod_module_info_get_value (l);
+
+    BLOB_COPY (key, fields[i].key, fields[i].keylen);
+    BLOB_COPY (value, fields[i].value, fields[i].valuelen);
+
+    if (streq (key, "alias")) {
+      alias = true;
+    } else if (streq (key, "parm") || streq (key, "parmtype")) {
+      parm = true;
+    } else {
+      for (k = 0; k < blob->nkeys; k++) {
+        const char *text;
+        size_t len;
+
+        text = modinfo_key_text (blob, &keys[k], &len);
+        if (len == fields[i].keylen && memcmp (text, key, len) == 0)
+          break;
+      }
+      if (k == blob->nkeys)
+        blob->nkeys++;
+      keys[k].kind  = KMODULE_MODINFO_FIELD;
+      keys[k].field = i;
+    }
+    i++;
+  }
+
+#undef BLOB_COPY
+
+  //
+  // There is room for the two of them: every parm or alias field took
+  // no key, and the builtin or filename keys are at most two.
+  //
+  if (parm)
+    keys[blob->nkeys++].kind = KMODULE_MODINFO_PARM;
+  if (alias)
+    keys[blob->nkeys++].kind = KMODULE_MODINFO_ALIAS;
+
+  blob->size = offset;
+
+  return blob;
+} // kmodule_modinfo_pack
+
+/***********************************************************************
+ *
+ * kmodule_modinfo_read:
+ *
+ *   Packed .modinfo of Mod into *Blob. With a Cache the copy kept for
+ *   the module file, as long as the file did not change, spares reading
+ *   it; a module read is added to the Cache. Returns 0 or a negative
+ *   errno. Needs no GIL.
+ *
+ ***********************************************************************/
+int
+kmodule_modinfo_read (
+  struct kmod_module            *mod,
+  struct kmodule_cache          *cache,
+  struct kmodule_modinfo_blob   **blob
+  )
+{
+  const char        *path = kmod_module_get_path (mod);
+  struct kmod_list  *info = NULL;
+  struct stat       st;
+  int               err;
+
+  if (cache != NULL && (path == NULL || stat (path, &st) < 0))
+    cache = NULL;
+
+  if (cache != NULL) {
+    *blob = kmodule_cache_get (cache, path, &st);
+    if (*blob != NULL) {
+      KMODULE_STATS_COUNT (KMODULE_COUNTER_CACHE_HIT, 1);
+      return 0;
+    }
+  }
+
+  *blob = NULL;
+  KMODULE_STATS_START (start);
+  err = kmod_module_get_info (mod, &info);
+  KMODULE_STATS_PHASE (KMODULE_PHASE_MODINFO, start);
+  if (err < 0)
+    return err;
+
+  *blob = kmodule_modinfo_pack (path, info);
+  kmod_module_info_free_list (info);
+  if (*blob == NULL)
+    return -ENOMEM;
+
+  if (cache != NULL)
+    kmodule_cache_put (cache, path, &st, *blob);
+
+  return 0;
+} // kmodule_modinfo_read
+
+/***********************************************************************
+ *
+ * kmodule_modinfo_check:
+ *
+ *   True when Blob, read back from a file of which Avail bytes are left
+ *   from Blob on, is whole: every offset and count in range and every
+ *   string NUL terminated.
+ *
+ ***********************************************************************/
+bool
+kmodule_modinfo_check (
+  const struct kmodule_modinfo_blob *blob,
+  size_t                            avail
+  )
+{
+  const struct kmodule_modinfo_field  *fields;
+  const struct kmodule_modinfo_key    *keys;
+  const char  *data = (const char *) blob;
+  size_t      strings;
+  uint32_t    i;
+
+  if (avail < sizeof (*blob) || blob->size > avail)
+    return false;
+
+  if (blob->count > blob->size / sizeof (*fields) ||
+      blob->nkeys > blob->count + 2)
+    return false;
+
+  strings = sizeof (*blob) + blob->count * sizeof (*fields) +
+            (blob->count + 2) * sizeof (*keys);
+  if (strings > blob->size)
+    return false;
+
+#define STR_OK(o, n)  ((o) >= strings && (n) < blob->size && \
+                       (o) < blob->size - (n) && data[(o) + (n)] == '\0')
+
+  if (!(blob->flags & KMODULE_MODINFO_BUILTIN) &&
+      !STR_OK (blob->filename, blob->filenamelen))
+    return false;
+
+  fields = BLOB_FIELDS (blob);
+  for (i = 0; i < blob->count; i++) {
+    if (!STR_OK (fields[i].key, fields[i].keylen) ||
+        !STR_OK (fields[i].value, fields[i].valuelen))
+      return false;
+  }
+
+#undef STR_OK
+
+  keys = BLOB_KEYS (blob);
+  for (i = 0; i < blob->nkeys; i++) {
+    if (keys[i].kind > KMODULE_MODINFO_ALIAS ||
+        (keys[i].kind == KMODULE_MODINFO_FIELD && keys[i].field >= blob->count))
+      return false;
+  }
+
+  return true;
+} // kmodule_modinfo_check
+
+///////////////////////////////////////////////////////////////////////
+///
+/// modinfo mapping type
+///
+///////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  PyObject_HEAD
+  const struct kmodule_modinfo_blob *blob;
+  PyObject  *owner;     // keeps Blob alive, Blob is freed with us when NULL
+  PyObject  *keys;      // tuple of interned keys, built on first use
+  PyObject  **values;   // values already built, one slot per key
+} ModinfoObject;
+
+/***********************************************************************
+ *
+ * kmodule_modinfo_new:
+ *
+ *   Wrap Blob. Without Owner the new object takes Blob over and frees
+ *   it, otherwise Owner is kept alive as long as the object is.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_modinfo_new (
+  const struct kmodule_modinfo_blob *blob,
+  PyObject                          *owner
+  )
+{
+  ModinfoObject *Self;
+
+  Self = PyObject_New (ModinfoObject, &ModinfoType);
+  if (Self == NULL)
+    return NULL;
+
+  Self->blob   = blob;
+  Self->owner  = owner;
+  Self->keys   = NULL;
+  Self->values = NULL;
+  Py_XINCREF (owner);
+
+  return (PyObject *) Self;
+} // kmodule_modinfo_new
+
+/***********************************************************************
+ *
+ * Modinfo_dealloc:
+ *
+ ***********************************************************************/
+static void
+Modinfo_dealloc (
+  ModinfoObject *Self
+  )
+{
+  uint32_t i;
+
+  if (Self->values != NULL) {
+    for (i = 0; i < Self->blob->nkeys; i++)
+      Py_XDECREF (Self->values[i]);
+    PyMem_Free (Self->values);
+  }
+  Py_XDECREF (Self->keys);
+
+  if (Self->owner != NULL)
+    Py_DECREF (Self->owner);
+  else
+    free ((void *) Self->blob);
+
+  PyObject_Del (Self);
+} // Modinfo_dealloc
+
+/***********************************************************************
+ *
+ * Modinfo_keys_get:
+ *
+ *   Borrowed tuple of the keys.
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_keys_get (
+  ModinfoObject *Self
+  )
+{
+  const struct kmodule_modinfo_blob *blob = Self->blob;
+  PyObject  *keys;
+  uint32_t  i;
+
+  if (Self->keys != NULL)
+    return Self->keys;
+
+  keys = PyTuple_New (blob->nkeys);
+  if (keys == NULL)
+    return NULL;
+
+  for (i = 0; i < blob->nkeys; i++) {
+    const char  *text;
+    size_t      len;
+    PyObject    *key;
+
+    text = modinfo_key_text (blob, &BLOB_KEYS (blob)[i], &len);
+    key  = PyUnicode_DecodeUTF8 (text, len, NULL);
+    if (key == NULL) {
+      Py_DECREF (keys);
+      return NULL;
+    }
+    PyUnicode_InternInPlace (&key);
+    PyTuple_SET_ITEM (keys, i, key);
+  }
+
+  Self->keys = keys;
+
+  return keys;
+} // Modinfo_keys_get
+
+/***********************************************************************
+ *
+ * Modinfo_find:
+ *
+ *   Index of Key, -1 when missing, -2 with an exception set.
+ *
+ ***********************************************************************/
+static int
+Modinfo_find (
+  ModinfoObject *Self,
+  PyObject      *Key
+  )
+{
+  const struct kmodule_modinfo_blob *blob = Self->blob;
+  const char  *name, *text;
+  Py_ssize_t  namelen;
+  size_t      len;
+  uint32_t    i;
+
+  if (!PyUnicode_Check (Key))
+    return -1;
+
+  name = PyUnicode_AsUTF8AndSize (Key, &namelen);
+  if (name == NULL)
+    return -2;
+
+  for (i = 0; i < blob->nkeys; i++) {
+    text = modinfo_key_text (blob, &BLOB_KEYS (blob)[i], &len);
+    if (len == (size_t) namelen && memcmp (text, name, len) == 0)
+      return i;
+  }
+
+  return -1;
+} // Modinfo_find
+
+/***********************************************************************
+ *
+ * Modinfo_build:
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_build (
+  ModinfoObject                     *Self,
+  const struct kmodule_modinfo_key  *key
+  )
+{
+  const struct kmodule_modinfo_blob   *blob = Self->blob;
+  const struct kmodule_modinfo_field  *fields = BLOB_FIELDS (blob);
+  struct param_table  params;
+  PyObject  *ret;
+  uint32_t  i, count;
+
+  switch (key->kind) {
+  case KMODULE_MODINFO_NAME:
+    return PyUnicode_FromString ("(builtin)");
+
+  case KMODULE_MODINFO_FILENAME:
+    if (blob->flags & KMODULE_MODINFO_BUILTIN)
+      return PyUnicode_FromString ("(builtin)");
+    return PyUnicode_DecodeUTF8 (BLOB_STR (blob, blob->filename), blob->filenamelen, NULL);
+
+  case KMODULE_MODINFO_PARM:
+    param_table_init (&params);
+    for (i = 0; i < blob->count; i++) {
+      const char *k = BLOB_STR (blob, fields[i].key);
+
+      if (streq (k, "parm") || streq (k, "parmtype")) {
+        if (process_parm (k, BLOB_STR (blob, fields[i].value), &params) < 0) {
+          param_table_release (&params);
+          return NULL;
+        }
+      }
+    }
+    ret = param_dict (&params);
+    param_table_release (&params);
+    return ret;
+
+  case KMODULE_MODINFO_ALIAS:
+    count = 0;
+    for (i = 0; i < blob->count; i++) {
+      if (streq (BLOB_STR (blob, fields[i].key), "alias"))
+        count++;
+    }
+    ret = PyTuple_New (count);
+    if (ret == NULL)
+      return NULL;
+    count = 0;
+    for (i = 0; i < blob->count; i++) {
+      PyObject *value;
+
+      if (!streq (BLOB_STR (blob, fields[i].key), "alias"))
+        continue;
+      value = PyUnicode_DecodeUTF8 (BLOB_STR (blob, fields[i].value), fields[i].valuelen, NULL);
+      if (value == NULL) {
+        Py_DECREF (ret);
+        return NULL;
+      }
+      PyTuple_SET_ITEM (ret, count++, value);
+    }
+    return ret;
+
+  default:
+    return PyUnicode_DecodeUTF8 (BLOB_STR (blob, fields[key->field].value),
+                                 fields[key->field].valuelen, NULL);
+  }
+} // Modinfo_build
+
+/***********************************************************************
+ *
+ * Modinfo_value:
+ *
+ *   New reference to the value of key Index, built on first use. The
+ *   cached parm dict is handed out as a copy, a caller changing it
+ *   would change it for every later reader.
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_value (
+  ModinfoObject *Self,
+  uint32_t      Index
+  )
+{
+  PyObject *value;
+
+  if (Self->values == NULL) {
+    Self->values = PyMem_Calloc (Self->blob->nkeys + 1, sizeof (PyObject *));
+    if (Self->values == NULL)
+      return PyErr_NoMemory ();
+  }
+
+  value = Self->values[Index];
+  if (value == NULL) {
+    value = Modinfo_build (Self, &BLOB_KEYS (Self->blob)[Index]);
+    if (value == NULL)
+      return NULL;
+    Self->values[Index] = value;
+  }
+
+  if (PyDict_CheckExact (value))
+    return PyDict_Copy (value);
+
+  Py_INCREF (value);
+  return value;
+} // Modinfo_value
+
+/***********************************************************************
+ *
+ * Modinfo_copy:
+ *
+ *   dict of every key and value.
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_copy (
+  ModinfoObject *Self,
+  PyObject      *Unused
+  )
+{
+  PyObject  *dict, *keys, *value;
+  uint32_t  i;
+
+  keys = Modinfo_keys_get (Self);
+  if (keys == NULL)
+    return NULL;
+
+  dict = PyDict_New ();
+  if (dict == NULL)
+    return NULL;
+
+  for (i = 0; i < Self->blob->nkeys; i++) {
+    value = Modinfo_value (Self, i);
+    if (value == NULL || PyDict_SetItem (dict, PyTuple_GET_ITEM (keys, i), value) < 0) {
+      Py_XDECREF (value);
+      Py_DECREF (dict);
+      return NULL;
+    }
+    Py_DECREF (value);
+  }
+
+  return dict;
+} // Modinfo_copy
+
+/***********************************************************************
+ *
+ * Modinfo_length:
+ *
+ ***********************************************************************/
+static Py_ssize_t
+Modinfo_length (
+  ModinfoObject *Self
+  )
+{
+  return Self->blob->nkeys;
+} // Modinfo_length
+
+/***********************************************************************
+ *
+ * Modinfo_subscript:
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_subscript (
+  ModinfoObject *Self,
+  PyObject      *Key
+  )
+{
+  int index = Modinfo_find (Self, Key);
+
+  if (index == -1)
+    PyErr_SetObject (PyExc_KeyError, Key);
+  if (index < 0)
+    return NULL;
+
+  return Modinfo_value (Self, index);
+} // Modinfo_subscript
+
+/***********************************************************************
+ *
+ * Modinfo_contains:
+ *
+ ***********************************************************************/
+static int
+Modinfo_contains (
+  ModinfoObject *Self,
+  PyObject      *Key
+  )
+{
+  int index = Modinfo_find (Self, Key);
+
+  if (index == -2)
+    return -1;
+
+  return index >= 0;
+} // Modinfo_contains
+
+/***********************************************************************
+ *
+ * Modinfo_iter:
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_iter (
+  ModinfoObject *Self
+  )
+{
+  PyObject *keys = Modinfo_keys_get (Self);
+
+  if (keys == NULL)
+    return NULL;
+
+  return PyObject_GetIter (keys);
+} // Modinfo_iter
+
+/***********************************************************************
+ *
+ * Modinfo_get:
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_get (
+  ModinfoObject *Self,
+  PyObject      *Args
+  )
+{
+  PyObject  *key, *def = Py_None;
+  int       index;
+
+  if (!PyArg_ParseTuple (Args, "O|O", &key, &def))
+    return NULL;
+
+  index = Modinfo_find (Self, key);
+  if (index == -2)
+    return NULL;
+
+  if (index == -1) {
+    Py_INCREF (def);
+    return def;
+  }
+
+  return Modinfo_value (Self, index);
+} // Modinfo_get
+
+/***********************************************************************
+ *
+ * Modinfo_getall:
+ *
+ *   Every value of a .modinfo key, in file order, e.g. all the
+ *   "firmware" lines where the mapping only shows the last one.
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_getall (
+  ModinfoObject *Self,
+  PyObject      *Args
+  )
+{
+  const struct kmodule_modinfo_blob   *blob = Self->blob;
+  const struct kmodule_modinfo_field  *fields = BLOB_FIELDS (blob);
+  const char  *name;
+  size_t      namelen;
+  PyObject    *ret, *value;
+  uint32_t    i;
+
+  if (!PyArg_ParseTuple (Args, "s", &name))
+    return NULL;
+  namelen = strlen (name);
+
+  ret = PyList_New (0);
+  if (ret == NULL)
+    return NULL;
+
+  for (i = 0; i < blob->count; i++) {
+    if (fields[i].keylen != namelen ||
+        memcmp (BLOB_STR (blob, fields[i].key), name, namelen) != 0)
+      continue;
+
+    value = PyUnicode_DecodeUTF8 (BLOB_STR (blob, fields[i].value), fields[i].valuelen, NULL);
+    if (value == NULL || PyList_Append (ret, value) < 0) {
+      Py_XDECREF (value);
+      Py_DECREF (ret);
+      return NULL;
+    }
+    Py_DECREF (value);
+  }
+
+  return ret;
+} // Modinfo_getall
+
+/***********************************************************************
+ *
+ * Modinfo_list:
+ *
+ *   keys(), values() and items() as lists, What 0, 1 or 2.
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_list (
+  ModinfoObject *Self,
+  int           What
+  )
+{
+  PyObject  *keys, *ret, *item;
+  uint32_t  i;
+
+  keys = Modinfo_keys_get (Self);
+  if (keys == NULL)
+    return NULL;
+
+  if (What == 0)
+    return PySequence_List (keys);
+
+  ret = PyList_New (Self->blob->nkeys);
+  if (ret == NULL)
+    return NULL;
+
+  for (i = 0; i < Self->blob->nkeys; i++) {
+    item = Modinfo_value (Self, i);
+    if (item != NULL && What == 2) {
+      PyObject *value = item;
+
+      item = PyTuple_Pack (2, PyTuple_GET_ITEM (keys, i), value);
+      Py_DECREF (value);
+    }
+    if (item == NULL) {
+      Py_DECREF (ret);
+      return NULL;
+    }
+    PyList_SET_ITEM (ret, i, item);
+  }
+
+  return ret;
+} // Modinfo_list
+
+static PyObject *
+Modinfo_keys (
+  ModinfoObject *Self,
+  PyObject      *Unused
+  )
+{
+  return Modinfo_list (Self, 0);
+} // Modinfo_keys
+
+static PyObject *
+Modinfo_values (
+  ModinfoObject *Self,
+  PyObject      *Unused
+  )
+{
+  return Modinfo_list (Self, 1);
+} // Modinfo_values
+
+static PyObject *
+Modinfo_items (
+  ModinfoObject *Self,
+  PyObject      *Unused
+  )
+{
+  return Modinfo_list (Self, 2);
+} // Modinfo_items
+
+/***********************************************************************
+ *
+ * Modinfo_repr:
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_repr (
+  ModinfoObject *Self
+  )
+{
+  PyObject *dict, *ret;
+
+  dict = Modinfo_copy (Self, NULL);
+  if (dict == NULL)
+    return NULL;
+
+  ret = PyObject_Repr (dict);
+  Py_DECREF (dict);
+
+  return ret;
+} // Modinfo_repr
+
+/***********************************************************************
+ *
+ * Modinfo_richcompare:
+ *
+ *   Equal to a mapping holding the same keys and values, as a dict is.
+ *
+ ***********************************************************************/
+static PyObject *
+Modinfo_richcompare (
+  ModinfoObject *Self,
+  PyObject      *Other,
+  int           Op
+  )
+{
+  PyObject *dict, *other, *ret;
+
+  if ((Op != Py_EQ && Op != Py_NE) ||
+      !(PyDict_Check (Other) || PyObject_TypeCheck (Other, &ModinfoType)))
+    Py_RETURN_NOTIMPLEMENTED;
+
+  dict = Modinfo_copy (Self, NULL);
+  if (dict == NULL)
+    return NULL;
+
+  if (PyDict_Check (Other)) {
+    Py_INCREF (Other);
+    other = Other;
+  } else {
+    other = Modinfo_copy ((ModinfoObject *) Other, NULL);
+  }
+
+  ret = other != NULL ? PyObject_RichCompare (dict, other, Op) : NULL;
+  Py_DECREF (dict);
+  Py_XDECREF (other);
+
+  return ret;
+} // Modinfo_richcompare
+
+static PyMethodDef Modinfo_methods[] = {
+  { "keys",     (PyCFunction) Modinfo_keys,   METH_NOARGS,  NULL},
+  { "values",   (PyCFunction) Modinfo_values, METH_NOARGS,  NULL},
+  { "items",    (PyCFunction) Modinfo_items,  METH_NOARGS,  NULL},
+  { "get",      (PyCFunction) Modinfo_get,    METH_VARARGS, NULL},
+  { "getall",   (PyCFunction) Modinfo_getall, METH_VARARGS, NULL},
+  { "copy",     (PyCFunction) Modinfo_copy,   METH_NOARGS,  NULL},
+  { NULL,       NULL,                         0,            NULL}
+};
+
+static PyMappingMethods Modinfo_as_mapping = {
+  .mp_length    = (lenfunc) Modinfo_length,
+  .mp_subscript = (binaryfunc) Modinfo_subscript,
+};
+
+static PySequenceMethods Modinfo_as_sequence = {
+  .sq_contains  = (objobjproc) Modinfo_contains,
+};
+
+PyTypeObject ModinfoType = {
+
+  PyVarObject_HEAD_INIT (NULL, 0)
+
+  .tp_name        = "_kmodule._modinfo",
+  .tp_doc         = "read only mapping of the .modinfo of one module",
+  .tp_basicsize   = sizeof (ModinfoObject),
+  .tp_itemsize    = 0,
+  .tp_flags       = Py_TPFLAGS_DEFAULT,
+  .tp_dealloc     = (destructor) Modinfo_dealloc,
+  .tp_repr        = (reprfunc) Modinfo_repr,
+  .tp_hash        = PyObject_HashNotImplemented,
+  .tp_as_mapping  = &Modinfo_as_mapping,
+  .tp_as_sequence = &Modinfo_as_sequence,
+  .tp_richcompare = (richcmpfunc) Modinfo_richcompare,
+  .tp_iter        = (getiterfunc) Modinfo_iter,
+  .tp_methods     = Modinfo_methods,
+
+}; // ModinfoType
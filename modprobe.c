@@ -0,0 +1,1301 @@
+/*
+ * modprobe.c: python wrapper for python wrapper for kmod/tools/modprobe.c
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <stdatomic.h>
+
+#include <libkmod/libkmod.h>
+
+#include <shared/hash.h>
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// static function for modprobe
+///
+///   The modules to load and everything they need are collected into a
+///   kmodule_dag: modules.dep entries become required edges, softdeps
+///   ordering only edges. The dag is then inserted on Jobs threads.
+///
+///   On a Context made with config, options and softdeps come from its
+///   compiled tables, and modules an alias resolves to are skipped when
+///   blacklisted, as modprobe does.
+///
+///   Context._closure collects the same dag and reads the .modinfo of
+///   every node on the worker threads instead of inserting it.
+///
+///////////////////////////////////////////////////////////////////////
+
+enum modprobe_status {
+  MODPROBE_PENDING = 0,
+  MODPROBE_INSERTED,
+  MODPROBE_LOADED,
+  MODPROBE_BUILTIN,
+  MODPROBE_FAILED,
+};
+
+static const char *modprobe_status_str [] = {
+  "skipped",
+  "inserted",
+  "loaded",
+  "builtin",
+  "failed",
+};
+
+struct modprobe_node {
+  struct kmod_module  *mod;
+  const char          *path;
+  char                *options;
+  char                *error;
+  int                 state;
+  int                 status;
+  unsigned            seq;          // finish order of a closure read
+  struct kmodule_insert_result  insert;
+  struct kmodule_modinfo_blob   *blob;
+};
+
+struct kmodule_modprobe {
+  struct kmod_ctx     *ctx;
+  struct kmodule_config *config;
+  struct kmodule_dag  dag;
+  struct hash         *index;
+  const char          *extra_options;
+  PyObject            *insert;
+  int                 decompress;
+  struct kmodule_cache *cache;
+  atomic_uint         seq;
+  const char          *dirname;
+  struct kmod_ctx     **workers;    // kmod_ctx of each worker, NULL for one job
+  unsigned            nworkers;
+};
+
+/***********************************************************************
+ *
+ * modprobe_options:
+ *
+ ***********************************************************************/
+static char *
+modprobe_options (
+  const char  *config,
+  const char  *extra
+  )
+{
+  char *options;
+
+  if (config == NULL) config = "";
+  if (extra == NULL)  extra  = "";
+
+  options = malloc (strlen (config) + strlen (extra) + 2);
+  if (options == NULL)
+    return NULL;
+
+  sprintf (options, "%s%s%s", config, (*config && *extra) ? " " : "", extra);
+
+  return options;
+} // modprobe_options
+
+/***********************************************************************
+ *
+ * modprobe_config_options:
+ *
+ ***********************************************************************/
+static const char *
+modprobe_config_options (
+  struct kmodule_modprobe *mp,
+  struct kmod_module      *mod
+  )
+{
+  if (mp->config != NULL)
+    return kmodule_config_options (mp->config, kmod_module_get_name (mod));
+
+  return kmod_module_get_options (mod);
+} // modprobe_config_options
+
+/***********************************************************************
+ *
+ * modprobe_is_alias:
+ *
+ *   Whether Lookup, a name given to modprobe, is not the name of
+ *   module Name, '-' and '_' alike.
+ *
+ ***********************************************************************/
+static bool
+modprobe_is_alias (
+  const char  *lookup,
+  const char  *name
+  )
+{
+  for (; *lookup != '\0' && *name != '\0'; lookup++, name++) {
+    if (*lookup != *name && !((*lookup == '-' || *lookup == '_') && (*name == '-' || *name == '_')))
+      return true;
+  }
+
+  return *lookup != *name;
+} // modprobe_is_alias
+
+static int
+modprobe_add (
+  struct kmodule_modprobe *mp,
+  struct kmod_module      *mod,
+  bool                    target
+  );
+
+/***********************************************************************
+ *
+ * modprobe_softdeps:
+ *
+ *   Add the modules of the space separated Names, each looked up as
+ *   modprobe would, and order them Before or after node Index.
+ *
+ ***********************************************************************/
+static int
+modprobe_softdeps (
+  struct kmodule_modprobe *mp,
+  int                     index,
+  const char              *names,
+  bool                    before
+  )
+{
+  char  name[PATH_MAX];
+  int   err = 0;
+
+  while (err == 0 && *names != '\0') {
+    struct kmod_list *l, *list = NULL;
+    size_t n = strcspn (names, " ");
+
+    if (n == 0 || n >= sizeof (name)) {
+      names += n + (names[n] == ' ');
+      continue;
+    }
+    memcpy (name, names, n);
+    name[n] = '\0';
+    names += n + (names[n] == ' ');
+
+    if (kmod_module_new_from_lookup (mp->ctx, name, &list) < 0)
+      continue;
+
+    kmod_list_foreach (l, list) {
+      struct kmod_module *dep = kmod_module_get_module (l);
+      int d = modprobe_add (mp, dep, false);
+
+      kmod_module_unref (dep);
+      if (d < 0) {
+        err = d;
+        break;
+      }
+      err = before ? kmodule_dag_edge (&mp->dag, d, index, false) :
+                     kmodule_dag_edge (&mp->dag, index, d, false);
+      if (err < 0)
+        break;
+    }
+    kmod_module_unref_list (list);
+  }
+
+  return err;
+} // modprobe_softdeps
+
+/***********************************************************************
+ *
+ * modprobe_add:
+ *
+ *   Add Mod and, recursively, its dependencies and softdeps. Returns
+ *   the node index or a negative errno. Called with the Context lock
+ *   held and without the GIL.
+ *
+ ***********************************************************************/
+static int
+modprobe_add (
+  struct kmodule_modprobe *mp,
+  struct kmod_module      *mod,
+  bool                    target
+  )
+{
+  struct modprobe_node *node;
+  struct kmod_list *l, *deps, *pre = NULL, *post = NULL;
+  const char *name = kmod_module_get_name (mod);
+  int index, err = 0;
+
+  index = (int) (intptr_t) hash_find (mp->index, name) - 1;
+  if (index >= 0) {
+    node = mp->dag.nodes[index].data;
+    if (target && node->options != NULL && mp->extra_options != NULL) {
+      char *options = modprobe_options (modprobe_config_options (mp, mod), mp->extra_options);
+
+      if (options == NULL)
+        return -ENOMEM;
+      free (node->options);
+      node->options = options;
+    }
+    return index;
+  }
+
+  node = calloc (1, sizeof (*node));
+  if (node == NULL)
+    return -ENOMEM;
+
+  node->options = modprobe_options (modprobe_config_options (mp, mod),
+                    target ? mp->extra_options : NULL);
+  if (node->options == NULL) {
+    free (node);
+    return -ENOMEM;
+  }
+
+  index = kmodule_dag_add (&mp->dag, node);
+  if (index < 0) {
+    free (node->options);
+    free (node);
+    return index;
+  }
+
+  KMODULE_STATS_START (start);
+  node->mod     = kmod_module_ref (mod);
+  node->path    = kmod_module_get_path (mod);
+  node->state   = kmod_module_get_initstate (mod);
+  KMODULE_STATS_PHASE (KMODULE_PHASE_STATE, start);
+
+  err = hash_add (mp->index, name, (void *) (intptr_t) (index + 1));
+  if (err < 0)
+    return err;
+
+  deps = kmod_module_get_dependencies (mod);
+  kmod_list_foreach (l, deps) {
+    struct kmod_module *dep = kmod_module_get_module (l);
+    int d = modprobe_add (mp, dep, false);
+
+    kmod_module_unref (dep);
+    if (d < 0) {
+      err = d;
+      break;
+    }
+    err = kmodule_dag_edge (&mp->dag, d, index, true);
+    if (err < 0)
+      break;
+  }
+  kmod_module_unref_list (deps);
+  if (err < 0)
+    return err;
+
+  if (mp->config != NULL) {
+    const char *before, *after;
+
+    if (kmodule_config_softdeps (mp->config, name, &before, &after)) {
+      err = modprobe_softdeps (mp, index, before, true);
+      if (err == 0)
+        err = modprobe_softdeps (mp, index, after, false);
+    }
+    return err < 0 ? err : index;
+  }
+
+  kmod_module_get_softdeps (mod, &pre, &post);
+
+  kmod_list_foreach (l, pre) {
+    struct kmod_module *dep = kmod_module_get_module (l);
+    int d = modprobe_add (mp, dep, false);
+
+    kmod_module_unref (dep);
+    if (d < 0 || kmodule_dag_edge (&mp->dag, d, index, false) < 0) {
+      err = d < 0 ? d : -ENOMEM;
+      break;
+    }
+  }
+
+  kmod_list_foreach (l, post) {
+    struct kmod_module *dep = kmod_module_get_module (l);
+    int d;
+
+    if (err < 0) {
+      kmod_module_unref (dep);
+      break;
+    }
+
+    d = modprobe_add (mp, dep, false);
+    kmod_module_unref (dep);
+    if (d < 0 || kmodule_dag_edge (&mp->dag, index, d, false) < 0)
+      err = d < 0 ? d : -ENOMEM;
+  }
+
+  kmod_module_unref_list (pre);
+  kmod_module_unref_list (post);
+
+  return err < 0 ? err : index;
+} // modprobe_add
+
+/***********************************************************************
+ *
+ * modprobe_insert_python:
+ *
+ *   Hand one module to the python insert backend,
+ *   insert (name, path, options) -> None or negative errno.
+ *
+ ***********************************************************************/
+static int
+modprobe_insert_python (
+  struct kmodule_modprobe *mp,
+  struct modprobe_node    *node
+  )
+{
+  PyGILState_STATE  gstate;
+  PyObject          *r;
+  int               err = 0;
+
+  gstate = PyGILState_Ensure ();
+
+  r = PyObject_CallFunction (mp->insert, "szs",
+        kmod_module_get_name (node->mod), node->path, node->options);
+  if (r == NULL) {
+    PyObject *type, *value, *tb, *str;
+
+    PyErr_Fetch (&type, &value, &tb);
+    PyErr_NormalizeException (&type, &value, &tb);
+
+    err = -EIO;
+    if (value != NULL && PyObject_IsInstance (value, PyExc_OSError) == 1) {
+      PyObject *no = PyObject_GetAttrString (value, "errno");
+
+      if (no != NULL && PyLong_Check (no) && PyLong_AsLong (no) > 0)
+        err = -(int) PyLong_AsLong (no);
+      Py_XDECREF (no);
+    }
+
+    str = value != NULL ? PyObject_Str (value) : NULL;
+    if (str != NULL && PyUnicode_AsUTF8 (str) != NULL)
+      node->error = strdup (PyUnicode_AsUTF8 (str));
+    Py_XDECREF (str);
+
+    Py_XDECREF (type);
+    Py_XDECREF (value);
+    Py_XDECREF (tb);
+    PyErr_Clear ();
+  } else {
+    if (PyLong_Check (r))
+      err = (int) PyLong_AsLong (r);
+    Py_DECREF (r);
+  }
+
+  PyGILState_Release (gstate);
+
+  return err;
+} // modprobe_insert_python
+
+/***********************************************************************
+ *
+ * modprobe_workers_new:
+ *
+ *   Room for a kmod_ctx per worker of a run on Jobs threads, none for
+ *   a single job, which uses the Context one under its lock. Returns 0
+ *   or -ENOMEM.
+ *
+ ***********************************************************************/
+static int
+modprobe_workers_new (
+  struct kmodule_modprobe *mp,
+  int                     jobs
+  )
+{
+  if (jobs <= 1 || mp->dag.count <= 1)
+    return 0;
+
+  mp->workers = calloc (jobs, sizeof (struct kmod_ctx *));
+  if (mp->workers == NULL)
+    return -ENOMEM;
+
+  mp->nworkers = jobs;
+  mp->dirname  = kmod_get_dirname (mp->ctx);
+
+  return 0;
+} // modprobe_workers_new
+
+/***********************************************************************
+ *
+ * modprobe_workers_free:
+ *
+ ***********************************************************************/
+static void
+modprobe_workers_free (
+  struct kmodule_modprobe *mp
+  )
+{
+  unsigned i;
+
+  for (i = 0; i < mp->nworkers; i++) {
+    if (mp->workers[i] != NULL)
+      kmod_unref (mp->workers[i]);
+  }
+
+  free (mp->workers);
+  mp->workers  = NULL;
+  mp->nworkers = 0;
+} // modprobe_workers_free
+
+/***********************************************************************
+ *
+ * modprobe_worker_module:
+ *
+ *   The module of Node for Worker: the node one on a single job, else
+ *   a new one of the worker kmod_ctx, made on its first use. A kmod_ctx
+ *   is not thread safe, the workers never share one.
+ *
+ ***********************************************************************/
+static int
+modprobe_worker_module (
+  struct kmodule_modprobe *mp,
+  unsigned                worker,
+  struct modprobe_node    *node,
+  struct kmod_module      **mod
+  )
+{
+  struct kmod_ctx *ctx;
+  const char *null_config = NULL;
+
+  if (mp->workers == NULL) {
+    *mod = kmod_module_ref (node->mod);
+    return 0;
+  }
+
+  ctx = mp->workers[worker];
+  if (ctx == NULL) {
+    KMODULE_STATS_START (start);
+    ctx = kmod_new (mp->dirname, &null_config);
+    if (ctx != NULL)
+      kmodule_log_attach (ctx);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_CONTEXT, start);
+    if (ctx == NULL)
+      return -ENOMEM;
+    mp->workers[worker] = ctx;
+  }
+
+  if (node->path != NULL)
+    return kmod_module_new_from_path (ctx, node->path, mod);
+
+  return kmod_module_new_from_name (ctx, kmod_module_get_name (node->mod), mod);
+} // modprobe_worker_module
+
+/***********************************************************************
+ *
+ * modprobe_insert:
+ *
+ *   kmodule_dag_fn, runs on the worker threads.
+ *
+ ***********************************************************************/
+static int
+modprobe_insert (
+  void                    *data,
+  struct kmodule_dag_node *dnode,
+  unsigned                worker
+  )
+{
+  struct kmodule_modprobe *mp = data;
+  struct modprobe_node    *node = dnode->data;
+  struct kmod_module      *mod;
+  int err;
+
+  if (node->state == KMOD_MODULE_LIVE || node->state == KMOD_MODULE_COMING) {
+    node->status = MODPROBE_LOADED;
+    return 0;
+  }
+
+  if (node->state == KMOD_MODULE_BUILTIN) {
+    node->status = MODPROBE_BUILTIN;
+    return 0;
+  }
+
+  if (node->path == NULL) {
+    node->status = MODPROBE_FAILED;
+    return -ENOENT;
+  }
+
+  if (mp->insert != NULL) {
+    err = modprobe_insert_python (mp, node);
+  } else {
+    err = modprobe_worker_module (mp, worker, node, &mod);
+    if (err == 0) {
+      err = kmodule_insert_module (mod, node->options, mp->decompress, &node->insert);
+      kmod_module_unref (mod);
+    }
+  }
+
+  if (err == -EEXIST) {
+    node->status = MODPROBE_LOADED;
+    return 0;
+  }
+
+  node->status = err < 0 ? MODPROBE_FAILED : MODPROBE_INSERTED;
+
+  return err < 0 ? err : 0;
+} // modprobe_insert
+
+/***********************************************************************
+ *
+ * modprobe_run:
+ *
+ *   Insert the dag on Jobs threads, called with the lock of Context
+ *   held. Each worker inserts through its own kmod_ctx. The python
+ *   backend runs user code, which may well call the same Context
+ *   again: the lock is then dropped for the run. The nodes hold
+ *   everything the backend is given and keep their kmod_ctx
+ *   referenced, nothing of the Context is used until it is taken back.
+ *
+ ***********************************************************************/
+static int
+modprobe_run (
+  struct kmodule_modprobe *mp,
+  PyObject                *Context,
+  int                     jobs
+  )
+{
+  int err;
+
+  if (mp->insert != NULL) {
+    kmodule_context_unlock (Context);
+    err = kmodule_dag_run (&mp->dag, jobs < 1 ? 1 : jobs, modprobe_insert, mp);
+    kmodule_context_lock (Context);
+    return err;
+  }
+
+  err = modprobe_workers_new (mp, jobs);
+  if (err == 0)
+    err = kmodule_dag_run (&mp->dag, jobs < 1 ? 1 : jobs, modprobe_insert, mp);
+  modprobe_workers_free (mp);
+
+  return err;
+} // modprobe_run
+
+/***********************************************************************
+ *
+ * modprobe_closure_read:
+ *
+ *   kmodule_dag_fn of Context._closure, reads the .modinfo of the node
+ *   through the kmod_ctx of the worker.
+ *   A node only finishes after the nodes ordered ahead of it, so its
+ *   sequence number gives a load order. A failed read is kept in the
+ *   node and does not cancel the modules depending on it.
+ *
+ ***********************************************************************/
+static int
+modprobe_closure_read (
+  void                    *data,
+  struct kmodule_dag_node *dnode,
+  unsigned                worker
+  )
+{
+  struct kmodule_modprobe *mp = data;
+  struct modprobe_node    *node = dnode->data;
+  struct kmod_module      *mod;
+  int err;
+
+  err = modprobe_worker_module (mp, worker, node, &mod);
+  if (err == 0) {
+    err = kmodule_modinfo_read (mod, mp->cache, &node->blob);
+    kmod_module_unref (mod);
+  }
+  if (err < 0)
+    node->error = strdup (strerror (-err));
+
+  node->seq = atomic_fetch_add (&mp->seq, 1) + 1;
+
+  return 0;
+} // modprobe_closure_read
+
+/***********************************************************************
+ *
+ * modprobe_free:
+ *
+ *   Called with the Context lock held and without the GIL.
+ *
+ ***********************************************************************/
+static void
+modprobe_free (
+  struct kmodule_modprobe *mp
+  )
+{
+  unsigned i;
+
+  for (i = 0; i < mp->dag.count; i++) {
+    struct modprobe_node *node = mp->dag.nodes[i].data;
+
+    kmod_module_unref (node->mod);
+    free (node->options);
+    free (node->error);
+    free (node->blob);
+    free (node);
+  }
+
+  kmodule_dag_free (&mp->dag);
+  hash_free (mp->index);
+} // modprobe_free
+
+/***********************************************************************
+ *
+ * modprobe_result:
+ *
+ ***********************************************************************/
+static PyObject *
+modprobe_result (
+  struct kmodule_modprobe *mp
+  )
+{
+  PyObject  *ret;
+  unsigned  i, j, *order;
+
+  //
+  // Report in the order the modules were started.
+  //
+  order = calloc (mp->dag.count + 1, sizeof (unsigned));
+  if (order == NULL)
+    return PyErr_NoMemory ();
+
+  for (i = 0; i < mp->dag.count; i++) {
+    for (j = i; j > 0 && mp->dag.nodes[order[j - 1]].start > mp->dag.nodes[i].start; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+
+  ret = PyTuple_New (mp->dag.count);
+  if (ret == NULL) {
+    free (order);
+    return NULL;
+  }
+
+  for (i = 0; i < mp->dag.count; i++) {
+    struct kmodule_dag_node *dnode = &mp->dag.nodes[order[i]];
+    struct modprobe_node    *node = dnode->data;
+    const char *error = NULL;
+    PyObject   *item;
+
+    if (dnode->err == -ECANCELED)
+      error = "Dependency failed";
+    else if (dnode->err == -ELOOP)
+      error = "Dependency cycle";
+    else if (node->error != NULL)
+      error = node->error;
+    else if (dnode->err < 0)
+      error = mod_strerror (-dnode->err);
+
+    item = Py_BuildValue ("{s:s,s:z,s:s,s:z,s:d,s:d,s:z,s:K}",
+             "name",        kmod_module_get_name (node->mod),
+             "path",        node->path,
+             "status",      modprobe_status_str[node->status],
+             "error",       error,
+             "start",       dnode->start,
+             "time",        dnode->time,
+             "decompress",  node->insert.method,
+             "avoided",     (unsigned long long) node->insert.avoided);
+    if (item == NULL) {
+      Py_DECREF (ret);
+      free (order);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM (ret, i, item);
+  }
+
+  free (order);
+
+  return ret;
+} // modprobe_result
+
+/***********************************************************************
+ *
+ * modprobe_closure_cmp:
+ *
+ *   Load order of the nodes of Context._closure, the nodes left on a
+ *   dependency cycle, never read, last by name.
+ *
+ ***********************************************************************/
+static int
+modprobe_closure_cmp (
+  const void  *a,
+  const void  *b
+  )
+{
+  const struct modprobe_node *na = *(struct modprobe_node * const *) a;
+  const struct modprobe_node *nb = *(struct modprobe_node * const *) b;
+  unsigned sa = na->seq ? na->seq : UINT_MAX;
+  unsigned sb = nb->seq ? nb->seq : UINT_MAX;
+
+  if (sa != sb)
+    return sa < sb ? -1 : 1;
+
+  return strcmp (kmod_module_get_name (na->mod), kmod_module_get_name (nb->mod));
+} // modprobe_closure_cmp
+
+/***********************************************************************
+ *
+ * modprobe_str_cmp:
+ *
+ ***********************************************************************/
+static int
+modprobe_str_cmp (
+  const void  *a,
+  const void  *b
+  )
+{
+  return strcmp (*(const char * const *) a, *(const char * const *) b);
+} // modprobe_str_cmp
+
+/***********************************************************************
+ *
+ * modprobe_closure_result:
+ *
+ *   Dict of Context._closure from the nodes read, with the GIL. Missing
+ *   is the list of the names no module matched.
+ *
+ ***********************************************************************/
+static PyObject *
+modprobe_closure_result (
+  struct kmodule_modprobe *mp,
+  PyObject                *missing
+  )
+{
+  struct modprobe_node  **order;
+  const char  **firmware = NULL;
+  PyObject    *modules = NULL, *paths = NULL, *builtin = NULL;
+  PyObject    *fw = NULL, *errors = NULL, *ret = NULL;
+  unsigned    i, j, nfirmware = 0, nfirmware_alloc = 0;
+
+  order = calloc (mp->dag.count + 1, sizeof (*order));
+  if (order == NULL)
+    return PyErr_NoMemory ();
+
+  for (i = 0; i < mp->dag.count; i++)
+    order[i] = mp->dag.nodes[i].data;
+  qsort (order, mp->dag.count, sizeof (*order), modprobe_closure_cmp);
+
+  //
+  // The firmware fields point into the blobs, sorted to drop the
+  // duplicates.
+  //
+  for (i = 0; i < mp->dag.count; i++) {
+    const struct kmodule_modinfo_blob   *blob = order[i]->blob;
+    const struct kmodule_modinfo_field  *fields;
+
+    if (blob == NULL)
+      continue;
+
+    fields = (const struct kmodule_modinfo_field *) (blob + 1);
+    for (j = 0; j < blob->count; j++) {
+      if (fields[j].keylen != 8 || memcmp ((const char *) blob + fields[j].key, "firmware", 8) != 0)
+        continue;
+
+      if (nfirmware == nfirmware_alloc) {
+        unsigned alloc = nfirmware_alloc ? nfirmware_alloc * 2 : 64;
+        void *tmp = realloc (firmware, alloc * sizeof (*firmware));
+
+        if (tmp == NULL) {
+          PyErr_NoMemory ();
+          goto end;
+        }
+        firmware = tmp;
+        nfirmware_alloc = alloc;
+      }
+      firmware[nfirmware++] = (const char *) blob + fields[j].value;
+    }
+  }
+  if (nfirmware > 1)
+    qsort (firmware, nfirmware, sizeof (*firmware), modprobe_str_cmp);
+
+  modules = PyList_New (0);
+  paths   = PyList_New (0);
+  builtin = PyList_New (0);
+  fw      = PyList_New (0);
+  errors  = PyDict_New ();
+  if (modules == NULL || paths == NULL || builtin == NULL || fw == NULL || errors == NULL)
+    goto end;
+
+  for (i = 0; i < mp->dag.count; i++) {
+    struct modprobe_node *node = order[i];
+    const char *name = kmod_module_get_name (node->mod);
+    const char *error = node->error;
+    PyObject   *item;
+    int        err;
+
+    if (node->seq == 0)
+      error = "Dependency cycle";
+
+    if (error != NULL) {
+      item = PyUnicode_FromString (error);
+      if (item == NULL || PyDict_SetItemString (errors, name, item) < 0) {
+        Py_XDECREF (item);
+        goto end;
+      }
+      Py_DECREF (item);
+    }
+
+    if (node->path == NULL) {
+      item = PyUnicode_FromString (name);
+      if (item == NULL || PyList_Append (builtin, item) < 0) {
+        Py_XDECREF (item);
+        goto end;
+      }
+      Py_DECREF (item);
+      continue;
+    }
+
+    item = PyUnicode_FromString (name);
+    err = item == NULL ? -1 : PyList_Append (modules, item);
+    Py_XDECREF (item);
+    if (err < 0)
+      goto end;
+
+    item = PyUnicode_FromString (node->path);
+    err = item == NULL ? -1 : PyList_Append (paths, item);
+    Py_XDECREF (item);
+    if (err < 0)
+      goto end;
+  }
+
+  for (i = 0; i < nfirmware; i++) {
+    PyObject *item;
+    int      err;
+
+    if (i > 0 && strcmp (firmware[i - 1], firmware[i]) == 0)
+      continue;
+
+    item = PyUnicode_FromString (firmware[i]);
+    err = item == NULL ? -1 : PyList_Append (fw, item);
+    Py_XDECREF (item);
+    if (err < 0)
+      goto end;
+  }
+
+  ret = Py_BuildValue ("{s:N,s:N,s:N,s:N,s:N,s:O}",
+          "modules",  PyList_AsTuple (modules),
+          "paths",    PyList_AsTuple (paths),
+          "builtin",  PyList_AsTuple (builtin),
+          "firmware", PyList_AsTuple (fw),
+          "missing",  PyList_AsTuple (missing),
+          "errors",   errors);
+
+end:
+  Py_XDECREF (modules);
+  Py_XDECREF (paths);
+  Py_XDECREF (builtin);
+  Py_XDECREF (fw);
+  Py_XDECREF (errors);
+  free (firmware);
+  free (order);
+
+  return ret;
+} // modprobe_closure_result
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule internal function
+///
+///   The same insertion for callers that find the modules themselves,
+///   coldplug. All but kmodule_modprobe_result() are called with the
+///   Context lock held and without the GIL.
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_modprobe_new:
+ *
+ *   Insert is the python backend as in Context._modprobe, or NULL.
+ *   Config, when not NULL, must outlive the modprobe.
+ *
+ ***********************************************************************/
+struct kmodule_modprobe *
+kmodule_modprobe_new (
+  struct kmod_ctx       *ctx,
+  struct kmodule_config *config,
+  int                   decompress,
+  PyObject              *insert
+  )
+{
+  struct kmodule_modprobe *mp;
+
+  mp = calloc (1, sizeof (*mp));
+  if (mp == NULL)
+    return NULL;
+
+  mp->ctx        = ctx;
+  mp->config     = config;
+  mp->insert     = insert;
+  mp->decompress = decompress;
+  mp->index      = hash_new (64, NULL);
+  if (mp->index == NULL) {
+    free (mp);
+    return NULL;
+  }
+
+  return mp;
+} // kmodule_modprobe_new
+
+/***********************************************************************
+ *
+ * kmodule_modprobe_add:
+ *
+ *   Add Mod with its dependencies and softdeps. Returns 0 or a negative
+ *   errno.
+ *
+ ***********************************************************************/
+int
+kmodule_modprobe_add (
+  struct kmodule_modprobe *mp,
+  struct kmod_module      *mod
+  )
+{
+  int index = modprobe_add (mp, mod, true);
+
+  return index < 0 ? index : 0;
+} // kmodule_modprobe_add
+
+/***********************************************************************
+ *
+ * kmodule_modprobe_run:
+ *
+ ***********************************************************************/
+int
+kmodule_modprobe_run (
+  struct kmodule_modprobe *mp,
+  PyObject                *Context,
+  int                     jobs
+  )
+{
+  return modprobe_run (mp, Context, jobs);
+} // kmodule_modprobe_run
+
+/***********************************************************************
+ *
+ * kmodule_modprobe_result:
+ *
+ *   Tuple of dict as Context._modprobe returns, with the GIL.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_modprobe_result (
+  struct kmodule_modprobe *mp
+  )
+{
+  return modprobe_result (mp);
+} // kmodule_modprobe_result
+
+/***********************************************************************
+ *
+ * kmodule_modprobe_free:
+ *
+ ***********************************************************************/
+void
+kmodule_modprobe_free (
+  struct kmodule_modprobe *mp
+  )
+{
+  if (mp == NULL)
+    return;
+
+  modprobe_free (mp);
+  free (mp);
+} // kmodule_modprobe_free
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule public function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_modprobe:
+ *
+ *   Context._modprobe (modules, parameter=None, jobs=1, insert=None)
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_modprobe (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  PyObject    *modules, *insert = Py_None, *ret = NULL;
+  char        *Parameters = NULL;
+  int         jobs = 1;
+  const char  **names;
+  const char  *missing = NULL;
+  Py_ssize_t  i, count;
+  int         err = 0;
+
+  struct kmod_ctx *ctx;
+  struct kmodule_modprobe mp;
+
+  static char   *kwlist[] = {"modules", "parameter", "jobs", "insert", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "O|ziO",
+      kwlist,
+      &modules,
+      &Parameters,
+      &jobs,
+      &insert)) {
+    return NULL;
+  }
+
+  ctx = kmodule_context_get (Self);
+  if (ctx == NULL)
+    return NULL;
+
+  if (insert != Py_None && !PyCallable_Check (insert)) {
+    PyErr_Format (PyExc_TypeError, "insert must be callable.");
+    return NULL;
+  }
+
+  modules = PySequence_Fast (modules, "modules must be a sequence.");
+  if (modules == NULL)
+    return NULL;
+
+  count = PySequence_Fast_GET_SIZE (modules);
+  names = PyMem_Calloc (count + 1, sizeof (char *));
+  if (names == NULL) {
+    Py_DECREF (modules);
+    return PyErr_NoMemory ();
+  }
+
+  for (i = 0; i < count; i++) {
+    names[i] = PyUnicode_AsUTF8 (PySequence_Fast_GET_ITEM (modules, i));
+    if (names[i] == NULL)
+      goto end;
+  }
+
+  memset (&mp, 0, sizeof (mp));
+  mp.ctx           = ctx;
+  mp.extra_options = Parameters;
+  mp.insert        = insert != Py_None ? insert : NULL;
+  mp.decompress    = ((KmodContextObject *) Self)->decompress;
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+
+  mp.ctx    = ctx = ((KmodContextObject *) Self)->ctx;
+  mp.config = kmodule_config_ref (((KmodContextObject *) Self)->config);
+  mp.index  = hash_new (64, NULL);
+  if (mp.index == NULL)
+    err = -ENOMEM;
+
+  for (i = 0; i < count && err == 0; i++) {
+    struct kmod_list *l, *list = NULL;
+
+    KMODULE_STATS_START (start);
+    err = kmod_module_new_from_lookup (ctx, names[i], &list);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+    if (err < 0 || list == NULL) {
+      missing = names[i];
+      err = err < 0 ? err : -ENOENT;
+      break;
+    }
+
+    kmod_list_foreach (l, list) {
+      struct kmod_module *mod = kmod_module_get_module (l);
+      int index;
+
+      if (mp.config != NULL &&
+          kmodule_config_blacklisted (mp.config, kmod_module_get_name (mod)) &&
+          modprobe_is_alias (names[i], kmod_module_get_name (mod))) {
+        kmod_module_unref (mod);
+        continue;
+      }
+
+      index = modprobe_add (&mp, mod, true);
+      kmod_module_unref (mod);
+      if (index < 0) {
+        err = index;
+        break;
+      }
+    }
+    kmod_module_unref_list (list);
+  }
+
+  if (err == 0)
+    err = modprobe_run (&mp, Self, jobs);
+
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  if (missing != NULL)
+    PyErr_Format (PyExc_OSError, "Module %s not found.\n", missing);
+  else if (err < 0)
+    PyErr_Format (PyExc_OSError, "modprobe failed: %s\n", strerror (-err));
+  else
+    ret = modprobe_result (&mp);
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+  if (mp.index != NULL)
+    modprobe_free (&mp);
+  kmodule_config_unref (mp.config);
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+end:
+  PyMem_Free (names);
+  Py_DECREF (modules);
+
+  return ret;
+
+} // kmodule_modprobe
+
+/***********************************************************************
+ *
+ * kmodule_closure:
+ *
+ *   Context._closure (modules, jobs=1)
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_closure (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  PyObject    *modules, *missing = NULL, *ret = NULL;
+  int         jobs = 1;
+  const char  **names;
+  bool        *lost = NULL;
+  Py_ssize_t  i, count;
+  int         err = 0;
+
+  struct kmod_ctx *ctx;
+  struct kmodule_modprobe mp;
+
+  static char   *kwlist[] = {"modules", "jobs", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "O|i",
+      kwlist,
+      &modules,
+      &jobs)) {
+    return NULL;
+  }
+
+  ctx = kmodule_context_get (Self);
+  if (ctx == NULL)
+    return NULL;
+
+  modules = PySequence_Fast (modules, "modules must be a sequence.");
+  if (modules == NULL)
+    return NULL;
+
+  count = PySequence_Fast_GET_SIZE (modules);
+  names = PyMem_Calloc (count + 1, sizeof (char *));
+  lost  = PyMem_Calloc (count + 1, sizeof (bool));
+  if (names == NULL || lost == NULL) {
+    PyErr_NoMemory ();
+    goto end;
+  }
+
+  for (i = 0; i < count; i++) {
+    names[i] = PyUnicode_AsUTF8 (PySequence_Fast_GET_ITEM (modules, i));
+    if (names[i] == NULL)
+      goto end;
+  }
+
+  memset (&mp, 0, sizeof (mp));
+  atomic_init (&mp.seq, 0);
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+
+  mp.ctx    = ctx = ((KmodContextObject *) Self)->ctx;
+  mp.config = kmodule_config_ref (((KmodContextObject *) Self)->config);
+  mp.cache  = ((KmodContextObject *) Self)->cache;
+  mp.index  = hash_new (64, NULL);
+  if (mp.index == NULL)
+    err = -ENOMEM;
+
+  for (i = 0; i < count && err == 0; i++) {
+    struct kmod_list *l, *list = NULL;
+
+    KMODULE_STATS_START (start);
+    err = kmod_module_new_from_lookup (ctx, names[i], &list);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+    if (err < 0 || list == NULL) {
+      lost[i] = true;
+      err = 0;
+      continue;
+    }
+
+    kmod_list_foreach (l, list) {
+      struct kmod_module *mod = kmod_module_get_module (l);
+      int index;
+
+      if (mp.config != NULL &&
+          kmodule_config_blacklisted (mp.config, kmod_module_get_name (mod)) &&
+          modprobe_is_alias (names[i], kmod_module_get_name (mod))) {
+        kmod_module_unref (mod);
+        continue;
+      }
+
+      index = modprobe_add (&mp, mod, false);
+      kmod_module_unref (mod);
+      if (index < 0) {
+        err = index;
+        break;
+      }
+    }
+    kmod_module_unref_list (list);
+  }
+
+  if (err == 0)
+    err = modprobe_workers_new (&mp, jobs);
+  if (err == 0)
+    err = kmodule_dag_run (&mp.dag, jobs < 1 ? 1 : jobs, modprobe_closure_read, &mp);
+  modprobe_workers_free (&mp);
+
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  if (err < 0) {
+    PyErr_Format (PyExc_OSError, "closure failed: %s\n", strerror (-err));
+  } else {
+    missing = PyList_New (0);
+    for (i = 0; i < count && missing != NULL; i++) {
+      if (lost[i] && PyList_Append (missing, PySequence_Fast_GET_ITEM (modules, i)) < 0)
+        Py_CLEAR (missing);
+    }
+    if (missing != NULL)
+      ret = modprobe_closure_result (&mp, missing);
+    Py_XDECREF (missing);
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+  if (mp.index != NULL)
+    modprobe_free (&mp);
+  kmodule_config_unref (mp.config);
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+end:
+  PyMem_Free (lost);
+  PyMem_Free (names);
+  Py_DECREF (modules);
+
+  return ret;
+
+} // kmodule_closure
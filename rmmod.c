@@ -22,11 +22,15 @@
 #define PYSAMPLE_MODULE
 #include "structmember.h"
 
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <libkmod/libkmod.h>
 
+#include <shared/hash.h>
 #include <shared/util.h>
 #include <tools/kmod.h>
+
+#include "kmodule.h"
 #else
 #include <errno.h>
 #include <getopt.h>
@@ -121,6 +125,8 @@ static int check_module_inuse(struct kmod_module *mod) {
  *
  * kmodule_rmmod:
  *
+ *   Context._rmmod (modules, force=False, wait=False, verbose=0)
+ *
  ***********************************************************************/
 PyObject *
 kmodule_rmmod (
@@ -141,8 +147,8 @@ kmodule_rmmod (
       "O|ppi",
       kwlist,
       &modules,
-      &wait,
       &force,
+      &wait,
       &verbose)) {
     return NULL;
   }
@@ -151,34 +157,35 @@ kmodule_rmmod (
   if (1)
   {
     struct kmod_ctx *ctx;
-    const char      *null_config = NULL;
     struct kmod_module *mod;
 
-    Py_ssize_t      i, mNum;
+    Py_ssize_t      i, mNum, failed = -1;
     PyObject        *modName;
+    const char      **modStrs;
+    int             err = 0;
+    int             prio;
 
     int flags = KMOD_REMOVE_NOWAIT;
 
     if (force) flags |=  KMOD_REMOVE_FORCE;
     if (wait)  flags &= ~KMOD_REMOVE_NOWAIT;
 
-    ctx = kmod_new(NULL, &null_config);
-      if (!ctx) {
-        ERR("kmod_new() failed!\n");
-        PyErr_Format (PyExc_MemoryError, "kmod_new() failed!");
-        return NULL;
-      }
-
-    ret = Py_None;
-    Py_INCREF (Py_None);
-    log_setup_kmod_log(ctx, verbose);
+    ctx = kmodule_context_get (Self);
+    if (!ctx)
+      return NULL;
 
     mNum = PyTuple_Size (modules);
-    for (i = 0; i < mNum; i++) {
+    if (mNum < 0)
+      return NULL;
 
-      const char *modStr;
-      struct stat st;
-      int         err;
+    //
+    // Collect the names first, the removal itself runs without the GIL.
+    //
+    modStrs = PyMem_Calloc (mNum + 1, sizeof (char *));
+    if (modStrs == NULL)
+      return PyErr_NoMemory ();
+
+    for (i = 0; i < mNum; i++) {
 
       modName = PyTuple_GetItem (modules, i);
       if (modName == NULL) {
@@ -186,31 +193,59 @@ kmodule_rmmod (
         PyErr_Clear ();
         continue;
       }
-      modStr = PyUnicode_AsUTF8 (modName);
-      if (modStr == NULL) {
+      modStrs[i] = PyUnicode_AsUTF8 (modName);
+      if (modStrs[i] == NULL) {
         PyErr_Print ();
         PyErr_Clear ();
         continue;
       }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    kmodule_context_lock (Self);
+
+    ctx = ((KmodContextObject *) Self)->ctx;
 
+    //
+    // verbose raises the libkmod messages of this call only, the
+    // Context log_priority is put back after it.
+    //
+    prio = kmod_get_log_priority (ctx);
+    if (verbose > prio)
+      kmod_set_log_priority (ctx, verbose);
+
+    for (i = 0; i < mNum; i++) {
+
+      const char *modStr = modStrs[i];
+      struct stat st;
+
+      if (modStr == NULL)
+        continue;
+
+      KMODULE_STATS_START (start);
       if (stat(modStr, &st) == 0)
         err = kmod_module_new_from_path(ctx, modStr, &mod);
       else
         err = kmod_module_new_from_name(ctx, modStr, &mod);
+      KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
 
       if (err < 0) {
         ERR("could not use module %s: %s\n", modStr, strerror(-err));
-        PyErr_Format (PyExc_OSError, "could not use module %s: %s\n", modStr, strerror(-err));
-        ret = NULL;
-        Py_DECREF (Py_None);
+        failed = i;
         break;
       }
 
-      if (!(flags & KMOD_REMOVE_FORCE) && check_module_inuse(mod) < 0) {
-        goto next;
+      if (!(flags & KMOD_REMOVE_FORCE)) {
+        KMODULE_STATS_START (state);
+        err = check_module_inuse(mod);
+        KMODULE_STATS_PHASE (KMODULE_PHASE_STATE, state);
+        if (err < 0)
+          goto next;
       }
 
+      KMODULE_STATS_START (remove);
       err = kmod_module_remove_module(mod, flags);
+      KMODULE_STATS_PHASE (KMODULE_PHASE_DELETE_MODULE, remove);
       if (err < 0) {
         ERR ("could not remove module %s: %s\n", modStr, strerror(-err));
       }
@@ -219,13 +254,616 @@ next:
 
     }
 
-    kmod_unref(ctx);
+    kmod_set_log_priority (ctx, prio);
+
+    kmodule_context_unlock (Self);
+    Py_END_ALLOW_THREADS
+
+    if (failed >= 0) {
+      PyErr_Format (PyExc_OSError, "could not use module %s: %s\n", modStrs[failed], strerror(-err));
+      ret = NULL;
+    } else {
+      ret = Py_None;
+      Py_INCREF (Py_None);
+    }
+
+    PyMem_Free (modStrs);
   }
 
   return ret;
 
 } // kmodule_rmmod
 
+///////////////////////////////////////////////////////////////////////
+///
+/// Batch removal
+///
+///   /proc/modules is read once into a holder graph. Every module to
+///   remove is a kmodule_dag node, with a required edge from each holder
+///   to the module it holds, so a module is only removed after all its
+///   holders in the batch are gone and is skipped when one of them
+///   failed. Modules that do not hold each other are removed on Jobs
+///   threads at the same time.
+///
+///////////////////////////////////////////////////////////////////////
+
+enum rmmod_status {
+  RMMOD_PENDING = 0,
+  RMMOD_REMOVED,
+  RMMOD_BUSY,
+  RMMOD_BUILTIN,
+  RMMOD_NOT_LOADED,
+  RMMOD_FAILED,
+};
+
+static const char *rmmod_status_str [] = {
+  "skipped",
+  "removed",
+  "busy",
+  "builtin",
+  "not loaded",
+  "failed",
+};
+
+struct rmmod_node {
+  struct kmod_module  *mod;
+  char                *holders;     // "a,b," of the snapshot, NULL for none
+  bool                outside;      // held by a module not in the batch
+  int                 status;
+};
+
+struct rmmod_batch {
+  struct kmodule_dag          dag;
+  struct hash                 *index;
+  struct hash                 *proc;
+  struct kmodule_proc_module  *mods;
+  int                         flags;
+  bool                        recursive;
+  const char                  *dirname;
+  struct kmod_ctx             **workers;  // kmod_ctx of each worker, NULL for one job
+  unsigned                    nworkers;
+};
+
+/***********************************************************************
+ *
+ * rmmod_node_new:
+ *
+ *   Node of Mod, added when the batch does not have it yet. Returns the
+ *   node index or a negative errno, *Created tells whether it is new.
+ *
+ ***********************************************************************/
+static int
+rmmod_node_new (
+  struct rmmod_batch  *rb,
+  struct kmod_module  *mod,
+  bool                *created
+  )
+{
+  struct rmmod_node *node;
+  const char *name = kmod_module_get_name (mod);
+  int index;
+
+  *created = false;
+
+  index = (int) (intptr_t) hash_find (rb->index, name) - 1;
+  if (index >= 0)
+    return index;
+
+  node = calloc (1, sizeof (*node));
+  if (node == NULL)
+    return -ENOMEM;
+
+  index = kmodule_dag_add (&rb->dag, node);
+  if (index < 0) {
+    free (node);
+    return index;
+  }
+
+  node->mod = kmod_module_ref (mod);
+  *created = true;
+
+  //
+  // hash_add does not copy the key, the name lives as long as the module.
+  //
+  return hash_add (rb->index, name, (void *) (intptr_t) (index + 1)) < 0 ? -ENOMEM : index;
+} // rmmod_node_new
+
+/***********************************************************************
+ *
+ * rmmod_link:
+ *
+ *   Look node Index up in the snapshot and order its holders ahead of
+ *   it. With Recursive the holders are added to the batch, otherwise a
+ *   holder not in the batch marks the node in use. Called with the
+ *   Context lock held and without the GIL.
+ *
+ ***********************************************************************/
+static int
+rmmod_link (
+  struct rmmod_batch  *rb,
+  struct kmod_ctx     *ctx,
+  int                 index
+  )
+{
+  struct kmodule_proc_module *pm;
+  struct rmmod_node *node = rb->dag.nodes[index].data;
+  const char *p, *comma;
+  int err;
+
+  pm = hash_find (rb->proc, kmod_module_get_name (node->mod));
+  if (pm == NULL) {
+    node->status = kmod_module_get_initstate (node->mod) == KMOD_MODULE_BUILTIN ?
+                     RMMOD_BUILTIN : RMMOD_NOT_LOADED;
+    return 0;
+  }
+
+  //
+  // "-" for no holder, "[permanent]" and "[unsafe]" are not modules.
+  //
+  if (streq (pm->usedby, "-") || pm->usedby[0] == '[')
+    return 0;
+
+  node->holders = strdup (pm->usedby);
+  if (node->holders == NULL)
+    return -ENOMEM;
+
+  for (p = pm->usedby; (comma = strchr (p, ',')) != NULL; p = comma + 1) {
+    char    *holder;
+    bool    created = false;
+    int     h;
+
+    holder = strndup (p, comma - p);
+    if (holder == NULL)
+      return -ENOMEM;
+
+    h = (int) (intptr_t) hash_find (rb->index, holder) - 1;
+    if (h < 0 && rb->recursive) {
+      struct kmod_module *hmod;
+
+      err = kmod_module_new_from_name (ctx, holder, &hmod);
+      if (err < 0) {
+        free (holder);
+        return err;
+      }
+      h = rmmod_node_new (rb, hmod, &created);
+      kmod_module_unref (hmod);
+      if (h < 0) {
+        free (holder);
+        return h;
+      }
+    }
+
+    free (holder);
+
+    if (h < 0) {
+      node->outside = true;
+      continue;
+    }
+
+    //
+    // The node array may move while the holders are added.
+    //
+    if (created) {
+      err = rmmod_link (rb, ctx, h);
+      if (err < 0)
+        return err;
+      node = rb->dag.nodes[index].data;
+    }
+
+    err = kmodule_dag_edge (&rb->dag, h, index, true);
+    if (err < 0)
+      return err;
+  }
+
+  return 0;
+} // rmmod_link
+
+/***********************************************************************
+ *
+ * rmmod_worker_module:
+ *
+ *   The module of Node for Worker: the node one on a single job, else
+ *   one of the worker kmod_ctx, made on its first use. A kmod_ctx is
+ *   not thread safe, the workers never share one.
+ *
+ ***********************************************************************/
+static int
+rmmod_worker_module (
+  struct rmmod_batch  *rb,
+  unsigned            worker,
+  struct rmmod_node   *node,
+  struct kmod_module  **mod
+  )
+{
+  struct kmod_ctx *ctx;
+  const char *null_config = NULL;
+
+  if (rb->workers == NULL) {
+    *mod = kmod_module_ref (node->mod);
+    return 0;
+  }
+
+  ctx = rb->workers[worker];
+  if (ctx == NULL) {
+    KMODULE_STATS_START (start);
+    ctx = kmod_new (rb->dirname, &null_config);
+    if (ctx != NULL)
+      kmodule_log_attach (ctx);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_CONTEXT, start);
+    if (ctx == NULL)
+      return -ENOMEM;
+    rb->workers[worker] = ctx;
+  }
+
+  return kmod_module_new_from_name (ctx, kmod_module_get_name (node->mod), mod);
+} // rmmod_worker_module
+
+/***********************************************************************
+ *
+ * rmmod_remove:
+ *
+ *   kmodule_dag_fn, runs on the worker threads.
+ *
+ ***********************************************************************/
+static int
+rmmod_remove (
+  void                    *data,
+  struct kmodule_dag_node *dnode,
+  unsigned                worker
+  )
+{
+  struct rmmod_batch  *rb = data;
+  struct rmmod_node   *node = dnode->data;
+  struct kmod_module  *mod;
+  int err;
+
+  if (node->status == RMMOD_BUILTIN || node->status == RMMOD_NOT_LOADED)
+    return -ENOENT;
+
+  if (node->outside && !(rb->flags & KMOD_REMOVE_FORCE)) {
+    node->status = RMMOD_BUSY;
+    return -EBUSY;
+  }
+
+  err = rmmod_worker_module (rb, worker, node, &mod);
+  if (err < 0) {
+    node->status = RMMOD_FAILED;
+    return err;
+  }
+
+  KMODULE_STATS_START (start);
+  err = kmod_module_remove_module (mod, rb->flags);
+  KMODULE_STATS_PHASE (KMODULE_PHASE_DELETE_MODULE, start);
+  kmod_module_unref (mod);
+  if (err == -EWOULDBLOCK || err == -EAGAIN || err == -EBUSY)
+    node->status = RMMOD_BUSY;
+  else if (err == -ENOENT)
+    node->status = RMMOD_NOT_LOADED;
+  else
+    node->status = err < 0 ? RMMOD_FAILED : RMMOD_REMOVED;
+
+  return err < 0 ? err : 0;
+} // rmmod_remove
+
+/***********************************************************************
+ *
+ * rmmod_free:
+ *
+ *   Called with the Context lock held and without the GIL.
+ *
+ ***********************************************************************/
+static void
+rmmod_free (
+  struct rmmod_batch  *rb
+  )
+{
+  unsigned i;
+
+  for (i = 0; i < rb->dag.count; i++) {
+    struct rmmod_node *node = rb->dag.nodes[i].data;
+
+    kmod_module_unref (node->mod);
+    free (node->holders);
+    free (node);
+  }
+
+  kmodule_dag_free (&rb->dag);
+  if (rb->index != NULL)
+    hash_free (rb->index);
+  if (rb->proc != NULL)
+    hash_free (rb->proc);
+  free (rb->mods);
+} // rmmod_free
+
+/***********************************************************************
+ *
+ * rmmod_holders:
+ *
+ *   "a,b," -> ('a', 'b'), NULL -> ()
+ *
+ ***********************************************************************/
+static PyObject *
+rmmod_holders (
+  const char  *holders
+  )
+{
+  PyObject    *list, *ret;
+  const char  *p, *comma;
+
+  list = PyList_New (0);
+  if (list == NULL)
+    return NULL;
+
+  for (p = holders; p != NULL && (comma = strchr (p, ',')) != NULL; p = comma + 1) {
+    PyObject *item = PyUnicode_FromStringAndSize (p, comma - p);
+
+    if (item == NULL || PyList_Append (list, item) < 0) {
+      Py_XDECREF (item);
+      Py_DECREF (list);
+      return NULL;
+    }
+    Py_DECREF (item);
+  }
+
+  ret = PyList_AsTuple (list);
+  Py_DECREF (list);
+
+  return ret;
+} // rmmod_holders
+
+/***********************************************************************
+ *
+ * rmmod_seq:
+ *
+ *   Sort key of Dnode: its finish order, after all of them for a node
+ *   Fn did not run on.
+ *
+ ***********************************************************************/
+static unsigned
+rmmod_seq (
+  const struct kmodule_dag_node *dnode
+  )
+{
+  return dnode->seq != 0 ? dnode->seq : UINT_MAX;
+} // rmmod_seq
+
+/***********************************************************************
+ *
+ * rmmod_result:
+ *
+ ***********************************************************************/
+static PyObject *
+rmmod_result (
+  struct rmmod_batch  *rb
+  )
+{
+  PyObject  *ret;
+  unsigned  i, j, *order;
+
+  //
+  // Report in the order the modules were removed, those never tried
+  // last.
+  //
+  order = calloc (rb->dag.count + 1, sizeof (unsigned));
+  if (order == NULL)
+    return PyErr_NoMemory ();
+
+  for (i = 0; i < rb->dag.count; i++) {
+    for (j = i; j > 0 && rmmod_seq (&rb->dag.nodes[order[j - 1]]) > rmmod_seq (&rb->dag.nodes[i]); j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+
+  ret = PyTuple_New (rb->dag.count);
+  if (ret == NULL) {
+    free (order);
+    return NULL;
+  }
+
+  for (i = 0; i < rb->dag.count; i++) {
+    struct kmodule_dag_node *dnode = &rb->dag.nodes[order[i]];
+    struct rmmod_node       *node = dnode->data;
+    const char *error = NULL;
+    PyObject   *item;
+
+    if (dnode->err == -ECANCELED)
+      error = "Holder not removed";
+    else if (dnode->err == -ELOOP)
+      error = "Holder cycle";
+    else if (node->status == RMMOD_BUSY && node->outside)
+      error = "Module is in use";
+    else if (node->status == RMMOD_FAILED)
+      error = strerror (-dnode->err);
+
+    item = Py_BuildValue ("{s:s,s:s,s:N,s:z,s:d,s:d}",
+             "name",     kmod_module_get_name (node->mod),
+             "status",   rmmod_status_str[node->status],
+             "holders",  rmmod_holders (node->holders),
+             "error",    error,
+             "start",    dnode->start,
+             "time",     dnode->time);
+    if (item == NULL) {
+      Py_DECREF (ret);
+      free (order);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM (ret, i, item);
+  }
+
+  free (order);
+
+  return ret;
+} // rmmod_result
+
+/***********************************************************************
+ *
+ * kmodule_rmmod_batch:
+ *
+ *   Context._rmmod_batch (modules, force=False, wait=False,
+ *                         recursive=False, jobs=1, proc="/proc/modules")
+ *
+ *   Remove every module of the sequence, and with recursive the modules
+ *   holding them, in holder order. Returns a tuple of dict, one per
+ *   module.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_rmmod_batch (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  PyObject    *modules, *ret = NULL;
+  int         force = 0, wait = 0, recursive = 0, jobs = 1;
+  const char  *proc = "/proc/modules";
+  const char  **names;
+  const char  *missing = NULL;
+  Py_ssize_t  i, count;
+  int         n, err = 0;
+
+  struct kmod_ctx     *ctx;
+  struct rmmod_batch  rb;
+
+  static char   *kwlist[] = {"modules", "force", "wait", "recursive", "jobs", "proc", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "O|pppis",
+      kwlist,
+      &modules,
+      &force,
+      &wait,
+      &recursive,
+      &jobs,
+      &proc)) {
+    return NULL;
+  }
+
+  ctx = kmodule_context_get (Self);
+  if (ctx == NULL)
+    return NULL;
+
+  modules = PySequence_Fast (modules, "modules must be a sequence.");
+  if (modules == NULL)
+    return NULL;
+
+  count = PySequence_Fast_GET_SIZE (modules);
+  names = PyMem_Calloc (count + 1, sizeof (char *));
+  if (names == NULL) {
+    Py_DECREF (modules);
+    return PyErr_NoMemory ();
+  }
+
+  for (i = 0; i < count; i++) {
+    names[i] = PyUnicode_AsUTF8 (PySequence_Fast_GET_ITEM (modules, i));
+    if (names[i] == NULL)
+      goto end;
+  }
+
+  memset (&rb, 0, sizeof (rb));
+  rb.flags     = KMOD_REMOVE_NOWAIT;
+  rb.recursive = recursive;
+  if (force) rb.flags |=  KMOD_REMOVE_FORCE;
+  if (wait)  rb.flags &= ~KMOD_REMOVE_NOWAIT;
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+
+  ctx = ((KmodContextObject *) Self)->ctx;
+
+  rb.index = hash_new (64, NULL);
+  rb.proc  = hash_new (256, NULL);
+  if (rb.index == NULL || rb.proc == NULL)
+    err = -ENOMEM;
+
+  if (err == 0) {
+    //
+    // No /proc/modules is a kernel without loadable modules.
+    //
+    KMODULE_STATS_START (start);
+    n = kmodule_proc_modules (proc, &rb.mods);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_STATE, start);
+    if (n < 0 && n != -ENOENT)
+      err = n;
+    for (i = 0; i < n && err == 0; i++)
+      err = hash_add (rb.proc, rb.mods[i].name, &rb.mods[i]);
+  }
+
+  //
+  // Every name is added before any holder is looked at, so a holder
+  // named in the batch orders the removal without Recursive as well.
+  //
+  for (i = 0; i < count && err == 0; i++) {
+    struct kmod_module *mod;
+    struct stat st;
+    bool created;
+
+    if (stat (names[i], &st) == 0)
+      err = kmod_module_new_from_path (ctx, names[i], &mod);
+    else
+      err = kmod_module_new_from_name (ctx, names[i], &mod);
+    if (err < 0) {
+      missing = names[i];
+      break;
+    }
+
+    n = rmmod_node_new (&rb, mod, &created);
+    kmod_module_unref (mod);
+    if (n < 0)
+      err = n;
+  }
+
+  for (i = 0, count = rb.dag.count; i < count && err == 0; i++)
+    err = rmmod_link (&rb, ctx, i);
+
+  //
+  // Each worker removes through its own kmod_ctx, a single job through
+  // the Context one.
+  //
+  if (err == 0 && jobs > 1 && rb.dag.count > 1) {
+    rb.dirname  = kmod_get_dirname (ctx);
+    rb.workers  = calloc (jobs, sizeof (struct kmod_ctx *));
+    rb.nworkers = jobs;
+    if (rb.workers == NULL)
+      err = -ENOMEM;
+  }
+
+  if (err == 0)
+    err = kmodule_dag_run (&rb.dag, jobs < 1 ? 1 : jobs, rmmod_remove, &rb);
+
+  for (i = 0; rb.workers != NULL && i < (Py_ssize_t) rb.nworkers; i++) {
+    if (rb.workers[i] != NULL)
+      kmod_unref (rb.workers[i]);
+  }
+  free (rb.workers);
+
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+  if (missing != NULL)
+    PyErr_Format (PyExc_OSError, "could not use module %s: %s\n", missing, strerror (-err));
+  else if (err < 0)
+    PyErr_Format (PyExc_OSError, "rmmod failed: %s\n", strerror (-err));
+  else
+    ret = rmmod_result (&rb);
+
+  Py_BEGIN_ALLOW_THREADS
+  kmodule_context_lock (Self);
+  rmmod_free (&rb);
+  kmodule_context_unlock (Self);
+  Py_END_ALLOW_THREADS
+
+end:
+  PyMem_Free (names);
+  Py_DECREF (modules);
+
+  return ret;
+
+} // kmodule_rmmod_batch
+
 #ifndef KMODULEPY
 const struct kmod_cmd kmod_cmd_compat_rmmod = {
 	.name = "rmmod",
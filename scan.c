@@ -0,0 +1,535 @@
+/*
+ * scan.c: parallel modinfo over a whole modules directory
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// A scan runs on its own threads, the first one walking the tree
+/// before it joins the others reading .modinfo. Each thread has its
+/// own kmod_ctx, so nothing but the path list and the result queue is
+/// shared. The queue is bounded, the threads wait while the python
+/// side does not keep up.
+///
+///////////////////////////////////////////////////////////////////////
+
+#define SCAN_QUEUE    256
+
+struct scan_path {
+  char  *path;
+  int   err;            // set when the walk itself failed on Path
+};
+
+struct scan_item {
+  const char                  *path;
+  struct kmodule_modinfo_blob *blob;
+  int                         err;
+};
+
+typedef struct {
+  PyObject_HEAD
+
+  char              dirname[PATH_MAX];
+
+  pthread_mutex_t   lock;
+  pthread_cond_t    cond;
+
+  struct scan_path  *paths;
+  size_t            npaths;
+  size_t            paths_alloc;
+  size_t            next;
+  bool              walked;
+  int               walk_err;     // errno of opening dirname, 0 if it opened
+
+  struct scan_item  queue[SCAN_QUEUE];
+  unsigned          head;
+  unsigned          count;
+
+  pthread_t         *threads;
+  unsigned          nthreads;
+  unsigned          running;
+  bool              stop;
+
+  struct kmodule_cache  *cache;
+} ScanObject;
+
+/***********************************************************************
+ *
+ * scan_add:
+ *
+ *   Queue Path for the readers. Takes Path over.
+ *
+ ***********************************************************************/
+static void
+scan_add (
+  ScanObject  *Self,
+  char        *path,
+  int         err
+  )
+{
+  pthread_mutex_lock (&Self->lock);
+
+  if (Self->npaths == Self->paths_alloc) {
+    size_t alloc = Self->paths_alloc ? Self->paths_alloc * 2 : 1024;
+    void *tmp = realloc (Self->paths, alloc * sizeof (struct scan_path));
+
+    if (tmp == NULL) {
+      pthread_mutex_unlock (&Self->lock);
+      free (path);
+      return;
+    }
+    Self->paths = tmp;
+    Self->paths_alloc = alloc;
+  }
+
+  Self->paths[Self->npaths].path = path;
+  Self->paths[Self->npaths].err  = err;
+  Self->npaths++;
+
+  pthread_cond_broadcast (&Self->cond);
+  pthread_mutex_unlock (&Self->lock);
+} // scan_add
+
+/***********************************************************************
+ *
+ * scan_walk:
+ *
+ *   Queue every module file under Dirfd, which is closed on return.
+ *   Symbolic links are not followed.
+ *
+ ***********************************************************************/
+static void
+scan_walk (
+  ScanObject  *Self,
+  int         dirfd,
+  const char  *path
+  )
+{
+  DIR           *dir;
+  struct dirent *de;
+  char          *sub;
+
+  dir = fdopendir (dirfd);
+  if (dir == NULL) {
+    close (dirfd);
+    return;
+  }
+
+  while (!Self->stop && (de = readdir (dir)) != NULL) {
+    unsigned char type = de->d_type;
+    size_t len = strlen (de->d_name);
+
+    if (de->d_name[0] == '.' &&
+        (len == 1 || (len == 2 && de->d_name[1] == '.')))
+      continue;
+
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+
+      if (fstatat (dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        continue;
+      type = S_ISDIR (st.st_mode) ? DT_DIR : S_ISREG (st.st_mode) ? DT_REG : DT_LNK;
+    }
+
+    if (type == DT_REG && !path_ends_with_kmod_ext (de->d_name, len))
+      continue;
+    if (type != DT_REG && type != DT_DIR)
+      continue;
+
+    if (asprintf (&sub, "%s/%s", path, de->d_name) < 0)
+      continue;
+
+    if (type == DT_REG) {
+      scan_add (Self, sub, 0);
+    } else {
+      int fd = openat (dirfd, de->d_name,
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+      if (fd < 0) {
+        scan_add (Self, sub, -errno);
+        continue;
+      }
+      scan_walk (Self, fd, sub);
+      free (sub);
+    }
+  }
+
+  closedir (dir);
+} // scan_walk
+
+/***********************************************************************
+ *
+ * scan_read:
+ *
+ ***********************************************************************/
+static void
+scan_read (
+  struct kmod_ctx       *ctx,
+  struct kmodule_cache  *cache,
+  struct scan_item      *item
+  )
+{
+  struct kmod_module  *mod;
+
+  if (ctx == NULL) {
+    item->err = -ENOMEM;
+    return;
+  }
+
+  KMODULE_STATS_START (start);
+  item->err = kmod_module_new_from_path (ctx, item->path, &mod);
+  KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+  if (item->err < 0)
+    return;
+
+  item->err = kmodule_modinfo_read (mod, cache, &item->blob);
+
+  kmod_module_unref (mod);
+} // scan_read
+
+/***********************************************************************
+ *
+ * scan_thread:
+ *
+ ***********************************************************************/
+static void *
+scan_thread (
+  void  *arg
+  )
+{
+  ScanObject        *Self = arg;
+  struct kmod_ctx   *ctx;
+  struct scan_item  item;
+  const char        *null_config = NULL;
+
+  KMODULE_STATS_START (start);
+
+  ctx = kmod_new (Self->dirname, &null_config);
+  if (ctx != NULL)
+    kmodule_log_attach (ctx);
+
+  KMODULE_STATS_PHASE (KMODULE_PHASE_CONTEXT, start);
+
+  pthread_mutex_lock (&Self->lock);
+
+  if (!Self->walked && pthread_equal (pthread_self (), Self->threads[0])) {
+    int fd, err;
+
+    pthread_mutex_unlock (&Self->lock);
+    fd = open (Self->dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    err = fd < 0 ? errno : 0;
+    if (fd >= 0)
+      scan_walk (Self, fd, Self->dirname);
+    pthread_mutex_lock (&Self->lock);
+    Self->walk_err = err;
+    Self->walked = true;
+    pthread_cond_broadcast (&Self->cond);
+  }
+
+  for (;;) {
+    while (!Self->stop && Self->next == Self->npaths && !Self->walked)
+      pthread_cond_wait (&Self->cond, &Self->lock);
+    if (Self->stop || Self->next == Self->npaths)
+      break;
+
+    memset (&item, 0, sizeof (item));
+    item.path = Self->paths[Self->next].path;
+    item.err  = Self->paths[Self->next].err;
+    Self->next++;
+    pthread_mutex_unlock (&Self->lock);
+
+    if (item.err == 0)
+      scan_read (ctx, Self->cache, &item);
+
+    pthread_mutex_lock (&Self->lock);
+    while (!Self->stop && Self->count == SCAN_QUEUE)
+      pthread_cond_wait (&Self->cond, &Self->lock);
+    if (Self->stop) {
+      free (item.blob);
+      break;
+    }
+    Self->queue[(Self->head + Self->count++) % SCAN_QUEUE] = item;
+    pthread_cond_broadcast (&Self->cond);
+  }
+
+  //
+  // The last thread out writes what was read to the cache.
+  //
+  if (--Self->running == 0 && Self->cache != NULL)
+    kmodule_cache_save (Self->cache);
+
+  pthread_cond_broadcast (&Self->cond);
+  pthread_mutex_unlock (&Self->lock);
+
+  if (ctx != NULL)
+    kmod_unref (ctx);
+
+  return NULL;
+} // scan_thread
+
+///////////////////////////////////////////////////////////////////////
+///
+/// scan iterator type
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * Scan_dealloc:
+ *
+ *   Stops the threads of an unfinished scan.
+ *
+ ***********************************************************************/
+static void
+Scan_dealloc (
+  ScanObject  *Self
+  )
+{
+  unsigned i;
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock (&Self->lock);
+  Self->stop = true;
+  pthread_cond_broadcast (&Self->cond);
+  pthread_mutex_unlock (&Self->lock);
+
+  for (i = 0; i < Self->nthreads; i++)
+    pthread_join (Self->threads[i], NULL);
+
+  kmodule_cache_close (Self->cache);
+  Py_END_ALLOW_THREADS
+
+  for (i = 0; i < Self->count; i++)
+    free (Self->queue[(Self->head + i) % SCAN_QUEUE].blob);
+  for (i = 0; i < Self->npaths; i++)
+    free (Self->paths[i].path);
+  free (Self->paths);
+  free (Self->threads);
+
+  pthread_cond_destroy (&Self->cond);
+  pthread_mutex_destroy (&Self->lock);
+
+  PyObject_Del (Self);
+} // Scan_dealloc
+
+/***********************************************************************
+ *
+ * Scan_next:
+ *
+ *   (path, modinfo) of the next module read, in no particular order.
+ *   modinfo is the exception raised for Path when it could not be read.
+ *   OSError when the modules directory itself could not be opened.
+ *
+ ***********************************************************************/
+static PyObject *
+Scan_next (
+  ScanObject  *Self
+  )
+{
+  struct scan_item  item;
+  bool              found = false;
+  int               err;
+  PyObject          *info;
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock (&Self->lock);
+  while (Self->count == 0 && Self->running != 0)
+    pthread_cond_wait (&Self->cond, &Self->lock);
+  if (Self->count != 0) {
+    item = Self->queue[Self->head];
+    Self->head = (Self->head + 1) % SCAN_QUEUE;
+    Self->count--;
+    found = true;
+    pthread_cond_broadcast (&Self->cond);
+  }
+  err = found ? 0 : Self->walk_err;
+  Self->walk_err = 0;
+  pthread_mutex_unlock (&Self->lock);
+  Py_END_ALLOW_THREADS
+
+  //
+  // A tree that could not be opened ends the scan with its error once,
+  // rather than as an empty one.
+  //
+  if (err != 0) {
+    errno = err;
+    return PyErr_SetFromErrnoWithFilename (PyExc_OSError, Self->dirname);
+  }
+
+  if (!found)
+    return NULL;
+
+  if (item.blob != NULL) {
+    info = kmodule_modinfo_new (item.blob, NULL);
+    if (info == NULL) {
+      free (item.blob);
+      return NULL;
+    }
+  } else {
+    info = PyObject_CallFunction (PyExc_OSError, "iss",
+             -item.err, strerror (-item.err), item.path);
+    if (info == NULL)
+      return NULL;
+  }
+
+  return Py_BuildValue ("(sN)", item.path, info);
+} // Scan_next
+
+PyTypeObject ScanType = {
+
+  PyVarObject_HEAD_INIT (NULL, 0)
+
+  .tp_name      = "_kmodule._scan",
+  .tp_doc       = "iterator over the modinfo of every module of a tree",
+  .tp_basicsize = sizeof (ScanObject),
+  .tp_itemsize  = 0,
+  .tp_flags     = Py_TPFLAGS_DEFAULT,
+  .tp_dealloc   = (destructor) Scan_dealloc,
+  .tp_iter      = PyObject_SelfIter,
+  .tp_iternext  = (iternextfunc) Scan_next,
+
+}; // ScanType
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_scan:
+ *
+ *   _scan (basedir=None, kversion=None, workers=0, cache=None)
+ *
+ *   Start reading the modinfo of every module file under the modules
+ *   directory on Workers threads, one per CPU by default, and return
+ *   the iterator over the results. Cache is the one of Context.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_scan (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  char        *root = NULL, *kversion = NULL;
+  PyObject    *cache = NULL;
+  char        cache_buf[PATH_MAX];
+  int         workers = 0;
+  ScanObject  *scan;
+  struct stat st;
+  unsigned    i;
+
+  static char   *kwlist[] = {"basedir", "kversion", "workers", "cache", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "|zziO",
+      kwlist,
+      &root,
+      &kversion,
+      &workers,
+      &cache)) {
+    return NULL;
+  }
+
+  if (workers <= 0)
+    workers = sysconf (_SC_NPROCESSORS_ONLN);
+  if (workers <= 0)
+    workers = 1;
+
+  scan = PyObject_New (ScanObject, &ScanType);
+  if (scan == NULL)
+    return NULL;
+
+  memset ((char *) scan + sizeof (PyObject), 0, sizeof (ScanObject) - sizeof (PyObject));
+  pthread_mutex_init (&scan->lock, NULL);
+  pthread_cond_init (&scan->cond, NULL);
+
+  if (kmodule_dirname (root, kversion, scan->dirname, sizeof (scan->dirname)) < 0) {
+    Py_DECREF (scan);
+    return NULL;
+  }
+
+  if (stat (scan->dirname, &st) < 0 || !S_ISDIR (st.st_mode)) {
+    if (errno == 0)
+      errno = ENOTDIR;
+    PyErr_SetFromErrnoWithFilename (PyExc_OSError, scan->dirname);
+    Py_DECREF (scan);
+    return NULL;
+  }
+
+  switch (kmodule_cache_path (cache, scan->dirname, "modinfo", cache_buf, sizeof (cache_buf))) {
+  case -1:
+    Py_DECREF (scan);
+    return NULL;
+
+  case 1:
+    Py_BEGIN_ALLOW_THREADS
+    scan->cache = kmodule_cache_open (cache_buf);
+    Py_END_ALLOW_THREADS
+    if (scan->cache == NULL) {
+      Py_DECREF (scan);
+      return PyErr_NoMemory ();
+    }
+    break;
+  }
+
+  scan->threads = calloc (workers, sizeof (pthread_t));
+  if (scan->threads == NULL) {
+    Py_DECREF (scan);
+    return PyErr_NoMemory ();
+  }
+
+  //
+  // The first thread walks the tree, it checks Threads[0] under the
+  // lock so it must not look before the array is filled in.
+  //
+  pthread_mutex_lock (&scan->lock);
+  for (i = 0; i < (unsigned) workers; i++) {
+    if (pthread_create (&scan->threads[i], NULL, scan_thread, scan) != 0)
+      break;
+    scan->nthreads++;
+    scan->running++;
+  }
+  if (scan->nthreads == 0)
+    scan->walked = true;
+  pthread_mutex_unlock (&scan->lock);
+
+  if (scan->nthreads == 0) {
+    Py_DECREF (scan);
+    PyErr_Format (PyExc_OSError, "could not start scan threads.\n");
+    return NULL;
+  }
+
+  return (PyObject *) scan;
+} // kmodule_scan
@@ -35,15 +35,17 @@ class KmodFlag:
             ('with-xz',         None, 'handle Xz-compressed modules [default=disabled]'),
             ('with-zlib',       None, 'handle gzipped modules [default=disabled]'),
             ('with-openssl',    None, 'handle PKCS7 signatures [default=disabled]'),
+            ('without-stats',   None, 'leave out the kmodule.stats() timers [default=enabled]'),
         ]
 
     InstallFlag  = None
 
     ConfigString = []
     BuildString  = []
+    DefineMacros = []
 
     @classmethod
-    def BuildOptions (cls, xz, zstd, zlib, openssl):
+    def BuildOptions (cls, xz, zstd, zlib, openssl, nostats):
         if xz is not None:
             cls.ConfigString += ['--with-xz']
             cls.BuildString  += ['-llzma']
@@ -56,6 +58,8 @@ class KmodFlag:
         if openssl is not None:
             cls.ConfigString += ['--with-openssl']
             cls.BuildString  += ['-lcrypto']
+        if nostats is not None:
+            cls.DefineMacros += [('KMODULE_NO_STATS', None)]
 
 class CustomCleanCommand(clean):
 
@@ -72,11 +76,12 @@ class CustomInstallCommand(install):
         self.with_xz        = None
         self.with_zlib      = None
         self.with_openssl   = None
+        self.without_stats  = None
         super().initialize_options()
 
     def finalize_options(self):
         KmodFlag.InstallFlag    = True
-        KmodFlag.BuildOptions (self.with_xz, self.with_zstd, self.with_zlib, self.with_openssl)
+        KmodFlag.BuildOptions (self.with_xz, self.with_zstd, self.with_zlib, self.with_openssl, self.without_stats)
         super().finalize_options()
 
     def run(self):
@@ -96,11 +101,12 @@ class CustomBuildCommand(build):
         self.with_xz        = None
         self.with_zlib      = None
         self.with_openssl   = None
+        self.without_stats  = None
         super().initialize_options()
 
     def finalize_options(self):
         if KmodFlag.InstallFlag == None:
-            KmodFlag.BuildOptions (self.with_xz, self.with_zstd, self.with_zlib, self.with_openssl)
+            KmodFlag.BuildOptions (self.with_xz, self.with_zstd, self.with_zlib, self.with_openssl, self.without_stats)
         super().finalize_options()
 
     def run(self):
@@ -114,6 +120,7 @@ class CustomBuildCommand(build):
 class CustomBuildExtCommand(build_ext):
     def build_extension(self, ext):
         ext.extra_link_args += KmodFlag.BuildString
+        ext.define_macros   += KmodFlag.DefineMacros
         super().build_extension (ext)
 
 
@@ -122,10 +129,26 @@ with open("README.md", "r") as fh:
 
 kmodulec = Extension('_kmodule',
                      ['kmodule.c',
+                      'context.c',
                       'insmod.c',
                       'rmmod.c',
                       'modinfo.c',
+                      'modinfomap.c',
+                      'scan.c',
+                      'cache.c',
+                      'aio.c',
+                      'lsmod.c',
+                      'modprobe.c',
+                      'dag.c',
                       'log.c',
+                      'stats.c',
+                      'alias.c',
+                      'coldplug.c',
+                      'depgraph.c',
+                      'config.c',
+                      'depmod.c',
+                      'symbols.c',
+                      'treediff.c',
                      ],
                      define_macros       =[("KMODULEPY", None)],
                      extra_compile_args  =['-Wl,--strip-all', '-g0', f"-I{KmodDir}", f'-I{KmodBuild}'],
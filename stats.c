@@ -0,0 +1,486 @@
+/*
+ * stats.c: per-phase timers and counters of the kmodule calls
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+
+#include <stdatomic.h>
+#include <time.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/util.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// Every thread counts into its own block, registered in a list the
+/// first time it records anything. Only the owner thread writes its
+/// block, so a phase costs two clock reads and a few relaxed stores; the
+/// readers sum the blocks under stats_lock. A thread going away folds
+/// its block into stats_retired.
+///
+/// Reset does not touch the blocks: it keeps the sums of the moment in
+/// stats_base, subtracted from what is read afterwards.
+///
+///////////////////////////////////////////////////////////////////////
+
+#define STATS_BUCKETS   40      // log2 of ns, the last one up to ~550 s
+
+static const char *stats_phase_str [KMODULE_PHASE_MAX] = {
+  "context",
+  "lookup",
+  "modinfo",
+  "decompress",
+  "init_module",
+  "state",
+  "delete_module",
+};
+
+static const char *stats_counter_str [KMODULE_COUNTER_MAX] = {
+  "read",
+  "decompressed",
+  "cache_hit",
+};
+
+struct stats_sum {
+  uint64_t  count[KMODULE_PHASE_MAX];
+  uint64_t  ns[KMODULE_PHASE_MAX];
+  uint64_t  hist[KMODULE_PHASE_MAX][STATS_BUCKETS];
+  uint64_t  counter[KMODULE_COUNTER_MAX];
+};
+
+#ifndef KMODULE_NO_STATS
+
+struct stats_block {
+  _Atomic uint64_t    count[KMODULE_PHASE_MAX];
+  _Atomic uint64_t    ns[KMODULE_PHASE_MAX];
+  _Atomic uint64_t    hist[KMODULE_PHASE_MAX][STATS_BUCKETS];
+  _Atomic uint64_t    counter[KMODULE_COUNTER_MAX];
+  struct stats_block  *next;
+  struct stats_block  **prev;
+};
+
+static pthread_mutex_t    stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_block *stats_blocks;
+static struct stats_sum   stats_retired;
+static pthread_key_t      stats_key;
+static pthread_once_t     stats_once = PTHREAD_ONCE_INIT;
+
+//
+// Owner only: a load and a store, no locked instruction.
+//
+#define STATS_ADD(v, n) \
+  atomic_store_explicit (&(v), atomic_load_explicit (&(v), memory_order_relaxed) + (n), memory_order_relaxed)
+
+#define STATS_GET(v)  atomic_load_explicit (&(v), memory_order_relaxed)
+
+/***********************************************************************
+ *
+ * stats_fold:
+ *
+ *   Add Block into Sum. Called with stats_lock held.
+ *
+ ***********************************************************************/
+static void
+stats_fold (
+  struct stats_sum    *sum,
+  struct stats_block  *block
+  )
+{
+  int p, b;
+
+  for (p = 0; p < KMODULE_PHASE_MAX; p++) {
+    sum->count[p] += STATS_GET (block->count[p]);
+    sum->ns[p]    += STATS_GET (block->ns[p]);
+    for (b = 0; b < STATS_BUCKETS; b++)
+      sum->hist[p][b] += STATS_GET (block->hist[p][b]);
+  }
+
+  for (p = 0; p < KMODULE_COUNTER_MAX; p++)
+    sum->counter[p] += STATS_GET (block->counter[p]);
+} // stats_fold
+
+/***********************************************************************
+ *
+ * stats_block_free:
+ *
+ *   Thread exit.
+ *
+ ***********************************************************************/
+static void
+stats_block_free (
+  void  *data
+  )
+{
+  struct stats_block *block = data;
+
+  pthread_mutex_lock (&stats_lock);
+  stats_fold (&stats_retired, block);
+  *block->prev = block->next;
+  if (block->next != NULL)
+    block->next->prev = block->prev;
+  pthread_mutex_unlock (&stats_lock);
+
+  free (block);
+} // stats_block_free
+
+/***********************************************************************
+ *
+ * stats_key_create:
+ *
+ ***********************************************************************/
+static void
+stats_key_create (
+  void
+  )
+{
+  pthread_key_create (&stats_key, stats_block_free);
+} // stats_key_create
+
+/***********************************************************************
+ *
+ * stats_block:
+ *
+ *   Block of the calling thread, NULL when out of memory.
+ *
+ ***********************************************************************/
+static struct stats_block *
+stats_block (
+  void
+  )
+{
+  struct stats_block *block;
+
+  pthread_once (&stats_once, stats_key_create);
+
+  block = pthread_getspecific (stats_key);
+  if (block != NULL)
+    return block;
+
+  block = calloc (1, sizeof (*block));
+  if (block == NULL)
+    return NULL;
+
+  pthread_mutex_lock (&stats_lock);
+  block->next = stats_blocks;
+  block->prev = &stats_blocks;
+  if (stats_blocks != NULL)
+    stats_blocks->prev = &block->next;
+  stats_blocks = block;
+  pthread_mutex_unlock (&stats_lock);
+
+  pthread_setspecific (stats_key, block);
+
+  return block;
+} // stats_block
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule internal function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_stats_clock:
+ *
+ *   Monotonic ns, the start of a phase.
+ *
+ ***********************************************************************/
+uint64_t
+kmodule_stats_clock (
+  void
+  )
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+} // kmodule_stats_clock
+
+/***********************************************************************
+ *
+ * kmodule_stats_phase:
+ *
+ *   Account the time from Start, a kmodule_stats_clock(), to Phase.
+ *
+ ***********************************************************************/
+void
+kmodule_stats_phase (
+  int       phase,
+  uint64_t  start
+  )
+{
+  struct stats_block *block = stats_block ();
+  uint64_t  ns = kmodule_stats_clock () - start;
+  int       bucket;
+
+  if (block == NULL)
+    return;
+
+  bucket = ns == 0 ? 0 : 64 - __builtin_clzll (ns);
+  if (bucket >= STATS_BUCKETS)
+    bucket = STATS_BUCKETS - 1;
+
+  STATS_ADD (block->count[phase], 1);
+  STATS_ADD (block->ns[phase], ns);
+  STATS_ADD (block->hist[phase][bucket], 1);
+} // kmodule_stats_phase
+
+/***********************************************************************
+ *
+ * kmodule_stats_count:
+ *
+ ***********************************************************************/
+void
+kmodule_stats_count (
+  int       counter,
+  uint64_t  value
+  )
+{
+  struct stats_block *block = stats_block ();
+
+  if (block != NULL)
+    STATS_ADD (block->counter[counter], value);
+} // kmodule_stats_count
+
+#endif // KMODULE_NO_STATS
+
+#ifndef KMODULE_NO_STATS
+
+//
+// Sums at the last reset, under stats_lock.
+//
+static struct stats_sum   stats_base;
+
+#endif // KMODULE_NO_STATS
+
+/***********************************************************************
+ *
+ * stats_total:
+ *
+ *   Sum of every thread since the last reset, without the GIL. With
+ *   Reset, the sum of every thread becomes the new base instead. The
+ *   base is read and written under the same lock as the blocks, so a
+ *   concurrent reset never leaves it past a sum being subtracted from.
+ *
+ ***********************************************************************/
+static void
+stats_total (
+  struct stats_sum  *sum,
+  bool              reset
+  )
+{
+#ifndef KMODULE_NO_STATS
+  struct stats_block *block;
+  int                p, b;
+
+  pthread_mutex_lock (&stats_lock);
+  *sum = stats_retired;
+  for (block = stats_blocks; block != NULL; block = block->next)
+    stats_fold (sum, block);
+
+  if (reset) {
+    stats_base = *sum;
+  } else {
+    for (p = 0; p < KMODULE_PHASE_MAX; p++) {
+      sum->count[p] -= stats_base.count[p];
+      sum->ns[p]    -= stats_base.ns[p];
+      for (b = 0; b < STATS_BUCKETS; b++)
+        sum->hist[p][b] -= stats_base.hist[p][b];
+    }
+    for (p = 0; p < KMODULE_COUNTER_MAX; p++)
+      sum->counter[p] -= stats_base.counter[p];
+  }
+  pthread_mutex_unlock (&stats_lock);
+#else
+  memset (sum, 0, sizeof (*sum));
+#endif
+} // stats_total
+
+/***********************************************************************
+ *
+ * stats_percentile:
+ *
+ *   Upper bound, in seconds, of the bucket holding the Q quantile.
+ *
+ ***********************************************************************/
+static double
+stats_percentile (
+  const uint64_t  *hist,
+  uint64_t        count,
+  double          q
+  )
+{
+  uint64_t  seen = 0, rank = (uint64_t) (q * count + 0.5);
+  int       b;
+
+  if (rank == 0)
+    rank = 1;
+
+  for (b = 0; b < STATS_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen >= rank)
+      break;
+  }
+
+  return (double) (1ULL << b) / 1e9;
+} // stats_percentile
+
+/***********************************************************************
+ *
+ * stats_phase_dict:
+ *
+ ***********************************************************************/
+static PyObject *
+stats_phase_dict (
+  const struct stats_sum  *sum,
+  int                     p
+  )
+{
+  PyObject  *hist, *item;
+  int       b, top;
+
+  for (top = STATS_BUCKETS - 1; top > 0 && sum->hist[p][top] == 0; top--)
+    ;
+
+  hist = PyTuple_New (sum->count[p] ? top + 1 : 0);
+  if (hist == NULL)
+    return NULL;
+
+  for (b = 0; b < PyTuple_GET_SIZE (hist); b++) {
+    item = Py_BuildValue ("(dK)", (double) (1ULL << b) / 1e9, (unsigned long long) sum->hist[p][b]);
+    if (item == NULL) {
+      Py_DECREF (hist);
+      return NULL;
+    }
+    PyTuple_SET_ITEM (hist, b, item);
+  }
+
+  if (sum->count[p] == 0)
+    return Py_BuildValue ("{s:K,s:d,s:O,s:O,s:O,s:N}",
+             "count",     0ULL,
+             "time",      0.0,
+             "p50",       Py_None,
+             "p90",       Py_None,
+             "p99",       Py_None,
+             "histogram", hist);
+
+  return Py_BuildValue ("{s:K,s:d,s:d,s:d,s:d,s:N}",
+           "count",     (unsigned long long) sum->count[p],
+           "time",      (double) sum->ns[p] / 1e9,
+           "p50",       stats_percentile (sum->hist[p], sum->count[p], 0.50),
+           "p90",       stats_percentile (sum->hist[p], sum->count[p], 0.90),
+           "p99",       stats_percentile (sum->hist[p], sum->count[p], 0.99),
+           "histogram", hist);
+} // stats_phase_dict
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule public function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_stats:
+ *
+ *   _stats () -> {'enabled', 'phases', 'counters'}
+ *
+ *   Timers and counters of every thread since the last _stats_reset ().
+ *   'phases' maps a phase to its count, time, p50/p90/p99 and histogram
+ *   of (upper bound, count) in seconds, one log2 bucket each.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_stats (
+  PyObject    *Self,
+  PyObject    *Args
+  )
+{
+  struct stats_sum  *sum;
+  PyObject          *phases, *counters, *value;
+  int               p, err = 0;
+
+  sum = PyMem_Malloc (sizeof (*sum));
+  if (sum == NULL)
+    return PyErr_NoMemory ();
+
+  Py_BEGIN_ALLOW_THREADS
+  stats_total (sum, false);
+  Py_END_ALLOW_THREADS
+
+  phases   = PyDict_New ();
+  counters = PyDict_New ();
+
+  for (p = 0; phases != NULL && err == 0 && p < KMODULE_PHASE_MAX; p++) {
+    value = stats_phase_dict (sum, p);
+    err   = value != NULL ? PyDict_SetItemString (phases, stats_phase_str[p], value) : -1;
+    Py_XDECREF (value);
+  }
+
+  for (p = 0; counters != NULL && err == 0 && p < KMODULE_COUNTER_MAX; p++) {
+    value = PyLong_FromUnsignedLongLong (sum->counter[p]);
+    err   = value != NULL ? PyDict_SetItemString (counters, stats_counter_str[p], value) : -1;
+    Py_XDECREF (value);
+  }
+
+  PyMem_Free (sum);
+
+  if (phases == NULL || counters == NULL || err < 0) {
+    Py_XDECREF (phases);
+    Py_XDECREF (counters);
+    return NULL;
+  }
+
+  return Py_BuildValue ("{s:O,s:N,s:N}",
+           "enabled",  KMODULE_STATS_ENABLED ? Py_True : Py_False,
+           "phases",   phases,
+           "counters", counters);
+
+} // kmodule_stats
+
+/***********************************************************************
+ *
+ * kmodule_stats_reset:
+ *
+ *   _stats_reset ()
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_stats_reset (
+  PyObject    *Self,
+  PyObject    *Args
+  )
+{
+  struct stats_sum  *sum;
+
+  sum = PyMem_Malloc (sizeof (*sum));
+  if (sum == NULL)
+    return PyErr_NoMemory ();
+
+  Py_BEGIN_ALLOW_THREADS
+  stats_total (sum, true);
+  Py_END_ALLOW_THREADS
+
+  PyMem_Free (sum);
+
+  Py_INCREF (Py_None);
+  return Py_None;
+
+} // kmodule_stats_reset
@@ -0,0 +1,1470 @@
+/*
+ * symbols.c: exported symbol index of a tree, modules.symbols and Module.symvers
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/hash.h>
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// static function for SymbolIndex
+///
+///   Every (symbol, module) pair read is an entry; the strings are kept
+///   once each in one buffer, entries hold their offsets. Entries are
+///   sorted by symbol, those of modules.symbols first in file order,
+///   and the hash maps a symbol to its first entry. A pair found in
+///   both files is one entry with what Module.symvers tells of it.
+///
+///   The index is read without the GIL into a symbols_table, handed to
+///   the object with the GIL held and never changes afterwards.
+///
+///////////////////////////////////////////////////////////////////////
+
+#define INDEX_MAGIC         0xB007F457
+#define INDEX_VERSION_MAJOR 0x0002
+#define INDEX_NODE_PREFIX   0x80000000
+#define INDEX_NODE_VALUES   0x40000000
+#define INDEX_NODE_CHILDS   0x20000000
+#define INDEX_NODE_MASK     0x0FFFFFFF
+#define INDEX_DEPTH         1024
+
+#define SYMBOLS_CRC         0x01    // crc known
+#define SYMBOLS_GPL         0x02    // EXPORT_SYMBOL_GPL
+#define SYMBOLS_SYMVERS     0x04    // read from Module.symvers
+
+struct symbols_entry {
+  uint32_t    symbol;       // offsets in strings
+  uint32_t    module;
+  uint32_t    ns;           // 0 for none
+  uint32_t    crc;
+  uint32_t    seq;
+  uint32_t    flags;
+};
+
+typedef struct {
+  PyObject_HEAD
+  char                  dirname[PATH_MAX];
+  char                  *strings;
+  size_t                len;
+  struct symbols_entry  *entries;
+  uint32_t              count;
+  uint32_t              nsymbols;
+  struct hash           *index;     // symbol -> first entry + 1
+} SymbolIndexObject;
+
+struct symbols_table {
+  char                  *strings;
+  size_t                len;
+  struct symbols_entry  *entries;
+  uint32_t              count;
+  uint32_t              nsymbols;
+  struct hash           *index;
+};
+
+struct symbols_build {
+  char                  *strings;
+  size_t                len;
+  size_t                alloc;
+  struct hash           *interned;  // module name -> offset, keys malloc'd
+  struct symbols_entry  *entries;
+  uint32_t              count;
+  uint32_t              entry_alloc;
+};
+
+/***********************************************************************
+ *
+ * symbols_string:
+ *
+ *   Offset of Len bytes of S added to the strings.
+ *
+ ***********************************************************************/
+static int64_t
+symbols_string (
+  struct symbols_build  *b,
+  const char            *s,
+  size_t                len
+  )
+{
+  size_t offset = b->len;
+
+  if (b->len + len + 1 > b->alloc) {
+    size_t alloc = b->alloc ? b->alloc : 65536;
+    void *tmp;
+
+    while (alloc < b->len + len + 1)
+      alloc *= 2;
+    if (alloc > UINT32_MAX)
+      return -E2BIG;
+    tmp = realloc (b->strings, alloc);
+    if (tmp == NULL)
+      return -ENOMEM;
+    b->strings = tmp;
+    b->alloc   = alloc;
+  }
+
+  memcpy (b->strings + b->len, s, len);
+  b->strings[b->len + len] = '\0';
+  b->len += len + 1;
+
+  return offset;
+} // symbols_string
+
+/***********************************************************************
+ *
+ * symbols_module:
+ *
+ *   Offset of the module name of Path, Len bytes, with '-' as '_': the
+ *   name is added once for all its symbols.
+ *
+ ***********************************************************************/
+static int64_t
+symbols_module (
+  struct symbols_build  *b,
+  const char            *path,
+  size_t                len
+  )
+{
+  char        name[PATH_MAX], *key;
+  const char  *base = path, *p;
+  size_t      i;
+  void        *offset;
+  int64_t     ret;
+
+  for (p = path; p < path + len; p++)
+    if (*p == '/')
+      base = p + 1;
+  len -= base - path;
+
+  for (i = 0; i < len && i < sizeof (name) - 1; i++) {
+    if (base[i] == '.' && strncmp (base + i, ".ko", 3) == 0)
+      break;
+    name[i] = base[i] == '-' ? '_' : base[i];
+  }
+  name[i] = '\0';
+
+  offset = hash_find (b->interned, name);
+  if (offset != NULL)
+    return (uintptr_t) offset - 1;
+
+  ret = symbols_string (b, name, i);
+  if (ret < 0)
+    return ret;
+
+  key = strdup (name);
+  if (key == NULL)
+    return -ENOMEM;
+  if (hash_add (b->interned, key, (void *) (uintptr_t) (ret + 1)) < 0) {
+    free (key);
+    return -ENOMEM;
+  }
+
+  return ret;
+} // symbols_module
+
+/***********************************************************************
+ *
+ * symbols_add:
+ *
+ ***********************************************************************/
+static int
+symbols_add (
+  struct symbols_build  *b,
+  const char            *symbol,
+  size_t                symlen,
+  const char            *module,
+  size_t                modlen,
+  const char            *ns,
+  size_t                nslen,
+  uint32_t              crc,
+  uint32_t              flags
+  )
+{
+  struct symbols_entry *e;
+  int64_t s, m, n = 0;
+
+  if (b->count == b->entry_alloc) {
+    uint32_t alloc = b->entry_alloc ? b->entry_alloc * 2 : 4096;
+    void *tmp = realloc (b->entries, alloc * sizeof (struct symbols_entry));
+
+    if (tmp == NULL)
+      return -ENOMEM;
+    b->entries     = tmp;
+    b->entry_alloc = alloc;
+  }
+
+  s = symbols_string (b, symbol, symlen);
+  m = s < 0 ? s : symbols_module (b, module, modlen);
+  if (m >= 0 && nslen != 0)
+    n = symbols_string (b, ns, nslen);
+  if (s < 0 || m < 0 || n < 0)
+    return s < 0 ? s : m < 0 ? m : n;
+
+  e = &b->entries[b->count];
+  e->symbol = s;
+  e->module = m;
+  e->ns     = n;
+  e->crc    = crc;
+  e->seq    = b->count++;
+  e->flags  = flags;
+
+  return 0;
+} // symbols_add
+
+/***********************************************************************
+ *
+ * symbols_file:
+ *
+ *   Whole file at Path into a malloc'd, NUL terminated, Buf.
+ *
+ ***********************************************************************/
+static int
+symbols_file (
+  const char  *path,
+  char        **buf,
+  size_t      *size
+  )
+{
+  struct stat st;
+  size_t      done = 0;
+  ssize_t     len;
+  int         fd, err = 0;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  if (fstat (fd, &st) < 0) {
+    err = -errno;
+    close (fd);
+    return err;
+  }
+
+  *buf = malloc (st.st_size + 1);
+  if (*buf == NULL) {
+    close (fd);
+    return -ENOMEM;
+  }
+
+  while (done < (size_t) st.st_size) {
+    len = read (fd, *buf + done, st.st_size - done);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0) {
+      err = len < 0 ? -errno : -EIO;
+      break;
+    }
+    done += len;
+  }
+  close (fd);
+
+  if (err < 0) {
+    free (*buf);
+    return err;
+  }
+
+  (*buf)[done] = '\0';
+  *size = done;
+
+  return 0;
+} // symbols_file
+
+/***********************************************************************
+ *
+ * symbols_read_text:
+ *
+ *   modules.symbols, "alias symbol:<symbol> <module>" lines.
+ *
+ ***********************************************************************/
+static int
+symbols_read_text (
+  struct symbols_build  *b,
+  const char            *path
+  )
+{
+  char    *buf, *line, *next;
+  size_t  size;
+  int     err;
+
+  err = symbols_file (path, &buf, &size);
+  if (err < 0)
+    return err;
+
+  for (line = buf; err == 0 && line < buf + size; line = next) {
+    char *sym, *mod;
+    size_t symlen;
+
+    next = strchr (line, '\n');
+    next = next != NULL ? next + 1 : buf + size;
+
+    if (strncmp (line, "alias symbol:", 13) != 0)
+      continue;
+    sym    = line + 13;
+    symlen = strcspn (sym, " \t\n");
+    mod    = sym + symlen;
+    mod   += strspn (mod, " \t");
+    if (symlen == 0 || *mod == '\n' || *mod == '\0')
+      continue;
+
+    err = symbols_add (b, sym, symlen, mod, strcspn (mod, " \t\n"), NULL, 0, 0, 0);
+  }
+
+  free (buf);
+
+  return err;
+} // symbols_read_text
+
+/***********************************************************************
+ *
+ * symbols_be32:
+ *
+ ***********************************************************************/
+static uint32_t
+symbols_be32 (
+  const unsigned char *p
+  )
+{
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+} // symbols_be32
+
+/***********************************************************************
+ *
+ * symbols_node:
+ *
+ *   Add the values of the libkmod index node at Offset and of its
+ *   children, Key holding the Keylen bytes of the key up to the node.
+ *   Children come in key order, so the values of a key come before
+ *   those of the keys it prefixes.
+ *
+ ***********************************************************************/
+static int
+symbols_node (
+  struct symbols_build  *b,
+  const unsigned char   *buf,
+  size_t                size,
+  uint32_t              offset,
+  char                  *key,
+  size_t                keylen,
+  int                   depth
+  )
+{
+  const unsigned char *p, *end = buf + size, *str, *childs = NULL;
+  uint32_t  pos = offset & INDEX_NODE_MASK;
+  uint32_t  i, count;
+  unsigned  first = 0, last = 0;
+  int       err = 0;
+
+  if (pos == 0 || pos >= size || depth > INDEX_DEPTH)
+    return pos == 0 ? 0 : -EINVAL;
+  p = buf + pos;
+
+  if (offset & INDEX_NODE_PREFIX) {
+    str = memchr (p, '\0', end - p);
+    if (str == NULL || keylen + (str - p) >= PATH_MAX - 1)
+      return -EINVAL;
+    memcpy (key + keylen, p, str - p);
+    keylen += str - p;
+    p = str + 1;
+  }
+
+  if (offset & INDEX_NODE_CHILDS) {
+    if (end - p < 2)
+      return -EINVAL;
+    first = p[0];
+    last  = p[1];
+    p += 2;
+    if (last < first || (size_t) (end - p) < (last - first + 1) * 4)
+      return -EINVAL;
+    childs = p;
+    p += (last - first + 1) * 4;
+  }
+
+  if (offset & INDEX_NODE_VALUES) {
+    if (end - p < 4)
+      return -EINVAL;
+    count = symbols_be32 (p);
+    p += 4;
+    for (i = 0; err == 0 && i < count; i++) {
+      if (end - p < 4)
+        return -EINVAL;
+      p += 4;
+      str = memchr (p, '\0', end - p);
+      if (str == NULL)
+        return -EINVAL;
+      if (keylen > 7 && strncmp (key, "symbol:", 7) == 0)
+        err = symbols_add (b, key + 7, keylen - 7, (const char *) p, str - p, NULL, 0, 0, 0);
+      p = str + 1;
+    }
+  }
+
+  for (i = 0; err == 0 && childs != NULL && i <= last - first; i++) {
+    if (keylen >= PATH_MAX - 2)
+      return -EINVAL;
+    key[keylen] = first + i;
+    err = symbols_node (b, buf, size, symbols_be32 (childs + 4 * i), key, keylen + 1, depth + 1);
+  }
+
+  return err;
+} // symbols_node
+
+/***********************************************************************
+ *
+ * symbols_read_bin:
+ *
+ *   modules.symbols.bin, for trees installed without the text file.
+ *
+ ***********************************************************************/
+static int
+symbols_read_bin (
+  struct symbols_build  *b,
+  const char            *path
+  )
+{
+  char    *buf, key[PATH_MAX];
+  size_t  size;
+  int     err;
+
+  err = symbols_file (path, &buf, &size);
+  if (err < 0)
+    return err;
+
+  if (size < 12 ||
+      symbols_be32 ((unsigned char *) buf) != INDEX_MAGIC ||
+      symbols_be32 ((unsigned char *) buf + 4) >> 16 != INDEX_VERSION_MAJOR)
+    err = -EINVAL;
+  else
+    err = symbols_node (b, (unsigned char *) buf, size, symbols_be32 ((unsigned char *) buf + 8), key, 0, 0);
+
+  free (buf);
+
+  return err;
+} // symbols_read_bin
+
+/***********************************************************************
+ *
+ * symbols_read_symvers:
+ *
+ *   Module.symvers, "<crc>\t<symbol>\t<module>\t<export>[\t<namespace>]"
+ *   lines; module vmlinux is the kernel itself. Older kernels put the
+ *   export type last or leave it out.
+ *
+ ***********************************************************************/
+static int
+symbols_read_symvers (
+  struct symbols_build  *b,
+  const char            *path
+  )
+{
+  char    *buf, *line, *next;
+  size_t  size;
+  int     err;
+
+  err = symbols_file (path, &buf, &size);
+  if (err < 0)
+    return err;
+
+  for (line = buf; err == 0 && line < buf + size; line = next) {
+    const char  *field[5];
+    size_t      len[5];
+    int         n = 0;
+    uint32_t    flags = SYMBOLS_SYMVERS;
+    char        *p = line, *end;
+    unsigned long crc;
+
+    next = strchr (line, '\n');
+    end  = next != NULL ? next : buf + size;
+    next = next != NULL ? next + 1 : buf + size;
+
+    while (n < 5 && p <= end) {
+      field[n] = p;
+      len[n]   = strcspn (p, "\t\n");
+      if (p + len[n] > end)
+        len[n] = end - p;
+      p += len[n] + 1;
+      n++;
+    }
+    if (n < 3 || len[1] == 0 || len[2] == 0)
+      continue;
+
+    crc = strtoul (field[0], NULL, 16);
+    if (field[0][0] == '0' && field[0][1] == 'x')
+      flags |= SYMBOLS_CRC;
+    if (n > 3 && len[3] == 17 && strncmp (field[3], "EXPORT_SYMBOL_GPL", 17) == 0)
+      flags |= SYMBOLS_GPL;
+    if (n > 4 && len[4] == 17 && strncmp (field[4], "EXPORT_SYMBOL_GPL", 17) == 0)
+      flags |= SYMBOLS_GPL;
+
+    err = symbols_add (b, field[1], len[1], field[2], len[2],
+                       n > 4 && strncmp (field[4], "EXPORT_", 7) != 0 ? field[4] : NULL,
+                       n > 4 && strncmp (field[4], "EXPORT_", 7) != 0 ? len[4] : 0,
+                       crc, flags);
+  }
+
+  free (buf);
+
+  return err;
+} // symbols_read_symvers
+
+static const char *symbols_strings;
+
+/***********************************************************************
+ *
+ * symbols_cmp:
+ *
+ *   By symbol, then in the order read.
+ *
+ ***********************************************************************/
+static int
+symbols_cmp (
+  const void  *a,
+  const void  *b
+  )
+{
+  const struct symbols_entry *x = a, *y = b;
+  int c = strcmp (symbols_strings + x->symbol, symbols_strings + y->symbol);
+
+  if (c != 0)
+    return c;
+
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+} // symbols_cmp
+
+/***********************************************************************
+ *
+ * symbols_clear:
+ *
+ ***********************************************************************/
+static void
+symbols_clear (
+  SymbolIndexObject *Self
+  )
+{
+  if (Self->index != NULL)
+    hash_free (Self->index);
+  free (Self->strings);
+  free (Self->entries);
+
+  Self->index    = NULL;
+  Self->strings  = NULL;
+  Self->entries  = NULL;
+  Self->len      = 0;
+  Self->count    = 0;
+  Self->nsymbols = 0;
+} // symbols_clear
+
+/***********************************************************************
+ *
+ * symbols_table_free:
+ *
+ ***********************************************************************/
+static void
+symbols_table_free (
+  struct symbols_table  *t
+  )
+{
+  if (t->index != NULL)
+    hash_free (t->index);
+  free (t->strings);
+  free (t->entries);
+
+  memset (t, 0, sizeof (*t));
+} // symbols_table_free
+
+/***********************************************************************
+ *
+ * symbols_load:
+ *
+ *   Read modules.symbols of Dirname and the Nsymvers Symvers files
+ *   into T. Called without the GIL. A symvers file that does not
+ *   exist is skipped when Optional.
+ *
+ ***********************************************************************/
+static int
+symbols_load (
+  const char            *dirname,
+  char                  **symvers,
+  Py_ssize_t            nsymvers,
+  bool                  optional,
+  struct symbols_table  *t
+  )
+{
+  static pthread_mutex_t sort_lock = PTHREAD_MUTEX_INITIALIZER;
+  struct symbols_build b;
+  struct hash_iter iter;
+  const void  *key;
+  char        path[PATH_MAX];
+  uint32_t    i, j, k;
+  Py_ssize_t  n;
+  int         err;
+
+  memset (&b, 0, sizeof (b));
+  b.interned = hash_new (2048, NULL);
+  if (b.interned == NULL)
+    return -ENOMEM;
+
+  //
+  // Offset 0 is the empty string, the namespace of entries without one.
+  //
+  err = symbols_string (&b, "", 0) < 0 ? -ENOMEM : 0;
+
+  if (err == 0) {
+    if (snprintf (path, sizeof (path), "%s/modules.symbols", dirname) >= (int) sizeof (path))
+      err = -ENAMETOOLONG;
+    else
+      err = symbols_read_text (&b, path);
+    if (err == -ENOENT) {
+      if (snprintf (path, sizeof (path), "%s/modules.symbols.bin", dirname) >= (int) sizeof (path))
+        err = -ENAMETOOLONG;
+      else
+        err = symbols_read_bin (&b, path);
+    }
+    if (err == -ENOENT && nsymvers != 0)
+      err = 0;
+  }
+
+  for (n = 0; err == 0 && n < nsymvers; n++) {
+    err = symbols_read_symvers (&b, symvers[n]);
+    if (err == -ENOENT && optional)
+      err = 0;
+  }
+
+  hash_iter_init (b.interned, &iter);
+  while (hash_iter_next (&iter, (const char **) &key, NULL))
+    free ((void *) key);
+  hash_free (b.interned);
+
+  if (err < 0) {
+    free (b.strings);
+    free (b.entries);
+    return err;
+  }
+
+  //
+  // qsort has no context argument in every libc, the strings go
+  // through a static under a lock.
+  //
+  pthread_mutex_lock (&sort_lock);
+  symbols_strings = b.strings;
+  qsort (b.entries, b.count, sizeof (struct symbols_entry), symbols_cmp);
+  pthread_mutex_unlock (&sort_lock);
+
+  //
+  // One entry per (symbol, module): Module.symvers adds its crc, export
+  // and namespace to the entry of modules.symbols.
+  //
+  for (i = 0, j = 0; i < b.count; i = k) {
+    uint32_t first = j;
+
+    for (k = i; k < b.count && streq (b.strings + b.entries[k].symbol, b.strings + b.entries[i].symbol); k++) {
+      uint32_t m;
+
+      for (m = first; m < j && b.entries[m].module != b.entries[k].module; m++)
+        ;
+      if (m == j) {
+        b.entries[j++] = b.entries[k];
+      } else if (b.entries[k].flags & SYMBOLS_SYMVERS) {
+        b.entries[m].crc    = b.entries[k].crc;
+        b.entries[m].ns     = b.entries[k].ns;
+        b.entries[m].flags |= b.entries[k].flags;
+      }
+    }
+  }
+  b.count = j;
+
+  t->strings = b.strings;
+  t->len     = b.len;
+  t->entries = b.entries;
+  t->count   = b.count;
+
+  t->index = hash_new (b.count / 2 + 16, NULL);
+  if (t->index == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < b.count; i++) {
+    const char *symbol = b.strings + b.entries[i].symbol;
+
+    if (i > 0 && streq (symbol, b.strings + b.entries[i - 1].symbol))
+      continue;
+    if (hash_add (t->index, symbol, (void *) (uintptr_t) (i + 1)) < 0)
+      return -ENOMEM;
+    t->nsymbols++;
+  }
+
+  return 0;
+} // symbols_load
+
+/***********************************************************************
+ *
+ * symbols_find:
+ *
+ *   First entry of Symbol and their count in *Count, NULL for none.
+ *
+ ***********************************************************************/
+static const struct symbols_entry *
+symbols_find (
+  SymbolIndexObject *Self,
+  const char        *symbol,
+  uint32_t          *count
+  )
+{
+  uintptr_t first;
+  uint32_t  i;
+
+  *count = 0;
+  if (Self->index == NULL)
+    return NULL;
+
+  first = (uintptr_t) hash_find (Self->index, symbol);
+  if (first == 0)
+    return NULL;
+
+  for (i = first - 1; i < Self->count && streq (Self->strings + Self->entries[i].symbol, symbol); i++)
+    (*count)++;
+
+  return &Self->entries[first - 1];
+} // symbols_find
+
+/***********************************************************************
+ *
+ * symbols_providers:
+ *
+ *   Tuple of the modules exporting Symbol, () for none.
+ *
+ ***********************************************************************/
+static PyObject *
+symbols_providers (
+  SymbolIndexObject *Self,
+  PyObject          *Symbol
+  )
+{
+  const struct symbols_entry *e;
+  const char  *s;
+  PyObject    *ret;
+  uint32_t    count, i;
+
+  s = PyUnicode_AsUTF8 (Symbol);
+  if (s == NULL)
+    return NULL;
+
+  e = symbols_find (Self, s, &count);
+  ret = PyTuple_New (count);
+  for (i = 0; ret != NULL && i < count; i++) {
+    PyObject *name = PyUnicode_FromString (Self->strings + e[i].module);
+
+    if (name == NULL) {
+      Py_CLEAR (ret);
+      break;
+    }
+    PyTuple_SET_ITEM (ret, i, name);
+  }
+
+  return ret;
+} // symbols_providers
+
+/***********************************************************************
+ *
+ * symbols_license_gpl:
+ *
+ *   Whether a module of License may use EXPORT_SYMBOL_GPL symbols, as
+ *   license_is_gpl_compatible() of the kernel.
+ *
+ ***********************************************************************/
+static bool
+symbols_license_gpl (
+  const char  *license
+  )
+{
+  static const char * const licenses[] = {
+    "GPL", "GPL v2", "GPL and additional rights", "Dual BSD/GPL",
+    "Dual MIT/GPL", "Dual MPL/GPL", NULL
+  };
+  int i;
+
+  for (i = 0; license != NULL && licenses[i] != NULL; i++)
+    if (streq (license, licenses[i]))
+      return true;
+
+  return false;
+} // symbols_license_gpl
+
+struct symbols_need {
+  char        *symbol;
+  uint32_t    crc;
+  bool        weak;
+};
+
+struct symbols_check {
+  struct symbols_need *needs;
+  size_t              count;
+  char                *license;
+  bool                has_license;
+};
+
+/***********************************************************************
+ *
+ * symbols_check_read:
+ *
+ *   Symbols the module at Path needs and its license, without the GIL.
+ *
+ ***********************************************************************/
+static int
+symbols_check_read (
+  const char            *dirname,
+  const char            *path,
+  struct symbols_check  *c
+  )
+{
+  struct kmod_ctx     *ctx;
+  struct kmod_module  *mod;
+  struct kmod_list    *l, *list = NULL;
+  const char          *null_config = NULL;
+  size_t              n = 0;
+  int                 err;
+
+  KMODULE_STATS_START (start);
+  ctx = kmod_new (dirname, &null_config);
+  if (ctx != NULL)
+    kmodule_log_attach (ctx);
+  KMODULE_STATS_PHASE (KMODULE_PHASE_CONTEXT, start);
+  if (ctx == NULL)
+    return -ENOMEM;
+
+  KMODULE_STATS_START (lookup);
+  err = kmod_module_new_from_path (ctx, path, &mod);
+  KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, lookup);
+  if (err < 0) {
+    kmod_unref (ctx);
+    return err;
+  }
+
+  KMODULE_STATS_START (info);
+  if (kmod_module_get_info (mod, &list) >= 0) {
+    kmod_list_foreach (l, list) {
+      if (streq (kmod_module_info_get_key (l), "license") && c->license == NULL) {
+        c->license = strdup (kmod_module_info_get_value (l));
+        if (c->license == NULL)
+          err = -ENOMEM;
+        c->has_license = true;
+      }
+    }
+    kmod_module_info_free_list (list);
+  }
+  KMODULE_STATS_PHASE (KMODULE_PHASE_MODINFO, info);
+
+  if (err < 0) {
+    kmod_module_unref (mod);
+    kmod_unref (ctx);
+    return err;
+  }
+
+  list = NULL;
+  err = kmod_module_get_dependency_symbols (mod, &list);
+  /* -EINVAL is a module without .symtab: like depmod, it needs nothing */
+  if (err == -ENOENT || err == -ENODATA || err == -EINVAL) {
+    err = 0;
+  } else if (err >= 0) {
+    err = 0;
+    kmod_list_foreach (l, list)
+      n++;
+    c->needs = calloc (n + 1, sizeof (struct symbols_need));
+    if (c->needs == NULL)
+      err = -ENOMEM;
+    kmod_list_foreach (l, list) {
+      struct symbols_need *need;
+
+      if (err < 0)
+        break;
+      need = &c->needs[c->count];
+      need->symbol = strdup (kmod_module_dependency_symbol_get_symbol (l));
+      need->crc    = kmod_module_dependency_symbol_get_crc (l);
+      need->weak   = kmod_module_dependency_symbol_get_bind (l) == KMOD_SYMBOL_WEAK;
+      if (need->symbol == NULL)
+        err = -ENOMEM;
+      else
+        c->count++;
+    }
+    kmod_module_dependency_symbols_free_list (list);
+  }
+
+  kmod_module_unref (mod);
+  kmod_unref (ctx);
+
+  return err;
+} // symbols_check_read
+
+/***********************************************************************
+ *
+ * symbols_check_free:
+ *
+ ***********************************************************************/
+static void
+symbols_check_free (
+  struct symbols_check  *c
+  )
+{
+  size_t i;
+
+  for (i = 0; i < c->count; i++)
+    free (c->needs[i].symbol);
+  free (c->needs);
+  free (c->license);
+} // symbols_check_free
+
+/***********************************************************************
+ *
+ * symbols_append:
+ *
+ ***********************************************************************/
+static int
+symbols_append (
+  PyObject    *List,
+  const char  *s
+  )
+{
+  PyObject *str = PyUnicode_FromString (s);
+  int       err;
+
+  if (str == NULL)
+    return -1;
+  err = PyList_Append (List, str);
+  Py_DECREF (str);
+
+  return err;
+} // symbols_append
+
+///////////////////////////////////////////////////////////////////////
+///
+/// SymbolIndex type
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * SymbolIndex_init:
+ *
+ *   _SymbolIndex (basedir=None, kversion=None, symvers=None)
+ *
+ *   Symvers is a path or an iterable of paths of Module.symvers files,
+ *   False for none. None reads <modules directory>/build/Module.symvers
+ *   when there is one. Queries read the index without a lock, it can
+ *   not be read again into the same object.
+ *
+ ***********************************************************************/
+static int
+SymbolIndex_init (
+  SymbolIndexObject *Self,
+  PyObject          *Args,
+  PyObject          *KwArgs
+  )
+{
+  char        *root = NULL, *kversion = NULL;
+  char        dirname[PATH_MAX];
+  char        build[PATH_MAX];
+  char        **paths = NULL;
+  PyObject    *symvers = Py_None, *seq = NULL;
+  Py_ssize_t  n = 0, i;
+  bool        optional = false;
+  int         err;
+
+  struct symbols_table  t;
+
+  static char   *kwlist[] = {"basedir", "kversion", "symvers", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "|zzO",
+      kwlist,
+      &root,
+      &kversion,
+      &symvers)) {
+    return -1;
+  }
+
+  if (Self->index != NULL) {
+    PyErr_Format (PyExc_RuntimeError, "SymbolIndex is already initialized.");
+    return -1;
+  }
+
+  if (kmodule_dirname (root, kversion, dirname, sizeof (dirname)) < 0)
+    return -1;
+
+  if (symvers == Py_None) {
+    if (snprintf (build, sizeof (build), "%s/build/Module.symvers", dirname) >= (int) sizeof (build)) {
+      errno = ENAMETOOLONG;
+      PyErr_SetFromErrnoWithFilename (PyExc_OSError, dirname);
+      return -1;
+    }
+    seq = Py_BuildValue ("(s)", build);
+    optional = true;
+  } else if (symvers == Py_False) {
+    seq = PyTuple_New (0);
+  } else if (PyUnicode_Check (symvers) || PyBytes_Check (symvers) || PyObject_HasAttrString (symvers, "__fspath__")) {
+    seq = PyTuple_Pack (1, symvers);
+  } else {
+    seq = PySequence_Tuple (symvers);
+  }
+  if (seq == NULL)
+    return -1;
+
+  n = PyTuple_GET_SIZE (seq);
+  paths = calloc (n + 1, sizeof (char *));
+  if (paths == NULL) {
+    Py_DECREF (seq);
+    PyErr_NoMemory ();
+    return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    PyObject *bytes;
+
+    if (!PyUnicode_FSConverter (PyTuple_GET_ITEM (seq, i), &bytes))
+      break;
+    paths[i] = strdup (PyBytes_AS_STRING (bytes));
+    Py_DECREF (bytes);
+    if (paths[i] == NULL) {
+      PyErr_NoMemory ();
+      break;
+    }
+  }
+  Py_DECREF (seq);
+
+  if (i == n) {
+    memset (&t, 0, sizeof (t));
+
+    Py_BEGIN_ALLOW_THREADS
+    err = symbols_load (dirname, paths, n, optional, &t);
+    if (err < 0)
+      symbols_table_free (&t);
+    Py_END_ALLOW_THREADS
+
+    //
+    // Another __init__ may have run while the GIL was released.
+    //
+    if (err < 0) {
+      PyErr_Format (PyExc_OSError, "could not read the symbols of %s: %s\n", dirname, strerror (-err));
+    } else if (Self->index != NULL) {
+      symbols_table_free (&t);
+      PyErr_Format (PyExc_RuntimeError, "SymbolIndex is already initialized.");
+    } else {
+      memcpy (Self->dirname, dirname, sizeof (Self->dirname));
+      Self->strings  = t.strings;
+      Self->len      = t.len;
+      Self->entries  = t.entries;
+      Self->count    = t.count;
+      Self->nsymbols = t.nsymbols;
+      Self->index    = t.index;
+    }
+  }
+
+  for (i = 0; i < n; i++)
+    free (paths[i]);
+  free (paths);
+
+  return PyErr_Occurred () ? -1 : 0;
+} // SymbolIndex_init
+
+/***********************************************************************
+ *
+ * SymbolIndex_dealloc:
+ *
+ ***********************************************************************/
+static void
+SymbolIndex_dealloc (
+  SymbolIndexObject *Self
+  )
+{
+  symbols_clear (Self);
+
+  Py_TYPE (Self)->tp_free ((PyObject *) Self);
+} // SymbolIndex_dealloc
+
+/***********************************************************************
+ *
+ * SymbolIndex_len:
+ *
+ ***********************************************************************/
+static Py_ssize_t
+SymbolIndex_len (
+  SymbolIndexObject *Self
+  )
+{
+  return Self->nsymbols;
+} // SymbolIndex_len
+
+/***********************************************************************
+ *
+ * SymbolIndex_contains:
+ *
+ ***********************************************************************/
+static int
+SymbolIndex_contains (
+  SymbolIndexObject *Self,
+  PyObject          *Symbol
+  )
+{
+  const char  *s;
+  uint32_t    count;
+
+  s = PyUnicode_AsUTF8 (Symbol);
+  if (s == NULL)
+    return -1;
+
+  symbols_find (Self, s, &count);
+
+  return count != 0;
+} // SymbolIndex_contains
+
+/***********************************************************************
+ *
+ * SymbolIndex_providers:
+ *
+ *   providers (symbols)
+ *
+ *   For one symbol, the tuple of the modules exporting it; for an
+ *   iterable, the list of those tuples in the same order.
+ *
+ ***********************************************************************/
+static PyObject *
+SymbolIndex_providers (
+  SymbolIndexObject *Self,
+  PyObject          *Symbols
+  )
+{
+  PyObject    *seq, *ret;
+  Py_ssize_t  n, i;
+
+  if (PyUnicode_Check (Symbols))
+    return symbols_providers (Self, Symbols);
+
+  seq = PySequence_Fast (Symbols, "symbols must be a str or an iterable of str.");
+  if (seq == NULL)
+    return NULL;
+
+  n   = PySequence_Fast_GET_SIZE (seq);
+  ret = PyList_New (n);
+  for (i = 0; ret != NULL && i < n; i++) {
+    PyObject *item = symbols_providers (Self, PySequence_Fast_GET_ITEM (seq, i));
+
+    if (item == NULL) {
+      Py_CLEAR (ret);
+      break;
+    }
+    PyList_SET_ITEM (ret, i, item);
+  }
+  Py_DECREF (seq);
+
+  return ret;
+} // SymbolIndex_providers
+
+/***********************************************************************
+ *
+ * SymbolIndex_lookup:
+ *
+ *   lookup (symbol)
+ *
+ *   Tuple of {'module', 'crc', 'gpl', 'namespace'} of every export of
+ *   Symbol, crc and namespace None when not known.
+ *
+ ***********************************************************************/
+static PyObject *
+SymbolIndex_lookup (
+  SymbolIndexObject *Self,
+  PyObject          *Symbol
+  )
+{
+  const struct symbols_entry *e;
+  const char  *s;
+  PyObject    *ret;
+  uint32_t    count, i;
+
+  s = PyUnicode_AsUTF8 (Symbol);
+  if (s == NULL)
+    return NULL;
+
+  e = symbols_find (Self, s, &count);
+  ret = PyTuple_New (count);
+  for (i = 0; ret != NULL && i < count; i++) {
+    PyObject *crc, *item;
+
+    if (e[i].flags & SYMBOLS_CRC) {
+      crc = PyLong_FromUnsignedLong (e[i].crc);
+    } else {
+      Py_INCREF (Py_None);
+      crc = Py_None;
+    }
+
+    item = Py_BuildValue ("{s:s,s:N,s:O,s:z}",
+             "module",    Self->strings + e[i].module,
+             "crc",       crc,
+             "gpl",       e[i].flags & SYMBOLS_GPL ? Py_True : Py_False,
+             "namespace", e[i].ns != 0 ? Self->strings + e[i].ns : NULL);
+    if (item == NULL) {
+      Py_CLEAR (ret);
+      break;
+    }
+    PyTuple_SET_ITEM (ret, i, item);
+  }
+
+  return ret;
+} // SymbolIndex_lookup
+
+/***********************************************************************
+ *
+ * SymbolIndex_exports:
+ *
+ *   exports (module)
+ *
+ *   Sorted tuple of the symbols Module exports.
+ *
+ ***********************************************************************/
+static PyObject *
+SymbolIndex_exports (
+  SymbolIndexObject *Self,
+  PyObject          *Module
+  )
+{
+  char        name[PATH_MAX];
+  const char  *s;
+  PyObject    *list, *ret;
+  uint32_t    i;
+  size_t      k;
+
+  s = PyUnicode_AsUTF8 (Module);
+  if (s == NULL)
+    return NULL;
+
+  for (k = 0; s[k] != '\0' && k < sizeof (name) - 1; k++)
+    name[k] = s[k] == '-' ? '_' : s[k];
+  name[k] = '\0';
+
+  list = PyList_New (0);
+  for (i = 0; list != NULL && i < Self->count; i++) {
+    if (!streq (Self->strings + Self->entries[i].module, name))
+      continue;
+    if (symbols_append (list, Self->strings + Self->entries[i].symbol) < 0)
+      Py_CLEAR (list);
+  }
+  if (list == NULL)
+    return NULL;
+
+  ret = PyList_AsTuple (list);
+  Py_DECREF (list);
+
+  return ret;
+} // SymbolIndex_exports
+
+/***********************************************************************
+ *
+ * SymbolIndex_check:
+ *
+ *   check (path)
+ *
+ *   What insmod of the module file Path would find of the symbols it
+ *   needs:
+ *     unresolved  needed, exported by nothing known
+ *     weak        weak, exported by nothing known
+ *     mismatch    exported, none with the crc the module was built for
+ *     gpl         only exported GPL while the module license is not
+ *     modules     modules it takes what it needs from, the first
+ *                 export the license allows, but vmlinux
+ *   each a sorted tuple.
+ *
+ ***********************************************************************/
+static PyObject *
+SymbolIndex_check (
+  SymbolIndexObject *Self,
+  PyObject          *Args,
+  PyObject          *KwArgs
+  )
+{
+  struct symbols_check  c;
+  PyObject    *path, *lists[5] = { NULL }, *modules = NULL, *ret = NULL;
+  size_t      i;
+  bool        gpl_ok;
+  int         err, k;
+
+  static char   *kwlist[] = {"path", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "O&",
+      kwlist,
+      PyUnicode_FSConverter,
+      &path)) {
+    return NULL;
+  }
+
+  memset (&c, 0, sizeof (c));
+
+  Py_BEGIN_ALLOW_THREADS
+  err = symbols_check_read (Self->dirname, PyBytes_AS_STRING (path), &c);
+  Py_END_ALLOW_THREADS
+
+  if (err < 0) {
+    PyErr_Format (PyExc_OSError, "could not read the symbols of %s: %s\n", PyBytes_AS_STRING (path), strerror (-err));
+    Py_DECREF (path);
+    symbols_check_free (&c);
+    return NULL;
+  }
+  Py_DECREF (path);
+
+  //
+  // A module without a license is tainted, the kernel treats it as not
+  // GPL compatible.
+  //
+  gpl_ok = symbols_license_gpl (c.license);
+
+  for (k = 0; k < 5; k++) {
+    lists[k] = PyList_New (0);
+    if (lists[k] == NULL)
+      goto done;
+  }
+  modules = PySet_New (NULL);
+  if (modules == NULL)
+    goto done;
+
+  for (i = 0; i < c.count; i++) {
+    const struct symbols_entry *e;
+    const struct symbols_need *need = &c.needs[i];
+    uint32_t count, j, provider = UINT32_MAX;
+    bool crc_known = false, crc_ok = false;
+
+    //
+    // Resolved by the linker of the module loader, as modpost skips them.
+    //
+    if (streq (need->symbol, "_GLOBAL_OFFSET_TABLE_") || streq (need->symbol, ".TOC."))
+      continue;
+
+    e = symbols_find (Self, need->symbol, &count);
+    if (count == 0) {
+      if (symbols_append (lists[need->weak ? 1 : 0], need->symbol) < 0)
+        goto done;
+      continue;
+    }
+
+    for (j = 0; j < count; j++) {
+      if (e[j].flags & SYMBOLS_CRC) {
+        crc_known = true;
+        crc_ok |= e[j].crc == need->crc;
+      }
+      if (provider == UINT32_MAX && (gpl_ok || !(e[j].flags & SYMBOLS_GPL)))
+        provider = j;
+    }
+
+    if (crc_known && !crc_ok && need->crc != 0 && symbols_append (lists[2], need->symbol) < 0)
+      goto done;
+    if (provider == UINT32_MAX && symbols_append (lists[3], need->symbol) < 0)
+      goto done;
+
+    //
+    // The module insmod would take the symbol from: the first export the
+    // license allows, none when it allows none.
+    //
+    if (provider != UINT32_MAX && !streq (Self->strings + e[provider].module, "vmlinux")) {
+      PyObject *name = PyUnicode_FromString (Self->strings + e[provider].module);
+
+      if (name == NULL || PySet_Add (modules, name) < 0) {
+        Py_XDECREF (name);
+        goto done;
+      }
+      Py_DECREF (name);
+    }
+  }
+
+  for (k = 0; k < 5; k++) {
+    PyObject *tuple;
+
+    if (k == 4) {
+      Py_DECREF (lists[4]);
+      lists[4] = PySequence_List (modules);
+      if (lists[4] == NULL)
+        goto done;
+    }
+    if (PyList_Sort (lists[k]) < 0)
+      goto done;
+    tuple = PyList_AsTuple (lists[k]);
+    if (tuple == NULL)
+      goto done;
+    Py_DECREF (lists[k]);
+    lists[k] = tuple;
+  }
+
+  ret = Py_BuildValue ("{s:O,s:O,s:O,s:O,s:O}",
+          "unresolved", lists[0],
+          "weak",       lists[1],
+          "mismatch",   lists[2],
+          "gpl",        lists[3],
+          "modules",    lists[4]);
+
+done:
+  for (k = 0; k < 5; k++)
+    Py_XDECREF (lists[k]);
+  Py_XDECREF (modules);
+  symbols_check_free (&c);
+
+  return ret;
+} // SymbolIndex_check
+
+static PyMethodDef SymbolIndex_methods [] = {
+
+  { "providers",    (PyCFunction) SymbolIndex_providers, METH_O, "modules exporting symbols"},
+  { "lookup",       (PyCFunction) SymbolIndex_lookup,    METH_O, "exports of a symbol"},
+  { "exports",      (PyCFunction) SymbolIndex_exports,   METH_O, "symbols a module exports"},
+  { "check",        (PyCFunction) SymbolIndex_check,     METH_VARARGS | METH_KEYWORDS, "symbols a module file needs that are missing"},
+
+  { NULL, NULL, 0, NULL}
+
+}; // SymbolIndex_methods
+
+static PySequenceMethods SymbolIndex_sequence = {
+
+  .sq_length    = (lenfunc) SymbolIndex_len,
+  .sq_contains  = (objobjproc) SymbolIndex_contains,
+
+}; // SymbolIndex_sequence
+
+PyTypeObject SymbolIndexType = {
+
+  PyVarObject_HEAD_INIT (NULL, 0)
+
+  .tp_name      = "_kmodule._SymbolIndex",
+  .tp_doc       = "exported symbol index",
+  .tp_basicsize = sizeof (SymbolIndexObject),
+  .tp_itemsize  = 0,
+  .tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_new       = PyType_GenericNew,
+  .tp_init      = (initproc) SymbolIndex_init,
+  .tp_dealloc   = (destructor) SymbolIndex_dealloc,
+  .tp_methods   = SymbolIndex_methods,
+  .tp_as_sequence = &SymbolIndex_sequence,
+
+}; // SymbolIndexType
@@ -0,0 +1,1042 @@
+/*
+ * treediff.c: module difference of two modules directories
+ *   Copyright (C) 2021  MaxWu <EfiPy.core@gmail.com>.
+
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <Python.h>
+#define PYSAMPLE_MODULE
+#include "structmember.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libkmod/libkmod.h>
+
+#include <shared/util.h>
+#include <tools/kmod.h>
+
+#include "kmodule.h"
+
+///////////////////////////////////////////////////////////////////////
+///
+/// static function for diff_trees
+///
+///   Both trees are walked, then every module of either is read on
+///   Workers threads, each with a kmod_ctx per tree. A thread turns the
+///   .modinfo it read into sorted arrays of the aliases, the firmware
+///   and the parameters, pointing into the packed modinfo.
+///
+///   The modules of each tree are then sorted by name, a module under
+///   updates/ winning over another of the same name as depmod has it,
+///   and the two lists merged; a module in both has its arrays merged
+///   the same way.
+///
+///////////////////////////////////////////////////////////////////////
+
+struct treediff_str {
+  const char  *s;
+  uint32_t    len;
+};
+
+struct treediff_parm {
+  const char  *name;
+  const char  *type;            // NULL without a parmtype field
+  uint32_t    namelen;
+  uint32_t    typelen;
+};
+
+struct treediff_mod {
+  char                        *path;
+  const char                  *rel;       // Path under the modules directory
+  char                        *name;
+  struct kmodule_modinfo_blob *blob;
+  struct treediff_str         vermagic;   // without the release of the tree
+  struct treediff_str         *strs;      // the aliases, then the firmware
+  uint32_t                    naliases;
+  uint32_t                    nfirmware;
+  struct treediff_parm        *parms;
+  uint32_t                    nparms;
+  int                         err;
+  bool                        dropped;    // another module of the same name won
+};
+
+struct treediff_tree {
+  char                dirname[PATH_MAX];
+  size_t              dirlen;
+  const char          *kversion;          // last component of Dirname
+  struct treediff_mod *mods;
+  size_t              count;
+  size_t              alloc;
+  struct treediff_mod **sorted;           // kept modules by name
+  size_t              nsorted;
+};
+
+struct treediff {
+  struct treediff_tree  trees[2];
+  pthread_mutex_t       lock;
+  size_t                next;
+};
+
+/***********************************************************************
+ *
+ * treediff_elapsed:
+ *
+ ***********************************************************************/
+static double
+treediff_elapsed (
+  const struct timespec *t0
+  )
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - t0->tv_sec) + (now.tv_nsec - t0->tv_nsec) / 1e9;
+} // treediff_elapsed
+
+/***********************************************************************
+ *
+ * treediff_cmp:
+ *
+ *   Order of two strings of known length.
+ *
+ ***********************************************************************/
+static int
+treediff_cmp (
+  const char  *a,
+  uint32_t    alen,
+  const char  *b,
+  uint32_t    blen
+  )
+{
+  int r = memcmp (a, b, alen < blen ? alen : blen);
+
+  if (r != 0)
+    return r;
+
+  return alen < blen ? -1 : alen > blen;
+} // treediff_cmp
+
+/***********************************************************************
+ *
+ * treediff_cmp_str:
+ *
+ ***********************************************************************/
+static int
+treediff_cmp_str (
+  const void  *a,
+  const void  *b
+  )
+{
+  const struct treediff_str *x = a, *y = b;
+
+  return treediff_cmp (x->s, x->len, y->s, y->len);
+} // treediff_cmp_str
+
+/***********************************************************************
+ *
+ * treediff_cmp_parm:
+ *
+ *   By name, the entry with a type first.
+ *
+ ***********************************************************************/
+static int
+treediff_cmp_parm (
+  const void  *a,
+  const void  *b
+  )
+{
+  const struct treediff_parm *x = a, *y = b;
+  int r = treediff_cmp (x->name, x->namelen, y->name, y->namelen);
+
+  if (r != 0)
+    return r;
+
+  return (x->type == NULL) - (y->type == NULL);
+} // treediff_cmp_parm
+
+/***********************************************************************
+ *
+ * treediff_cmp_mod:
+ *
+ *   By name, then updates/ first, then by path.
+ *
+ ***********************************************************************/
+static int
+treediff_cmp_mod (
+  const void  *a,
+  const void  *b
+  )
+{
+  const struct treediff_mod *x = *(const struct treediff_mod * const *) a;
+  const struct treediff_mod *y = *(const struct treediff_mod * const *) b;
+  bool ux, uy;
+  int  r;
+
+  r = strcmp (x->name, y->name);
+  if (r != 0)
+    return r;
+
+  ux = strncmp (x->rel, "updates/", 8) == 0;
+  uy = strncmp (y->rel, "updates/", 8) == 0;
+  if (ux != uy)
+    return ux ? -1 : 1;
+
+  return strcmp (x->rel, y->rel);
+} // treediff_cmp_mod
+
+/***********************************************************************
+ *
+ * treediff_unique:
+ *
+ *   Sort the Count strings of Strs and drop the duplicates, returns the
+ *   count left.
+ *
+ ***********************************************************************/
+static uint32_t
+treediff_unique (
+  struct treediff_str *strs,
+  uint32_t            count
+  )
+{
+  uint32_t i, n;
+
+  if (count < 2)
+    return count;
+
+  qsort (strs, count, sizeof (*strs), treediff_cmp_str);
+  for (i = 1, n = 1; i < count; i++) {
+    if (treediff_cmp_str (&strs[n - 1], &strs[i]) != 0)
+      strs[n++] = strs[i];
+  }
+
+  return n;
+} // treediff_unique
+
+/***********************************************************************
+ *
+ * treediff_add:
+ *
+ *   Add the module file Path, taken over, to Tree. Its name is the file
+ *   name up to the first dot, dashes made underscores, as libkmod names
+ *   a module of a path.
+ *
+ ***********************************************************************/
+static int
+treediff_add (
+  struct treediff_tree  *tree,
+  char                  *path
+  )
+{
+  struct treediff_mod *mod;
+  const char          *base = strrchr (path, '/') + 1;
+  size_t              i, len = strcspn (base, ".");
+
+  if (tree->count == tree->alloc) {
+    size_t alloc = tree->alloc ? tree->alloc * 2 : 1024;
+    void *tmp = realloc (tree->mods, alloc * sizeof (struct treediff_mod));
+
+    if (tmp == NULL) {
+      free (path);
+      return -ENOMEM;
+    }
+    tree->mods  = tmp;
+    tree->alloc = alloc;
+  }
+
+  mod = &tree->mods[tree->count];
+  memset (mod, 0, sizeof (*mod));
+  mod->name = strndup (base, len);
+  if (mod->name == NULL) {
+    free (path);
+    return -ENOMEM;
+  }
+  for (i = 0; i < len; i++) {
+    if (mod->name[i] == '-')
+      mod->name[i] = '_';
+  }
+  mod->path = path;
+  mod->rel  = path + tree->dirlen + 1;
+  tree->count++;
+
+  return 0;
+} // treediff_add
+
+/***********************************************************************
+ *
+ * treediff_walk:
+ *
+ *   Add every module file under Dirfd, which is closed on return.
+ *   Symbolic links are not followed.
+ *
+ ***********************************************************************/
+static int
+treediff_walk (
+  struct treediff_tree  *tree,
+  int                   dirfd,
+  const char            *path
+  )
+{
+  DIR           *dir;
+  struct dirent *de;
+  char          *sub;
+  int           err = 0;
+
+  dir = fdopendir (dirfd);
+  if (dir == NULL) {
+    close (dirfd);
+    return 0;
+  }
+
+  while (err == 0 && (de = readdir (dir)) != NULL) {
+    unsigned char type = de->d_type;
+    size_t len = strlen (de->d_name);
+
+    if (de->d_name[0] == '.' &&
+        (len == 1 || (len == 2 && de->d_name[1] == '.')))
+      continue;
+
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+
+      if (fstatat (dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        continue;
+      type = S_ISDIR (st.st_mode) ? DT_DIR : S_ISREG (st.st_mode) ? DT_REG : DT_LNK;
+    }
+
+    if (type == DT_REG && !path_ends_with_kmod_ext (de->d_name, len))
+      continue;
+    if (type != DT_REG && type != DT_DIR)
+      continue;
+
+    if (asprintf (&sub, "%s/%s", path, de->d_name) < 0) {
+      err = -ENOMEM;
+      break;
+    }
+
+    if (type == DT_REG) {
+      err = treediff_add (tree, sub);
+    } else {
+      int fd = openat (dirfd, de->d_name,
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+      if (fd >= 0)
+        err = treediff_walk (tree, fd, sub);
+      free (sub);
+    }
+  }
+
+  closedir (dir);
+
+  return err;
+} // treediff_walk
+
+/***********************************************************************
+ *
+ * treediff_index:
+ *
+ *   Sorted arrays of Mod from its packed modinfo. A vermagic starting
+ *   with the release of Tree is kept without it, so the modules of two
+ *   releases built alike compare equal.
+ *
+ ***********************************************************************/
+static int
+treediff_index (
+  struct treediff_tree  *tree,
+  struct treediff_mod   *mod
+  )
+{
+  const struct kmodule_modinfo_blob   *blob = mod->blob;
+  const struct kmodule_modinfo_field  *fields = (const struct kmodule_modinfo_field *) (blob + 1);
+  const char  *base = (const char *) blob;
+  uint32_t    i, n, naliases = 0, nfirmware = 0, nparms = 0;
+  size_t      rlen = strlen (tree->kversion);
+
+  for (i = 0; i < blob->count; i++) {
+    const char *key = base + fields[i].key;
+
+    if (streq (key, "alias"))
+      naliases++;
+    else if (streq (key, "firmware"))
+      nfirmware++;
+    else if (streq (key, "parm") || streq (key, "parmtype"))
+      nparms++;
+  }
+
+  mod->strs  = calloc (naliases + nfirmware + 1, sizeof (struct treediff_str));
+  mod->parms = calloc (nparms + 1, sizeof (struct treediff_parm));
+  if (mod->strs == NULL || mod->parms == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < blob->count; i++) {
+    const char *key   = base + fields[i].key;
+    const char *value = base + fields[i].value;
+    uint32_t   len    = fields[i].valuelen;
+
+    if (streq (key, "alias")) {
+      mod->strs[mod->naliases].s     = value;
+      mod->strs[mod->naliases++].len = len;
+    } else if (streq (key, "firmware")) {
+      mod->strs[naliases + mod->nfirmware].s     = value;
+      mod->strs[naliases + mod->nfirmware++].len = len;
+    } else if (streq (key, "vermagic")) {
+      if (len > rlen && strncmp (value, tree->kversion, rlen) == 0 && value[rlen] == ' ') {
+        value += rlen + 1;
+        len   -= rlen + 1;
+      }
+      mod->vermagic.s   = value;
+      mod->vermagic.len = len;
+    } else if (streq (key, "parm") || streq (key, "parmtype")) {
+      struct treediff_parm *p = &mod->parms[mod->nparms++];
+      const char *colon = memchr (value, ':', len);
+
+      p->name    = value;
+      p->namelen = colon != NULL ? (uint32_t) (colon - value) : len;
+      if (key[4] == 't') {
+        p->type    = colon != NULL ? colon + 1 : value + len;
+        p->typelen = len - p->namelen - (colon != NULL);
+      }
+    }
+  }
+
+  mod->naliases = treediff_unique (mod->strs, naliases);
+  n = treediff_unique (mod->strs + naliases, nfirmware);
+  if (mod->naliases != naliases)
+    memmove (mod->strs + mod->naliases, mod->strs + naliases, n * sizeof (struct treediff_str));
+  mod->nfirmware = n;
+
+  //
+  // One parameter per name, the parmtype entry sorting ahead of the
+  // parm one carries the type.
+  //
+  if (mod->nparms > 1) {
+    qsort (mod->parms, mod->nparms, sizeof (struct treediff_parm), treediff_cmp_parm);
+    for (i = 1, n = 1; i < mod->nparms; i++) {
+      if (treediff_cmp (mod->parms[n - 1].name, mod->parms[n - 1].namelen,
+                        mod->parms[i].name, mod->parms[i].namelen) != 0)
+        mod->parms[n++] = mod->parms[i];
+    }
+    mod->nparms = n;
+  }
+
+  return 0;
+} // treediff_index
+
+/***********************************************************************
+ *
+ * treediff_thread:
+ *
+ ***********************************************************************/
+static void *
+treediff_thread (
+  void  *arg
+  )
+{
+  struct treediff *td = arg;
+  struct kmod_ctx *ctx[2] = { NULL, NULL };
+  const char      *null_config = NULL;
+  size_t          i;
+
+  for (;;) {
+    struct treediff_tree  *tree;
+    struct treediff_mod   *mod;
+    struct kmod_module    *kmod;
+    int                   t;
+
+    pthread_mutex_lock (&td->lock);
+    i = td->next++;
+    pthread_mutex_unlock (&td->lock);
+
+    t = i >= td->trees[0].count;
+    if (t)
+      i -= td->trees[0].count;
+    tree = &td->trees[t];
+    if (i >= tree->count)
+      break;
+    mod = &tree->mods[i];
+
+    if (ctx[t] == NULL) {
+      KMODULE_STATS_START (start);
+      ctx[t] = kmod_new (tree->dirname, &null_config);
+      if (ctx[t] != NULL)
+        kmodule_log_attach (ctx[t]);
+      KMODULE_STATS_PHASE (KMODULE_PHASE_CONTEXT, start);
+      if (ctx[t] == NULL) {
+        mod->err = -ENOMEM;
+        continue;
+      }
+    }
+
+    KMODULE_STATS_START (start);
+    mod->err = kmod_module_new_from_path (ctx[t], mod->path, &kmod);
+    KMODULE_STATS_PHASE (KMODULE_PHASE_LOOKUP, start);
+    if (mod->err < 0)
+      continue;
+
+    mod->err = kmodule_modinfo_read (kmod, NULL, &mod->blob);
+    kmod_module_unref (kmod);
+    if (mod->err == 0)
+      mod->err = treediff_index (tree, mod);
+  }
+
+  for (i = 0; i < 2; i++) {
+    if (ctx[i] != NULL)
+      kmod_unref (ctx[i]);
+  }
+
+  return NULL;
+} // treediff_thread
+
+/***********************************************************************
+ *
+ * treediff_sort:
+ *
+ *   Sorted by name the modules of Tree that win over those of the same
+ *   name, the modules that could not be read included.
+ *
+ ***********************************************************************/
+static int
+treediff_sort (
+  struct treediff_tree  *tree
+  )
+{
+  size_t i, n;
+
+  tree->sorted = calloc (tree->count + 1, sizeof (struct treediff_mod *));
+  if (tree->sorted == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < tree->count; i++)
+    tree->sorted[i] = &tree->mods[i];
+  qsort (tree->sorted, tree->count, sizeof (struct treediff_mod *), treediff_cmp_mod);
+
+  for (i = 0, n = 0; i < tree->count; i++) {
+    if (n > 0 && streq (tree->sorted[n - 1]->name, tree->sorted[i]->name)) {
+      tree->sorted[i]->dropped = true;
+      continue;
+    }
+    tree->sorted[n++] = tree->sorted[i];
+  }
+  tree->nsorted = n;
+
+  return 0;
+} // treediff_sort
+
+/***********************************************************************
+ *
+ * treediff_free:
+ *
+ ***********************************************************************/
+static void
+treediff_free (
+  struct treediff *td
+  )
+{
+  size_t i;
+  int    t;
+
+  for (t = 0; t < 2; t++) {
+    struct treediff_tree *tree = &td->trees[t];
+
+    for (i = 0; i < tree->count; i++) {
+      free (tree->mods[i].path);
+      free (tree->mods[i].name);
+      free (tree->mods[i].blob);
+      free (tree->mods[i].strs);
+      free (tree->mods[i].parms);
+    }
+    free (tree->mods);
+    free (tree->sorted);
+  }
+  pthread_mutex_destroy (&td->lock);
+} // treediff_free
+
+/***********************************************************************
+ *
+ * treediff_text:
+ *
+ *   str of the Len bytes at S, None for a NULL S.
+ *
+ ***********************************************************************/
+static PyObject *
+treediff_text (
+  const char  *s,
+  uint32_t    len
+  )
+{
+  if (s == NULL)
+    Py_RETURN_NONE;
+
+  return PyUnicode_DecodeUTF8 (s, len, "replace");
+} // treediff_text
+
+/***********************************************************************
+ *
+ * treediff_strs:
+ *
+ *   {'added': ..., 'removed': ...} of two sorted string arrays, NULL
+ *   with no error when they are the same.
+ *
+ ***********************************************************************/
+static PyObject *
+treediff_strs (
+  const struct treediff_str *old,
+  uint32_t                  nold,
+  const struct treediff_str *new,
+  uint32_t                  nnew
+  )
+{
+  PyObject  *added, *removed, *ret = NULL;
+  uint32_t  i = 0, j = 0;
+
+  added   = PyList_New (0);
+  removed = PyList_New (0);
+  if (added == NULL || removed == NULL)
+    goto end;
+
+  while (i < nold || j < nnew) {
+    PyObject *list, *item;
+    const struct treediff_str *s;
+    int r;
+
+    if (i == nold)
+      r = 1;
+    else if (j == nnew)
+      r = -1;
+    else
+      r = treediff_cmp_str (&old[i], &new[j]);
+
+    if (r == 0) {
+      i++;
+      j++;
+      continue;
+    }
+
+    list = r < 0 ? removed : added;
+    s    = r < 0 ? &old[i++] : &new[j++];
+    item = treediff_text (s->s, s->len);
+    if (item == NULL || PyList_Append (list, item) < 0) {
+      Py_XDECREF (item);
+      goto end;
+    }
+    Py_DECREF (item);
+  }
+
+  if (PyList_GET_SIZE (added) != 0 || PyList_GET_SIZE (removed) != 0)
+    ret = Py_BuildValue ("{s:N,s:N}",
+            "added",    PyList_AsTuple (added),
+            "removed",  PyList_AsTuple (removed));
+
+end:
+  Py_XDECREF (added);
+  Py_XDECREF (removed);
+
+  return ret;
+} // treediff_strs
+
+/***********************************************************************
+ *
+ * treediff_parms:
+ *
+ *   {'added': ..., 'removed': ..., 'changed': ...} of two sorted
+ *   parameter arrays, changed holding (name, old type, new type). NULL
+ *   with no error when they are the same.
+ *
+ ***********************************************************************/
+static PyObject *
+treediff_parms (
+  const struct treediff_parm  *old,
+  uint32_t                    nold,
+  const struct treediff_parm  *new,
+  uint32_t                    nnew
+  )
+{
+  PyObject  *added, *removed, *changed, *ret = NULL;
+  uint32_t  i = 0, j = 0;
+
+  added   = PyList_New (0);
+  removed = PyList_New (0);
+  changed = PyList_New (0);
+  if (added == NULL || removed == NULL || changed == NULL)
+    goto end;
+
+  while (i < nold || j < nnew) {
+    PyObject *item;
+    int r, err;
+
+    if (i == nold)
+      r = 1;
+    else if (j == nnew)
+      r = -1;
+    else
+      r = treediff_cmp (old[i].name, old[i].namelen, new[j].name, new[j].namelen);
+
+    if (r < 0) {
+      item = treediff_text (old[i].name, old[i].namelen);
+      err  = item == NULL ? -1 : PyList_Append (removed, item);
+      i++;
+    } else if (r > 0) {
+      item = treediff_text (new[j].name, new[j].namelen);
+      err  = item == NULL ? -1 : PyList_Append (added, item);
+      j++;
+    } else if (old[i].type != NULL && new[j].type != NULL &&
+               treediff_cmp (old[i].type, old[i].typelen, new[j].type, new[j].typelen) == 0) {
+      i++;
+      j++;
+      continue;
+    } else if (old[i].type == NULL && new[j].type == NULL) {
+      i++;
+      j++;
+      continue;
+    } else {
+      item = Py_BuildValue ("(NNN)",
+               treediff_text (old[i].name, old[i].namelen),
+               treediff_text (old[i].type, old[i].typelen),
+               treediff_text (new[j].type, new[j].typelen));
+      err  = item == NULL ? -1 : PyList_Append (changed, item);
+      i++;
+      j++;
+    }
+
+    Py_XDECREF (item);
+    if (err < 0)
+      goto end;
+  }
+
+  if (PyList_GET_SIZE (added) != 0 || PyList_GET_SIZE (removed) != 0 || PyList_GET_SIZE (changed) != 0)
+    ret = Py_BuildValue ("{s:N,s:N,s:N}",
+            "added",    PyList_AsTuple (added),
+            "removed",  PyList_AsTuple (removed),
+            "changed",  PyList_AsTuple (changed));
+
+end:
+  Py_XDECREF (added);
+  Py_XDECREF (removed);
+  Py_XDECREF (changed);
+
+  return ret;
+} // treediff_parms
+
+/***********************************************************************
+ *
+ * treediff_module:
+ *
+ *   Dict of what changed between Old and New, empty for nothing.
+ *
+ ***********************************************************************/
+static PyObject *
+treediff_module (
+  const struct treediff_mod *old,
+  const struct treediff_mod *new
+  )
+{
+  PyObject *ret, *item;
+
+  ret = PyDict_New ();
+  if (ret == NULL)
+    return NULL;
+
+  if (old->err != 0 || new->err != 0)
+    return ret;
+
+  if (treediff_cmp (old->vermagic.s ? old->vermagic.s : "", old->vermagic.len,
+                    new->vermagic.s ? new->vermagic.s : "", new->vermagic.len) != 0) {
+    item = Py_BuildValue ("(NN)",
+             treediff_text (old->vermagic.s, old->vermagic.len),
+             treediff_text (new->vermagic.s, new->vermagic.len));
+    if (item == NULL || PyDict_SetItemString (ret, "vermagic", item) < 0)
+      goto fail;
+    Py_DECREF (item);
+  }
+
+  item = treediff_parms (old->parms, old->nparms, new->parms, new->nparms);
+  if (item == NULL && PyErr_Occurred ())
+    goto fail;
+  if (item != NULL) {
+    if (PyDict_SetItemString (ret, "params", item) < 0)
+      goto fail;
+    Py_DECREF (item);
+  }
+
+  item = treediff_strs (old->strs, old->naliases, new->strs, new->naliases);
+  if (item == NULL && PyErr_Occurred ())
+    goto fail;
+  if (item != NULL) {
+    if (PyDict_SetItemString (ret, "aliases", item) < 0)
+      goto fail;
+    Py_DECREF (item);
+  }
+
+  item = treediff_strs (old->strs + old->naliases, old->nfirmware,
+                        new->strs + new->naliases, new->nfirmware);
+  if (item == NULL && PyErr_Occurred ())
+    goto fail;
+  if (item != NULL) {
+    if (PyDict_SetItemString (ret, "firmware", item) < 0)
+      goto fail;
+    Py_DECREF (item);
+  }
+
+  return ret;
+
+fail:
+  Py_XDECREF (item);
+  Py_DECREF (ret);
+
+  return NULL;
+} // treediff_module
+
+/***********************************************************************
+ *
+ * treediff_result:
+ *
+ *   Merge the two sorted trees into the result dict, with the GIL.
+ *
+ ***********************************************************************/
+static PyObject *
+treediff_result (
+  struct treediff *td,
+  double          scan
+  )
+{
+  struct treediff_tree  *old = &td->trees[0], *new = &td->trees[1];
+  PyObject              *added, *removed, *changed, *errors, *dups, *ret = NULL;
+  size_t                i = 0, j = 0, unchanged = 0;
+  struct timespec       t0;
+  int                   t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+
+  added   = PyList_New (0);
+  removed = PyList_New (0);
+  changed = PyDict_New ();
+  errors  = PyDict_New ();
+  dups    = PyList_New (0);
+  if (added == NULL || removed == NULL || changed == NULL || errors == NULL || dups == NULL)
+    goto fail;
+
+  while (i < old->nsorted || j < new->nsorted) {
+    PyObject *item;
+    int r, err;
+
+    if (i == old->nsorted)
+      r = 1;
+    else if (j == new->nsorted)
+      r = -1;
+    else
+      r = strcmp (old->sorted[i]->name, new->sorted[j]->name);
+
+    if (r != 0) {
+      item = PyUnicode_FromString (r < 0 ? old->sorted[i++]->name : new->sorted[j++]->name);
+      err  = item == NULL ? -1 : PyList_Append (r < 0 ? removed : added, item);
+      Py_XDECREF (item);
+      if (err < 0)
+        goto fail;
+      continue;
+    }
+
+    item = treediff_module (old->sorted[i], new->sorted[j]);
+    if (item == NULL)
+      goto fail;
+    if (PyDict_GET_SIZE (item) == 0) {
+      unchanged++;
+      err = 0;
+    } else {
+      err = PyDict_SetItemString (changed, old->sorted[i]->name, item);
+    }
+    Py_DECREF (item);
+    if (err < 0)
+      goto fail;
+    i++;
+    j++;
+  }
+
+  for (t = 0; t < 2; t++) {
+    for (i = 0; i < td->trees[t].count; i++) {
+      struct treediff_mod *mod = &td->trees[t].mods[i];
+      PyObject *path;
+
+      if (!mod->dropped && mod->err == 0)
+        continue;
+
+      path = PyUnicode_DecodeFSDefault (mod->path);
+      if (path == NULL)
+        goto fail;
+
+      if (mod->dropped) {
+        if (PyList_Append (dups, path) < 0) {
+          Py_DECREF (path);
+          goto fail;
+        }
+      } else {
+        PyObject *msg = PyUnicode_FromString (strerror (-mod->err));
+
+        if (msg == NULL || PyDict_SetItem (errors, path, msg) < 0) {
+          Py_XDECREF (msg);
+          Py_DECREF (path);
+          goto fail;
+        }
+        Py_DECREF (msg);
+      }
+      Py_DECREF (path);
+    }
+  }
+
+  ret = Py_BuildValue ("{s:N,s:N,s:O,s:n,s:n,s:n,s:N,s:O,s:d,s:d}",
+          "added",      PyList_AsTuple (added),
+          "removed",    PyList_AsTuple (removed),
+          "changed",    changed,
+          "unchanged",  (Py_ssize_t) unchanged,
+          "old",        (Py_ssize_t) old->nsorted,
+          "new",        (Py_ssize_t) new->nsorted,
+          "duplicates", PyList_AsTuple (dups),
+          "errors",     errors,
+          "scan",       scan,
+          "diff",       treediff_elapsed (&t0));
+
+fail:
+  Py_XDECREF (added);
+  Py_XDECREF (removed);
+  Py_XDECREF (changed);
+  Py_XDECREF (errors);
+  Py_XDECREF (dups);
+
+  return ret;
+} // treediff_result
+
+///////////////////////////////////////////////////////////////////////
+///
+/// kmodule public function
+///
+///////////////////////////////////////////////////////////////////////
+
+/***********************************************************************
+ *
+ * kmodule_diff_trees:
+ *
+ *   _diff_trees (old_basedir, old_kversion, new_basedir, new_kversion,
+ *                workers=0)
+ *
+ *   Read the modules of both modules directories on Workers threads,
+ *   one per CPU for 0, and return {'added', 'removed', 'changed',
+ *   'unchanged', 'old', 'new', 'duplicates', 'errors', 'scan', 'diff'},
+ *   the times in seconds.
+ *
+ ***********************************************************************/
+PyObject *
+kmodule_diff_trees (
+  PyObject    *Self,
+  PyObject    *Args,
+  PyObject    *KwArgs
+  )
+{
+  char            *roots[2] = { NULL, NULL }, *kversions[2] = { NULL, NULL };
+  PyObject        *ret;
+  int             workers = 0, err = 0, fd, t;
+  unsigned        i, nthreads;
+  pthread_t       *threads;
+  double          scan;
+  struct timespec t0;
+  struct stat     st;
+  struct treediff td;
+
+  static char   *kwlist[] = {"old_basedir", "old_kversion", "new_basedir", "new_kversion", "workers", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords (
+      Args,
+      KwArgs,
+      "zzzz|i",
+      kwlist,
+      &roots[0],
+      &kversions[0],
+      &roots[1],
+      &kversions[1],
+      &workers)) {
+    return NULL;
+  }
+
+  memset (&td, 0, sizeof (td));
+  for (t = 0; t < 2; t++) {
+    struct treediff_tree *tree = &td.trees[t];
+
+    if (kmodule_dirname (roots[t], kversions[t], tree->dirname, sizeof (tree->dirname)) < 0)
+      return NULL;
+    tree->dirlen   = strlen (tree->dirname);
+    tree->kversion = strrchr (tree->dirname, '/') + 1;
+
+    if (stat (tree->dirname, &st) < 0)
+      return PyErr_SetFromErrnoWithFilename (PyExc_OSError, tree->dirname);
+    if (!S_ISDIR (st.st_mode)) {
+      errno = ENOTDIR;
+      return PyErr_SetFromErrnoWithFilename (PyExc_OSError, tree->dirname);
+    }
+  }
+
+  if (workers <= 0)
+    workers = sysconf (_SC_NPROCESSORS_ONLN);
+  if (workers <= 0)
+    workers = 1;
+
+  pthread_mutex_init (&td.lock, NULL);
+
+  Py_BEGIN_ALLOW_THREADS
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+
+  for (t = 0; t < 2 && err == 0; t++) {
+    fd = open (td.trees[t].dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    err = fd < 0 ? -errno : treediff_walk (&td.trees[t], fd, td.trees[t].dirname);
+  }
+
+  if (err == 0) {
+    size_t count = td.trees[0].count + td.trees[1].count;
+
+    nthreads = (unsigned) workers < count ? (unsigned) workers : count;
+    threads  = calloc (nthreads + 1, sizeof (pthread_t));
+    if (threads == NULL) {
+      err = -ENOMEM;
+    } else {
+      for (i = 0; i < nthreads; i++)
+        if (pthread_create (&threads[i], NULL, treediff_thread, &td) != 0)
+          break;
+      nthreads = i;
+      if (nthreads == 0)
+        treediff_thread (&td);
+      for (i = 0; i < nthreads; i++)
+        pthread_join (threads[i], NULL);
+      free (threads);
+    }
+  }
+
+  for (t = 0; t < 2 && err == 0; t++)
+    err = treediff_sort (&td.trees[t]);
+  scan = treediff_elapsed (&t0);
+
+  Py_END_ALLOW_THREADS
+
+  if (err < 0) {
+    PyErr_Format (PyExc_OSError, "diff of %s and %s failed: %s\n",
+      td.trees[0].dirname, td.trees[1].dirname, strerror (-err));
+    ret = NULL;
+  } else {
+    ret = treediff_result (&td, scan);
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  treediff_free (&td);
+  Py_END_ALLOW_THREADS
+
+  return ret;
+
+} // kmodule_diff_trees